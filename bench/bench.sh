@@ -0,0 +1,229 @@
+#!/bin/bash
+#
+# This file is part of imgclone, see imgclone.c for the license.
+#
+# Benchmark imgclone on synthetic SD cards, run with: sudo make bench
+#
+# Every profile builds a loop-backed disk file with an msdos label, a FAT32
+# boot partition and an ext4 root partition, fills the root partition and
+# clones it with every mode. A line per run is added to
+# bench/results/<date>.tsv, the phase report of each run is kept next to it.
+#
+# Settings, as environment variables:
+#   BENCH_PROFILES  profiles to run (tiny media deep hardlinks sparse mixed)
+#   BENCH_MODES     imgclone modes (files blocks gzip zstd)
+#   BENCH_DISK_MB   size of the synthetic card, default 2048
+#   BENCH_SCALE     multiplies the amount of data of every profile, default 1, raise BENCH_DISK_MB with it
+#   BENCH_DIR       work directory for the cards and images, default /var/tmp/imgclone-bench
+#   BENCH_ARGS      extra imgclone arguments, e.g. "-j 8"
+
+set -u
+
+IMGCLONE=$(readlink -f "${1:-./imgclone}")
+PROFILES=${BENCH_PROFILES:-tiny media deep hardlinks sparse mixed}
+MODES=${BENCH_MODES:-files blocks gzip}
+DISK_MB=${BENCH_DISK_MB:-2048}
+SCALE=${BENCH_SCALE:-1}
+WORK=${BENCH_DIR:-/var/tmp/imgclone-bench}
+ARGS=${BENCH_ARGS:-}
+RESULTS=$(dirname "$(readlink -f "$0")")/results
+STAMP=$(date +%Y%m%d-%H%M%S)
+TSV=$RESULTS/$STAMP.tsv
+
+LOOP=""
+MNT=""
+
+fail ()
+{
+	echo "bench: $*" >&2
+	exit 1
+}
+
+cleanup ()
+{
+	[ -n "$MNT" ] && mountpoint -q "$MNT" && umount "$MNT"
+	[ -n "$LOOP" ] && losetup -d "$LOOP" 2>/dev/null
+	LOOP=""
+}
+trap cleanup EXIT
+
+[ "$(id -u)" = 0 ] || fail "must run as root, it uses loop devices and mount"
+[ -x "$IMGCLONE" ] || fail "$IMGCLONE not found, run make first"
+for tool in parted mkfs.fat mkfs.ext4 losetup; do
+	command -v $tool >/dev/null || fail "$tool is needed"
+done
+
+mkdir -p "$WORK" "$RESULTS"
+MNT=$(mktemp -d)
+
+# incompressible data of $1 bytes, like media files, worst case for compression and deduplication
+data ()
+{
+	head -c "$1" /dev/urandom
+}
+
+#---------------------------------------------------------------------------
+# Profiles, $1 is the mounted root partition
+
+profile_tiny ()
+{
+	local d f
+	for d in $(seq 1 $((200 * SCALE))); do
+		mkdir -p "$1/tiny/$d"
+		for f in $(seq 1 100); do
+			data $((512 + (d * f) % 3584)) > "$1/tiny/$d/$f.conf"
+		done
+	done
+}
+
+profile_media ()
+{
+	local f
+	mkdir -p "$1/media"
+	for f in $(seq 1 $((8 * SCALE))); do
+		data $((64 * 1024 * 1024)) > "$1/media/video$f.mp4"
+	done
+}
+
+profile_deep ()
+{
+	local b l path
+	for b in $(seq 1 $((20 * SCALE))); do
+		path="$1/deep/b$b"
+		for l in $(seq 1 40); do
+			path="$path/level$l"
+			mkdir -p "$path"
+			data 2048 > "$path/file"
+		done
+	done
+}
+
+profile_hardlinks ()
+{
+	local f l
+	mkdir -p "$1/links/a" "$1/links/b" "$1/links/c" "$1/links/d"
+	for f in $(seq 1 $((2000 * SCALE))); do
+		data 8192 > "$1/links/a/$f"
+		for l in b c d; do
+			ln "$1/links/a/$f" "$1/links/$l/$f"
+		done
+	done
+}
+
+profile_sparse ()
+{
+	local f o
+	mkdir -p "$1/sparse"
+	for f in $(seq 1 $((4 * SCALE))); do
+		truncate -s 1G "$1/sparse/vm$f.raw"
+		# a few MB of data scattered over the file, like a VM disk or a database
+		for o in 0 100 300 700 1000; do
+			data $((1024 * 1024)) | dd of="$1/sparse/vm$f.raw" bs=1M seek=$o conv=notrunc status=none
+		done
+	done
+}
+
+profile_mixed ()
+{
+	mkdir -p "$1/mixed"
+	profile_tiny "$1/mixed"
+	profile_deep "$1/mixed"
+	profile_hardlinks "$1/mixed"
+	data $((128 * SCALE * 1024 * 1024)) > "$1/mixed/big.bin"
+	truncate -s 512M "$1/mixed/swapfile"
+}
+
+#---------------------------------------------------------------------------
+# Synthetic SD card
+
+make_card ()
+{
+	local card=$1 profile=$2 p
+
+	rm -f "$card"
+	truncate -s ${DISK_MB}M "$card"
+	parted -s "$card" mklabel msdos mkpart primary fat32 8192s 532479s mkpart primary ext4 532480s 100% set 1 lba on || fail "parted failed"
+	LOOP=$(losetup -P --show -f "$card") || fail "no loop device"
+	for p in 1 2; do
+		for i in $(seq 1 50); do [ -b ${LOOP}p$p ] && break; sleep 0.1; done
+		[ -b ${LOOP}p$p ] || fail "${LOOP}p$p did not appear"
+	done
+	mkfs.fat -F 32 -n BOOT ${LOOP}p1 >/dev/null || fail "mkfs.fat failed"
+	mkfs.ext4 -q -F -L rootfs ${LOOP}p2 || fail "mkfs.ext4 failed"
+
+	mount ${LOOP}p1 "$MNT" || fail "mount failed"
+	data $((4 * 1024 * 1024)) > "$MNT/kernel.img"
+	echo "console=serial0,115200 root=PARTUUID=$(blkid -s PTUUID -o value $LOOP)-02 rootwait" > "$MNT/cmdline.txt"
+	umount "$MNT"
+
+	mount ${LOOP}p2 "$MNT" || fail "mount failed"
+	mkdir -p "$MNT/etc"
+	echo "PARTUUID=$(blkid -s PTUUID -o value $LOOP)-02 / ext4 defaults 0 1" > "$MNT/etc/fstab"
+	profile_$profile "$MNT"
+	sync
+	USED_MB=$(df -m --output=used "$MNT" | tail -n 1 | tr -d ' ')
+	FILES=$(df --output=iused "$MNT" | tail -n 1 | tr -d ' ')
+	umount "$MNT"
+}
+
+#---------------------------------------------------------------------------
+# Runs
+
+mode_args ()
+{
+	case $1 in
+		files) echo "" ;;
+		blocks) echo "-b" ;;
+		gzip) echo "-gzip" ;;
+		zstd) echo "-zstd" ;;
+		*) fail "unknown mode $1" ;;
+	esac
+}
+
+# wall time of one phase from the JSON report
+phase_wall ()
+{
+	grep -o "\"name\":\"$2\"[^}]*" "$1" | sed -n 's/.*"wall":\([0-9.]*\).*/\1/p'
+}
+
+printf "profile\tmode\tused_mb\tfiles\twall_s\tmb_s\tout_mb\tout_alloc_mb\treading_s\tpartitions_s\tcopy_s\tblocks_s\tunmount_s\tcompress_s\tresult\n" > "$TSV"
+
+for profile in $PROFILES; do
+	card=$WORK/card-$profile.img
+	echo "Building card for profile $profile"
+	make_card "$card" $profile
+
+	for mode in $MODES; do
+		out=$WORK/out-$profile-$mode
+		json=$RESULTS/$STAMP-$profile-$mode.json
+		rm -f "$out".img*
+		sync
+		echo 3 > /proc/sys/vm/drop_caches 2>/dev/null
+
+		echo "Cloning $profile with mode $mode"
+		start=$(date +%s.%N)
+		"$IMGCLONE" -s $LOOP -d "$out.img" $(mode_args $mode) $ARGS --stats-json "$json" > "$RESULTS/$STAMP-$profile-$mode.log" 2>&1
+		result=$?
+		wall=$(awk "BEGIN { print $(date +%s.%N) - $start }")
+
+		image=$(ls "$out".img* 2>/dev/null | grep -v manifest | head -n 1)
+		out_mb=0
+		alloc_mb=0
+		if [ -n "$image" ]; then
+			out_mb=$(( $(stat -c %s "$image") / 1048576 ))
+			alloc_mb=$(( $(stat -c %b "$image") * 512 / 1048576 ))
+		fi
+		printf "%s\t%s\t%s\t%s\t%.2f\t%.1f\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" $profile $mode $USED_MB $FILES $wall \
+			$(awk "BEGIN { print $USED_MB / $wall }") $out_mb $alloc_mb \
+			"$(phase_wall "$json" "reading partitions")" "$(phase_wall "$json" "creating partitions")" \
+			"$(phase_wall "$json" "copying files")" "$(phase_wall "$json" "copying blocks")" \
+			"$(phase_wall "$json" "unmounting")" "$(phase_wall "$json" "compression")" $result >> "$TSV"
+		rm -f "$out".img*
+	done
+	cleanup
+	rm -f "$card"
+done
+
+echo
+column -t -s "$(printf '\t')" "$TSV"
+echo "Results in $TSV"
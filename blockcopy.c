@@ -0,0 +1,366 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+blockcopy: find the allocated blocks of ext2/3/4 and FAT file systems and copy
+only those. All on-disk values are little endian.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "blockcopy.h"
+#include "probe.h"
+#include "ioengine.h"
+#include "util.h"
+
+#define MERGE_GAP   (128*1024)        /* read small free gaps too, one large read is faster than two */
+
+#define EXT4_MAGIC              0xEF53
+#define EXT4_BG_BLOCK_UNINIT    0x0002
+#define EXT4_INCOMPAT_64BIT     0x0080
+
+/*---------------------------------------------------------------------------*/
+/* Range lists */
+
+void range_add (range_list *l, long long int start, long long int len)
+{
+	byte_range *last;
+
+	if (len <= 0) return;
+	if (l->n > 0)
+	{
+		last = &l->r[l->n - 1];
+		if (start >= last->start && start <= last->start + last->len + MERGE_GAP)
+		{
+			if (start + len > last->start + last->len) last->len = start + len - last->start;
+			return;
+		}
+	}
+	if (l->n == l->size)
+	{
+		l->size = l->size ? l->size * 2 : 1024;
+		l->r = realloc (l->r, l->size * sizeof (byte_range));
+	}
+	l->r[l->n].start = start;
+	l->r[l->n].len = len;
+	l->n++;
+}
+
+long long int range_total (const range_list *l)
+{
+	long long int total = 0;
+	int i;
+
+	for (i = 0; i < l->n; i++) total += l->r[i].len;
+	return total;
+}
+
+void range_free (range_list *l)
+{
+	free (l->r);
+	memset (l, 0, sizeof (range_list));
+}
+
+static int compare_range (const void *a, const void *b)
+{
+	const byte_range *ra = a, *rb = b;
+
+	if (ra->start < rb->start) return -1;
+	return ra->start > rb->start;
+}
+
+/* file system metadata is not always found in disk order */
+static void range_append_sorted (range_list *out, range_list *l)
+{
+	int i;
+
+	qsort (l->r, l->n, sizeof (byte_range), compare_range);
+	for (i = 0; i < l->n; i++) range_add (out, l->r[i].start, l->r[i].len);
+	range_free (l);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+/* adds the runs of set bits of a bitmap, bit i is unit first + i */
+static void add_bitmap_runs (range_list *l, const unsigned char *bitmap, long long int bits, long long int first, long long int unit, long long int offset)
+{
+	long long int i = 0, run;
+
+	while (i < bits)
+	{
+		// skip whole free bytes quickly
+		if ((i & 7) == 0 && i + 8 <= bits && bitmap[i >> 3] == 0)
+		{
+			i += 8;
+			continue;
+		}
+		if (!(bitmap[i >> 3] & (1 << (i & 7))))
+		{
+			i++;
+			continue;
+		}
+		run = i;
+		while (i < bits && (bitmap[i >> 3] & (1 << (i & 7))))
+		{
+			if ((i & 7) == 0 && i + 8 <= bits && bitmap[i >> 3] == 0xff) i += 8;
+			else i++;
+		}
+		range_add (l, offset + (first + run) * unit, (i - run) * unit);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/* ext2/3/4 */
+
+static int ext_used_ranges (int fd, long long int offset, const unsigned char *sb, range_list *out)
+{
+	uint32_t incompat = le32 (sb + 0x60);
+	long long int block_size = 1024LL << le32 (sb + 0x18);
+	long long int blocks = le32 (sb + 0x04);
+	long long int first_data_block = le32 (sb + 0x14);
+	long long int bpg = le32 (sb + 0x20);
+	long long int ipg = le32 (sb + 0x28);
+	long long int inode_size = le16 (sb + 0x58);
+	long long int desc_size = 32, groups, gdt_blocks, g, group_start, group_blocks, itable_blocks;
+	long long int bitmap_block, meta[3];
+	unsigned char *gdt, *bitmap, *desc;
+	range_list uninit;
+	int i;
+
+	if (incompat & EXT4_INCOMPAT_64BIT)
+	{
+		blocks |= (long long int) le32 (sb + 0x150) << 32;
+		desc_size = le16 (sb + 0xFE);
+		if (desc_size < 32) desc_size = 32;
+	}
+	if (block_size > 65536 || bpg == 0 || bpg > block_size * 8) return -1;
+	if (inode_size == 0) inode_size = 128;
+	groups = (blocks - first_data_block + bpg - 1) / bpg;
+	gdt_blocks = (groups * desc_size + block_size - 1) / block_size;
+	itable_blocks = (ipg * inode_size + block_size - 1) / block_size;
+
+	gdt = malloc (gdt_blocks * block_size);
+	bitmap = malloc (block_size);
+	if (gdt == NULL || bitmap == NULL)
+	{
+		free (gdt);
+		free (bitmap);
+		return -1;
+	}
+	// with meta_bg the blocks of the table are spread over the file system
+	for (g = 0; g < gdt_blocks; g++)
+		if (read_at (fd, gdt + g * block_size, block_size, offset + probe_ext_desc_block (sb, g) * block_size))
+		{
+			free (gdt);
+			free (bitmap);
+			return -1;
+		}
+
+	// boot sector and superblock, on 1k block file systems they are not part of a group
+	range_add (out, offset, (first_data_block + 1) * block_size);
+
+	for (g = 0; g < groups; g++)
+	{
+		desc = gdt + g * desc_size;
+		group_start = first_data_block + g * bpg;
+		group_blocks = blocks - group_start < bpg ? blocks - group_start : bpg;
+
+		if (le16 (desc + 0x12) & EXT4_BG_BLOCK_UNINIT)
+		{
+			// no bitmap on disk, same rule as the kernel: backup superblock, descriptors and the group's own metadata
+			memset (&uninit, 0, sizeof (uninit));
+			if (probe_ext_base_blocks (sb, g)) range_add (&uninit, offset + group_start * block_size, probe_ext_base_blocks (sb, g) * block_size);
+			for (i = 0; i < 3; i++)
+			{
+				meta[i] = le32 (desc + i * 4);
+				if (desc_size >= 64) meta[i] |= (long long int) le32 (desc + 0x20 + i * 4) << 32;
+				if (meta[i] >= group_start && meta[i] < group_start + group_blocks)
+					range_add (&uninit, offset + meta[i] * block_size, (i == 2 ? itable_blocks : 1) * block_size);
+			}
+			range_append_sorted (out, &uninit);
+			continue;
+		}
+
+		bitmap_block = le32 (desc);
+		if (desc_size >= 64) bitmap_block |= (long long int) le32 (desc + 0x20) << 32;
+		if (read_at (fd, bitmap, block_size, offset + bitmap_block * block_size))
+		{
+			free (gdt);
+			free (bitmap);
+			return -1;
+		}
+		add_bitmap_runs (out, bitmap, group_blocks, group_start, block_size, offset);
+	}
+	free (gdt);
+	free (bitmap);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* FAT12/16/32 */
+
+static int fat_used_ranges (int fd, long long int offset, const unsigned char *bs, const char **type, range_list *out)
+{
+	long long int bps = le16 (bs + 11), spc = bs[13], rsvd = le16 (bs + 14), nfats = bs[16], root_entries = le16 (bs + 17);
+	long long int total = le16 (bs + 19), fat_size = le16 (bs + 22), root_sectors, first_data, clusters, c, entry, run = -1;
+	long long int cluster_size;
+	unsigned char *fat;
+
+	if (total == 0) total = le32 (bs + 32);
+	if (fat_size == 0) fat_size = le32 (bs + 36);
+	if ((bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) || spc == 0 || (spc & (spc - 1)) || nfats < 1 || nfats > 2 || fat_size == 0 || rsvd == 0)
+		return -1;
+	root_sectors = (root_entries * 32 + bps - 1) / bps;
+	first_data = rsvd + nfats * fat_size + root_sectors;
+	if (total <= first_data) return -1;
+	clusters = (total - first_data) / spc;
+	cluster_size = spc * bps;
+	*type = clusters < 4085 ? "fat12" : clusters < 65525 ? "fat16" : "fat32";
+
+	fat = malloc (fat_size * bps);
+	if (fat == NULL || read_at (fd, fat, fat_size * bps, offset + rsvd * bps))
+	{
+		free (fat);
+		return -1;
+	}
+
+	// boot sector, reserved sectors, all FATs and the FAT12/16 root directory
+	range_add (out, offset, first_data * bps);
+
+	for (c = 2; c < clusters + 2; c++)
+	{
+		if (clusters < 4085)
+		{
+			entry = le16 (fat + c + c / 2);
+			entry = (c & 1) ? entry >> 4 : entry & 0xfff;
+		}
+		else if (clusters < 65525) entry = (c * 2 + 1 < fat_size * bps) ? le16 (fat + c * 2) : 0;
+		else entry = (c * 4 + 3 < fat_size * bps) ? le32 (fat + c * 4) & 0x0FFFFFFF : 0;
+
+		if (entry != 0 && run < 0) run = c;
+		if (entry == 0 && run >= 0)
+		{
+			range_add (out, offset + first_data * bps + (run - 2) * cluster_size, (c - run) * cluster_size);
+			run = -1;
+		}
+	}
+	if (run >= 0) range_add (out, offset + first_data * bps + (run - 2) * cluster_size, (c - run) * cluster_size);
+	free (fat);
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+const char *fs_used_ranges (int fd, long long int offset, long long int size, range_list *out)
+{
+	unsigned char *buf;
+	const char *type = "unknown";
+	range_list found;
+
+	memset (&found, 0, sizeof (found));
+	buf = malloc (4096);
+	if (buf != NULL && read_at (fd, buf, 4096, offset) == 0)
+	{
+		if (le16 (buf + 1024 + 0x38) == EXT4_MAGIC)
+		{
+			if (ext_used_ranges (fd, offset, buf + 1024, &found) == 0) type = "ext4";
+		}
+		else if (!memcmp (buf + 4096 - 10, "SWAPSPACE2", 10))
+		{
+			// only the header with label and UUID, the rest is garbage after a reboot
+			range_add (&found, offset, 4096);
+			type = "linux-swap";
+		}
+		else if (buf[510] == 0x55 && buf[511] == 0xAA)
+		{
+			if (fat_used_ranges (fd, offset, buf, &type, &found)) type = "unknown";
+		}
+	}
+	free (buf);
+
+	if (!strcmp (type, "unknown"))
+	{
+		range_free (&found);
+		range_add (out, offset, size);
+		return type;
+	}
+	range_append_sorted (out, &found);
+	return type;
+}
+
+/* next piece of at most max bytes of the ranges to read, returns 0 when all ranges are done */
+static int next_piece (const range_list *ranges, long long int image_size, int max, int *i, long long int *pos, long long int *off, long long int *n)
+{
+	long long int end;
+
+	for (; *i < ranges->n; (*i)++)
+	{
+		*off = ranges->r[*i].start > *pos ? ranges->r[*i].start : *pos;
+		end = ranges->r[*i].start + ranges->r[*i].len;
+		if (end > image_size) end = image_size;
+		if (*off >= end) continue;
+		*n = end - *off > max ? max : end - *off;
+		*pos = *off + *n;
+		return 1;
+	}
+	return 0;
+}
+
+int block_copy (int fd, const range_list *ranges, long long int image_size, img_sink *sink, volatile long long int *copied)
+{
+	long long int pos = sink->offset, next_pos = sink->offset, *off, *len;
+	int i = 0, head = 0, queued = 0, slot, depth, res = 0;
+	io_engine *io;
+
+	io = io_engine_open ();
+	if (io == NULL) return -1;
+	depth = io_engine_depth (io);
+	printf ("Reading with %s, %d requests of %d KB in flight.\n", io_engine_name (io), depth, io_engine_block_size (io) / 1024);
+	off = calloc (depth, sizeof (long long int));
+	len = calloc (depth, sizeof (long long int));
+	if (off == NULL || len == NULL) res = -1;
+
+	// the reads run ahead of the sink, they are passed on in disk order
+	while (!res)
+	{
+		while (queued < depth)
+		{
+			slot = (head + queued) % depth;
+			if (!next_piece (ranges, image_size, io_engine_block_size (io), &i, &next_pos, &off[slot], &len[slot])) break;
+			if (io_engine_submit (io, slot, fd, off[slot], len[slot], 0))
+			{
+				res = -1;
+				break;
+			}
+			queued++;
+		}
+		if (queued == 0 || res) break;
+
+		if (io_engine_wait (io, head))
+		{
+			fprintf (stderr, "Could not read source at %lld: %s\n", off[head], strerror (errno));
+			res = -1;
+			break;
+		}
+		if (off[head] > pos) res = sink_zero (sink, off[head] - pos);
+		// allocated blocks of zeros are common, free space that was never trimmed
+		if (!res) res = sink_write_sparse (sink, io_engine_buffer (io, head), len[head]);
+		__atomic_add_fetch (copied, len[head], __ATOMIC_RELAXED);
+		pos = off[head] + len[head];
+		head = (head + 1) % depth;
+		queued--;
+	}
+	if (!res && pos < image_size) res = sink_zero (sink, image_size - pos);
+	io_engine_close (io);
+	free (off);
+	free (len);
+	return res;
+}
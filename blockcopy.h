@@ -0,0 +1,54 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+blockcopy: clone a disk by copying only the blocks its file systems use.
+
+The block bitmaps of ext2/3/4 and the allocation table of FAT12/16/32 are read
+straight from the partition, every allocated block is copied to the same
+offset in the image and free space becomes a hole (or a zero region of the
+sink). Partitions with an unknown file system are copied completely.
+*/
+
+#ifndef BLOCKCOPY_H
+#define BLOCKCOPY_H
+
+#include "sink.h"
+
+typedef struct
+{
+	long long int start;
+	long long int len;
+} byte_range;
+
+/* sorted list of byte ranges of the disk that have to be copied */
+typedef struct
+{
+	byte_range *r;
+	int n;
+	int size;
+} range_list;
+
+/* adds a range, ranges must be added in ascending order, small gaps are merged to keep reads large */
+void range_add (range_list *l, long long int start, long long int len);
+long long int range_total (const range_list *l);
+void range_free (range_list *l);
+
+/* fs_used_ranges
+   Adds the allocated parts of the file system on a partition to the list
+	@param fd the whole disk, opened for reading
+	@param offset byte offset of the partition on the disk
+	@param size partition size in bytes
+	@param out ranges are added with disk offsets
+	@return name of the file system that was found ("ext4", "fat32", ...) or "unknown" if the whole partition was added
+*/
+const char *fs_used_ranges (int fd, long long int offset, long long int size, range_list *out);
+
+/* block_copy
+   Writes an image of image_size bytes to the sink, the ranges are read from fd, everything else is zero.
+   A sink that continues an image starts at its offset, the ranges before it are not read
+	@param copied counter of the bytes read so far, for progress reports
+	@return 0 on success
+*/
+int block_copy (int fd, const range_list *ranges, long long int image_size, img_sink *sink, volatile long long int *copied);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+Self-check of the zero blocks of copied files, run with: make check
+
+A file without holes that has blocks of zeros between its data is copied with
+a manifest, like a clone does. The copy must have the same contents, the zero
+blocks must be holes in it and the manifest must have the hash of the data.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../copytree.h"
+#include "../hash.h"
+
+#define BLOCK  (256 * 1024)
+#define BLOCKS 16                   /* every other block is zeros */
+
+static int failed = 0;
+
+static void check (int ok, const char *what)
+{
+	if (ok) return;
+	fprintf (stderr, "copy of a file with zero blocks: %s\n", what);
+	failed++;
+}
+
+static char *read_file (const char *path, long long int *len)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0 || fstat (fd, &st)) return NULL;
+	buf = malloc (st.st_size + 1);
+	*len = read (fd, buf, st.st_size);
+	close (fd);
+	return buf;
+}
+
+int main (void)
+{
+	char dir[] = "/tmp/imgclone-check.XXXXXX", src[256], dst[256], path[256], cmd[300];
+	char *data, *copy;
+	long long int len = 0;
+	copy_options options;
+	copy_stats stats;
+	manifest_entry *e;
+	manifest *m;
+	struct stat src_st, dst_st;
+	int fd, i;
+
+	if (mkdtemp (dir) == NULL)
+	{
+		perror ("mkdtemp");
+		return 1;
+	}
+	snprintf (src, sizeof (src), "%s/src", dir);
+	snprintf (dst, sizeof (dst), "%s/dst", dir);
+	mkdir (src, 0755);
+	mkdir (dst, 0755);
+
+	// all blocks are written, the zero blocks too, so the source has no holes
+	data = calloc (BLOCKS, BLOCK);
+	for (i = 0; i < BLOCKS * BLOCK; i++)
+		if ((i / BLOCK) % 2 == 0) data[i] = 1 + i % 251;
+	snprintf (path, sizeof (path), "%s/zeros.bin", src);
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write (fd, data, BLOCKS * BLOCK) != BLOCKS * BLOCK || fsync (fd) || close (fd))
+	{
+		perror (path);
+		return 1;
+	}
+	stat (path, &src_st);
+	check (src_st.st_blocks * 512 >= (long long int) BLOCKS * BLOCK, "the source has holes, the file system can't run this check");
+
+	memset (&options, 0, sizeof (options));
+	memset (&stats, 0, sizeof (stats));
+	options.threads = 2;
+	snprintf (path, sizeof (path), "%s/manifest", dir);
+	options.record = manifest_create (path);
+	manifest_partition (options.record, 1);
+	check (copy_tree (src, dst, &options, &stats) == 0, "the copy failed");
+	check (manifest_close (options.record) == 0, "the manifest could not be written");
+
+	snprintf (path, sizeof (path), "%s/zeros.bin", dst);
+	copy = read_file (path, &len);
+	check (copy && len == BLOCKS * BLOCK && memcmp (copy, data, len) == 0, "the copy differs from the source");
+	check (stat (path, &dst_st) == 0 && dst_st.st_blocks * 512 <= (long long int) BLOCKS / 2 * BLOCK, "the zero blocks were written");
+	check (stats.holes == (long long int) BLOCKS / 2 * BLOCK, "the zero blocks were not counted as holes");
+
+	snprintf (path, sizeof (path), "%s/manifest", dir);
+	m = manifest_load (path, 1);
+	e = m ? manifest_find (m, "zeros.bin") : NULL;
+	check (e && e->hash == hash_buffer (data, BLOCKS * BLOCK, 0), "the manifest does not have the hash of the data");
+	if (m) manifest_free (m);
+
+	free (data);
+	free (copy);
+	snprintf (cmd, sizeof (cmd), "rm -rf %s", dir);
+	if (system (cmd)) fprintf (stderr, "Could not remove %s.\n", dir);
+	if (failed)
+	{
+		fprintf (stderr, "%d copy checks failed\n", failed);
+		return 1;
+	}
+	printf ("copy checks passed\n");
+	return 0;
+}
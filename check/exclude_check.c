@@ -0,0 +1,198 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+Self-check of the exclude rules, run with: make check
+
+Every case walks a path from the root of a partition the way the copy does,
+a directory at a time, and compares whether it ends up in the backup. The
+cases follow the examples of exclude.h and the default rules, a change of
+the matcher that changes which files are left out of a backup fails here.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../exclude.h"
+
+typedef struct
+{
+	const char *path;	// path relative to the root of the partition
+	int is_dir;
+	int excluded;
+} check_case;
+
+static int failed = 0;
+
+/* excluded
+   Walks path like the copy, an excluded directory leaves out everything below it
+	@return 1 if path is not in the backup
+*/
+static int excluded (const exclude_rules *r, const char *path, int is_dir)
+{
+	char dir[1024];
+	const char *name = path, *slash;
+	exclude_dir *d;
+	int res;
+
+	while (1)
+	{
+		slash = strchr (name, '/');
+		snprintf (dir, sizeof (dir), "%.*s", name == path ? 0 : (int) (name - path - 1), path);
+		d = exclude_enter (r, dir);
+		if (slash == NULL)
+		{
+			res = exclude_match (d, name, is_dir);
+			exclude_leave (d);
+			return res;
+		}
+		snprintf (dir, sizeof (dir), "%.*s", (int) (slash - name), name);
+		res = exclude_match (d, dir, 1);
+		exclude_leave (d);
+		if (res) return 1;
+		name = slash + 1;
+	}
+}
+
+static void check_rules (const char *title, const exclude_rules *r, const check_case *cases)
+{
+	const check_case *c;
+	int res;
+
+	for (c = cases; c->path; c++)
+	{
+		res = excluded (r, c->path, c->is_dir);
+		if (res == c->excluded) continue;
+		fprintf (stderr, "%s: %s%s should be %s\n", title, c->path, c->is_dir ? "/" : "", c->excluded ? "excluded" : "kept");
+		failed++;
+	}
+}
+
+static void check_rule (const char *rule, const check_case *cases)
+{
+	exclude_rules *r = exclude_new ();
+
+	if (exclude_add (r, rule))
+	{
+		fprintf (stderr, "%s: rule was rejected\n", rule);
+		failed++;
+	}
+	else check_rules (rule, r, cases);
+	exclude_free (r);
+}
+
+static void check_invalid (const char *rule)
+{
+	exclude_rules *r = exclude_new ();
+
+	if (exclude_add (r, rule) == 0)
+	{
+		fprintf (stderr, "%s: rule should be rejected\n", rule);
+		failed++;
+	}
+	exclude_free (r);
+}
+
+int main (void)
+{
+	exclude_rules *r;
+
+	check_rule ("/var/swap", (const check_case []) {
+		{"var/swap", 0, 1},
+		{"var", 1, 0},
+		{"var/swapfile", 0, 0},
+		{"home/pi/var/swap", 0, 0},
+		{NULL, 0, 0}});
+	check_rule ("var/log/syslog.1", (const check_case []) {
+		{"var/log/syslog.1", 0, 1},
+		{"var/log/syslog", 0, 0},
+		{"srv/var/log/syslog.1", 0, 0},
+		{NULL, 0, 0}});
+	check_rule ("*.tmp", (const check_case []) {
+		{"a.tmp", 0, 1},
+		{"home/pi/b.tmp", 0, 1},
+		{"cache.tmp", 1, 1},
+		{"home/pi/b.tmp.txt", 0, 0},
+		{"tmp", 1, 0},
+		{NULL, 0, 0}});
+	check_rule ("tmp/", (const check_case []) {
+		{"tmp", 1, 1},
+		{"tmp/x", 0, 1},
+		{"home/pi/tmp", 1, 1},
+		{"home/pi/tmp", 0, 0},
+		{NULL, 0, 0}});
+	check_rule ("/home/**/*.log", (const check_case []) {
+		{"home/a.log", 0, 1},
+		{"home/pi/a.log", 0, 1},
+		{"home/pi/x/y/a.log", 0, 1},
+		{"var/log/a.log", 0, 0},
+		{NULL, 0, 0}});
+	check_rule ("/opt/**", (const check_case []) {
+		{"opt", 1, 0},
+		{"opt/a", 0, 1},
+		{"opt/x/y", 1, 1},
+		{NULL, 0, 0}});
+	check_rule ("/tmp/*", (const check_case []) {
+		{"tmp", 1, 0},
+		{"tmp/a", 0, 1},
+		{"tmp/.X11-unix", 1, 1},
+		{"var/tmp/a", 0, 0},
+		{NULL, 0, 0}});
+	check_rule ("/etc/rc?.d/[KS]0*", (const check_case []) {
+		{"etc/rc2.d/K01ssh", 0, 1},
+		{"etc/rc2.d/S01ssh", 0, 1},
+		{"etc/rc2.d/A01ssh", 0, 0},
+		{"etc/rc10.d/K01ssh", 0, 0},
+		{NULL, 0, 0}});
+
+	check_invalid ("");
+	check_invalid ("/");
+	check_invalid ("**");
+	check_invalid ("/**/");
+
+	r = exclude_new ();
+	exclude_add_defaults (r);
+	check_rules ("defaults", r, (const check_case []) {
+		{"var/swap", 0, 1},
+		{"swapfile", 0, 1},
+		{"var/cache/apt/pkgcache.bin", 0, 1},
+		{"var/cache/apt/srcpkgcache.bin", 0, 1},
+		{"var/cache/apt/archives/vim_9.0_arm64.deb", 0, 1},
+		{"var/cache/apt/archives/partial/x.deb", 0, 1},
+		{"var/log/journal/0123/system.journal", 0, 1},
+		{"var/lib/systemd/coredump/core.1", 0, 1},
+		{"var/tmp/x", 0, 1},
+		{"tmp/x", 0, 1},
+		{"root/.cache/pip", 1, 1},
+		{"home/pi/.cache/chromium/x", 0, 1},
+		{"var/cache/apt", 1, 0},
+		{"var/cache/apt/archives", 1, 0},
+		{"var/cache/apt/archives/lock", 0, 0},
+		{"var/cache/apt/archives/partial", 1, 0},
+		{"var/log/journal", 1, 0},
+		{"var/log/syslog", 0, 0},
+		{"var/lib/systemd/coredump", 1, 0},
+		{"var/tmp", 1, 0},
+		{"tmp", 1, 0},
+		{"root/.cache", 1, 0},
+		{"root/.bashrc", 0, 0},
+		{"home/pi/.cache", 1, 0},
+		{"home/pi/.config/x", 0, 0},
+		{"home/pi/swapfile", 0, 0},
+		{"etc/fstab", 0, 0},
+		{"boot/cmdline.txt", 0, 0},
+		{NULL, 0, 0}});
+	if (exclude_count (r) != 11)
+	{
+		fprintf (stderr, "defaults: %d rules instead of 11\n", exclude_count (r));
+		failed++;
+	}
+	exclude_free (r);
+
+	if (failed)
+	{
+		fprintf (stderr, "%d exclude checks failed\n", failed);
+		return 1;
+	}
+	printf ("exclude checks passed\n");
+	return 0;
+}
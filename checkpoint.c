@@ -0,0 +1,309 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+checkpoint: the journal of a backup in progress and the syncs behind its records.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "checkpoint.h"
+
+struct checkpoint
+{
+	int fd;
+	char *path;
+	int failed;                     /* a record could not be written, the rest are skipped */
+};
+
+struct checkpoint_watch
+{
+	checkpoint *cp;
+	int pnum;
+	manifest_writer *record;
+	char *mnt;
+	int image_fd;
+	int stop;
+	int started;                    /* thread has to be joined */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+typedef struct
+{
+	img_sink *sink;
+	checkpoint *cp;
+	long long int next;             /* offset of the next checkpoint */
+} checkpoint_sink;
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+/* appends a line and syncs it, after an error the journal is left as it is */
+static void add_record (checkpoint *cp, const char *format, ...)
+{
+	char line[256];
+	va_list args;
+	int len;
+
+	if (cp == NULL || cp->failed) return;
+	va_start (args, format);
+	len = vsnprintf (line, sizeof (line), format, args);
+	va_end (args);
+	if (write (cp->fd, line, len) != len || fdatasync (cp->fd))
+	{
+		fprintf (stderr, "Warning: could not write checkpoint to %s: %s, the backup can't be resumed from here.\n", cp->path, strerror (errno));
+		cp->failed = 1;
+	}
+}
+
+static checkpoint *open_journal (const char *path, int flags)
+{
+	checkpoint *cp;
+	int fd;
+
+	fd = open (path, O_WRONLY | O_APPEND | flags, 0644);
+	if (fd < 0)
+	{
+		fprintf (stderr, "Warning: could not open checkpoint %s: %s, the backup can't be resumed.\n", path, strerror (errno));
+		return NULL;
+	}
+	cp = calloc (1, sizeof (checkpoint));
+	cp->fd = fd;
+	cp->path = strdup (path);
+	return cp;
+}
+
+/* syncs everything the manifest lists so far into the image file and records it */
+static void sync_files (checkpoint_watch *w)
+{
+	long long int len;
+	int fd;
+
+	// entries are written when a file is complete, so the files before len are on the file system
+	len = manifest_sync (w->record);
+	fd = open (w->mnt, O_RDONLY | O_DIRECTORY);
+	if (len < 0 || fd < 0 || syncfs (fd) || fdatasync (w->image_fd))
+	{
+		fprintf (stderr, "Warning: could not sync partition %d to the image for a checkpoint.\n", w->pnum);
+	}
+	else
+	{
+		checkpoint_files (w->cp, w->pnum, len);
+	}
+	if (fd >= 0) close (fd);
+}
+
+static void *watch_thread (checkpoint_watch *w)
+{
+	struct timespec until;
+
+	pthread_mutex_lock (&w->lock);
+	while (!w->stop)
+	{
+		clock_gettime (CLOCK_REALTIME, &until);
+		until.tv_sec += CHECKPOINT_SECONDS;
+		while (!w->stop && pthread_cond_timedwait (&w->cond, &w->lock, &until) != ETIMEDOUT);
+		if (w->stop) break;
+		pthread_mutex_unlock (&w->lock);
+		sync_files (w);
+		pthread_mutex_lock (&w->lock);
+	}
+	pthread_mutex_unlock (&w->lock);
+	return NULL;
+}
+
+static int checkpoint_after (img_sink *s, int res)
+{
+	checkpoint_sink *c = s->priv;
+
+	if (res || c->cp == NULL || s->offset < c->next) return res;
+	if (sink_sync (c->sink) == 0) checkpoint_blocks (c->cp, s->offset);
+	c->next = s->offset + CHECKPOINT_BYTES;
+	return 0;
+}
+
+static int checkpoint_write (img_sink *s, const char *buf, long long int len)
+{
+	return checkpoint_after (s, sink_write (((checkpoint_sink *) s->priv)->sink, buf, len));
+}
+
+static int checkpoint_zero (img_sink *s, long long int len)
+{
+	return checkpoint_after (s, sink_zero (((checkpoint_sink *) s->priv)->sink, len));
+}
+
+static int checkpoint_sync (img_sink *s)
+{
+	return sink_sync (((checkpoint_sink *) s->priv)->sink);
+}
+
+static int checkpoint_sink_close (img_sink *s)
+{
+	checkpoint_sink *c = s->priv;
+	int res = sink_close (c->sink);
+
+	free (c);
+	return res;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+checkpoint *checkpoint_create (const char *path, const char *mode, const char *disk_id, long long int size)
+{
+	checkpoint *cp = open_journal (path, O_CREAT | O_TRUNC);
+
+	add_record (cp, "imgclone checkpoint 1 %s %s %lld\n", mode, strlen (disk_id) ? disk_id : "-", size);
+	return cp;
+}
+
+int checkpoint_load (const char *path, checkpoint_state *state)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	long long int value;
+	int pnum, number = 0;
+	FILE *fp;
+
+	memset (state, 0, sizeof (checkpoint_state));
+	fp = fopen (path, "r");
+	if (fp == NULL)
+	{
+		fprintf (stderr, "No checkpoint %s to resume from: %s\n", path, strerror (errno));
+		return 1;
+	}
+	while ((len = getline (&line, &size, fp)) > 0)
+	{
+		// the last line can be cut off
+		if (line[len - 1] != '\n') break;
+		if (number++ == 0)
+		{
+			if (sscanf (line, "imgclone checkpoint 1 %7s %63s %lld", state->mode, state->disk_id, &state->size) != 3) break;
+			if (!strcmp (state->disk_id, "-")) state->disk_id[0] = 0;
+		}
+		else if (sscanf (line, "P %d %lld", &pnum, &value) == 2 && pnum > 0 && pnum < 64)
+		{
+			state->done |= 1ULL << pnum;
+			state->done_manifest = value;
+			if (state->current == pnum) state->current = 0;
+		}
+		else if (sscanf (line, "F %d %lld", &pnum, &value) == 2 && pnum > 0 && pnum < 64)
+		{
+			state->current = pnum;
+			state->current_manifest = value;
+		}
+		else if (sscanf (line, "B %lld", &value) == 1)
+		{
+			state->offset = value;
+		}
+	}
+	free (line);
+	fclose (fp);
+	if (state->mode[0] == 0)
+	{
+		fprintf (stderr, "%s is not a checkpoint of imgclone.\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+checkpoint *checkpoint_append (const char *path)
+{
+	return open_journal (path, 0);
+}
+
+void checkpoint_partition (checkpoint *cp, int pnum, long long int manifest_bytes)
+{
+	if (manifest_bytes < 0) fprintf (stderr, "Warning: could not sync the manifest, partition %d is not recorded as complete.\n", pnum);
+	else add_record (cp, "P %d %lld\n", pnum, manifest_bytes);
+}
+
+void checkpoint_files (checkpoint *cp, int pnum, long long int manifest_bytes)
+{
+	add_record (cp, "F %d %lld\n", pnum, manifest_bytes);
+}
+
+void checkpoint_blocks (checkpoint *cp, long long int offset)
+{
+	add_record (cp, "B %lld\n", offset);
+}
+
+void checkpoint_close (checkpoint *cp, int finished)
+{
+	if (cp == NULL) return;
+	close (cp->fd);
+	if (finished) unlink (cp->path);
+	free (cp->path);
+	free (cp);
+}
+
+checkpoint_watch *checkpoint_watch_start (checkpoint *cp, int pnum, manifest_writer *record, const char *mnt, int image_fd)
+{
+	checkpoint_watch *w;
+
+	if (cp == NULL) return NULL;
+	w = calloc (1, sizeof (checkpoint_watch));
+	w->cp = cp;
+	w->pnum = pnum;
+	w->record = record;
+	w->mnt = strdup (mnt);
+	w->image_fd = image_fd;
+	pthread_mutex_init (&w->lock, NULL);
+	pthread_cond_init (&w->cond, NULL);
+	w->started = pthread_create (&w->thread, NULL, (void * (*)(void *)) &watch_thread, w) == 0;
+	if (!w->started)
+	{
+		// the partition is only recorded when it is complete
+		checkpoint_watch_stop (w);
+		return NULL;
+	}
+	return w;
+}
+
+void checkpoint_watch_stop (checkpoint_watch *w)
+{
+	if (w == NULL) return;
+	if (w->started)
+	{
+		pthread_mutex_lock (&w->lock);
+		w->stop = 1;
+		pthread_cond_broadcast (&w->cond);
+		pthread_mutex_unlock (&w->lock);
+		pthread_join (w->thread, NULL);
+	}
+	pthread_mutex_destroy (&w->lock);
+	pthread_cond_destroy (&w->cond);
+	free (w->mnt);
+	free (w);
+}
+
+img_sink *checkpoint_sink_open (img_sink *sink, checkpoint *cp)
+{
+	img_sink *s;
+	checkpoint_sink *c;
+
+	c = calloc (1, sizeof (checkpoint_sink));
+	c->sink = sink;
+	c->cp = cp;
+	c->next = sink->offset + CHECKPOINT_BYTES;
+	s = calloc (1, sizeof (img_sink));
+	s->write = checkpoint_write;
+	s->zero = checkpoint_zero;
+	s->close = checkpoint_sink_close;
+	s->sync = checkpoint_sync;
+	s->offset = sink->offset;
+	s->priv = c;
+	return s;
+}
@@ -0,0 +1,94 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+checkpoint: journal of a backup in progress, written next to the image as
+<image>.checkpoint so that --resume can continue it after an interruption.
+
+The journal is plain text, one record per line:
+	imgclone checkpoint 1 <files|blocks> <disk id of the source, - if none> <image size>
+	P <partition number> <manifest bytes>   the partition is complete in the image
+	F <partition number> <manifest bytes>   the files of the partition in the manifest are in the image
+	B <offset>                              the image is complete up to offset
+A record is written after the data it describes was synced to disk and is
+synced itself before the backup goes on, so the last record is the last point
+a resumed backup can trust. Manifest bytes are the length of the unfinished
+manifest at that point. A line that was cut off by the interruption is ignored.
+The journal is removed when the backup is finished.
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "manifest.h"
+#include "sink.h"
+
+#define CHECKPOINT_BYTES   (256LL << 20)   /* block mode: image bytes between checkpoints */
+#define CHECKPOINT_SECONDS 60              /* file mode: seconds between checkpoints of a partition */
+
+typedef struct checkpoint checkpoint;
+typedef struct checkpoint_watch checkpoint_watch;
+
+/* what a journal says about the interrupted backup */
+typedef struct
+{
+	char mode[8];                   /* "files" or "blocks" */
+	char disk_id[64];               /* "" if the source has none */
+	long long int size;
+	unsigned long long int done;    /* bit n is set if partition n is complete */
+	long long int done_manifest;    /* manifest bytes of the complete partitions */
+	int current;                    /* partition with files in the image that is not complete, 0 for none */
+	long long int current_manifest; /* manifest bytes up to the last file checkpoint of it */
+	long long int offset;           /* block mode: image bytes that are complete */
+} checkpoint_state;
+
+/* checkpoint_create
+   Starts a new journal, an old one is replaced
+	@param mode "files" or "blocks"
+	@param disk_id disk identifier of the source, "" if it has none
+	@param size image size in bytes
+	@return the journal or NULL with a message, the backup then goes on without checkpoints
+*/
+checkpoint *checkpoint_create (const char *path, const char *mode, const char *disk_id, long long int size);
+
+/* checkpoint_load
+   Reads the journal of an interrupted backup
+	@return 0 on success, 1 with a message if there is no valid journal
+*/
+int checkpoint_load (const char *path, checkpoint_state *state);
+
+/* opens the journal of an interrupted backup to add records to it, NULL with a message on error */
+checkpoint *checkpoint_append (const char *path);
+
+/* records that partition pnum is complete in the image, the journal may be NULL */
+void checkpoint_partition (checkpoint *cp, int pnum, long long int manifest_bytes);
+
+/* records that the files of partition pnum in the first manifest_bytes of the manifest are in the image */
+void checkpoint_files (checkpoint *cp, int pnum, long long int manifest_bytes);
+
+/* records that the image is complete up to offset */
+void checkpoint_blocks (checkpoint *cp, long long int offset);
+
+/* closes the journal, removes it if finished is 1 */
+void checkpoint_close (checkpoint *cp, int finished);
+
+/* checkpoint_watch_start
+   Records a file checkpoint every CHECKPOINT_SECONDS while partition pnum is copied: the manifest,
+   the file system mounted on mnt and the image file are synced, then the journal record is written
+	@param record manifest the copy adds its entries to
+	@param image_fd image file
+	@return the watch or NULL if cp is NULL or there is no thread
+*/
+checkpoint_watch *checkpoint_watch_start (checkpoint *cp, int pnum, manifest_writer *record, const char *mnt, int image_fd);
+
+/* stops the watch, NULL is ignored */
+void checkpoint_watch_stop (checkpoint_watch *w);
+
+/* checkpoint_sink_open
+   Opens a sink that passes the image to sink and records a block checkpoint every CHECKPOINT_BYTES,
+   after sink_sync. It starts at the offset of sink and closes it with itself
+	@param cp journal, may be NULL
+	@return the sink
+*/
+img_sink *checkpoint_sink_open (img_sink *sink, checkpoint *cp);
+
+#endif
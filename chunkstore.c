@@ -0,0 +1,503 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+chunkstore: content defined chunking and a deduplicating chunk repository.
+
+Boundaries are found with a gear rolling hash (as in FastCDC): the hash is
+shifted one bit per byte so it only depends on the last 64 bytes, a chunk ends
+where its top bits are all zero. No boundary is tested in the first
+CHUNK_MIN bytes, which also skips most of the hashing work. The producer only
+finds boundaries, SHA-256 and writing the chunk files runs on a pool of
+threads, the index keeps the original order.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "chunkstore.h"
+#include "util.h"
+
+#define CHUNK_MIN  (256*1024)
+#define CHUNK_MAX  (4*1024*1024)
+#define CHUNK_MASK 0xFFFFF00000000000ULL   /* 20 bits, about 1MB on average after CHUNK_MIN */
+#define CHUNK_PATH 4096
+
+typedef struct
+{
+	char hash[65];          /* filled in by the worker that stored the chunk */
+	int zero;               /* region of zeros, no chunk */
+	long long int len;
+} chunk_ref;
+
+typedef struct chunk_job
+{
+	char *data;
+	long long int len;
+	long long int ref;
+	struct chunk_job *next;
+} chunk_job;
+
+typedef struct
+{
+	char *repo;
+	char *name;
+	uint64_t gear;
+	char *cur;
+	long long int cur_len;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	chunk_job *head, *tail;
+	int in_flight;
+	int max_in_flight;
+	int closing;
+	int error;
+	int nworkers;
+	pthread_t *workers;
+
+	chunk_ref *refs;
+	long long int nrefs, srefs;
+	long long int chunks, new_chunks, new_bytes, dup_bytes, zero_bytes;
+} chunk_sink;
+
+static uint64_t gear_table[256];
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+/* the table must be the same on every run or no chunk would ever match again */
+static void init_gear_table (void)
+{
+	uint64_t x = 0x696d67636c6f6e65ULL, z;
+	int i;
+
+	for (i = 0; i < 256; i++)
+	{
+		// splitmix64
+		x += 0x9E3779B97F4A7C15ULL;
+		z = x;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		gear_table[i] = z ^ (z >> 31);
+	}
+}
+
+/* path of a chunk file in a buffer of CHUNK_PATH bytes, returns -1 if it does not fit */
+static int chunk_path (const char *repo, const char *hash, char *path)
+{
+	return snprintf (path, CHUNK_PATH, "%s/chunks/%.2s/%s", repo, hash, hash) < CHUNK_PATH ? 0 : -1;
+}
+
+static long long int add_ref (chunk_sink *c, long long int len, int zero)
+{
+	long long int i;
+
+	pthread_mutex_lock (&c->lock);
+	if (c->nrefs == c->srefs)
+	{
+		c->srefs = c->srefs ? c->srefs * 2 : 4096;
+		c->refs = realloc (c->refs, c->srefs * sizeof (chunk_ref));
+	}
+	i = c->nrefs++;
+	c->refs[i].hash[0] = 0;
+	c->refs[i].zero = zero;
+	c->refs[i].len = len;
+	pthread_mutex_unlock (&c->lock);
+	return i;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Chunk workers */
+
+static int store_chunk (chunk_sink *c, const char *data, long long int len, const char *hash)
+{
+	char path[CHUNK_PATH], tmp[CHUNK_PATH];
+	int fd;
+
+	if (chunk_path (c->repo, hash, path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (access (path, F_OK) == 0) return 0;
+
+	// write under a temporary name, a chunk file is either complete or missing
+	if (snprintf (tmp, sizeof (tmp), "%s.%d.%lx.tmp", path, (int) getpid (), (unsigned long) pthread_self ()) >= (int) sizeof (tmp))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return -1;
+	if (write_all (fd, data, len) || close (fd))
+	{
+		unlink (tmp);
+		return -1;
+	}
+	if (rename (tmp, path))
+	{
+		unlink (tmp);
+		return -1;
+	}
+	return 1;
+}
+
+static void *chunk_worker (chunk_sink *c)
+{
+	unsigned char digest[32];
+	char hash[65];
+	chunk_job *job;
+	int res;
+
+	pthread_mutex_lock (&c->lock);
+	for (;;)
+	{
+		while (c->head == NULL && !c->closing) pthread_cond_wait (&c->cond, &c->lock);
+		if (c->head == NULL) break;
+		job = c->head;
+		c->head = job->next;
+		if (c->head == NULL) c->tail = NULL;
+		pthread_mutex_unlock (&c->lock);
+
+		sha256_buffer (job->data, job->len, digest);
+		hash_hex (digest, 32, hash);
+		res = store_chunk (c, job->data, job->len, hash);
+		if (res < 0) fprintf (stderr, "Could not store chunk %s: %s\n", hash, strerror (errno));
+
+		pthread_mutex_lock (&c->lock);
+		strcpy (c->refs[job->ref].hash, hash);
+		c->chunks++;
+		if (res < 0) c->error = 1;
+		else if (res > 0)
+		{
+			c->new_chunks++;
+			c->new_bytes += job->len;
+		}
+		else c->dup_bytes += job->len;
+		c->in_flight--;
+		pthread_cond_broadcast (&c->cond);
+		free (job->data);
+		free (job);
+	}
+	pthread_mutex_unlock (&c->lock);
+	return NULL;
+}
+
+/* hand the current chunk to the workers, waits while too many chunks are in memory */
+static int submit_chunk (chunk_sink *c)
+{
+	chunk_job *job;
+
+	if (c->cur_len == 0) return 0;
+	job = malloc (sizeof (chunk_job));
+	job->data = c->cur;
+	job->len = c->cur_len;
+	job->ref = add_ref (c, c->cur_len, 0);
+	job->next = NULL;
+	c->cur = malloc (CHUNK_MAX);
+	c->cur_len = 0;
+	c->gear = 0;
+
+	pthread_mutex_lock (&c->lock);
+	while (c->in_flight >= c->max_in_flight && !c->error) pthread_cond_wait (&c->cond, &c->lock);
+	c->in_flight++;
+	if (c->tail) c->tail->next = job;
+	else c->head = job;
+	c->tail = job;
+	pthread_cond_broadcast (&c->cond);
+	pthread_mutex_unlock (&c->lock);
+	return c->error ? -1 : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Sink functions */
+
+static int chunk_write (img_sink *s, const char *buf, long long int len)
+{
+	chunk_sink *c = s->priv;
+	const unsigned char *p = (const unsigned char *) buf;
+	long long int n, skip;
+	uint64_t gear;
+	int cut;
+
+	while (len > 0)
+	{
+		n = 0;
+		cut = 0;
+		gear = c->gear;
+		while (n < len)
+		{
+			if (c->cur_len + n < CHUNK_MIN)
+			{
+				skip = CHUNK_MIN - (c->cur_len + n);
+				n += skip < len - n ? skip : len - n;
+				continue;
+			}
+			gear = (gear << 1) + gear_table[p[n++]];
+			if ((gear & CHUNK_MASK) == 0 || c->cur_len + n == CHUNK_MAX)
+			{
+				cut = 1;
+				break;
+			}
+		}
+		c->gear = gear;
+		memcpy (c->cur + c->cur_len, p, n);
+		c->cur_len += n;
+		p += n;
+		len -= n;
+		if (cut && submit_chunk (c)) return -1;
+	}
+	return 0;
+}
+
+static int chunk_zero (img_sink *s, long long int len)
+{
+	chunk_sink *c = s->priv;
+
+	if (submit_chunk (c)) return -1;
+	pthread_mutex_lock (&c->lock);
+	c->zero_bytes += len;
+	if (c->nrefs > 0 && c->refs[c->nrefs - 1].zero)
+	{
+		// the last reference is a zero region too
+		c->refs[c->nrefs - 1].len += len;
+		pthread_mutex_unlock (&c->lock);
+		return 0;
+	}
+	pthread_mutex_unlock (&c->lock);
+	add_ref (c, len, 1);
+	return 0;
+}
+
+static void chunk_free (chunk_sink *c)
+{
+	pthread_mutex_destroy (&c->lock);
+	pthread_cond_destroy (&c->cond);
+	free (c->workers);
+	free (c->refs);
+	free (c->cur);
+	free (c->repo);
+	free (c->name);
+	free (c);
+}
+
+static int chunk_close (img_sink *s)
+{
+	chunk_sink *c = s->priv;
+	char path[CHUNK_PATH], tmp[CHUNK_PATH];
+	long long int i, size = 0;
+	FILE *fp;
+	int res;
+
+	submit_chunk (c);
+	pthread_mutex_lock (&c->lock);
+	c->closing = 1;
+	pthread_cond_broadcast (&c->cond);
+	pthread_mutex_unlock (&c->lock);
+	for (i = 0; i < c->nworkers; i++) pthread_join (c->workers[i], NULL);
+	res = c->error;
+
+	if (!res)
+	{
+		for (i = 0; i < c->nrefs; i++) size += c->refs[i].len;
+		snprintf (path, sizeof (path), "%s/index/%s.idx", c->repo, c->name);
+		if (snprintf (tmp, sizeof (tmp), "%s.tmp", path) >= (int) sizeof (tmp))
+		{
+			errno = ENAMETOOLONG;
+			fp = NULL;
+		}
+		else fp = fopen (tmp, "w");
+		if (fp == NULL) res = 1;
+		else
+		{
+			fprintf (fp, "# imgclone chunk index 1\nsize %lld\n", size);
+			for (i = 0; i < c->nrefs; i++)
+				fprintf (fp, "%s %lld\n", c->refs[i].zero ? "Z" : c->refs[i].hash, c->refs[i].len);
+			if (fclose (fp) || rename (tmp, path)) res = 1;
+		}
+		if (res) fprintf (stderr, "Could not write index %s: %s\n", path, strerror (errno));
+		else printf ("Stored %lld chunks in %s, %lld new (%lld bytes), %lld bytes already stored, %lld bytes of zeros.\n",
+			c->chunks, c->repo, c->new_chunks, c->new_bytes, c->dup_bytes, c->zero_bytes);
+	}
+
+	chunk_free (c);
+	return res;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+img_sink *sink_chunkstore_open (const char *repo, const char *name, int threads)
+{
+	img_sink *s;
+	chunk_sink *c;
+	char path[CHUNK_PATH];
+	int i;
+
+	if (gear_table[0] == 0) init_gear_table ();
+	// the chunk files are the longest paths, a 64 digit hash below chunks/xx/
+	if (strlen (repo) + strlen (name) + 200 > CHUNK_PATH)
+	{
+		fprintf (stderr, "The path of the repository %s is too long.\n", repo);
+		return NULL;
+	}
+
+	// repository layout, every directory may exist already
+	mkdir (repo, 0755);
+	snprintf (path, sizeof (path), "%s/index", repo);
+	mkdir (path, 0755);
+	snprintf (path, sizeof (path), "%s/chunks", repo);
+	mkdir (path, 0755);
+	for (i = 0; i < 256; i++)
+	{
+		snprintf (path, sizeof (path), "%s/chunks/%02x", repo, i);
+		if (mkdir (path, 0755) && errno != EEXIST)
+		{
+			fprintf (stderr, "Could not create repository directory %s: %s\n", path, strerror (errno));
+			return NULL;
+		}
+	}
+
+	if (threads <= 0) threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+	if (threads <= 0) threads = 1;
+	c = calloc (1, sizeof (chunk_sink));
+	s = calloc (1, sizeof (img_sink));
+	if (c == NULL || s == NULL)
+	{
+		free (c);
+		free (s);
+		return NULL;
+	}
+	c->repo = strdup (repo);
+	c->name = strdup (name);
+	c->cur = malloc (CHUNK_MAX);
+	c->max_in_flight = threads * 2;
+	pthread_mutex_init (&c->lock, NULL);
+	pthread_cond_init (&c->cond, NULL);
+	c->workers = calloc (threads, sizeof (pthread_t));
+	// only the workers that were started are joined
+	for (i = 0; c->repo && c->name && c->cur && c->workers && i < threads; i++)
+	{
+		if (pthread_create (&c->workers[i], NULL, (void * (*)(void *)) &chunk_worker, c)) break;
+		c->nworkers++;
+	}
+	if (c->nworkers == 0)
+	{
+		fprintf (stderr, "Could not start storing %s in %s.\n", name, repo);
+		chunk_free (c);
+		free (s);
+		return NULL;
+	}
+
+	s->write = chunk_write;
+	s->zero = chunk_zero;
+	s->close = chunk_close;
+	s->priv = c;
+	return s;
+}
+
+int chunkstore_export (const char *repo, const char *name, const char *out)
+{
+	char path[CHUNK_PATH], line[256], hash[65], check[65];
+	unsigned char digest[32];
+	long long int len, size = -1, done = 0;
+	char *buffer, *zeros;
+	FILE *fp;
+	int fd, in, res = 0, sparse;
+	long long int n;
+
+	if (snprintf (path, sizeof (path), "%s/index/%s.idx", repo, name) >= (int) sizeof (path))
+	{
+		fprintf (stderr, "The path of the index of %s in %s is too long.\n", name, repo);
+		return 1;
+	}
+	fp = fopen (path, "r");
+	if (fp == NULL)
+	{
+		fprintf (stderr, "Could not open index %s: %s\n", path, strerror (errno));
+		return 1;
+	}
+	if (!strcmp (out, "-")) fd = 1;
+	else fd = open (out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		fprintf (stderr, "Could not create %s: %s\n", out, strerror (errno));
+		fclose (fp);
+		return 1;
+	}
+	// holes only work on a regular file
+	sparse = lseek (fd, 0, SEEK_CUR) >= 0;
+	buffer = malloc (CHUNK_MAX);
+	zeros = calloc (1, 65536);
+
+	while (!res && fgets (line, sizeof (line), fp) != NULL)
+	{
+		if (line[0] == '#') continue;
+		if (sscanf (line, "size %lld", &size) == 1) continue;
+		if (sscanf (line, "%64s %lld", hash, &len) != 2 || len < 0) continue;
+
+		if (!strcmp (hash, "Z"))
+		{
+			if (sparse)
+			{
+				if (lseek (fd, len, SEEK_CUR) < 0) res = 1;
+			}
+			else
+			{
+				for (n = 0; n < len && !res; n += 65536)
+					res = write_all (fd, zeros, len - n < 65536 ? len - n : 65536);
+			}
+			done += len;
+			continue;
+		}
+
+		in = chunk_path (repo, hash, path) ? -1 : open (path, O_RDONLY);
+		n = -1;
+		if (in >= 0 && len <= CHUNK_MAX)
+		{
+			// a short read is a damaged chunk, not data
+			n = read_at (in, buffer, len, 0) ? -1 : len;
+		}
+		if (in >= 0) close (in);
+		if (n != len)
+		{
+			fprintf (stderr, "Chunk %s is missing or damaged.\n", hash);
+			res = 1;
+			break;
+		}
+		sha256_buffer (buffer, len, digest);
+		hash_hex (digest, 32, check);
+		if (strcmp (hash, check))
+		{
+			fprintf (stderr, "Chunk %s is damaged, its hash is %s.\n", hash, check);
+			res = 1;
+			break;
+		}
+		res = write_all (fd, buffer, len);
+		done += len;
+	}
+	fclose (fp);
+	free (buffer);
+	free (zeros);
+
+	if (!res && size >= 0 && done != size)
+	{
+		fprintf (stderr, "Index %s is incomplete, %lld of %lld bytes.\n", name, done, size);
+		res = 1;
+	}
+	if (!res && sparse && ftruncate (fd, done)) res = 1;
+	if (fd != 1 && close (fd)) res = 1;
+	if (res) fprintf (stderr, "Could not export image %s.\n", name);
+	else fprintf (fd == 1 ? stderr : stdout, "Exported %s, %lld bytes.\n", name, done);
+	return res;
+}
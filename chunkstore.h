@@ -0,0 +1,38 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+chunkstore: deduplicating repository for many generations of images.
+
+An image is cut in variable sized chunks at content defined boundaries, so
+data that moved or changed only shifts the chunks around it. Every chunk is
+stored once under its SHA-256, an image is an index of chunk references:
+	<repo>/chunks/<first 2 hex digits>/<sha256>
+	<repo>/index/<name>.idx
+The index is text: a "size <bytes>" line, then "<sha256> <length>" per chunk
+and "Z <length>" for regions of zeros.
+*/
+
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include "sink.h"
+
+/* sink_chunkstore_open
+   Opens a sink that stores the image in a chunk repository, the repository is created if needed
+	@param repo repository directory
+	@param name image name, the index is written on close
+	@param threads number of hashing threads, 0 for one per CPU core
+	@return the sink or NULL on error
+*/
+img_sink *sink_chunkstore_open (const char *repo, const char *name, int threads);
+
+/* chunkstore_export
+   Reassembles an image from the repository, every chunk is verified against its hash
+	@param repo repository directory
+	@param name image name
+	@param out output file, zero regions become holes, or "-" for stdout
+	@return 0 on success
+*/
+int chunkstore_export (const char *repo, const char *name, const char *out);
+
+#endif
@@ -0,0 +1,1016 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+copytree: multi-threaded file tree copy, replaces "cp -ax src/. dst/."
+
+Every worker thread owns a task deque. New work (directories to read, files to
+copy) is pushed to the deque of the thread that found it and popped LIFO from
+there, idle threads steal the oldest task from the other deques. Metadata of
+directories and hard links is applied after all workers finished, so adding
+entries to a directory does not change its restored modification time.
+
+Small reads all over the card are much slower than reads in disk order. A
+directory is read with large getdents64 calls and its entries are looked at in
+inode order, so the inode table is read front to back. Its small files are
+queued in batches, a batch opens its files and copies them in the order of
+their first block on the disk (FIEMAP, inode order if the file system can't
+tell).
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <ftw.h>
+
+#include "hash.h"
+#include "copytree.h"
+#include "sink.h"
+#include "throttle.h"
+#include "util.h"
+
+#define TASK_DIR   0
+#define TASK_FILE  1
+#define TASK_BATCH 2                /* small files of one directory */
+
+#define COPY_CHUNK  (8*1024*1024)  /* bytes per copy_file_range/sendfile call, progress granularity */
+#define COPY_BUFFER (1024*1024)    /* read/write fallback buffer per worker */
+#define XATTR_BUFFER 65536
+#define LINK_HASH_SIZE 4096
+#define BATCH_FILES 32              /* files of a batch, each is open while the batch is sorted */
+#define BATCH_BYTES (8*1024*1024)
+#define BATCH_FILE_SIZE (1024*1024) /* larger files are read sequentially anyway, they are queued alone */
+
+/* the kernel's struct for getdents64, glibc only has a wrapper since 2.30 */
+typedef struct
+{
+	unsigned long long int d_ino;
+	long long int d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} linux_dirent;
+
+typedef struct copy_task
+{
+	int type;
+	char *src;
+	char *dst;
+	struct stat st;
+	struct copy_task *next;         /* TASK_BATCH: its files, linked by next */
+	int in;                         /* file of a batch: opened source, -1 if not open */
+	unsigned long long int where;   /* file of a batch: disk offset of its first block */
+} copy_task;
+
+/* batch that is being filled */
+typedef struct
+{
+	copy_task *first;
+	copy_task *last;
+	int files;
+	long long int bytes;
+} task_batch;
+
+/* entry of a directory, the name is an offset in the name buffer */
+typedef struct
+{
+	unsigned long long int ino;
+	size_t name;
+} dir_entry;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	copy_task **tasks;
+	int head;
+	int tail;
+	int size;
+} task_deque;
+
+typedef struct
+{
+	char *src;
+	char *dst;
+	struct stat st;
+} deferred_dir;
+
+typedef struct link_entry
+{
+	dev_t dev;
+	ino_t ino;
+	char *dst;
+	struct link_entry *next;
+} link_entry;
+
+typedef struct
+{
+	char *target;
+	char *dst;
+} deferred_link;
+
+typedef struct
+{
+	int nworkers;
+	task_deque *deques;
+	pthread_mutex_t pool_lock;
+	pthread_cond_t pool_cond;
+	volatile long long int queued;   /* tasks sitting in a deque */
+	volatile long long int pending;  /* tasks queued or running */
+	int idle;                        /* workers waiting for a task, protected by pool_lock */
+	dev_t root_dev;
+	size_t root_len;
+	copy_options opts;
+	copy_stats *stats;
+
+	pthread_mutex_t meta_lock;       /* protects everything below */
+	deferred_dir *dirs;
+	int ndirs, sdirs;
+	deferred_link *links;
+	int nlinks, slinks;
+	link_entry *link_hash[LINK_HASH_SIZE];
+} copy_ctx;
+
+typedef struct
+{
+	copy_ctx *ctx;
+	int id;
+	char *buffer;
+	char *xattr_list;
+	char *xattr_value;
+} copy_worker;
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+static void count (volatile long long int *counter, long long int n)
+{
+	__atomic_add_fetch (counter, n, __ATOMIC_RELAXED);
+}
+
+static void copy_error (copy_ctx *ctx, const char *path, const char *what)
+{
+	fprintf (stderr, "Could not %s %s: %s\n", what, path, strerror (errno));
+	count (&ctx->stats->errors, 1);
+}
+
+static char *join_path (const char *dir, const char *name)
+{
+	size_t ld = strlen (dir), ln = strlen (name);
+	char *p = malloc (ld + ln + 2);
+
+	if (p == NULL) return NULL;
+	memcpy (p, dir, ld);
+	p[ld] = '/';
+	memcpy (p + ld + 1, name, ln + 1);
+	return p;
+}
+
+/* copy all extended attributes (capabilities, ACLs, SELinux labels) without following symlinks */
+static void copy_xattrs (copy_worker *w, const char *src, const char *dst)
+{
+	ssize_t len, vlen;
+	char *name;
+
+	len = llistxattr (src, w->xattr_list, XATTR_BUFFER);
+	if (len <= 0) return;
+	for (name = w->xattr_list; name < w->xattr_list + len; name += strlen (name) + 1)
+	{
+		vlen = lgetxattr (src, name, w->xattr_value, XATTR_BUFFER);
+		if (vlen < 0) continue;
+		if (lsetxattr (dst, name, w->xattr_value, vlen, 0) && errno != ENOTSUP)
+			fprintf (stderr, "Warning: could not set attribute %s on %s: %s\n", name, dst, strerror (errno));
+	}
+}
+
+/* ownership first, chown clears the set-uid bits */
+static void copy_attributes (copy_worker *w, const char *src, const char *dst, const struct stat *st)
+{
+	struct timespec times[2];
+
+	if (lchown (dst, st->st_uid, st->st_gid)) copy_error (w->ctx, dst, "set owner of");
+	if (!S_ISLNK (st->st_mode) && chmod (dst, st->st_mode & 07777)) copy_error (w->ctx, dst, "set mode of");
+	copy_xattrs (w, src, dst);
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	if (utimensat (AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW)) copy_error (w->ctx, dst, "set times of");
+}
+
+/*---------------------------------------------------------------------------*/
+/* Task queues */
+
+static void deque_push (task_deque *q, copy_task *t)
+{
+	pthread_mutex_lock (&q->lock);
+	if (q->tail == q->size)
+	{
+		if (q->head > q->size / 2)
+		{
+			memmove (q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof (copy_task *));
+			q->tail -= q->head;
+			q->head = 0;
+		}
+		else
+		{
+			q->size = q->size ? q->size * 2 : 256;
+			q->tasks = realloc (q->tasks, q->size * sizeof (copy_task *));
+		}
+	}
+	q->tasks[q->tail++] = t;
+	pthread_mutex_unlock (&q->lock);
+}
+
+/* owner side, newest task first keeps the walk depth first */
+static copy_task *deque_pop (task_deque *q)
+{
+	copy_task *t = NULL;
+
+	pthread_mutex_lock (&q->lock);
+	if (q->tail > q->head) t = q->tasks[--q->tail];
+	if (q->tail == q->head) q->tail = q->head = 0;
+	pthread_mutex_unlock (&q->lock);
+	return t;
+}
+
+/* thief side, oldest task is usually the biggest subtree */
+static copy_task *deque_steal (task_deque *q)
+{
+	copy_task *t = NULL;
+
+	pthread_mutex_lock (&q->lock);
+	if (q->tail > q->head) t = q->tasks[q->head++];
+	if (q->tail == q->head) q->tail = q->head = 0;
+	pthread_mutex_unlock (&q->lock);
+	return t;
+}
+
+static copy_task *new_task (copy_ctx *ctx, int type, const char *src, const char *dst, const struct stat *st)
+{
+	size_t ls = strlen (src) + 1, ld = strlen (dst) + 1;
+	copy_task *t = malloc (sizeof (copy_task) + ls + ld);
+
+	if (t == NULL)
+	{
+		copy_error (ctx, src, "queue");
+		return NULL;
+	}
+	t->type = type;
+	t->src = (char *) (t + 1);
+	t->dst = t->src + ls;
+	memcpy (t->src, src, ls);
+	memcpy (t->dst, dst, ld);
+	t->st = *st;
+	t->next = NULL;
+	t->in = -1;
+	t->where = 0;
+	return t;
+}
+
+static void queue_task (copy_ctx *ctx, int id, copy_task *t)
+{
+	__atomic_add_fetch (&ctx->pending, 1, __ATOMIC_SEQ_CST);
+	deque_push (&ctx->deques[id], t);
+	__atomic_add_fetch (&ctx->queued, 1, __ATOMIC_SEQ_CST);
+	// a worker checks queued and goes idle under the lock, so it either sees this task or is woken up
+	pthread_mutex_lock (&ctx->pool_lock);
+	if (ctx->idle) pthread_cond_signal (&ctx->pool_cond);
+	pthread_mutex_unlock (&ctx->pool_lock);
+}
+
+static void push_task (copy_ctx *ctx, int id, int type, const char *src, const char *dst, const struct stat *st)
+{
+	copy_task *t = new_task (ctx, type, src, dst, st);
+
+	if (t != NULL) queue_task (ctx, id, t);
+}
+
+/* queues the files collected so far, a single file as a task of its own */
+static void batch_flush (copy_ctx *ctx, int id, task_batch *b)
+{
+	copy_task *t;
+
+	if (b->files == 1)
+	{
+		queue_task (ctx, id, b->first);
+	}
+	else if (b->files > 1)
+	{
+		t = new_task (ctx, TASK_BATCH, "", "", &b->first->st);
+		if (t != NULL)
+		{
+			t->next = b->first;
+			queue_task (ctx, id, t);
+		}
+	}
+	memset (b, 0, sizeof (task_batch));
+}
+
+/* small files are collected in a batch, large ones are queued alone */
+static void batch_add (copy_ctx *ctx, int id, task_batch *b, const char *src, const char *dst, const struct stat *st)
+{
+	copy_task *t;
+
+	if (st->st_size >= BATCH_FILE_SIZE)
+	{
+		push_task (ctx, id, TASK_FILE, src, dst, st);
+		return;
+	}
+	t = new_task (ctx, TASK_FILE, src, dst, st);
+	if (t == NULL) return;
+	if (b->last) b->last->next = t;
+	else b->first = t;
+	b->last = t;
+	b->files++;
+	b->bytes += st->st_size;
+	if (b->files == BATCH_FILES || b->bytes >= BATCH_BYTES) batch_flush (ctx, id, b);
+}
+
+static void defer_dir (copy_ctx *ctx, const char *src, const char *dst, const struct stat *st)
+{
+	pthread_mutex_lock (&ctx->meta_lock);
+	if (ctx->ndirs == ctx->sdirs)
+	{
+		ctx->sdirs = ctx->sdirs ? ctx->sdirs * 2 : 1024;
+		ctx->dirs = realloc (ctx->dirs, ctx->sdirs * sizeof (deferred_dir));
+	}
+	ctx->dirs[ctx->ndirs].src = strdup (src);
+	ctx->dirs[ctx->ndirs].dst = strdup (dst);
+	ctx->dirs[ctx->ndirs].st = *st;
+	ctx->ndirs++;
+	pthread_mutex_unlock (&ctx->meta_lock);
+}
+
+/* returns 1 if this inode was already copied and dst will become a hard link to it */
+static int defer_hard_link (copy_ctx *ctx, const char *dst, const struct stat *st)
+{
+	link_entry *e;
+	unsigned int h = (unsigned int) (st->st_ino ^ (st->st_ino >> 12)) % LINK_HASH_SIZE;
+
+	pthread_mutex_lock (&ctx->meta_lock);
+	for (e = ctx->link_hash[h]; e != NULL; e = e->next)
+	{
+		if (e->ino == st->st_ino && e->dev == st->st_dev) break;
+	}
+	if (e == NULL)
+	{
+		e = malloc (sizeof (link_entry));
+		e->dev = st->st_dev;
+		e->ino = st->st_ino;
+		e->dst = strdup (dst);
+		e->next = ctx->link_hash[h];
+		ctx->link_hash[h] = e;
+		pthread_mutex_unlock (&ctx->meta_lock);
+		return 0;
+	}
+	if (ctx->nlinks == ctx->slinks)
+	{
+		ctx->slinks = ctx->slinks ? ctx->slinks * 2 : 256;
+		ctx->links = realloc (ctx->links, ctx->slinks * sizeof (deferred_link));
+	}
+	ctx->links[ctx->nlinks].target = e->dst;
+	ctx->links[ctx->nlinks].dst = strdup (dst);
+	ctx->nlinks++;
+	pthread_mutex_unlock (&ctx->meta_lock);
+	return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Copy functions */
+
+/* writes buf at pos, blocks of zeros are skipped and stay holes */
+static int write_sparse (copy_worker *w, int out, const char *buf, ssize_t len, off_t pos)
+{
+	ssize_t i, n, run = -1;
+
+	for (i = 0; i < len; i += n)
+	{
+		n = len - i < SINK_ZERO_BLOCK ? len - i : SINK_ZERO_BLOCK;
+		if (sink_is_zero (buf + i, n))
+		{
+			if (run >= 0 && pwrite_all (out, buf + run, i - run, pos + run)) return -1;
+			run = -1;
+			count (&w->ctx->stats->holes, n);
+		}
+		else if (run < 0) run = i;
+	}
+	if (run >= 0 && pwrite_all (out, buf + run, len - run, pos + run)) return -1;
+	return 0;
+}
+
+static void hash_zeros (hash_state *hash, off_t len)
+{
+	static const char zeros[65536];
+
+	for (; hash && len > 0; len -= sizeof (zeros))
+		hash_update (hash, zeros, len < (off_t) sizeof (zeros) ? len : (off_t) sizeof (zeros));
+}
+
+/* copy with our own buffer: the holes of the source are skipped with SEEK_DATA/SEEK_HOLE,
+   blocks of zeros are not written and the data is hashed from the same buffer */
+static int copy_sparse (copy_worker *w, int in, int out, hash_state *hash)
+{
+	off_t pos = lseek (in, 0, SEEK_CUR), data, end;
+	ssize_t n, want;
+	struct stat st;
+
+	for (;;)
+	{
+		data = lseek (in, pos, SEEK_DATA);
+		if (data < 0 && errno == ENXIO) break;     // only a hole up to the end of the file
+		if (data < 0)
+		{
+			// no SEEK_DATA support, read everything
+			data = pos;
+			end = -1;
+		}
+		else end = lseek (in, data, SEEK_HOLE);
+		if (data > pos)
+		{
+			hash_zeros (hash, data - pos);
+			count (&w->ctx->stats->holes, data - pos);
+			pos = data;
+		}
+		while (end < 0 || pos < end)
+		{
+			want = end >= 0 && end - pos < COPY_BUFFER ? end - pos : COPY_BUFFER;
+			n = pread (in, w->buffer, want, pos);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0) return -1;
+			if (n == 0) goto done;
+			if (write_sparse (w, out, w->buffer, n, pos)) return -1;
+			if (hash) hash_update (hash, w->buffer, n);
+			throttle_take (n);
+			throttle_drop_read (in, pos, n);
+			throttle_drop_written (out, pos, n);
+			pos += n;
+			count (&w->ctx->stats->bytes, n);
+		}
+	}
+done:
+	// the file can end with a hole
+	if (fstat (in, &st) == 0 && st.st_size > pos)
+	{
+		hash_zeros (hash, st.st_size - pos);
+		count (&w->ctx->stats->holes, st.st_size - pos);
+		pos = st.st_size;
+	}
+	return ftruncate (out, pos);
+}
+
+/* copy until end of file, files on a live system may grow while we copy them
+   data that is hashed for the manifest and sparse files are copied through our own buffer */
+static int copy_data (copy_worker *w, int in, int out, hash_state *hash, int sparse)
+{
+	int method = hash || sparse ? 2 : 0; /* 0 copy_file_range, 1 sendfile, 2 read/write */
+	ssize_t n = 0;
+	off_t pos = 0;
+
+	for (;;)
+	{
+		if (method == 0)
+		{
+			n = copy_file_range (in, NULL, out, NULL, COPY_CHUNK, 0);
+			if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				method = 1;
+				continue;
+			}
+		}
+		else if (method == 1)
+		{
+			n = sendfile (out, in, NULL, COPY_CHUNK);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+			{
+				method = 2;
+				continue;
+			}
+		}
+		else
+		{
+			// continues where the other methods stopped, the output offset follows the input
+			if (lseek (out, lseek (in, 0, SEEK_CUR), SEEK_SET) < 0) return -1;
+			return copy_sparse (w, in, out, hash);
+		}
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0) return 0;
+		count (&w->ctx->stats->bytes, n);
+		throttle_take (n);
+		throttle_drop_read (in, pos, n);
+		throttle_drop_written (out, pos, n);
+		pos += n;
+	}
+}
+
+/* path relative to the source root as stored in the manifest, "" for the root */
+static const char *relative_path (copy_ctx *ctx, const char *src)
+{
+	return src[ctx->root_len] ? src + ctx->root_len + 1 : "";
+}
+
+static void record (copy_ctx *ctx, const char *src, const struct stat *st, uint64_t hash)
+{
+	if (ctx->opts.record) manifest_add (ctx->opts.record, relative_path (ctx, src), st, hash);
+	// directories are visited on every pass, only their contents can change
+	if (ctx->opts.changed && !S_ISDIR (st->st_mode)) manifest_add (ctx->opts.changed, relative_path (ctx, src), st, hash);
+}
+
+static int remove_entry (const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	return remove (path);
+}
+
+/* make room for a new version of an entry, directories that stay directories are kept */
+static void remove_existing (copy_ctx *ctx, const char *dst, const struct stat *st)
+{
+	struct stat old;
+
+	if (lstat (dst, &old)) return;
+	if (S_ISDIR (old.st_mode))
+	{
+		if (st != NULL && S_ISDIR (st->st_mode)) return;
+		if (nftw (dst, remove_entry, 64, FTW_DEPTH | FTW_PHYS)) copy_error (ctx, dst, "remove");
+	}
+	else if (unlink (dst))
+	{
+		copy_error (ctx, dst, "remove");
+	}
+}
+
+static int open_source (const char *src)
+{
+	int in = open (src, O_RDONLY | O_NOFOLLOW | O_NOATIME);
+
+	if (in < 0 && errno == EPERM) in = open (src, O_RDONLY | O_NOFOLLOW);
+	return in;
+}
+
+/* in is the opened source or -1 */
+static void copy_file (copy_worker *w, copy_task *t, int in)
+{
+	hash_state hash;
+	int out;
+
+	if (in < 0) in = open_source (t->src);
+	if (in < 0)
+	{
+		copy_error (w->ctx, t->src, "open");
+		return;
+	}
+	out = open (t->dst, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (out < 0)
+	{
+		copy_error (w->ctx, t->dst, "create");
+		close (in);
+		return;
+	}
+	hash_init (&hash, 0);
+	// fewer allocated blocks than the size: the file has holes
+	if (copy_data (w, in, out, w->ctx->opts.record ? &hash : NULL, t->st.st_blocks * 512 < t->st.st_size)) copy_error (w->ctx, t->src, "copy");
+	close (in);
+	if (close (out)) copy_error (w->ctx, t->dst, "write");
+	copy_attributes (w, t->src, t->dst, &t->st);
+	record (w->ctx, t->src, &t->st, w->ctx->opts.record ? hash_final (&hash) : 0);
+	count (&w->ctx->stats->files, 1);
+}
+
+/* disk offset of the first block of a file, 0 if it has none or the file system can't tell */
+static unsigned long long int first_block (int fd)
+{
+	struct
+	{
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} f;
+
+	memset (&f, 0, sizeof (f));
+	f.map.fm_length = FIEMAP_MAX_OFFSET;
+	f.map.fm_extent_count = 1;
+	if (ioctl (fd, FS_IOC_FIEMAP, &f.map) || f.map.fm_mapped_extents == 0) return 0;
+	return f.extent.fe_physical;
+}
+
+/* qsort compare, disk order and inode order for files without a known position */
+static int compare_where (const void *a, const void *b)
+{
+	const copy_task *ta = *(copy_task **) a, *tb = *(copy_task **) b;
+
+	if (ta->where != tb->where) return ta->where < tb->where ? -1 : 1;
+	if (ta->st.st_ino != tb->st.st_ino) return ta->st.st_ino < tb->st.st_ino ? -1 : 1;
+	return 0;
+}
+
+/* copies the small files of a batch in the order of their data on the disk */
+static void copy_batch (copy_worker *w, copy_task *t)
+{
+	copy_task *files[BATCH_FILES], *f;
+	int i, n = 0;
+
+	// the files were found in inode order, opening them reads the inode table in that order
+	for (f = t->next; f != NULL && n < BATCH_FILES; f = f->next)
+	{
+		f->in = open_source (f->src);
+		if (f->in >= 0) f->where = first_block (f->in);
+		files[n++] = f;
+	}
+	qsort (files, n, sizeof (copy_task *), compare_where);
+	for (i = 0; i < n; i++)
+	{
+		copy_file (w, files[i], files[i]->in);
+		free (files[i]);
+	}
+}
+
+static void copy_special (copy_worker *w, const char *src, const char *dst, const struct stat *st)
+{
+	char target[4096];
+	ssize_t len = 0;
+
+	if (S_ISLNK (st->st_mode))
+	{
+		len = readlink (src, target, sizeof (target) - 1);
+		if (len < 0)
+		{
+			copy_error (w->ctx, src, "read link");
+			return;
+		}
+		target[len] = 0;
+		if (symlink (target, dst))
+		{
+			copy_error (w->ctx, dst, "create link");
+			return;
+		}
+	}
+	else if (mknod (dst, st->st_mode, st->st_rdev))
+	{
+		copy_error (w->ctx, dst, "create node");
+		return;
+	}
+	copy_attributes (w, src, dst, st);
+	record (w->ctx, src, st, len ? hash_buffer (target, len, 0) : 0);
+	count (&w->ctx->stats->others, 1);
+}
+
+/* incremental copy, returns 1 if the entry did not change since the base manifest */
+static int unchanged (copy_ctx *ctx, const char *src, const char *dst, const struct stat *st)
+{
+	manifest_entry *e;
+
+	if (ctx->opts.base == NULL) return 0;
+	e = manifest_find (ctx->opts.base, relative_path (ctx, src));
+	if (e != NULL)
+	{
+		e->seen = 1;
+		if (!S_ISDIR (st->st_mode) && manifest_unchanged (e, st))
+		{
+			if (ctx->opts.record) manifest_add (ctx->opts.record, relative_path (ctx, src), st, e->hash);
+			count (&ctx->stats->unchanged, 1);
+			return 1;
+		}
+	}
+	remove_existing (ctx, dst, st);
+	return 0;
+}
+
+/* qsort compare, inode order */
+static int compare_ino (const void *a, const void *b)
+{
+	const dir_entry *ea = a, *eb = b;
+
+	if (ea->ino != eb->ino) return ea->ino < eb->ino ? -1 : 1;
+	return 0;
+}
+
+/* read_entries
+   Reads all entries of a directory except . and .. with getdents64 calls of COPY_BUFFER bytes
+	@param entries receives the entries sorted by inode number, free it
+	@param names receives the names the entries point into, free it
+	@return number of entries or -1 on error
+*/
+static long long int read_entries (copy_worker *w, int fd, dir_entry **entries, char **names)
+{
+	size_t size = 0, alloc = 0, used = 0, name_alloc = 0, len;
+	long long int n, pos;
+	linux_dirent *de;
+
+	*entries = NULL;
+	*names = NULL;
+	while ((n = syscall (SYS_getdents64, fd, w->buffer, COPY_BUFFER)) > 0)
+	{
+		for (pos = 0; pos < n; pos += de->d_reclen)
+		{
+			de = (linux_dirent *) (w->buffer + pos);
+			if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, "..")) continue;
+			len = strlen (de->d_name) + 1;
+			if (size == alloc)
+			{
+				alloc = alloc ? alloc * 2 : 256;
+				*entries = realloc (*entries, alloc * sizeof (dir_entry));
+			}
+			if (used + len > name_alloc)
+			{
+				name_alloc = (used + len) * 2;
+				*names = realloc (*names, name_alloc);
+			}
+			(*entries)[size].ino = de->d_ino;
+			(*entries)[size].name = used;
+			memcpy (*names + used, de->d_name, len);
+			used += len;
+			size++;
+		}
+	}
+	if (n < 0)
+	{
+		free (*entries);
+		free (*names);
+		return -1;
+	}
+	qsort (*entries, size, sizeof (dir_entry), compare_ino);
+	return size;
+}
+
+/* read one directory, create the sub directories and queue everything below it */
+static void copy_dir (copy_worker *w, copy_task *t)
+{
+	copy_ctx *ctx = w->ctx;
+	dir_entry *entries;
+	exclude_dir *excluded;
+	task_batch batch;
+	struct stat st;
+	char *src, *dst, *names, *name;
+	long long int i, n;
+	int fd;
+
+	fd = open (t->src, O_RDONLY | O_DIRECTORY);
+	n = fd < 0 ? -1 : read_entries (w, fd, &entries, &names);
+	if (n < 0)
+	{
+		copy_error (ctx, t->src, "read directory");
+		if (fd >= 0) close (fd);
+		return;
+	}
+	memset (&batch, 0, sizeof (batch));
+	excluded = exclude_enter (ctx->opts.exclude, relative_path (ctx, t->src));
+	for (i = 0; i < n; i++)
+	{
+		name = names + entries[i].name;
+		src = join_path (t->src, name);
+		dst = join_path (t->dst, name);
+		if (src == NULL || dst == NULL)
+		{
+			copy_error (ctx, t->src, "read entries of");
+		}
+		else if (fstatat (fd, name, &st, AT_SYMLINK_NOFOLLOW))
+		{
+			copy_error (ctx, src, "stat");
+		}
+		else if (exclude_match (excluded, name, S_ISDIR (st.st_mode)))
+		{
+			// not descended into, an incremental copy removes it from the destination
+			count (&ctx->stats->excluded, 1);
+		}
+		else if (unchanged (ctx, src, dst, &st))
+		{
+			// already in the destination
+		}
+		else if (S_ISDIR (st.st_mode))
+		{
+			// like cp -x, mount points are created but not descended into
+			if (mkdir (dst, S_IRWXU) && errno != EEXIST)
+			{
+				copy_error (ctx, dst, "create directory");
+			}
+			else
+			{
+				defer_dir (ctx, src, dst, &st);
+				record (ctx, src, &st, 0);
+				count (&ctx->stats->dirs, 1);
+				if (st.st_dev == ctx->root_dev) push_task (ctx, w->id, TASK_DIR, src, dst, &st);
+			}
+		}
+		else if (st.st_nlink > 1 && defer_hard_link (ctx, dst, &st))
+		{
+			// created after all workers finished
+			record (ctx, src, &st, 0);
+		}
+		else if (S_ISREG (st.st_mode))
+		{
+			batch_add (ctx, w->id, &batch, src, dst, &st);
+		}
+		else
+		{
+			copy_special (w, src, dst, &st);
+		}
+		free (src);
+		free (dst);
+	}
+	batch_flush (ctx, w->id, &batch);
+	exclude_leave (excluded);
+	free (entries);
+	free (names);
+	close (fd);
+}
+
+static void *copy_worker_func (copy_worker *w)
+{
+	copy_ctx *ctx = w->ctx;
+	copy_task *t;
+	int i;
+
+	for (;;)
+	{
+		t = deque_pop (&ctx->deques[w->id]);
+		for (i = 1; t == NULL && i < ctx->nworkers; i++)
+			t = deque_steal (&ctx->deques[(w->id + i) % ctx->nworkers]);
+
+		if (t != NULL)
+		{
+			__atomic_sub_fetch (&ctx->queued, 1, __ATOMIC_SEQ_CST);
+			if (t->type == TASK_DIR) copy_dir (w, t);
+			else if (t->type == TASK_BATCH) copy_batch (w, t);
+			else copy_file (w, t, -1);
+			free (t);
+			if (__atomic_sub_fetch (&ctx->pending, 1, __ATOMIC_SEQ_CST) == 0)
+			{
+				pthread_mutex_lock (&ctx->pool_lock);
+				pthread_cond_broadcast (&ctx->pool_cond);
+				pthread_mutex_unlock (&ctx->pool_lock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock (&ctx->pool_lock);
+		if (ctx->pending == 0)
+		{
+			pthread_mutex_unlock (&ctx->pool_lock);
+			break;
+		}
+		if (ctx->queued <= 0)
+		{
+			ctx->idle++;
+			pthread_cond_wait (&ctx->pool_cond, &ctx->pool_lock);
+			ctx->idle--;
+		}
+		pthread_mutex_unlock (&ctx->pool_lock);
+	}
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+int copy_default_threads (void)
+{
+	long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+	// copying is mostly waiting for the SD card, more threads than cores keep it busy
+	if (n < 1) n = 1;
+	return (int) n * 2;
+}
+
+/* qsort compare, reverse order puts the contents of a directory before the directory */
+static int compare_path_reverse (const void *a, const void *b)
+{
+	return strcmp ((*(manifest_entry **) b)->path, (*(manifest_entry **) a)->path);
+}
+
+/* incremental copy, remove everything that was in the base but is no longer on the source */
+static void delete_removed (copy_ctx *ctx, const char *dst)
+{
+	manifest_entry **removed;
+	long long int i, n = 0;
+	char *path;
+
+	removed = malloc (ctx->opts.base->count * sizeof (manifest_entry *) + 1);
+	for (i = 0; i < ctx->opts.base->count; i++)
+	{
+		if (!ctx->opts.base->entries[i].seen) removed[n++] = &ctx->opts.base->entries[i];
+	}
+	qsort (removed, n, sizeof (manifest_entry *), compare_path_reverse);
+	for (i = 0; i < n; i++)
+	{
+		path = join_path (dst, removed[i]->path);
+		remove_existing (ctx, path, NULL);
+		count (&ctx->stats->deleted, 1);
+		free (path);
+	}
+	free (removed);
+}
+
+long long int copy_tree (const char *src, const char *dst, const copy_options *options, copy_stats *stats)
+{
+	int threads = options->threads;
+	copy_ctx ctx;
+	copy_worker *workers;
+	pthread_t *tids;
+	copy_stats local_stats;
+	struct stat st;
+	int i;
+
+	if (threads <= 0) threads = copy_default_threads ();
+	if (stats == NULL) stats = &local_stats;
+	memset (stats, 0, sizeof (copy_stats));
+
+	if (lstat (src, &st))
+	{
+		fprintf (stderr, "Could not stat %s: %s\n", src, strerror (errno));
+		return 1;
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.nworkers = threads;
+	ctx.root_dev = st.st_dev;
+	ctx.root_len = strlen (src);
+	ctx.opts = *options;
+	ctx.stats = stats;
+	pthread_mutex_init (&ctx.pool_lock, NULL);
+	pthread_cond_init (&ctx.pool_cond, NULL);
+	pthread_mutex_init (&ctx.meta_lock, NULL);
+	ctx.deques = calloc (threads, sizeof (task_deque));
+	workers = calloc (threads, sizeof (copy_worker));
+	tids = calloc (threads, sizeof (pthread_t));
+	for (i = 0; i < threads; i++)
+	{
+		pthread_mutex_init (&ctx.deques[i].lock, NULL);
+		workers[i].ctx = &ctx;
+		workers[i].id = i;
+		workers[i].buffer = malloc (COPY_BUFFER);
+		workers[i].xattr_list = malloc (XATTR_BUFFER);
+		workers[i].xattr_value = malloc (XATTR_BUFFER);
+	}
+
+	// same as cp -a src/. dst/. the root directory attributes are copied too
+	defer_dir (&ctx, src, dst, &st);
+	push_task (&ctx, 0, TASK_DIR, src, dst, &st);
+
+	for (i = 0; i < threads; i++)
+	{
+		if (pthread_create (&tids[i], NULL, (void * (*)(void *)) &copy_worker_func, &workers[i]))
+		{
+			fprintf (stderr, "Error creating copy thread\n");
+			threads = i;
+			break;
+		}
+	}
+	if (threads == 0) copy_worker_func (&workers[0]);
+	for (i = 0; i < threads; i++) pthread_join (tids[i], NULL);
+
+	if (ctx.opts.base) delete_removed (&ctx, dst);
+
+	// hard links and directory attributes, deepest directories first
+	for (i = 0; i < ctx.nlinks; i++)
+	{
+		if (link (ctx.links[i].target, ctx.links[i].dst)) copy_error (&ctx, ctx.links[i].dst, "create hard link");
+		else count (&stats->others, 1);
+		free (ctx.links[i].dst);
+	}
+	for (i = ctx.ndirs - 1; i >= 0; i--)
+	{
+		copy_attributes (&workers[0], ctx.dirs[i].src, ctx.dirs[i].dst, &ctx.dirs[i].st);
+		free (ctx.dirs[i].src);
+		free (ctx.dirs[i].dst);
+	}
+
+	for (i = 0; i < LINK_HASH_SIZE; i++)
+	{
+		link_entry *e, *next;
+		for (e = ctx.link_hash[i]; e != NULL; e = next)
+		{
+			next = e->next;
+			free (e->dst);
+			free (e);
+		}
+	}
+	for (i = 0; i < ctx.nworkers; i++)
+	{
+		free (workers[i].buffer);
+		free (workers[i].xattr_list);
+		free (workers[i].xattr_value);
+		free (ctx.deques[i].tasks);
+		pthread_mutex_destroy (&ctx.deques[i].lock);
+	}
+	free (ctx.links);
+	free (ctx.dirs);
+	free (ctx.deques);
+	free (workers);
+	free (tids);
+	return stats->errors;
+}
@@ -0,0 +1,52 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+copytree: in-process replacement for "cp -ax src/. dst/."
+A pool of worker threads walks the source tree and copies files in parallel,
+preserving ownership, mode, timestamps, extended attributes, symlinks, device
+nodes and hard links, without crossing filesystem boundaries.
+*/
+
+#ifndef COPYTREE_H
+#define COPYTREE_H
+
+#include "manifest.h"
+#include "exclude.h"
+
+/* counters updated by the copy engine while it runs, safe to read from another thread */
+typedef struct
+{
+	volatile long long int files;   /* regular files copied */
+	volatile long long int dirs;    /* directories created */
+	volatile long long int others;  /* symlinks, device nodes, fifos, sockets and hard links */
+	volatile long long int bytes;   /* file data bytes copied */
+	volatile long long int holes;   /* bytes of holes and zero blocks that were not written */
+	volatile long long int errors;  /* entries that could not be copied */
+	volatile long long int unchanged; /* entries skipped because they match the base manifest */
+	volatile long long int deleted; /* entries of the base manifest removed from the destination */
+	volatile long long int excluded; /* entries left out by the exclude rules, with everything below them */
+} copy_stats;
+
+typedef struct
+{
+	int threads;                    /* number of worker threads, 0 for default */
+	manifest_writer *record;        /* every entry is added to this manifest, may be NULL, with a manifest file data is hashed and zero blocks become holes */
+	manifest *base;                 /* manifest of what dst already contains, only changes are copied, may be NULL */
+	manifest_writer *changed;       /* entries that were copied because they are new or changed, may be NULL */
+	const exclude_rules *exclude;   /* entries that are not copied, may be NULL */
+} copy_options;
+
+/* returns the default number of copy threads for this machine */
+int copy_default_threads (void);
+
+/* copy_tree
+   Copies the contents of directory src into existing directory dst
+	@param src source directory
+	@param dst destination directory, must exist
+	@param options threads, manifest to record, base manifest for an incremental copy and exclude rules
+	@param stats counters updated during the copy, may be NULL
+	@return 0 on success, number of entries that failed otherwise
+*/
+long long int copy_tree (const char *src, const char *dst, const copy_options *options, copy_stats *stats);
+
+#endif
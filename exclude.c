@@ -0,0 +1,438 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+exclude: compiled exclusion rules, see exclude.h for the syntax.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "exclude.h"
+
+#define NODE_LITERAL 0
+#define NODE_GLOB    1
+#define NODE_ANY     2              /* ** */
+
+#define MATCH_ALL 1                 /* a rule ends at the node */
+#define MATCH_DIR 2                 /* a rule with a trailing / ends at the node */
+
+typedef struct exclude_node
+{
+	char *name;
+	int kind;
+	int match;
+	struct exclude_node **literals; /* sorted by name */
+	int nliterals;
+	struct exclude_node **globs;    /* glob and ** components */
+	int nglobs;
+} exclude_node;
+
+struct exclude_rules
+{
+	exclude_node root;
+	int count;
+};
+
+/* nodes whose children are matched against the entries of a directory */
+struct exclude_dir
+{
+	const exclude_node **nodes;
+	int count;
+	int size;
+};
+
+/* Raspberry Pi OS, files that are recreated or downloaded again when they are needed */
+static const char *default_rules[] =
+{
+	"/var/swap",
+	"/swapfile",
+	"/var/cache/apt/*.bin",
+	"/var/cache/apt/archives/*.deb",
+	"/var/cache/apt/archives/partial/*",
+	"/var/log/journal/*",
+	"/var/lib/systemd/coredump/*",
+	"/var/tmp/*",
+	"/tmp/*",
+	"/root/.cache/*",
+	"/home/*/.cache/*",
+	NULL
+};
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+static int compare_name (const void *key, const void *node)
+{
+	return strcmp (key, (*(exclude_node **) node)->name);
+}
+
+static exclude_node *find_literal (const exclude_node *n, const char *name)
+{
+	exclude_node **found;
+
+	if (n->nliterals == 0) return NULL;
+	found = bsearch (name, n->literals, n->nliterals, sizeof (exclude_node *), compare_name);
+	return found ? *found : NULL;
+}
+
+/* returns the child for component name, it is added if there is none */
+static exclude_node *add_child (exclude_node *n, const char *name)
+{
+	exclude_node *c;
+	int i;
+
+	if (!strcmp (name, "**") || strpbrk (name, "*?[\\"))
+	{
+		for (i = 0; i < n->nglobs; i++)
+		{
+			if (!strcmp (n->globs[i]->name, name)) return n->globs[i];
+		}
+		c = calloc (1, sizeof (exclude_node));
+		c->name = strdup (name);
+		c->kind = strcmp (name, "**") ? NODE_GLOB : NODE_ANY;
+		n->globs = realloc (n->globs, (n->nglobs + 1) * sizeof (exclude_node *));
+		n->globs[n->nglobs++] = c;
+		return c;
+	}
+	c = find_literal (n, name);
+	if (c) return c;
+	c = calloc (1, sizeof (exclude_node));
+	c->name = strdup (name);
+	c->kind = NODE_LITERAL;
+	// keep the literals sorted for bsearch
+	n->literals = realloc (n->literals, (n->nliterals + 1) * sizeof (exclude_node *));
+	for (i = n->nliterals; i > 0 && strcmp (n->literals[i - 1]->name, name) > 0; i--) n->literals[i] = n->literals[i - 1];
+	n->literals[i] = c;
+	n->nliterals++;
+	return c;
+}
+
+static void free_children (exclude_node *n)
+{
+	int i;
+
+	for (i = 0; i < n->nliterals + n->nglobs; i++)
+	{
+		exclude_node *c = i < n->nliterals ? n->literals[i] : n->globs[i - n->nliterals];
+
+		free_children (c);
+		free (c->name);
+		free (c);
+	}
+	free (n->literals);
+	free (n->globs);
+}
+
+static int matches (const exclude_node *n, int is_dir)
+{
+	return (n->match & MATCH_ALL) || ((n->match & MATCH_DIR) && is_dir);
+}
+
+/* adds a node and the ** below it, a ** also matches no directory at all, any 0 leaves out the ** nodes */
+static void add_node (exclude_dir *d, const exclude_node *n, int any)
+{
+	int i;
+
+	if (n->kind == NODE_ANY && !any) return;
+	for (i = 0; i < d->count; i++)
+	{
+		if (d->nodes[i] == n) return;
+	}
+	if (d->count == d->size)
+	{
+		d->size = d->size ? d->size * 2 : 8;
+		d->nodes = realloc (d->nodes, d->size * sizeof (exclude_node *));
+	}
+	d->nodes[d->count++] = n;
+	for (i = 0; i < n->nglobs; i++)
+	{
+		if (n->globs[i]->kind == NODE_ANY) add_node (d, n->globs[i], any);
+	}
+}
+
+/* state of sub directory name of d */
+static exclude_dir *step (const exclude_dir *d, const char *name, int any)
+{
+	exclude_dir *next = calloc (1, sizeof (exclude_dir));
+	const exclude_node *n, *c;
+	int i, j;
+
+	for (i = 0; i < d->count; i++)
+	{
+		n = d->nodes[i];
+		// ** stays in the sub directories
+		if (n->kind == NODE_ANY) add_node (next, n, any);
+		c = find_literal (n, name);
+		if (c) add_node (next, c, any);
+		for (j = 0; j < n->nglobs; j++)
+		{
+			c = n->globs[j];
+			if (c->kind == NODE_GLOB && fnmatch (c->name, name, 0) == 0) add_node (next, c, any);
+		}
+	}
+	return next;
+}
+
+static exclude_dir *enter (const exclude_rules *r, const char *path, int any)
+{
+	exclude_dir *d, *next;
+	const char *end;
+	char name[256];
+	size_t len;
+
+	if (r == NULL || (r->root.nliterals == 0 && r->root.nglobs == 0)) return NULL;
+	d = calloc (1, sizeof (exclude_dir));
+	add_node (d, &r->root, any);
+	for (; *path && d->count; path = *end ? end + 1 : end)
+	{
+		end = strchrnul (path, '/');
+		len = end - path < (long) sizeof (name) ? (size_t) (end - path) : sizeof (name) - 1;
+		memcpy (name, path, len);
+		name[len] = 0;
+		if (len == 0) continue;
+		next = step (d, name, any);
+		exclude_leave (d);
+		d = next;
+	}
+	if (d->count == 0)
+	{
+		exclude_leave (d);
+		return NULL;
+	}
+	return d;
+}
+
+/* adds up an excluded entry and everything below it on the same file system */
+static void measure_tree (int dir, const char *name, dev_t dev, long long int *bytes, long long int *files)
+{
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int fd;
+
+	if (fstatat (dir, name, &st, AT_SYMLINK_NOFOLLOW) || st.st_dev != dev) return;
+	// a file with other names stays in the image
+	if (S_ISDIR (st.st_mode) || st.st_nlink == 1)
+	{
+		*bytes += (long long int) st.st_blocks * 512;
+		(*files)++;
+	}
+	if (!S_ISDIR (st.st_mode)) return;
+	fd = openat (dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) return;
+	d = fdopendir (fd);
+	if (d == NULL)
+	{
+		close (fd);
+		return;
+	}
+	while ((de = readdir (d)) != NULL)
+	{
+		if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, "..")) continue;
+		measure_tree (dirfd (d), de->d_name, dev, bytes, files);
+	}
+	closedir (d);
+}
+
+static void measure_entry (const exclude_dir *d, int dir, const char *name, dev_t dev, long long int *bytes, long long int *files);
+
+/* looks for excluded entries in a directory, only the names of the rules if they have no globs */
+static void measure_dir (const exclude_dir *d, int dir, dev_t dev, long long int *bytes, long long int *files)
+{
+	const exclude_node *n = d->nodes[0];
+	struct dirent *de;
+	DIR *list;
+	int i, fd;
+
+	if (d->count == 1 && n->nglobs == 0)
+	{
+		for (i = 0; i < n->nliterals; i++) measure_entry (d, dir, n->literals[i]->name, dev, bytes, files);
+		return;
+	}
+	// a directory stream of its own, dir is used for the entries
+	fd = openat (dir, ".", O_RDONLY | O_DIRECTORY);
+	list = fd < 0 ? NULL : fdopendir (fd);
+	if (list == NULL)
+	{
+		if (fd >= 0) close (fd);
+		return;
+	}
+	while ((de = readdir (list)) != NULL)
+	{
+		if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, "..")) continue;
+		measure_entry (d, dir, de->d_name, dev, bytes, files);
+	}
+	closedir (list);
+}
+
+static void measure_entry (const exclude_dir *d, int dir, const char *name, dev_t dev, long long int *bytes, long long int *files)
+{
+	exclude_dir *next;
+	struct stat st;
+	int fd;
+
+	if (fstatat (dir, name, &st, AT_SYMLINK_NOFOLLOW) || st.st_dev != dev) return;
+	if (exclude_match (d, name, S_ISDIR (st.st_mode)))
+	{
+		measure_tree (dir, name, dev, bytes, files);
+		return;
+	}
+	if (!S_ISDIR (st.st_mode)) return;
+	next = step (d, name, 0);
+	fd = next->count ? openat (dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW) : -1;
+	if (fd >= 0)
+	{
+		measure_dir (next, fd, dev, bytes, files);
+		close (fd);
+	}
+	exclude_leave (next);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+exclude_rules *exclude_new (void)
+{
+	return calloc (1, sizeof (exclude_rules));
+}
+
+int exclude_add (exclude_rules *r, const char *pattern)
+{
+	char *copy, *name, *save = NULL;
+	char *names[128];
+	int n = 0, i, dir_only, anchored, any = 1;
+	size_t len;
+	exclude_node *node;
+
+	copy = strdup (pattern);
+	len = strlen (copy);
+	dir_only = len > 0 && copy[len - 1] == '/';
+	while (len > 0 && copy[len - 1] == '/') copy[--len] = 0;
+	anchored = strchr (copy, '/') != NULL;
+	// a rule without / is a name anywhere in the tree, like **/name
+	if (!anchored) names[n++] = "**";
+	for (name = strtok_r (copy, "/", &save); name != NULL && n < 128; name = strtok_r (NULL, "/", &save))
+	{
+		if (!strcmp (name, ".")) continue;
+		// ** followed by ** is the same as one
+		if (!strcmp (name, "**") && n > 0 && !strcmp (names[n - 1], "**")) continue;
+		names[n++] = name;
+		if (strcmp (name, "**")) any = 0;
+	}
+	if (n == 0 || any || name != NULL)
+	{
+		fprintf (stderr, "Invalid exclude rule \"%s\", it is empty, too long or excludes everything.\n", pattern);
+		free (copy);
+		return 1;
+	}
+	node = &r->root;
+	for (i = 0; i < n; i++) node = add_child (node, names[i]);
+	node->match |= dir_only ? MATCH_DIR : MATCH_ALL;
+	r->count++;
+	free (copy);
+	return 0;
+}
+
+int exclude_add_file (exclude_rules *r, const char *path)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int res = 0;
+	FILE *fp;
+
+	fp = fopen (path, "r");
+	if (fp == NULL)
+	{
+		fprintf (stderr, "Could not read exclude rules from %s: %s\n", path, strerror (errno));
+		return 1;
+	}
+	while (res == 0 && (len = getline (&line, &size, fp)) > 0)
+	{
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+		if (line[strspn (line, " \t")] == 0 || line[0] == '#') continue;
+		res = exclude_add (r, line);
+	}
+	free (line);
+	fclose (fp);
+	return res;
+}
+
+void exclude_add_defaults (exclude_rules *r)
+{
+	const char **rule;
+
+	for (rule = default_rules; *rule; rule++) exclude_add (r, *rule);
+}
+
+int exclude_count (const exclude_rules *r)
+{
+	return r ? r->count : 0;
+}
+
+void exclude_free (exclude_rules *r)
+{
+	if (r == NULL) return;
+	free_children (&r->root);
+	free (r);
+}
+
+exclude_dir *exclude_enter (const exclude_rules *r, const char *path)
+{
+	return enter (r, path, 1);
+}
+
+int exclude_match (const exclude_dir *d, const char *name, int is_dir)
+{
+	const exclude_node *n, *c;
+	int i, j;
+
+	if (d == NULL) return 0;
+	for (i = 0; i < d->count; i++)
+	{
+		n = d->nodes[i];
+		// a rule ending in ** excludes everything below
+		if (n->kind == NODE_ANY && matches (n, is_dir)) return 1;
+		c = find_literal (n, name);
+		if (c && matches (c, is_dir)) return 1;
+		for (j = 0; j < n->nglobs; j++)
+		{
+			c = n->globs[j];
+			if (c->kind == NODE_GLOB && matches (c, is_dir) && fnmatch (c->name, name, 0) == 0) return 1;
+		}
+	}
+	return 0;
+}
+
+void exclude_leave (exclude_dir *d)
+{
+	if (d == NULL) return;
+	free (d->nodes);
+	free (d);
+}
+
+void exclude_measure (const exclude_rules *r, const char *root, long long int *bytes, long long int *files)
+{
+	exclude_dir *d;
+	struct stat st;
+	int fd;
+
+	*bytes = 0;
+	*files = 0;
+	d = enter (r, "", 0);
+	if (d == NULL) return;
+	fd = open (root, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0 && fstat (fd, &st) == 0) measure_dir (d, fd, st.st_dev, bytes, files);
+	if (fd >= 0) close (fd);
+	exclude_leave (d);
+}
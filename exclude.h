@@ -0,0 +1,75 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+exclude: rules for files that are left out of a backup.
+
+A rule is a path pattern relative to the root of each partition:
+	/var/swap           the file var/swap, a leading / anchors the rule at the root
+	var/log/syslog.1    a / in the rule anchors it at the root too
+	*.tmp               a rule without / matches the name at any depth
+	tmp/                a trailing / only matches directories
+A component can use *, ? and [...] like the shell, a component ** matches any
+number of directories, also none. An excluded directory is left out with
+everything below it, a rule that ends with a / and * keeps the directory but
+not what is in it.
+
+The rules are compiled into a tree of their components: the literal components
+of a level are sorted and found with a binary search, glob components are
+matched with fnmatch. A directory of the walk gets the set of tree nodes its
+path reaches once, its entries are checked against the children of those
+nodes only, and most directories reach no node except the ones of the rules
+without /.
+*/
+
+#ifndef EXCLUDE_H
+#define EXCLUDE_H
+
+typedef struct exclude_rules exclude_rules;
+typedef struct exclude_dir exclude_dir;
+
+/* returns a set of rules without rules */
+exclude_rules *exclude_new (void);
+
+/* exclude_add
+   Adds a rule
+	@return 0 on success, 1 with a message if the rule is empty or matches every path
+*/
+int exclude_add (exclude_rules *r, const char *pattern);
+
+/* exclude_add_file
+   Adds the rules in a file, one per line, empty lines and lines starting with # are skipped
+	@return 0 on success, 1 with a message if the file can't be read or has an invalid rule
+*/
+int exclude_add_file (exclude_rules *r, const char *path);
+
+/* adds the rules for the swap file, package caches, journal logs, user caches and temporary files of Raspberry Pi OS */
+void exclude_add_defaults (exclude_rules *r);
+
+/* returns the number of rules */
+int exclude_count (const exclude_rules *r);
+
+void exclude_free (exclude_rules *r);
+
+/* exclude_enter
+   Looks up the rules that can match entries of a directory
+	@param r rules, may be NULL
+	@param path directory relative to the root, "" for the root itself
+	@return the state of the directory, NULL if no rule can match below it
+*/
+exclude_dir *exclude_enter (const exclude_rules *r, const char *path);
+
+/* returns 1 if entry name of the directory of d is excluded, d may be NULL */
+int exclude_match (const exclude_dir *d, const char *name, int is_dir);
+
+/* frees the state of a directory, NULL is ignored */
+void exclude_leave (exclude_dir *d);
+
+/* exclude_measure
+   Adds up the space and inodes of what the anchored rules exclude below the mounted file system root,
+   to size an image without them. Rules without / and below ** are not counted, that would read the whole tree
+	@param bytes receives the allocated bytes of the excluded entries
+	@param files receives the number of excluded inodes
+*/
+void exclude_measure (const exclude_rules *r, const char *root, long long int *bytes, long long int *files);
+
+#endif
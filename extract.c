@@ -0,0 +1,599 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+extract: path lookup and file reads on ext2/3/4 and FAT12/16/32, read only,
+straight from the image bytes.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "imgfile.h"
+#include "extract.h"
+#include "probe.h"
+#include "util.h"
+
+#define EXT4_MAGIC              0xEF53
+#define EXT4_INCOMPAT_64BIT     0x0080
+#define EXT4_EXTENTS_FL         0x00080000
+#define EXT4_INLINE_DATA_FL     0x10000000
+#define EXT4_EXTENT_MAGIC       0xF30A
+#define EXT4_ROOT_INODE         2
+#define EXT4_INODE_MAX          1024
+
+#define FAT_ATTR_LFN    0x0F
+#define FAT_ATTR_VOLUME 0x08
+#define FAT_ATTR_DIR    0x10
+
+#define MAX_SYMLINKS 40
+#define RUN_BLOCKS   256                 /* contiguous blocks read at once */
+
+typedef struct
+{
+	img_file *img;
+	long long int offset;               /* byte offset of the partition in the image */
+	long long int size;
+
+	// ext2/3/4
+	long long int block_size;
+	long long int ipg;
+	long long int inode_size;
+	long long int desc_size;
+	unsigned char sb[1024];             /* superblock, the group descriptors are found with it */
+	unsigned char *block;
+
+	// FAT
+	int fat_type;                       /* 12, 16 or 32 */
+	long long int bps;
+	long long int cluster_size;
+	long long int fat;                  /* byte offsets in the partition */
+	long long int root;
+	long long int root_size;
+	long long int data;
+	long long int clusters;
+	long long int root_cluster;
+} fs_ctx;
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+static int fs_read (fs_ctx *fs, void *buf, long long int len, long long int pos)
+{
+	if (pos < 0 || pos + len > fs->size) return -1;
+	return img_file_read (fs->img, buf, len, fs->offset + pos);
+}
+
+static int read_image (void *img, void *buf, long long int len, long long int offset)
+{
+	return img_file_read (img, buf, len, offset);
+}
+
+/*---------------------------------------------------------------------------*/
+/* ext2/3/4 */
+
+static int ext_open (fs_ctx *fs, const unsigned char *sb)
+{
+	uint32_t incompat = le32 (sb + 0x60);
+
+	fs->block_size = 1024LL << le32 (sb + 0x18);
+	fs->ipg = le32 (sb + 0x28);
+	fs->inode_size = le32 (sb + 0x4C) ? le16 (sb + 0x58) : 128;
+	fs->desc_size = 32;
+	if ((incompat & EXT4_INCOMPAT_64BIT) && le16 (sb + 0xFE) >= 64) fs->desc_size = le16 (sb + 0xFE);
+	memcpy (fs->sb, sb, sizeof (fs->sb));
+	if (fs->block_size > 65536 || fs->ipg == 0 || fs->inode_size < 128 || fs->inode_size > EXT4_INODE_MAX)
+	{
+		fprintf (stderr, "Unsupported ext file system layout.\n");
+		return -1;
+	}
+	fs->block = malloc (fs->block_size);
+	return fs->block == NULL ? -1 : 0;
+}
+
+static int ext_inode (fs_ctx *fs, long long int ino, unsigned char *inode)
+{
+	unsigned char desc[64];
+	long long int g = (ino - 1) / fs->ipg, dpb = fs->block_size / fs->desc_size, table;
+
+	if (ino < 1 || fs_read (fs, desc, fs->desc_size, probe_ext_desc_block (fs->sb, g / dpb) * fs->block_size + g % dpb * fs->desc_size)) return -1;
+	table = le32 (desc + 0x08);
+	if (fs->desc_size >= 64) table |= (long long int) le32 (desc + 0x28) << 32;
+	memset (inode, 0, EXT4_INODE_MAX);
+	return fs_read (fs, inode, fs->inode_size, table * fs->block_size + ((ino - 1) % fs->ipg) * fs->inode_size);
+}
+
+static long long int ext_size (const unsigned char *inode)
+{
+	return le32 (inode + 0x04) | ((long long int) le32 (inode + 0x6C) << 32);
+}
+
+/* physical block of logical block l of a file, 0 for a hole, -1 on error */
+static long long int ext_map (fs_ctx *fs, const unsigned char *inode, long long int l)
+{
+	const unsigned char *node = inode + 0x28, *e;
+	long long int per = fs->block_size / 4, block, start;
+	int i, n, depth, len;
+
+	if (le32 (inode + 0x20) & EXT4_EXTENTS_FL)
+	{
+		for (;;)
+		{
+			if (le16 (node) != EXT4_EXTENT_MAGIC) return -1;
+			n = le16 (node + 2);
+			depth = le16 (node + 6);
+			if (depth == 0)
+			{
+				for (i = 0; i < n; i++)
+				{
+					e = node + 12 + i * 12;
+					len = le16 (e + 4);
+					// longer than 32768 marks an uninitialized extent, it reads as zeros
+					if (len > 32768) continue;
+					start = le32 (e + 8) | ((long long int) le16 (e + 6) << 32);
+					if (l >= le32 (e) && l < (long long int) le32 (e) + len) return start + l - le32 (e);
+				}
+				return 0;
+			}
+			// the last index that starts at or before l
+			for (i = 0; i + 1 < n && le32 (node + 12 + (i + 1) * 12) <= l; i++);
+			if (n == 0) return 0;
+			e = node + 12 + i * 12;
+			block = le32 (e + 4) | ((long long int) le16 (e + 8) << 32);
+			if (fs_read (fs, fs->block, fs->block_size, block * fs->block_size)) return -1;
+			node = fs->block;
+		}
+	}
+
+	// ext2/3: 12 direct blocks, then single, double and triple indirect blocks
+	if (l < 12) return le32 (inode + 0x28 + l * 4);
+	l -= 12;
+	if (l < per) { depth = 1; block = le32 (inode + 0x28 + 12 * 4); }
+	else if ((l -= per) < per * per) { depth = 2; block = le32 (inode + 0x28 + 13 * 4); }
+	else { l -= per * per; depth = 3; block = le32 (inode + 0x28 + 14 * 4); }
+	for (; depth > 0 && block; depth--)
+	{
+		long long int unit = depth == 3 ? per * per : depth == 2 ? per : 1;
+
+		if (fs_read (fs, fs->block, fs->block_size, block * fs->block_size)) return -1;
+		block = le32 (fs->block + (l / unit) * 4);
+		l %= unit;
+	}
+	return block;
+}
+
+/* reads len bytes of a file from pos, runs of contiguous blocks are read at once */
+static int ext_read (fs_ctx *fs, const unsigned char *inode, char *buf, long long int len, long long int pos)
+{
+	long long int bs = fs->block_size, l, first, next, n, skip, run;
+
+	if (le32 (inode + 0x20) & EXT4_INLINE_DATA_FL)
+	{
+		// only the part in the inode, longer inline data continues in an extended attribute
+		if (pos + len > 60)
+		{
+			fprintf (stderr, "Inline data longer than 60 bytes is not supported.\n");
+			return -1;
+		}
+		memcpy (buf, inode + 0x28 + pos, len);
+		return 0;
+	}
+	while (len > 0)
+	{
+		l = pos / bs;
+		skip = pos % bs;
+		first = ext_map (fs, inode, l);
+		if (first < 0) return -1;
+		for (run = 1; run < RUN_BLOCKS && (run * bs - skip) < len; run++)
+		{
+			next = ext_map (fs, inode, l + run);
+			if (next < 0) return -1;
+			if (first == 0 ? next != 0 : next != first + run) break;
+		}
+		n = run * bs - skip < len ? run * bs - skip : len;
+		if (first == 0) memset (buf, 0, n);
+		else if (fs_read (fs, buf, n, first * bs + skip)) return -1;
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* inode number of name in directory dir, 0 if it is not there, -1 on error */
+static long long int ext_lookup (fs_ctx *fs, long long int dir, const char *name)
+{
+	unsigned char inode[EXT4_INODE_MAX], *e;
+	long long int size, pos, found = 0;
+	size_t name_len = strlen (name);
+	char *data;
+	int rec_len;
+
+	if (ext_inode (fs, dir, inode)) return -1;
+	if ((le16 (inode) & S_IFMT) != S_IFDIR) return 0;
+	size = ext_size (inode);
+	data = malloc (size + 1);
+	if (data == NULL || ext_read (fs, inode, data, size, 0))
+	{
+		free (data);
+		return -1;
+	}
+	// hashed directories keep normal entries in their leaf blocks, the index blocks look like empty entries
+	for (pos = 0; pos + 8 <= size && !found; pos += rec_len)
+	{
+		e = (unsigned char *) data + pos;
+		rec_len = le16 (e + 4);
+		if (rec_len < 8) break;
+		if (le32 (e) && e[6] == name_len && !memcmp (e + 8, name, name_len)) found = le32 (e);
+	}
+	free (data);
+	return found;
+}
+
+/* path lookup from the root, symlinks are followed inside the partition */
+static long long int ext_resolve (fs_ctx *fs, const char *path, unsigned char *inode)
+{
+	char *work, *name, *rest, *next, target[4096];
+	long long int dir = EXT4_ROOT_INODE, ino = EXT4_ROOT_INODE, size;
+	int links = 0;
+
+	work = strdup (path);
+	if (work == NULL || ext_inode (fs, ino, inode))
+	{
+		free (work);
+		return -1;
+	}
+	for (name = work; name != NULL; name = rest)
+	{
+		while (*name == '/') name++;
+		rest = strchr (name, '/');
+		if (rest) *rest++ = 0;
+		if (!*name) continue;
+		dir = ino;
+		ino = ext_lookup (fs, dir, name);
+		if (ino <= 0 || ext_inode (fs, ino, inode))
+		{
+			if (ino == 0) fprintf (stderr, "%s: %s not found.\n", path, name);
+			free (work);
+			return -1;
+		}
+		if ((le16 (inode) & S_IFMT) != S_IFLNK) continue;
+
+		// the target replaces the link in the path, relative to the directory of the link or to the root
+		size = ext_size (inode);
+		if (++links > MAX_SYMLINKS || size >= (long long int) sizeof (target))
+		{
+			fprintf (stderr, "%s: too many levels of symbolic links.\n", path);
+			free (work);
+			return -1;
+		}
+		// a fast symlink keeps its target in the block pointers
+		if (size < 60 && !(le32 (inode + 0x20) & EXT4_EXTENTS_FL) && le32 (inode + 0x1C) == 0) memcpy (target, inode + 0x28, size);
+		else if (ext_read (fs, inode, target, size, 0))
+		{
+			free (work);
+			return -1;
+		}
+		target[size] = 0;
+		next = malloc (strlen (target) + (rest ? strlen (rest) : 0) + 2);
+		if (next == NULL) { free (work); return -1; }
+		sprintf (next, "%s/%s", target, rest ? rest : "");
+		free (work);
+		work = next;
+		rest = work;
+		ino = target[0] == '/' ? EXT4_ROOT_INODE : dir;
+		if (ext_inode (fs, ino, inode)) { free (work); return -1; }
+	}
+	free (work);
+	return ino;
+}
+
+static int ext_extract (fs_ctx *fs, const char *path, int out)
+{
+	unsigned char inode[EXT4_INODE_MAX];
+	struct timespec times[2];
+	struct stat st;
+	long long int size, pos, n;
+	char *buffer;
+	int res = 0;
+
+	if (ext_resolve (fs, path, inode) < 0) return -1;
+	if ((le16 (inode) & S_IFMT) != S_IFREG)
+	{
+		fprintf (stderr, "%s is not a regular file.\n", path);
+		return -1;
+	}
+	size = ext_size (inode);
+	buffer = malloc (RUN_BLOCKS * fs->block_size);
+	if (buffer == NULL) return -1;
+	for (pos = 0; pos < size && !res; pos += n)
+	{
+		n = size - pos < RUN_BLOCKS * fs->block_size ? size - pos : RUN_BLOCKS * fs->block_size;
+		res = ext_read (fs, inode, buffer, n, pos) || write_all (out, buffer, n);
+	}
+	free (buffer);
+	if (!res && fstat (out, &st) == 0 && S_ISREG (st.st_mode))
+	{
+		fchmod (out, le16 (inode) & 07777);
+		times[0].tv_sec = le32 (inode + 0x08);
+		times[1].tv_sec = le32 (inode + 0x10);
+		times[0].tv_nsec = times[1].tv_nsec = 0;
+		futimens (out, times);
+	}
+	printf ("%lld bytes extracted.\n", size);
+	return res ? -1 : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* FAT12/16/32 */
+
+static int fat_open (fs_ctx *fs, const unsigned char *bs)
+{
+	long long int spc = bs[13], rsvd = le16 (bs + 14), nfats = bs[16], root_entries = le16 (bs + 17);
+	long long int total = le16 (bs + 19), fat_size = le16 (bs + 22);
+
+	fs->bps = le16 (bs + 11);
+	if (total == 0) total = le32 (bs + 32);
+	if (fat_size == 0) fat_size = le32 (bs + 36);
+	if ((fs->bps != 512 && fs->bps != 1024 && fs->bps != 2048 && fs->bps != 4096) || spc == 0 || (spc & (spc - 1)) || nfats < 1 || fat_size == 0 || rsvd == 0)
+		return -1;
+	fs->cluster_size = spc * fs->bps;
+	fs->fat = rsvd * fs->bps;
+	fs->root = (rsvd + nfats * fat_size) * fs->bps;
+	fs->root_size = root_entries * 32;
+	fs->data = fs->root + (fs->root_size + fs->bps - 1) / fs->bps * fs->bps;
+	if (total * fs->bps <= fs->data) return -1;
+	fs->clusters = (total * fs->bps - fs->data) / fs->cluster_size;
+	fs->fat_type = fs->clusters < 4085 ? 12 : fs->clusters < 65525 ? 16 : 32;
+	fs->root_cluster = fs->fat_type == 32 ? le32 (bs + 44) : 0;
+	return 0;
+}
+
+/* next cluster of a chain, 0 at the end or on error */
+static long long int fat_next (fs_ctx *fs, long long int c)
+{
+	unsigned char e[4];
+	long long int next;
+
+	if (fs->fat_type == 12)
+	{
+		if (fs_read (fs, e, 2, fs->fat + c + c / 2)) return 0;
+		next = (c & 1) ? le16 (e) >> 4 : le16 (e) & 0xfff;
+		return next >= 2 && next < 0xff7 ? next : 0;
+	}
+	if (fs->fat_type == 16)
+	{
+		if (fs_read (fs, e, 2, fs->fat + c * 2)) return 0;
+		next = le16 (e);
+		return next >= 2 && next < 0xfff7 ? next : 0;
+	}
+	if (fs_read (fs, e, 4, fs->fat + c * 4)) return 0;
+	next = le32 (e) & 0x0FFFFFFF;
+	return next >= 2 && next < 0x0FFFFFF7 ? next : 0;
+}
+
+/* reads up to len bytes of a cluster chain, returns the bytes read or -1 */
+static long long int fat_read_chain (fs_ctx *fs, long long int c, char *buf, long long int len)
+{
+	long long int done = 0, n, count = 0;
+
+	for (; c >= 2 && c < fs->clusters + 2 && done < len && count <= fs->clusters; c = fat_next (fs, c), count++)
+	{
+		n = len - done < fs->cluster_size ? len - done : fs->cluster_size;
+		if (fs_read (fs, buf + done, n, fs->data + (c - 2) * fs->cluster_size)) return -1;
+		done += n;
+	}
+	return done;
+}
+
+/* long file name characters of an LFN entry as UTF-8, at their place in name */
+static void fat_lfn (const unsigned char *e, char name[][4])
+{
+	static const int pos[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	int seq = (e[0] & 0x1F) - 1, i;
+	unsigned int c;
+
+	if (seq < 0 || seq >= 20) return;
+	for (i = 0; i < 13; i++)
+	{
+		c = le16 (e + pos[i]);
+		char *p = name[seq * 13 + i];
+		memset (p, 0, 4);
+		if (c == 0 || c == 0xFFFF) continue;
+		if (c < 0x80) p[0] = c;
+		else if (c < 0x800) { p[0] = 0xC0 | (c >> 6); p[1] = 0x80 | (c & 0x3F); }
+		else { p[0] = 0xE0 | (c >> 12); p[1] = 0x80 | ((c >> 6) & 0x3F); p[2] = 0x80 | (c & 0x3F); }
+	}
+}
+
+/* finds name in a directory, e receives its 32 byte entry, returns 1 if found */
+static int fat_lookup (fs_ctx *fs, long long int cluster, const char *name, unsigned char *found)
+{
+	char lfn[20 * 13][4], full[20 * 13 * 3 + 1], short_name[13];
+	unsigned char *e;
+	long long int size, i;
+	char *data;
+	int j, k, has_lfn = 0, res = 0;
+
+	// the FAT12/16 root directory is a fixed area, other directories are cluster chains
+	if (cluster == 0 && fs->fat_type != 32)
+	{
+		size = fs->root_size;
+		data = malloc (size);
+		if (data == NULL || fs_read (fs, data, size, fs->root)) size = -1;
+	}
+	else
+	{
+		if (cluster == 0) cluster = fs->root_cluster;
+		for (size = 0, i = cluster; i >= 2 && size < 64 * 1024 * 1024; i = fat_next (fs, i)) size += fs->cluster_size;
+		data = malloc (size);
+		if (data != NULL) size = fat_read_chain (fs, cluster, data, size);
+	}
+	if (data == NULL || size < 0)
+	{
+		free (data);
+		return -1;
+	}
+
+	memset (lfn, 0, sizeof (lfn));
+	for (i = 0; i + 32 <= size && !res; i += 32)
+	{
+		e = (unsigned char *) data + i;
+		if (e[0] == 0) break;
+		if (e[0] == 0xE5)
+		{
+			has_lfn = 0;
+			continue;
+		}
+		if (e[11] == FAT_ATTR_LFN)
+		{
+			// the entry with the highest sequence number comes first
+			if (e[0] & 0x40) memset (lfn, 0, sizeof (lfn));
+			fat_lfn (e, lfn);
+			has_lfn = 1;
+			continue;
+		}
+		if (e[11] & FAT_ATTR_VOLUME)
+		{
+			has_lfn = 0;
+			continue;
+		}
+		// 8.3 name, blanks removed
+		for (j = k = 0; j < 8 && e[j] != ' '; j++) short_name[k++] = e[j];
+		if (e[8] != ' ') short_name[k++] = '.';
+		for (j = 8; j < 11 && e[j] != ' '; j++) short_name[k++] = e[j];
+		short_name[k] = 0;
+		if (short_name[0] == 0x05) short_name[0] = (char) 0xE5;
+		full[0] = 0;
+		if (has_lfn)
+		{
+			for (j = 0; j < 20 * 13 && lfn[j][0]; j++) strcat (full, lfn[j]);
+		}
+		if (!strcasecmp (name, short_name) || (full[0] && !strcasecmp (name, full)))
+		{
+			memcpy (found, e, 32);
+			res = 1;
+		}
+		has_lfn = 0;
+		memset (lfn, 0, sizeof (lfn));
+	}
+	free (data);
+	return res;
+}
+
+static int fat_extract (fs_ctx *fs, const char *path, int out)
+{
+	unsigned char e[32];
+	char *work, *name, *rest, *buffer;
+	long long int cluster = 0, size, n, c, count = 0;
+	int res = 0, is_dir = 1;
+
+	work = strdup (path);
+	if (work == NULL) return -1;
+	for (name = work; name != NULL; name = rest)
+	{
+		while (*name == '/') name++;
+		rest = strchr (name, '/');
+		if (rest) *rest++ = 0;
+		if (!*name) continue;
+		if (!is_dir || (res = fat_lookup (fs, cluster, name, e)) <= 0)
+		{
+			if (res == 0) fprintf (stderr, "%s: %s not found.\n", path, name);
+			free (work);
+			return -1;
+		}
+		cluster = le16 (e + 26) | ((long long int) le16 (e + 20) << 16);
+		is_dir = (e[11] & FAT_ATTR_DIR) != 0;
+	}
+	free (work);
+	if (is_dir)
+	{
+		fprintf (stderr, "%s is not a regular file.\n", path);
+		return -1;
+	}
+
+	size = le32 (e + 28);
+	buffer = malloc (fs->cluster_size);
+	if (buffer == NULL) return -1;
+	res = 0;
+	for (c = cluster; size > 0 && !res; c = fat_next (fs, c), count++)
+	{
+		if (c < 2 || c >= fs->clusters + 2 || count > fs->clusters)
+		{
+			fprintf (stderr, "The cluster chain of %s is broken.\n", path);
+			res = -1;
+			break;
+		}
+		n = size < fs->cluster_size ? size : fs->cluster_size;
+		res = fs_read (fs, buffer, n, fs->data + (c - 2) * fs->cluster_size) || write_all (out, buffer, n);
+		size -= n;
+	}
+	free (buffer);
+	if (!res) printf ("%u bytes extracted.\n", le32 (e + 28));
+	return res ? -1 : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+int extract_file (const char *image, const char *path, int out)
+{
+	unsigned char sb[2048];
+	partition_t table[MAXPART];
+	fs_ctx fs;
+	const char *colon;
+	int pnum = 0, n, i, type = 0, res = -1;
+
+	// <partition>:<path>
+	colon = strchr (path, ':');
+	if (colon && sscanf (path, "%d:", &pnum) == 1 && pnum > 0) path = colon + 1;
+	else pnum = 0;
+
+	memset (&fs, 0, sizeof (fs));
+	fs.img = img_file_open (image);
+	if (fs.img == NULL) return -1;
+
+	n = probe_read_partitions (read_image, fs.img, table, NULL);
+	if (n < 0)
+	{
+		fprintf (stderr, "Could not read the partition table of %s.\n", image);
+		img_file_close (fs.img);
+		return -1;
+	}
+	// without a number the last partition with a file system, a swap partition often comes after the root
+	for (i = n - 1; i >= 0 && type == 0; i--)
+	{
+		if ((pnum && table[i].pnum != pnum) || !strcmp (table[i].ptype, "extended")) continue;
+		fs.offset = table[i].start * 512;
+		fs.size = (table[i].end - table[i].start + 1) * 512;
+		if (fs.offset + fs.size > img_file_size (fs.img)) fs.size = img_file_size (fs.img) - fs.offset;
+		if (fs_read (&fs, sb, sizeof (sb), 0)) continue;
+		if (le16 (sb + 1024 + 0x38) == EXT4_MAGIC) type = 2;
+		else if (sb[510] == 0x55 && sb[511] == 0xAA && fat_open (&fs, sb) == 0) type = 1;
+		if (type) pnum = table[i].pnum;
+	}
+
+	if (type == 2)
+	{
+		printf ("Extracting %s from ext partition %d of %s.\n", path, pnum, image);
+		if (ext_open (&fs, sb + 1024) == 0) res = ext_extract (&fs, path, out);
+	}
+	else if (type == 1)
+	{
+		printf ("Extracting %s from FAT%d partition %d of %s.\n", path, fs.fat_type, pnum, image);
+		res = fat_extract (&fs, path, out);
+	}
+	else if (pnum) fprintf (stderr, "Partition %d of %s has no ext or FAT file system.\n", pnum, image);
+	else fprintf (stderr, "No partition with an ext or FAT file system in %s.\n", image);
+	if (img_file_frames_read (fs.img)) printf ("%lld compressed frames read.\n", img_file_frames_read (fs.img));
+	free (fs.block);
+	img_file_close (fs.img);
+	return res;
+}
@@ -0,0 +1,25 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+extract: copies one file out of an image without restoring it.
+
+The partition is found in the MSDOS partition table of the image, the path is
+looked up in its ext2/3/4 or FAT file system, following symlinks inside the
+partition, and only the blocks of the directories on the way and of the file
+itself are read. On an indexed .gz image that means only the frames that hold
+them are inflated.
+*/
+
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+/* extract_file
+   Writes the contents of a file in an image to out
+	@param image raw image, indexed .gz image or device
+	@param path [<partition number>:]<path in the partition>, the last partition if no number is given
+	@param out open file, an ext file's mode and modification time are set if it is a regular file
+	@return 0 on success
+*/
+int extract_file (const char *image, const char *path, int out);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+fleet: the calling thread schedules, every job runs in a thread of its own.
+
+The lines of the fleet about a job start with the tag of the job in its slot,
+the messages of the clone itself are printed as they come.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "probe.h"
+#include "fleet.h"
+#include "util.h"
+
+#define JOB_WAITING 0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+#define TAG_MAX     96
+
+typedef struct fleet_ctx fleet_ctx;
+
+typedef struct
+{
+	fleet_ctx *ctx;
+	fleet_job *job;
+	int number;
+	int state;
+	int started;                    /* thread has to be joined */
+	int threads;                    /* copy threads of the job */
+	char tag[TAG_MAX];              /* in front of each line the fleet prints about the job */
+	pthread_t thread;
+} fleet_slot;
+
+struct fleet_ctx
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int free_threads;               /* copy threads that no running job has */
+	fleet_clone clone;
+	void *arg;
+};
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+/* device of the file system a new file at path ends up on */
+static unsigned long long int dest_device (const char *path)
+{
+	char dir[512], *slash;
+	struct stat st;
+
+	snprintf (dir, sizeof (dir), "%s", path);
+	if (stat (dir, &st) == 0 && !S_ISREG (st.st_mode)) return st.st_rdev ? st.st_rdev : st.st_dev;
+	slash = strrchr (dir, '/');
+	if (slash == NULL) strcpy (dir, ".");
+	else slash[slash == dir] = 0;
+	return stat (dir, &st) == 0 ? st.st_dev : 0;
+}
+
+static void *job_thread (fleet_slot *slot)
+{
+	fleet_ctx *ctx = slot->ctx;
+	fleet_job *job = slot->job;
+	long long int before, after;
+	double start = now ();
+
+	// the source is only read by this job, its counters are the bytes of the clone
+	before = probe_read_bytes (job->src_dev);
+	job->result = ctx->clone (job, slot->threads, ctx->arg);
+	after = probe_read_bytes (job->src_dev);
+	job->bytes = before >= 0 && after >= before ? after - before : 0;
+	job->seconds = now () - start;
+	fflush (stdout);
+	if (job->result) fprintf (stderr, "%sfailed with code %d.\n", slot->tag, job->result);
+	else printf ("%sfinished.\n", slot->tag);
+
+	pthread_mutex_lock (&ctx->lock);
+	ctx->free_threads += slot->threads;
+	slot->state = JOB_DONE;
+	pthread_cond_broadcast (&ctx->cond);
+	pthread_mutex_unlock (&ctx->lock);
+	return NULL;
+}
+
+/* returns 1 if the limits allow job i to start next to the running jobs */
+static int may_start (fleet_slot *slots, int n, int i, int max_jobs, int per_dest, int per_bus)
+{
+	int j, running = 0, dest = 0, bus = 0;
+
+	for (j = 0; j < n; j++)
+	{
+		if (slots[j].state != JOB_RUNNING) continue;
+		running++;
+		if (slots[j].job->dest == slots[i].job->dest) dest++;
+		if (!strcmp (slots[j].job->bus, slots[i].job->bus)) bus++;
+	}
+	return running < max_jobs && dest < per_dest && bus < per_bus;
+}
+
+/* copy threads for job i that starts now: the free threads are shared with the waiting jobs that can run next to it */
+static int job_threads (fleet_ctx *ctx, fleet_slot *slots, int n, int max_jobs)
+{
+	int j, running = 0, waiting = 0, share;
+
+	for (j = 0; j < n; j++)
+	{
+		if (slots[j].state == JOB_RUNNING) running++;
+		if (slots[j].state == JOB_WAITING) waiting++;
+	}
+	share = max_jobs - running < waiting ? max_jobs - running : waiting;
+	share = share > 0 && ctx->free_threads > 0 ? ctx->free_threads / share : 0;
+	return share < 2 ? 2 : share;
+}
+
+static void print_summary (fleet_job *jobs, int n, double wall)
+{
+	long long int total = 0;
+	int i, failed = 0;
+
+	printf ("job  source              bus           result   MB read  seconds     MB/s  destination\n");
+	for (i = 0; i < n; i++)
+	{
+		printf ("%3d  %-18s  %-12s  %6d  %8.1f  %7.1f  %7.1f  %s\n", i + 1, jobs[i].src_dev, jobs[i].bus, jobs[i].result,
+			jobs[i].bytes / 1e6, jobs[i].seconds, jobs[i].seconds > 0 ? jobs[i].bytes / 1e6 / jobs[i].seconds : 0, jobs[i].dst_file);
+		total += jobs[i].bytes;
+		if (jobs[i].result) failed++;
+	}
+	printf ("%d jobs, %d failed, %.1f MB read in %.1f s, %.1f MB/s for the fleet.\n", n, failed, total / 1e6, wall, wall > 0 ? total / 1e6 / wall : 0);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+int fleet_load (const char *path, fleet_job *jobs, int n)
+{
+	char line[4096], *token, *save;
+	FILE *fp;
+	int number = 0, field;
+
+	fp = fopen (path, "r");
+	if (fp == NULL)
+	{
+		fprintf (stderr, "Could not open job file %s: %s\n", path, strerror (errno));
+		return -1;
+	}
+	while (fgets (line, sizeof (line), fp))
+	{
+		number++;
+		token = strtok_r (line, " \t\r\n", &save);
+		if (token == NULL || token[0] == '#') continue;
+		if (n == MAXJOBS)
+		{
+			fprintf (stderr, "%s: more than %d jobs.\n", path, MAXJOBS);
+			fclose (fp);
+			return -1;
+		}
+		memset (&jobs[n], 0, sizeof (fleet_job));
+		for (field = 0; token && field <= MAXDEST; field++, token = strtok_r (NULL, " \t\r\n", &save))
+		{
+			if (field == 0) snprintf (jobs[n].src_dev, sizeof (jobs[n].src_dev), "%s", token);
+			else if (field == 1) snprintf (jobs[n].dst_file, sizeof (jobs[n].dst_file), "%s", token);
+			else snprintf (jobs[n].more_dst[jobs[n].n_more++], sizeof (jobs[n].more_dst[0]), "%s", token);
+		}
+		if (field < 2 || token)
+		{
+			fprintf (stderr, "%s line %d: expected a source device and 1 to %d destinations.\n", path, number, MAXDEST);
+			fclose (fp);
+			return -1;
+		}
+		n++;
+	}
+	fclose (fp);
+	return n;
+}
+
+int fleet_run (fleet_job *jobs, int n, int max_jobs, int per_dest, int per_bus, int threads, fleet_clone clone, void *arg)
+{
+	fleet_slot *slots;
+	fleet_ctx ctx;
+	double start = now ();
+	int i, busy, failed = 0;
+
+	ctx.clone = clone;
+	ctx.arg = arg;
+	// a job gets its share of the threads that are free when it starts, the threads of a finished job go to the next ones
+	ctx.free_threads = threads;
+	pthread_mutex_init (&ctx.lock, NULL);
+	pthread_cond_init (&ctx.cond, NULL);
+	slots = calloc (n, sizeof (fleet_slot));
+	if (slots == NULL)
+	{
+		fprintf (stderr, "Not enough memory for %d jobs.\n", n);
+		return n;
+	}
+	for (i = 0; i < n; i++)
+	{
+		slots[i].ctx = &ctx;
+		slots[i].job = &jobs[i];
+		slots[i].number = i + 1;
+		snprintf (slots[i].tag, sizeof (slots[i].tag), "[job %d %s] ", i + 1, jobs[i].src_dev);
+		jobs[i].dest = dest_device (jobs[i].dst_file);
+		if (probe_bus (jobs[i].src_dev, jobs[i].bus, sizeof (jobs[i].bus))) strcpy (jobs[i].bus, "unknown");
+		printf ("%sbus %s, to %s", slots[i].tag, jobs[i].bus, jobs[i].dst_file);
+		for (busy = 0; busy < jobs[i].n_more; busy++) printf (" and %s", jobs[i].more_dst[busy]);
+		printf ("\n");
+	}
+	printf ("Running %d jobs, at most %d at a time, %d per destination and %d per bus, %d copy threads shared by the running jobs.\n", n, max_jobs, per_dest, per_bus, threads);
+
+	pthread_mutex_lock (&ctx.lock);
+	for (;;)
+	{
+		busy = 0;
+		for (i = 0; i < n; i++)
+		{
+			if (slots[i].state == JOB_WAITING && may_start (slots, n, i, max_jobs, per_dest, per_bus))
+			{
+				slots[i].threads = job_threads (&ctx, slots, n, max_jobs);
+				ctx.free_threads -= slots[i].threads;
+				printf ("%sstarting with %d copy threads.\n", slots[i].tag, slots[i].threads);
+				slots[i].state = JOB_RUNNING;
+				slots[i].started = pthread_create (&slots[i].thread, NULL, (void * (*)(void *)) &job_thread, &slots[i]) == 0;
+				if (!slots[i].started)
+				{
+					fprintf (stderr, "%scould not be started.\n", slots[i].tag);
+					jobs[i].result = -1;
+					ctx.free_threads += slots[i].threads;
+					slots[i].state = JOB_DONE;
+				}
+			}
+			if (slots[i].state != JOB_DONE) busy++;
+		}
+		if (busy == 0) break;
+		pthread_cond_wait (&ctx.cond, &ctx.lock);
+	}
+	pthread_mutex_unlock (&ctx.lock);
+
+	for (i = 0; i < n; i++)
+	{
+		if (slots[i].started) pthread_join (slots[i].thread, NULL);
+		if (jobs[i].result) failed++;
+	}
+	print_summary (jobs, n, now () - start);
+	free (slots);
+	pthread_mutex_destroy (&ctx.lock);
+	pthread_cond_destroy (&ctx.cond);
+	return failed;
+}
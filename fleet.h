@@ -0,0 +1,61 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+fleet: many clones in one process, for a bench host with a row of card
+readers.
+
+Every job is one source device and its destinations. A scheduler starts a
+job when the limits allow it: the number of jobs in total, per file system
+the images are written to and per bus the sources hang on (a USB bus, an MMC
+host, the disk behind the backing file of a loop device), so that jobs that
+would only fight over the same link wait instead. The copy threads are one
+budget for the whole process: a job gets its share of the threads that are
+free when it starts, the threads of a finished job go to the jobs after it.
+The lines of the fleet about a job start with [job <number> <source>].
+*/
+
+#ifndef FLEET_H
+#define FLEET_H
+
+#define MAXDEST   8        /* -d can be given this many times per source */
+#define MAXJOBS   64
+
+typedef struct
+{
+	char src_dev[64];
+	char dst_file[512];
+	char more_dst[MAXDEST - 1][512];
+	int n_more;
+
+	// filled in by fleet_run
+	char bus[64];
+	unsigned long long int dest;    /* device of the file system of the first destination */
+	int result;
+	long long int bytes;            /* read from the source */
+	double seconds;
+} fleet_job;
+
+/* runs one job with threads copy threads, returns the exit code of the clone */
+typedef int (*fleet_clone) (fleet_job *job, int threads, void *arg);
+
+/* fleet_load
+   Adds the jobs of a job file, one per line: <source device> <destination> [<destination> ...],
+   empty lines and lines starting with # are skipped
+	@param jobs array of MAXJOBS jobs
+	@param n jobs already in the array
+	@return the new number of jobs or -1 with a message
+*/
+int fleet_load (const char *path, fleet_job *jobs, int n);
+
+/* fleet_run
+   Runs all jobs, each in its own thread, and prints a summary
+	@param max_jobs jobs at the same time
+	@param per_dest jobs at the same time that write to one file system
+	@param per_bus jobs at the same time that read from one bus
+	@param threads copy threads shared by the running jobs
+	@param clone runs a job
+	@return the number of jobs that failed
+*/
+int fleet_run (fleet_job *jobs, int n, int max_jobs, int per_dest, int per_bus, int threads, fleet_clone clone, void *arg);
+
+#endif
@@ -0,0 +1,314 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+hash: XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+SHA-256, see FIPS 180-4 and HMAC, see RFC 2104
+*/
+
+#include <string.h>
+
+#include "hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl (uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64 (const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy (&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64 (v);
+#endif
+	return v;
+}
+
+static uint32_t read32 (const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy (&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32 (v);
+#endif
+	return v;
+}
+
+static uint64_t round64 (uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	acc = rotl (acc, 31);
+	return acc * PRIME1;
+}
+
+static uint64_t merge64 (uint64_t acc, uint64_t val)
+{
+	acc ^= round64 (0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+void hash_init (hash_state *h, uint64_t seed)
+{
+	memset (h, 0, sizeof (hash_state));
+	h->seed = seed;
+	h->v[0] = seed + PRIME1 + PRIME2;
+	h->v[1] = seed + PRIME2;
+	h->v[2] = seed;
+	h->v[3] = seed - PRIME1;
+}
+
+void hash_update (hash_state *h, const void *data, size_t len)
+{
+	const unsigned char *p = data, *end = p + len;
+
+	h->total += len;
+	if (h->memsize + len < 32)
+	{
+		memcpy (h->mem + h->memsize, p, len);
+		h->memsize += len;
+		return;
+	}
+	if (h->memsize)
+	{
+		memcpy (h->mem + h->memsize, p, 32 - h->memsize);
+		p += 32 - h->memsize;
+		h->v[0] = round64 (h->v[0], read64 (h->mem));
+		h->v[1] = round64 (h->v[1], read64 (h->mem + 8));
+		h->v[2] = round64 (h->v[2], read64 (h->mem + 16));
+		h->v[3] = round64 (h->v[3], read64 (h->mem + 24));
+		h->memsize = 0;
+	}
+	while (p + 32 <= end)
+	{
+		h->v[0] = round64 (h->v[0], read64 (p));
+		h->v[1] = round64 (h->v[1], read64 (p + 8));
+		h->v[2] = round64 (h->v[2], read64 (p + 16));
+		h->v[3] = round64 (h->v[3], read64 (p + 24));
+		p += 32;
+	}
+	if (p < end)
+	{
+		memcpy (h->mem, p, end - p);
+		h->memsize = end - p;
+	}
+}
+
+uint64_t hash_final (const hash_state *h)
+{
+	const unsigned char *p = h->mem, *end = p + h->memsize;
+	uint64_t acc;
+
+	if (h->total >= 32)
+	{
+		acc = rotl (h->v[0], 1) + rotl (h->v[1], 7) + rotl (h->v[2], 12) + rotl (h->v[3], 18);
+		acc = merge64 (acc, h->v[0]);
+		acc = merge64 (acc, h->v[1]);
+		acc = merge64 (acc, h->v[2]);
+		acc = merge64 (acc, h->v[3]);
+	}
+	else
+	{
+		acc = h->seed + PRIME5;
+	}
+	acc += h->total;
+
+	while (p + 8 <= end)
+	{
+		acc ^= round64 (0, read64 (p));
+		acc = rotl (acc, 27) * PRIME1 + PRIME4;
+		p += 8;
+	}
+	if (p + 4 <= end)
+	{
+		acc ^= (uint64_t) read32 (p) * PRIME1;
+		acc = rotl (acc, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	while (p < end)
+	{
+		acc ^= (*p) * PRIME5;
+		acc = rotl (acc, 11) * PRIME1;
+		p++;
+	}
+
+	acc ^= acc >> 33;
+	acc *= PRIME2;
+	acc ^= acc >> 29;
+	acc *= PRIME3;
+	acc ^= acc >> 32;
+	return acc;
+}
+
+uint64_t hash_buffer (const void *data, size_t len, uint64_t seed)
+{
+	hash_state h;
+
+	hash_init (&h, seed);
+	hash_update (&h, data, len);
+	return hash_final (&h);
+}
+
+/*---------------------------------------------------------------------------*/
+/* SHA-256 */
+
+static const uint32_t sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr32 (uint32_t x, int r)
+{
+	return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block (sha256_state *s, const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32_t) p[i * 4] << 24) | ((uint32_t) p[i * 4 + 1] << 16) | ((uint32_t) p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + (rotr32 (w[i - 15], 7) ^ rotr32 (w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			w[i - 7] + (rotr32 (w[i - 2], 17) ^ rotr32 (w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+	for (i = 0; i < 64; i++)
+	{
+		t1 = h + (rotr32 (e, 6) ^ rotr32 (e, 11) ^ rotr32 (e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (rotr32 (a, 2) ^ rotr32 (a, 13) ^ rotr32 (a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void sha256_init (sha256_state *s)
+{
+	static const uint32_t init[8] =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memset (s, 0, sizeof (sha256_state));
+	memcpy (s->h, init, sizeof (init));
+}
+
+void sha256_update (sha256_state *s, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t n;
+
+	s->total += len;
+	if (s->memsize)
+	{
+		n = 64 - s->memsize < len ? 64 - s->memsize : len;
+		memcpy (s->mem + s->memsize, p, n);
+		s->memsize += n;
+		p += n;
+		len -= n;
+		if (s->memsize < 64) return;
+		sha256_block (s, s->mem);
+		s->memsize = 0;
+	}
+	while (len >= 64)
+	{
+		sha256_block (s, p);
+		p += 64;
+		len -= 64;
+	}
+	memcpy (s->mem, p, len);
+	s->memsize = len;
+}
+
+void sha256_final (sha256_state *s, unsigned char digest[32])
+{
+	uint64_t bits = s->total * 8;
+	int i;
+
+	s->mem[s->memsize++] = 0x80;
+	if (s->memsize > 56)
+	{
+		memset (s->mem + s->memsize, 0, 64 - s->memsize);
+		sha256_block (s, s->mem);
+		s->memsize = 0;
+	}
+	memset (s->mem + s->memsize, 0, 56 - s->memsize);
+	for (i = 0; i < 8; i++) s->mem[56 + i] = bits >> (56 - i * 8);
+	sha256_block (s, s->mem);
+	for (i = 0; i < 32; i++) digest[i] = s->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+void sha256_buffer (const void *data, size_t len, unsigned char digest[32])
+{
+	sha256_state s;
+
+	sha256_init (&s);
+	sha256_update (&s, data, len);
+	sha256_final (&s, digest);
+}
+
+/*---------------------------------------------------------------------------*/
+/* HMAC-SHA256, RFC 2104 */
+
+void hmac_sha256_init (hmac_sha256_state *s, const void *key, size_t len)
+{
+	unsigned char block[64];
+	int i;
+
+	// keys longer than a block are hashed first
+	memset (block, 0, sizeof (block));
+	if (len > sizeof (block)) sha256_buffer (key, len, block);
+	else memcpy (block, key, len);
+
+	for (i = 0; i < 64; i++) block[i] ^= 0x36;
+	sha256_init (&s->inner);
+	sha256_update (&s->inner, block, 64);
+	for (i = 0; i < 64; i++) block[i] ^= 0x36 ^ 0x5c;
+	sha256_init (&s->outer);
+	sha256_update (&s->outer, block, 64);
+}
+
+void hmac_sha256_update (hmac_sha256_state *s, const void *data, size_t len)
+{
+	sha256_update (&s->inner, data, len);
+}
+
+void hmac_sha256_final (hmac_sha256_state *s, unsigned char digest[32])
+{
+	unsigned char inner[32];
+
+	sha256_final (&s->inner, inner);
+	sha256_update (&s->outer, inner, 32);
+	sha256_final (&s->outer, digest);
+}
+
+void hash_hex (const unsigned char *digest, size_t len, char *out)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		out[i * 2] = hex[digest[i] >> 4];
+		out[i * 2 + 1] = hex[digest[i] & 15];
+	}
+	out[len * 2] = 0;
+}
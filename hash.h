@@ -0,0 +1,59 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+hash: XXH64 content hash, streaming and one-shot.
+Fast enough to hash file data while it is copied without slowing down the copy.
+SHA-256 is used where a collision would lose data, like chunk names, and
+HMAC-SHA256 signs the verification manifest.
+*/
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+	uint64_t v[4];
+	uint64_t seed;
+	uint64_t total;
+	unsigned char mem[32];
+	unsigned int memsize;
+} hash_state;
+
+void hash_init (hash_state *h, uint64_t seed);
+void hash_update (hash_state *h, const void *data, size_t len);
+uint64_t hash_final (const hash_state *h);
+
+/* hash of a complete buffer */
+uint64_t hash_buffer (const void *data, size_t len, uint64_t seed);
+
+typedef struct
+{
+	uint32_t h[8];
+	uint64_t total;
+	unsigned char mem[64];
+	unsigned int memsize;
+} sha256_state;
+
+void sha256_init (sha256_state *s);
+void sha256_update (sha256_state *s, const void *data, size_t len);
+void sha256_final (sha256_state *s, unsigned char digest[32]);
+void sha256_buffer (const void *data, size_t len, unsigned char digest[32]);
+
+/* HMAC-SHA256 of data with a secret key, signs files so changes can be detected */
+typedef struct
+{
+	sha256_state inner;
+	sha256_state outer;
+} hmac_sha256_state;
+
+void hmac_sha256_init (hmac_sha256_state *s, const void *key, size_t len);
+void hmac_sha256_update (hmac_sha256_state *s, const void *data, size_t len);
+void hmac_sha256_final (hmac_sha256_state *s, unsigned char digest[32]);
+
+/* writes the lower case hex form of len bytes to out, out must hold 2 * len + 1 chars */
+void hash_hex (const unsigned char *digest, size_t len, char *out);
+
+#endif
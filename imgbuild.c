@@ -0,0 +1,1981 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+imgbuild: the in-process image builder, see imgbuild.h.
+
+Both trees are read breadth first, so the children of a directory are a range
+of the entry array and a directory is found again from its parent index.
+Blocks of the ext4 file system are handed out by a cursor that runs once over
+the partition and skips the superblock and descriptor backups: first the
+bitmaps and inode tables of all groups, then the journal, the directories and
+the file data, the extent tree leaves and long symlink targets last. If the
+files don't fit, the file system is laid out again a bit larger. FAT clusters
+are handed out the same way, the root directory first.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+
+#include "imgbuild.h"
+#include "probe.h"
+#include "sink.h"
+#include "throttle.h"
+#include "util.h"
+
+#define SECTOR 512
+#define ALIGN_SECTORS 8192          /* partitions start at 4 MB boundaries like Raspberry Pi OS */
+#define COPY_BUFFER (1024*1024)     /* read buffer per copy thread */
+#define WRITE_BATCH (8*1024*1024)   /* adjacent metadata is collected up to this size before it is written */
+#define XATTR_BUFFER 65536
+#define LINK_HASH_SIZE 4096
+
+#define BLOCK 4096
+#define BLOCKS_PER_GROUP 32768      /* bits of one bitmap block */
+#define INODE_SIZE 256
+#define INODE_EXTRA 32              /* i_extra_isize, up to the creation time */
+#define XATTR_AREA (INODE_SIZE - 128 - INODE_EXTRA)
+#define INODES_PER_BLOCK (BLOCK / INODE_SIZE)
+#define BYTES_PER_INODE 16384       /* the default ratio of mke2fs */
+#define DESC_SIZE 32
+#define DESC_PER_BLOCK (BLOCK / DESC_SIZE)
+#define FIRST_INO 11
+#define ROOT_INO 2
+#define JOURNAL_INO 8
+#define LOST_FOUND_BLOCKS 4
+#define EXTENT_MAX 32768            /* blocks of one initialized extent */
+#define LEAF_EXTENTS ((BLOCK - 12) / 12)
+#define FAST_SYMLINK 60             /* shorter targets are stored in the inode */
+#define SPARSE_RANGES 64            /* a sparse file with more data ranges gets blocks for its holes too */
+
+#define EXT4_MAGIC 0xEF53
+#define EXT4_EXTENT_MAGIC 0xF30A
+#define EXT4_EXTENTS_FL 0x80000
+#define EXT4_COMPAT (0x0004 | 0x0008 | 0x0020)             /* has_journal, ext_attr, dir_index */
+#define EXT4_INCOMPAT (0x0002 | 0x0010 | 0x0040 | 0x0200)  /* filetype, meta_bg, extents, flex_bg */
+#define EXT4_RO_COMPAT (0x0001 | 0x0002 | 0x0020 | 0x0040) /* sparse_super, large_file, dir_nlink, extra_isize */
+#define EXT4_XATTR_MAGIC 0xEA020000
+#define JBD2_MAGIC 0xC03B3998
+
+#define FAT_RESERVED 32
+#define FAT_MIN_CLUSTERS 65525
+#define FAT_MIN_SIZE (64LL*1024*1024)
+#define FAT_ENTRY 32
+
+/* run of blocks or clusters of an entry, start is relative to the first block or cluster of the data area,
+   logical is the first block or cluster of the file in the run */
+typedef struct
+{
+	long long int start;
+	long long int len;
+	long long int logical;
+} build_run;
+
+typedef struct
+{
+	char *name;                     /* "" for the root */
+	char *target;                   /* symlinks: the target */
+	unsigned char *xattr;           /* ext4: extended attributes in the format of the inode body, NULL for none */
+	long long int parent;
+	long long int first;            /* directories: the children are entries first .. first + count - 1 */
+	long long int count;
+	long long int link;             /* ext4: entry of the first name of a hard link, -1 for none */
+	long long int size;             /* regular files: bytes, symlinks: length of the target */
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	dev_t rdev;
+	unsigned int links;             /* ext4: directory entries that point to the inode */
+	unsigned int ino;               /* ext4: inode number */
+	struct timespec atime, mtime, ctime;
+	int other_fs;                   /* directory on another file system, created empty like cp -x */
+	long long int run;              /* the data is in runs run .. run + runs - 1 */
+	int runs;
+	long long int leaf;             /* ext4: block of the extent tree leaf, 0 if the extents fit in the inode */
+	long long int data;             /* ext4: the blocks of a sparse file with data are ranges data .. data + ndata - 1 */
+	int ndata;                      /* -1 for a file that gets blocks for all of its size */
+	char short_name[11];            /* FAT: 8.3 name */
+	unsigned char lower;            /* FAT: case flags of the short name */
+	int lfn;                        /* FAT: long name entries */
+} build_entry;
+
+typedef struct
+{
+	char *dir;                      /* without trailing /, "" for / */
+	build_entry *entries;
+	long long int count;
+	long long int alloc;
+	int fat;
+} build_tree;
+
+typedef struct link_entry
+{
+	dev_t dev;
+	ino_t ino;
+	long long int entry;
+	struct link_entry *next;
+} link_entry;
+
+struct build_image
+{
+	build_options opts;
+	char disk_id[9];
+	char *boot_dir;
+	dev_t boot_dev;                 /* the boot directory is left empty in the root tree */
+	ino_t boot_ino;
+	build_tree boot;
+	build_tree root;
+	build_run *runs;
+	long long int nruns;
+	long long int aruns;
+	long long int fat_runs;         /* the runs of the boot tree come first, ext4 lays out after them */
+	build_run *ranges;              /* data ranges of sparse files in blocks of the file, start and len */
+	long long int nranges;
+	long long int aranges;
+	long long int errors;           /* entries that could not be read */
+	long long int excluded;
+	char *xattr_list;
+	char *xattr_value;
+	time_t now;
+
+	// partitions in sectors
+	long long int boot_start;
+	long long int boot_sectors;
+	long long int root_start;
+	long long int root_sectors;
+
+	// FAT32
+	int spc;                        /* sectors per cluster */
+	long long int fat_reserved;     /* sectors before the first FAT */
+	long long int fat_sectors;      /* sectors of one FAT */
+	long long int clusters;
+	long long int next_cluster;
+	uint32_t volume_id;
+
+	// ext4
+	long long int blocks;
+	long long int groups;
+	long long int ipg;              /* inodes per group */
+	long long int itb;              /* inode table blocks per group */
+	long long int *block_bitmap;
+	long long int *inode_bitmap;
+	long long int *inode_table;
+	unsigned char *used;            /* bitmap of the blocks in use, padded to whole groups */
+	long long int cursor;
+	long long int free_blocks;
+	unsigned int inodes_used;       /* highest inode number in use */
+	build_entry journal;
+	build_entry lost_found;
+	unsigned char uuid[16];
+	unsigned char hash_seed[16];
+};
+
+typedef struct
+{
+	int fat;
+	long long int entry;
+} build_job;
+
+typedef struct
+{
+	build_image *b;
+	build_job *jobs;
+	long long int njobs;
+	long long int next;
+	int fd;
+	copy_stats *stats;
+} build_ctx;
+
+/* metadata is collected here and written in large runs */
+typedef struct
+{
+	int fd;
+	char *buffer;
+	long long int start;            /* image offset of the buffer */
+	long long int len;
+	copy_stats *stats;
+	int failed;
+} batch_writer;
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+static void count (volatile long long int *counter, long long int n)
+{
+	__atomic_add_fetch (counter, n, __ATOMIC_RELAXED);
+}
+
+static void put16 (unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32 (unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void put32be (unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void random_bytes (unsigned char *buf, int len)
+{
+	int fd = open ("/dev/urandom", O_RDONLY), n = 0, i;
+
+	if (fd >= 0)
+	{
+		n = read (fd, buf, len);
+		close (fd);
+	}
+	if (n == len) return;
+	srand (time (NULL) ^ getpid ());
+	for (i = 0; i < len; i++) buf[i] = rand ();
+}
+
+/* writes buf at pos, blocks of zeros are skipped and stay holes */
+static int write_sparse (int out, const char *buf, long long int len, long long int pos, copy_stats *stats)
+{
+	long long int i, n, run = -1;
+
+	for (i = 0; i < len; i += n)
+	{
+		n = len - i < SINK_ZERO_BLOCK ? len - i : SINK_ZERO_BLOCK;
+		if (sink_is_zero (buf + i, n))
+		{
+			if (run >= 0 && pwrite_all (out, buf + run, i - run, pos + run)) return -1;
+			run = -1;
+			count (&stats->holes, n);
+		}
+		else if (run < 0) run = i;
+	}
+	if (run >= 0 && pwrite_all (out, buf + run, len - run, pos + run)) return -1;
+	return 0;
+}
+
+static void batch_flush (batch_writer *w)
+{
+	if (w->len && !w->failed && write_sparse (w->fd, w->buffer, w->len, w->start, w->stats))
+	{
+		fprintf (stderr, "Could not write the image: %s\n", strerror (errno));
+		w->failed = 1;
+	}
+	w->len = 0;
+}
+
+static void batch_write (batch_writer *w, long long int offset, const void *data, long long int len)
+{
+	if (w->len && (offset != w->start + w->len || w->len + len > WRITE_BATCH)) batch_flush (w);
+	if (len > WRITE_BATCH)
+	{
+		if (!w->failed && write_sparse (w->fd, data, len, offset, w->stats))
+		{
+			fprintf (stderr, "Could not write the image: %s\n", strerror (errno));
+			w->failed = 1;
+		}
+		return;
+	}
+	if (w->len == 0) w->start = offset;
+	memcpy (w->buffer + w->len, data, len);
+	w->len += len;
+}
+
+/* writes buf to the runs of an entry, unit is the size of a block or cluster and base the image offset of the data area */
+static void write_runs (batch_writer *w, build_image *b, const build_entry *e, long long int base, long long int unit, const unsigned char *buf)
+{
+	build_run *r;
+	int i;
+
+	for (i = 0; i < e->runs; i++)
+	{
+		r = &b->runs[e->run + i];
+		batch_write (w, base + r->start * unit, buf, r->len * unit);
+		buf += r->len * unit;
+	}
+}
+
+static long long int add_run (build_image *b, long long int start, long long int len, long long int logical)
+{
+	if (b->nruns == b->aruns)
+	{
+		b->aruns = b->aruns ? b->aruns * 2 : 4096;
+		b->runs = realloc (b->runs, b->aruns * sizeof (build_run));
+	}
+	b->runs[b->nruns].start = start;
+	b->runs[b->nruns].len = len;
+	b->runs[b->nruns].logical = logical;
+	return b->nruns++;
+}
+
+static long long int run_blocks (const build_image *b, const build_entry *e)
+{
+	long long int n = 0;
+	int i;
+
+	for (i = 0; i < e->runs; i++) n += b->runs[e->run + i].len;
+	return n;
+}
+
+/* blocks of the data of a file */
+static long long int file_blocks (const build_image *b, const build_entry *e)
+{
+	long long int n = 0;
+	int k;
+
+	if (e->ndata < 0) return (e->size + BLOCK - 1) / BLOCK;
+	for (k = 0; k < e->ndata; k++) n += b->ranges[e->data + k].len;
+	return n;
+}
+
+/* bytes of a file that are read, the holes of a sparse file are not */
+static long long int file_bytes (const build_image *b, const build_entry *e)
+{
+	long long int n = file_blocks (b, e) * BLOCK;
+
+	return e->ndata < 0 || n > e->size ? e->size : n;
+}
+
+/* entry_path
+   Builds the path of an entry of a tree
+	@return 0 on success, -1 if it is longer than size
+*/
+static int entry_path (const build_tree *t, long long int i, char *buf, size_t size)
+{
+	long long int chain[PATH_MAX / 2];
+	size_t len = strlen (t->dir), l;
+	int n = 0;
+
+	for (; i > 0 && n < PATH_MAX / 2; i = t->entries[i].parent) chain[n++] = i;
+	if (len + 2 > size) return -1;
+	memcpy (buf, t->dir, len);
+	if (n == 0 && len == 0) buf[len++] = '/';
+	while (n--)
+	{
+		l = strlen (t->entries[chain[n]].name);
+		if (len + l + 2 > size) return -1;
+		buf[len++] = '/';
+		memcpy (buf + len, t->entries[chain[n]].name, l);
+		len += l;
+	}
+	buf[len] = 0;
+	return 0;
+}
+
+/* path relative to the root of the tree, "" for the root */
+static const char *relative_path (const build_tree *t, const char *path)
+{
+	size_t len = strlen (t->dir);
+
+	return path[len] == '/' && path[len + 1] ? path + len + 1 : "";
+}
+
+/*---------------------------------------------------------------------------*/
+/* Reading the trees */
+
+static long long int add_entry (build_tree *t, const char *name, long long int parent, const struct stat *st)
+{
+	build_entry *e;
+
+	if (t->count == t->alloc)
+	{
+		t->alloc = t->alloc ? t->alloc * 2 : 1024;
+		t->entries = realloc (t->entries, t->alloc * sizeof (build_entry));
+	}
+	e = &t->entries[t->count];
+	memset (e, 0, sizeof (build_entry));
+	e->name = strdup (name);
+	e->parent = parent;
+	e->link = -1;
+	e->run = -1;
+	e->ndata = -1;
+	e->mode = st->st_mode;
+	e->uid = st->st_uid;
+	e->gid = st->st_gid;
+	e->rdev = st->st_rdev;
+	e->size = S_ISREG (st->st_mode) ? st->st_size : 0;
+	e->links = S_ISDIR (st->st_mode) ? 2 : 1;
+	e->atime = st->st_atim;
+	e->mtime = st->st_mtim;
+	e->ctime = st->st_ctim;
+	return t->count++;
+}
+
+/* converts an ACL from the xattr format (version 2) to the one ext4 stores (version 1), returns its length or -1 */
+static int ext_acl (const unsigned char *in, int len, unsigned char *out)
+{
+	int i, n = 4, tag;
+
+	if (len < 4 || le32 (in) != 2 || (len - 4) % 8) return -1;
+	put32 (out, 1);
+	for (i = 4; i < len; i += 8)
+	{
+		tag = le16 (in + i);
+		put16 (out + n, tag);
+		put16 (out + n + 2, le16 (in + i + 2));
+		// only named users and groups have an id
+		if (tag == 0x02 || tag == 0x08)
+		{
+			put32 (out + n + 4, le32 (in + i + 4));
+			n += 8;
+		}
+		else n += 4;
+	}
+	return n;
+}
+
+/* reads the extended attributes of path into the format of the inode body, attributes that don't fit are left out with a warning */
+static void read_xattrs (build_image *b, const char *path, build_entry *e)
+{
+	static const struct { const char *prefix; int index; } names[] = {
+		{ "user.", 1 }, { "system.posix_acl_access", 2 }, { "system.posix_acl_default", 3 }, { "trusted.", 4 }, { "security.", 6 } };
+	unsigned char area[XATTR_AREA], acl[XATTR_BUFFER];
+	const unsigned char *value;
+	const char *suffix;
+	ssize_t len, vlen;
+	int end = 4, top = XATTR_AREA, index, need, vneed, i;
+	char *name;
+
+	len = llistxattr (path, b->xattr_list, XATTR_BUFFER);
+	if (len <= 0) return;
+	memset (area, 0, sizeof (area));
+	for (name = b->xattr_list; name < b->xattr_list + len; name += strlen (name) + 1)
+	{
+		index = 0;
+		suffix = name;
+		for (i = 0; i < (int) (sizeof (names) / sizeof (names[0])); i++)
+		{
+			if (strncmp (name, names[i].prefix, strlen (names[i].prefix))) continue;
+			index = names[i].index;
+			suffix = name + strlen (names[i].prefix);
+			break;
+		}
+		vlen = lgetxattr (path, name, b->xattr_value, XATTR_BUFFER);
+		if (vlen < 0) continue;
+		value = (unsigned char *) b->xattr_value;
+		if (index == 2 || index == 3)
+		{
+			vlen = ext_acl (value, vlen, acl);
+			value = acl;
+		}
+		need = (16 + strlen (suffix) + 3) & ~3;
+		vneed = (vlen + 3) & ~3;
+		if (index == 0 || vlen < 0 || strlen (suffix) > 255 || end + need + 4 > top - vneed)
+		{
+			fprintf (stderr, "Warning: attribute %s of %s is not copied, it %s.\n", name, path, index == 0 || vlen < 0 ? "has an unknown type" : "does not fit in the inode");
+			continue;
+		}
+		top -= vneed;
+		memcpy (area + top, value, vlen);
+		area[end] = strlen (suffix);
+		area[end + 1] = index;
+		put16 (area + end + 2, vlen ? top - 4 : 0);   // relative to the first entry
+		put32 (area + end + 8, vlen);
+		memcpy (area + end + 16, suffix, strlen (suffix));
+		end += need;
+	}
+	if (end == 4) return;
+	put32 (area, EXT4_XATTR_MAGIC);
+	e->xattr = malloc (XATTR_AREA);
+	memcpy (e->xattr, area, XATTR_AREA);
+}
+
+/* read_ranges
+   Finds the ranges of a sparse file that have data, whole blocks of holes get no blocks in the image.
+   A file with too many ranges or without SEEK_DATA gets blocks for all of its size
+*/
+static void read_ranges (build_image *b, int dir, const char *name, build_entry *e)
+{
+	long long int first = b->nranges, start, end;
+	off_t data = 0, hole;
+	int fd = openat (dir, name, O_RDONLY | O_NOFOLLOW), full = 0;
+	build_run *last;
+
+	if (fd < 0) return;
+	e->data = first;
+	e->ndata = 0;
+	while ((data = lseek (fd, data, SEEK_DATA)) >= 0 && data < e->size)
+	{
+		hole = lseek (fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > e->size) hole = e->size;
+		start = data / BLOCK;
+		end = (hole + BLOCK - 1) / BLOCK;
+		last = e->ndata ? &b->ranges[b->nranges - 1] : NULL;
+		if (last && last->start + last->len >= start) last->len = end - last->start;
+		else if (e->ndata == SPARSE_RANGES)
+		{
+			full = 1;
+			break;
+		}
+		else
+		{
+			if (b->nranges == b->aranges)
+			{
+				b->aranges = b->aranges ? b->aranges * 2 : 256;
+				b->ranges = realloc (b->ranges, b->aranges * sizeof (build_run));
+			}
+			b->ranges[b->nranges].start = start;
+			b->ranges[b->nranges].len = end - start;
+			b->nranges++;
+			e->ndata++;
+		}
+		data = hole;
+	}
+	if (data < 0 && errno != ENXIO) full = 1;
+	close (fd);
+	if (full)
+	{
+		e->ndata = -1;
+		b->nranges = first;
+	}
+}
+
+/* returns the entry of the first name of a hard linked inode, or adds it and returns -1 */
+static long long int find_link (link_entry **links, const struct stat *st, long long int entry)
+{
+	link_entry **head = &links[(st->st_ino ^ st->st_dev) % LINK_HASH_SIZE], *l;
+
+	for (l = *head; l; l = l->next)
+		if (l->ino == st->st_ino && l->dev == st->st_dev) return l->entry;
+	l = malloc (sizeof (link_entry));
+	l->dev = st->st_dev;
+	l->ino = st->st_ino;
+	l->entry = entry;
+	l->next = *head;
+	*head = l;
+	return -1;
+}
+
+typedef struct
+{
+	ino_t ino;
+	char *name;
+} scan_name;
+
+static int compare_scan_name (const void *a, const void *b)
+{
+	const scan_name *na = a, *nb = b;
+
+	if (na->ino != nb->ino) return na->ino < nb->ino ? -1 : 1;
+	return 0;
+}
+
+/* reads directory d of the tree and adds its entries, in inode order so the inode table is read front to back */
+static void scan_dir (build_image *b, build_tree *t, long long int d, dev_t dev, link_entry **links)
+{
+	char path[PATH_MAX], child[PATH_MAX];
+	scan_name *names = NULL;
+	size_t n = 0, alloc = 0, k;
+	exclude_dir *excluded;
+	struct dirent *de;
+	struct stat st;
+	long long int i, first;
+	DIR *dir;
+	int len;
+
+	t->entries[d].first = t->count;
+	if (entry_path (t, d, path, sizeof (path)) || (dir = opendir (path)) == NULL)
+	{
+		fprintf (stderr, "Could not open %s: %s\n", path, strerror (errno));
+		b->errors++;
+		return;
+	}
+	while ((de = readdir (dir)) != NULL)
+	{
+		if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, "..")) continue;
+		if (n == alloc)
+		{
+			alloc = alloc ? alloc * 2 : 256;
+			names = realloc (names, alloc * sizeof (scan_name));
+		}
+		names[n].ino = de->d_ino;
+		names[n].name = strdup (de->d_name);
+		n++;
+	}
+	if (n) qsort (names, n, sizeof (scan_name), compare_scan_name);
+	excluded = exclude_enter (b->opts.exclude, relative_path (t, path));
+	first = t->count;
+	for (k = 0; k < n; k++)
+	{
+		len = snprintf (child, sizeof (child), "%s/%s", strcmp (path, "/") ? path : "", names[k].name);
+		if (len >= (int) sizeof (child) || fstatat (dirfd (dir), names[k].name, &st, AT_SYMLINK_NOFOLLOW))
+		{
+			fprintf (stderr, "Could not stat %s: %s\n", child, len >= (int) sizeof (child) ? strerror (ENAMETOOLONG) : strerror (errno));
+			b->errors++;
+			continue;
+		}
+		if (exclude_match (excluded, names[k].name, S_ISDIR (st.st_mode)))
+		{
+			b->excluded++;
+			continue;
+		}
+		// the new file system gets its own
+		if (!t->fat && d == 0 && !strcmp (names[k].name, "lost+found")) continue;
+		if (t->fat && !S_ISDIR (st.st_mode) && !S_ISREG (st.st_mode))
+		{
+			fprintf (stderr, "Warning: %s is not copied, FAT has no symlinks or special files.\n", child);
+			continue;
+		}
+		if (t->fat && S_ISREG (st.st_mode) && st.st_size > 0xFFFFFFFFLL)
+		{
+			fprintf (stderr, "Could not copy %s: FAT files can't be larger than 4 GB\n", child);
+			b->errors++;
+			continue;
+		}
+		if (strlen (names[k].name) > 255)
+		{
+			fprintf (stderr, "Could not copy %s: %s\n", child, strerror (ENAMETOOLONG));
+			b->errors++;
+			continue;
+		}
+		i = add_entry (t, names[k].name, d, &st);
+		if (S_ISDIR (st.st_mode) && (st.st_dev != dev || (!t->fat && st.st_dev == b->boot_dev && st.st_ino == b->boot_ino))) t->entries[i].other_fs = 1;
+		if (S_ISLNK (st.st_mode))
+		{
+			t->entries[i].target = malloc (PATH_MAX);
+			len = readlinkat (dirfd (dir), names[k].name, t->entries[i].target, PATH_MAX - 1);
+			if (len < 0)
+			{
+				fprintf (stderr, "Could not read link %s: %s\n", child, strerror (errno));
+				b->errors++;
+				free (t->entries[i].target);
+				free (t->entries[i].name);
+				t->count--;
+				continue;
+			}
+			t->entries[i].target[len] = 0;
+			t->entries[i].size = len;
+		}
+		if (t->fat) continue;
+		read_xattrs (b, child, &t->entries[i]);
+		if (!S_ISDIR (st.st_mode) && st.st_nlink > 1)
+		{
+			t->entries[i].link = find_link (links, &st, i);
+			if (t->entries[i].link >= 0) t->entries[t->entries[i].link].links++;
+		}
+		if (S_ISREG (st.st_mode) && t->entries[i].link < 0 && st.st_blocks * 512 < st.st_size) read_ranges (b, dirfd (dir), names[k].name, &t->entries[i]);
+	}
+	exclude_leave (excluded);
+	closedir (dir);
+	t->entries[d].first = first;
+	t->entries[d].count = t->count - first;
+	for (k = 0; k < n; k++) free (names[k].name);
+	free (names);
+}
+
+/* scan_tree
+   Reads the tree below dir breadth first, without crossing into other file systems
+	@return 0 on success, -1 with a message if dir can't be read
+*/
+static int scan_tree (build_image *b, build_tree *t, const char *dir, int fat)
+{
+	link_entry **links, *l;
+	struct stat st;
+	long long int d;
+	size_t len = strlen (dir);
+
+	if (lstat (dir, &st) || !S_ISDIR (st.st_mode))
+	{
+		fprintf (stderr, "%s is not a directory.\n", dir);
+		return -1;
+	}
+	while (len > 0 && dir[len - 1] == '/') len--;
+	t->dir = strndup (dir, len);
+	t->fat = fat;
+	add_entry (t, "", -1, &st);
+	links = calloc (LINK_HASH_SIZE, sizeof (link_entry *));
+	for (d = 0; d < t->count; d++)
+	{
+		if (!S_ISDIR (t->entries[d].mode) || t->entries[d].other_fs) continue;
+		scan_dir (b, t, d, st.st_dev, links);
+	}
+	for (d = 0; d < LINK_HASH_SIZE; d++)
+		while ((l = links[d]) != NULL)
+		{
+			links[d] = l->next;
+			free (l);
+		}
+	free (links);
+	return 0;
+}
+
+/* finds the boot file system mounted below the root tree */
+static char *find_boot_dir (const char *root)
+{
+	static const char *dirs[] = { "boot/firmware", "boot" };
+	struct stat rst, st;
+	char path[PATH_MAX];
+	int i;
+
+	if (stat (root, &rst)) return NULL;
+	for (i = 0; i < 2; i++)
+	{
+		snprintf (path, sizeof (path), "%s/%s", strcmp (root, "/") ? root : "", dirs[i]);
+		if (stat (path, &st) == 0 && S_ISDIR (st.st_mode) && st.st_dev != rst.st_dev) return strdup (path);
+	}
+	fprintf (stderr, "No boot file system is mounted on %s/boot/firmware or %s/boot, give its directory with --boot-dir.\n", root, root);
+	return NULL;
+}
+
+/* size of the file system mounted on dir, 0 if dir is not a mount point */
+static long long int mounted_size (const char *dir)
+{
+	char parent[PATH_MAX];
+	struct stat st, pst;
+	struct statvfs vfs;
+
+	snprintf (parent, sizeof (parent), "%s/..", dir);
+	if (stat (dir, &st) || stat (parent, &pst) || st.st_dev == pst.st_dev) return 0;
+	if (statvfs (dir, &vfs)) return 0;
+	return (long long int) vfs.f_blocks * vfs.f_frsize;
+}
+
+/*---------------------------------------------------------------------------*/
+/* FAT32 layout */
+
+static int fat_short_char (unsigned char c)
+{
+	return c > 0x20 && c < 0x7F && !strchr ("\"*+,./:;<=>?[\\]|", c);
+}
+
+/* fat_exact_name
+   Makes the 8.3 name of a name that fits in one, all lower case parts are kept with the case flags of Windows NT
+	@return 1 if the name needs no long name entries
+*/
+static int fat_exact_name (const char *name, char *short_name, unsigned char *lower)
+{
+	const char *dot = strrchr (name, '.');
+	int len = strlen (name), base = dot ? dot - name : len, ext = dot ? len - base - 1 : 0, i, upper, low;
+
+	if (base < 1 || base > 8 || ext > 3 || (dot && (ext == 0 || strchr (name, '.') != dot))) return 0;
+	memset (short_name, ' ', 11);
+	*lower = 0;
+	for (upper = low = 0, i = 0; i < base; i++)
+	{
+		if (!fat_short_char (name[i])) return 0;
+		if (name[i] >= 'a' && name[i] <= 'z') low = 1;
+		if (name[i] >= 'A' && name[i] <= 'Z') upper = 1;
+		short_name[i] = name[i] >= 'a' && name[i] <= 'z' ? name[i] - 32 : name[i];
+	}
+	if (upper && low) return 0;
+	if (low) *lower |= 0x08;
+	for (upper = low = 0, i = 0; i < ext; i++)
+	{
+		if (!fat_short_char (dot[1 + i])) return 0;
+		if (dot[1 + i] >= 'a' && dot[1 + i] <= 'z') low = 1;
+		if (dot[1 + i] >= 'A' && dot[1 + i] <= 'Z') upper = 1;
+		short_name[8 + i] = dot[1 + i] >= 'a' && dot[1 + i] <= 'z' ? dot[1 + i] - 32 : dot[1 + i];
+	}
+	if (upper && low) return 0;
+	if (low) *lower |= 0x10;
+	return 1;
+}
+
+/* the basis of a generated 8.3 name: upper case, invalid characters as _, returns the length of the base */
+static int fat_basis (const char *name, char *short_name)
+{
+	const char *dot = strrchr (name, '.'), *p;
+	int k = 0, j;
+
+	if (dot == name) dot = NULL;
+	memset (short_name, ' ', 11);
+	for (p = name; *p && p != dot && k < 8; p++)
+	{
+		if (*p == ' ' || *p == '.' || ((unsigned char) *p & 0xC0) == 0x80) continue;
+		short_name[k++] = fat_short_char (*p) ? (*p >= 'a' && *p <= 'z' ? *p - 32 : *p) : '_';
+	}
+	if (k == 0) short_name[k++] = '_';
+	for (p = dot ? dot + 1 : "", j = 8; *p && j < 11; p++)
+	{
+		if (*p == ' ' || ((unsigned char) *p & 0xC0) == 0x80) continue;
+		short_name[j++] = fat_short_char (*p) ? (*p >= 'a' && *p <= 'z' ? *p - 32 : *p) : '_';
+	}
+	return k;
+}
+
+/* UTF-8 to UTF-16, invalid bytes become _, returns the number of units */
+static int fat_utf16 (const char *name, uint16_t *out)
+{
+	const unsigned char *p = (const unsigned char *) name;
+	uint32_t c;
+	int n = 0, more;
+
+	while (*p && n < 256)
+	{
+		if (*p < 0x80) { c = *p++; more = 0; }
+		else if ((*p & 0xE0) == 0xC0) { c = *p++ & 0x1F; more = 1; }
+		else if ((*p & 0xF0) == 0xE0) { c = *p++ & 0x0F; more = 2; }
+		else if ((*p & 0xF8) == 0xF0) { c = *p++ & 0x07; more = 3; }
+		else { p++; c = '_'; more = 0; }
+		for (; more > 0; more--)
+		{
+			if ((*p & 0xC0) != 0x80) { c = '_'; break; }
+			c = c << 6 | (*p++ & 0x3F);
+		}
+		if (c >= 0x10000)
+		{
+			c -= 0x10000;
+			out[n++] = 0xD800 | c >> 10;
+			c = 0xDC00 | (c & 0x3FF);
+		}
+		out[n++] = c;
+	}
+	return n;
+}
+
+static int fat_name_used (const build_tree *t, long long int from, long long int to, const char *short_name)
+{
+	long long int i;
+
+	for (i = from; i < to; i++)
+		if (!memcmp (t->entries[i].short_name, short_name, 11)) return 1;
+	return 0;
+}
+
+/* gives the children of a directory their 8.3 names, names that fit first so the generated ones can't take them */
+static void fat_names (build_tree *t, long long int d)
+{
+	build_entry *dir = &t->entries[d], *e;
+	uint16_t units[260];
+	char tail[10], basis[11], name[11];
+	long long int i;
+	int k, n, l, pos;
+
+	for (i = dir->first; i < dir->first + dir->count; i++)
+	{
+		e = &t->entries[i];
+		memset (e->short_name, 0, 11);
+		if (fat_exact_name (e->name, name, &e->lower) && !fat_name_used (t, dir->first, i, name)) memcpy (e->short_name, name, 11);
+		else e->lfn = (fat_utf16 (e->name, units) + 12) / 13;
+	}
+	for (i = dir->first; i < dir->first + dir->count; i++)
+	{
+		e = &t->entries[i];
+		if (!e->lfn) continue;
+		e->lower = 0;
+		k = fat_basis (e->name, basis);
+		for (n = 1; n < 1000000; n++)
+		{
+			l = snprintf (tail, sizeof (tail), "~%d", n);
+			pos = k < 8 - l ? k : 8 - l;
+			memcpy (name, basis, 11);
+			memset (name + pos, ' ', 8 - pos);
+			memcpy (name + pos, tail, l);
+			if (!fat_name_used (t, dir->first, dir->first + dir->count, name)) break;
+		}
+		memcpy (e->short_name, name, 11);
+	}
+}
+
+/* entries of a FAT directory, with . and .. or the volume label of the root */
+static long long int fat_dir_entries (const build_tree *t, long long int d)
+{
+	long long int i, n = d == 0 ? 1 : 2;
+
+	for (i = t->entries[d].first; i < t->entries[d].first + t->entries[d].count; i++) n += 1 + t->entries[i].lfn;
+	return n;
+}
+
+static long long int fat_entry_clusters (const build_image *b, long long int i)
+{
+	long long int cs = b->spc * SECTOR;
+
+	if (S_ISDIR (b->boot.entries[i].mode)) return (fat_dir_entries (&b->boot, i) * FAT_ENTRY + cs - 1) / cs;
+	return (b->boot.entries[i].size + cs - 1) / cs;
+}
+
+/* fat_geometry
+   Sets the cluster size and the size of the FATs for a partition, the data area starts 4k aligned
+	@return 0 on success, -1 if the partition has too few clusters for FAT32
+*/
+static int fat_geometry (build_image *b, long long int sectors)
+{
+	long long int size = sectors * SECTOR, fat = 1, need;
+
+	b->boot_sectors = sectors;
+	b->spc = size < (260LL << 20) ? 1 : size < (8LL << 30) ? 8 : size < (16LL << 30) ? 16 : size < (32LL << 30) ? 32 : 64;
+	for (;;)
+	{
+		b->fat_reserved = FAT_RESERVED + (8 - (FAT_RESERVED + 2 * fat) % 8) % 8;
+		b->clusters = (sectors - b->fat_reserved - 2 * fat) / b->spc;
+		need = ((b->clusters + 2) * 4 + SECTOR - 1) / SECTOR;
+		if (need <= fat) break;
+		fat = need;
+	}
+	b->fat_sectors = fat;
+	return b->clusters < FAT_MIN_CLUSTERS ? -1 : 0;
+}
+
+/* sizes the boot partition and gives every directory and file its clusters */
+static int layout_fat (build_image *b)
+{
+	build_tree *t = &b->boot;
+	long long int sectors, need, i, n, bytes = 0;
+	int fixed = 1;
+
+	for (i = 0; i < t->count; i++)
+		if (S_ISDIR (t->entries[i].mode)) fat_names (t, i);
+	sectors = b->opts.boot_size / SECTOR;
+	if (sectors == 0) sectors = mounted_size (b->boot_dir) / SECTOR;
+	if (sectors == 0)
+	{
+		// not a mount point: what the files need on 4k clusters, with room for kernel updates
+		for (i = 0; i < t->count; i++) bytes += S_ISDIR (t->entries[i].mode) ? BLOCK : (t->entries[i].size + BLOCK - 1) / BLOCK * BLOCK;
+		bytes += bytes / 2;
+		sectors = (bytes > FAT_MIN_SIZE ? bytes : FAT_MIN_SIZE) / SECTOR;
+		fixed = 0;
+	}
+	sectors = (sectors + ALIGN_SECTORS - 1) / ALIGN_SECTORS * ALIGN_SECTORS;
+	for (;;)
+	{
+		if (fat_geometry (b, sectors))
+		{
+			if (fixed)
+			{
+				fprintf (stderr, "A boot partition of %lld bytes is too small for FAT32.\n", sectors * SECTOR);
+				return -1;
+			}
+			sectors += ALIGN_SECTORS;
+			continue;
+		}
+		need = 0;
+		for (i = 0; i < t->count; i++) need += fat_entry_clusters (b, i);
+		if (need <= b->clusters) break;
+		if (fixed)
+		{
+			fprintf (stderr, "The files of %s need %lld bytes, the boot partition has %lld.\n", b->boot_dir, need * b->spc * SECTOR, b->clusters * b->spc * SECTOR);
+			return -1;
+		}
+		sectors += ((need - b->clusters) * b->spc + ALIGN_SECTORS) / ALIGN_SECTORS * ALIGN_SECTORS;
+	}
+	// the root directory gets cluster 2, the directories come before the files
+	b->next_cluster = 2;
+	for (n = 0; n < 2; n++)
+		for (i = 0; i < t->count; i++)
+		{
+			if ((n == 0) != (S_ISDIR (t->entries[i].mode) != 0) || (need = fat_entry_clusters (b, i)) == 0) continue;
+			t->entries[i].run = add_run (b, b->next_cluster - 2, need, 0);
+			t->entries[i].runs = 1;
+			b->next_cluster += need;
+		}
+	b->fat_runs = b->nruns;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* ext4 layout */
+
+static int is_power (long long int g, int base)
+{
+	long long int p;
+
+	for (p = base; p < g; p *= base);
+	return p == g;
+}
+
+/* sparse_super: groups 0, 1 and the powers of 3, 5 and 7 have a superblock backup */
+static int has_super (long long int g)
+{
+	return g <= 1 || is_power (g, 3) || is_power (g, 5) || is_power (g, 7);
+}
+
+/* blocks at the start of group g: the superblock or its backup and, meta_bg, the descriptor block of its meta group or a backup of it */
+static long long int group_overhead (long long int g)
+{
+	long long int m = g % DESC_PER_BLOCK;
+
+	return has_super (g) + (m == 0 || m == 1 || m == DESC_PER_BLOCK - 1);
+}
+
+static int block_used (const build_image *b, long long int block)
+{
+	return b->used[block >> 3] >> (block & 7) & 1;
+}
+
+static void use_block (build_image *b, long long int block)
+{
+	b->used[block >> 3] |= 1 << (block & 7);
+}
+
+/* the run of free blocks at the cursor, up to want blocks, returns its length, 0 if the file system is full */
+static long long int alloc_run (build_image *b, long long int want, long long int *start)
+{
+	long long int len = 0;
+
+	while (b->cursor < b->blocks && block_used (b, b->cursor)) b->cursor++;
+	*start = b->cursor;
+	while (len < want && b->cursor < b->blocks && !block_used (b, b->cursor))
+	{
+		use_block (b, b->cursor++);
+		len++;
+	}
+	return len;
+}
+
+/* n contiguous free blocks, returns the first one or -1 if the file system is full */
+static long long int alloc_contiguous (build_image *b, long long int n)
+{
+	long long int start, i;
+
+	for (;;)
+	{
+		while (b->cursor < b->blocks && block_used (b, b->cursor)) b->cursor++;
+		start = b->cursor;
+		for (i = 0; i < n && start + i < b->blocks && !block_used (b, start + i); i++);
+		if (i == n) break;
+		if (start + i >= b->blocks) return -1;
+		b->cursor = start + i;
+	}
+	for (i = 0; i < n; i++) use_block (b, start + i);
+	b->cursor = start + n;
+	return start;
+}
+
+/* adds runs of at most one extent for blocks of an entry from block logical of the file, returns 0 or -1 if the file system is full */
+static int add_blocks (build_image *b, build_entry *e, long long int logical, long long int blocks)
+{
+	long long int start, len;
+
+	while (blocks > 0)
+	{
+		len = alloc_run (b, blocks < EXTENT_MAX ? blocks : EXTENT_MAX, &start);
+		if (len == 0) return -1;
+		add_run (b, start, len, logical);
+		e->runs++;
+		logical += len;
+		blocks -= len;
+	}
+	return 0;
+}
+
+/* gives an entry its blocks, returns 0 or -1 if the file system is full */
+static int alloc_blocks (build_image *b, build_entry *e, long long int blocks)
+{
+	e->run = b->nruns;
+	e->runs = 0;
+	return add_blocks (b, e, 0, blocks);
+}
+
+/* gives a file the blocks of its data, the holes of a sparse file get none */
+static int alloc_file (build_image *b, build_entry *e)
+{
+	build_run *d;
+	int k;
+
+	if (e->ndata < 0) return alloc_blocks (b, e, (e->size + BLOCK - 1) / BLOCK);
+	e->run = b->nruns;
+	e->runs = 0;
+	for (k = 0; k < e->ndata; k++)
+	{
+		d = &b->ranges[e->data + k];
+		if (add_blocks (b, e, d->start, d->len)) return -1;
+	}
+	return 0;
+}
+
+/* the default journal size of mke2fs */
+static long long int journal_blocks (long long int blocks)
+{
+	if (blocks < 32768) return 1024;
+	if (blocks < 256 * 1024) return 4096;
+	if (blocks < 512 * 1024) return 8192;
+	if (blocks < 4096 * 1024) return 16384;
+	if (blocks < 8192 * 1024) return 32768;
+	if (blocks < 16384 * 1024) return 65536;
+	if (blocks < 32768 * 1024) return 131072;
+	return 262144;
+}
+
+static int ext_file_type (mode_t mode)
+{
+	if (S_ISREG (mode)) return 1;
+	if (S_ISDIR (mode)) return 2;
+	if (S_ISCHR (mode)) return 3;
+	if (S_ISBLK (mode)) return 4;
+	if (S_ISFIFO (mode)) return 5;
+	if (S_ISSOCK (mode)) return 6;
+	return 7;
+}
+
+/* adds an entry to a linear directory, buf NULL only counts, an entry that doesn't fit stretches the previous one to the end of its block */
+static void dir_add (unsigned char *buf, long long int *pos, long long int *last, unsigned int ino, const char *name, mode_t mode)
+{
+	int len = strlen (name), rec = (8 + len + 3) & ~3;
+
+	if (*pos % BLOCK + rec > BLOCK)
+	{
+		if (buf) put16 (buf + *last + 4, BLOCK - *last % BLOCK);
+		*pos += BLOCK - *pos % BLOCK;
+	}
+	if (buf)
+	{
+		put32 (buf + *pos, ino);
+		put16 (buf + *pos + 4, rec);
+		buf[*pos + 6] = len;
+		buf[*pos + 7] = ext_file_type (mode);
+		memcpy (buf + *pos + 8, name, len);
+	}
+	*last = *pos;
+	*pos += rec;
+}
+
+/* ext_dir
+   Fills the blocks of directory d of the root tree
+	@param buf receives the blocks, NULL only counts them
+	@return the number of blocks
+*/
+static long long int ext_dir (build_image *b, long long int d, unsigned char *buf)
+{
+	build_tree *t = &b->root;
+	build_entry *e = &t->entries[d];
+	long long int pos = 0, last = 0, i;
+
+	dir_add (buf, &pos, &last, e->ino, ".", S_IFDIR);
+	dir_add (buf, &pos, &last, d ? t->entries[e->parent].ino : ROOT_INO, "..", S_IFDIR);
+	if (d == 0) dir_add (buf, &pos, &last, FIRST_INO, "lost+found", S_IFDIR);
+	for (i = e->first; i < e->first + e->count; i++) dir_add (buf, &pos, &last, t->entries[i].ino, t->entries[i].name, t->entries[i].mode);
+	if (buf) put16 (buf + last + 4, BLOCK - last % BLOCK);
+	return (pos + BLOCK - 1) / BLOCK;
+}
+
+/* ext4_try
+   Lays out the file system on a number of blocks
+	@return 0 on success, -1 if it is too small, -2 with a message if the files can't be stored
+*/
+static int ext4_try (build_image *b, long long int blocks)
+{
+	build_tree *t = &b->root;
+	long long int g, i, inodes, end;
+	char path[PATH_MAX];
+	build_entry *e;
+
+	b->blocks = blocks;
+	b->groups = (blocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+	inodes = blocks * BLOCK / BYTES_PER_INODE;
+	if (inodes < b->inodes_used + b->inodes_used / 10) inodes = b->inodes_used + b->inodes_used / 10;
+	b->ipg = ((inodes + b->groups - 1) / b->groups + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+	if (b->ipg > BLOCKS_PER_GROUP) return -1;
+	b->itb = b->ipg / INODES_PER_BLOCK;
+	free (b->block_bitmap);
+	free (b->inode_bitmap);
+	free (b->inode_table);
+	free (b->used);
+	b->block_bitmap = calloc (b->groups, sizeof (long long int));
+	b->inode_bitmap = calloc (b->groups, sizeof (long long int));
+	b->inode_table = calloc (b->groups, sizeof (long long int));
+	b->used = calloc (b->groups, BLOCKS_PER_GROUP / 8);
+	for (g = 0; g < b->groups; g++)
+		for (i = 0; i < group_overhead (g); i++) use_block (b, g * BLOCKS_PER_GROUP + i);
+	// the bitmap of the last group is padded with blocks in use
+	for (end = blocks; end < b->groups * BLOCKS_PER_GROUP; end++) use_block (b, end);
+	b->cursor = 0;
+	b->nruns = b->fat_runs;
+	for (g = 0; g < b->groups; g++)
+		if ((b->block_bitmap[g] = alloc_contiguous (b, 1)) < 0) return -1;
+	for (g = 0; g < b->groups; g++)
+		if ((b->inode_bitmap[g] = alloc_contiguous (b, 1)) < 0) return -1;
+	for (g = 0; g < b->groups; g++)
+		if ((b->inode_table[g] = alloc_contiguous (b, b->itb)) < 0) return -1;
+	b->journal.size = journal_blocks (blocks) * BLOCK;
+	if (alloc_blocks (b, &b->journal, journal_blocks (blocks)) || alloc_blocks (b, &b->lost_found, LOST_FOUND_BLOCKS)) return -1;
+	for (i = 0; i < t->count; i++)
+		if (S_ISDIR (t->entries[i].mode) && alloc_blocks (b, &t->entries[i], ext_dir (b, i, NULL))) return -1;
+	for (i = 0; i < t->count; i++)
+	{
+		e = &t->entries[i];
+		if (S_ISREG (e->mode) && e->link < 0 && alloc_file (b, e)) return -1;
+	}
+	// extent tree leaves, the journal first
+	for (i = -1; i < t->count; i++)
+	{
+		e = i < 0 ? &b->journal : &t->entries[i];
+		e->leaf = 0;
+		if (e->runs <= 4 || e->link >= 0 || S_ISLNK (e->mode)) continue;
+		if (e->runs > LEAF_EXTENTS)
+		{
+			entry_path (t, i, path, sizeof (path));
+			fprintf (stderr, "Could not copy %s: the file is too large\n", path);
+			return -2;
+		}
+		if ((e->leaf = alloc_contiguous (b, 1)) < 0) return -1;
+	}
+	for (i = 0; i < t->count; i++)
+	{
+		e = &t->entries[i];
+		if (S_ISLNK (e->mode) && e->size >= FAST_SYMLINK && alloc_blocks (b, e, 1)) return -1;
+	}
+	for (b->free_blocks = 0, i = 0; i < b->groups * BLOCKS_PER_GROUP; i++) b->free_blocks += !block_used (b, i);
+	return 0;
+}
+
+/* numbers the inodes and sizes the root partition for the files, the reserved blocks and -x */
+static int layout_ext4 (build_image *b)
+{
+	build_tree *t = &b->root;
+	long long int i, blocks = LOST_FOUND_BLOCKS, extra = (b->opts.extra_space + BLOCK - 1) / BLOCK, want;
+	unsigned int ino = FIRST_INO + 1;
+	build_entry *e;
+	int r;
+
+	t->entries[0].ino = ROOT_INO;
+	t->entries[0].links++;          // lost+found
+	for (i = 1; i < t->count; i++)
+	{
+		e = &t->entries[i];
+		e->ino = e->link >= 0 ? t->entries[e->link].ino : ino++;
+		if (S_ISDIR (e->mode)) t->entries[e->parent].links++;
+	}
+	b->inodes_used = ino - 1;
+	for (i = 0; i < t->count; i++)
+	{
+		e = &t->entries[i];
+		if (S_ISDIR (e->mode)) blocks += ext_dir (b, i, NULL);
+		else if (S_ISREG (e->mode) && e->link < 0) blocks += file_blocks (b, e);
+		else if (S_ISLNK (e->mode) && e->size >= FAST_SYMLINK) blocks++;
+	}
+	b->lost_found.mode = S_IFDIR | 0700;
+	b->lost_found.links = 2;
+	b->lost_found.ino = FIRST_INO;
+	b->journal.mode = S_IFREG | 0600;
+	b->journal.links = 1;
+	b->journal.ino = JOURNAL_INO;
+	b->journal.link = b->lost_found.link = -1;
+	b->journal.atime.tv_sec = b->journal.mtime.tv_sec = b->journal.ctime.tv_sec = b->now;
+	b->lost_found.atime = b->lost_found.mtime = b->lost_found.ctime = b->journal.atime;
+
+	// the first guess leaves room for the inode tables and the journal, each try that is too small adds what was missing
+	blocks += extra + blocks / 16 + 8192;
+	for (;;)
+	{
+		if (blocks % BLOCKS_PER_GROUP && blocks % BLOCKS_PER_GROUP < 1024) blocks += 1024 - blocks % BLOCKS_PER_GROUP;
+		r = ext4_try (b, blocks);
+		if (r == -2) return -1;
+		want = extra + blocks / 20;
+		if (r == 0 && b->free_blocks >= want) break;
+		blocks += r == 0 ? want - b->free_blocks + 256 : blocks / 8 + 1024;
+	}
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* ext4 metadata */
+
+static void ext_time (unsigned char *p, unsigned char *extra, const struct timespec *ts)
+{
+	long long int sec = ts->tv_sec;
+
+	put32 (p, (uint32_t) sec);
+	// the extra field has the epoch bits above 32 bits and the nanoseconds
+	put32 (extra, (uint32_t) (((sec - (int32_t) sec) >> 32) & 3) | (uint32_t) ts->tv_nsec << 2);
+}
+
+static void extent_header (unsigned char *p, int entries, int max, int depth)
+{
+	put16 (p, EXT4_EXTENT_MAGIC);
+	put16 (p + 2, entries);
+	put16 (p + 4, max);
+	put16 (p + 6, depth);
+	put32 (p + 8, 0);
+}
+
+/* writes the extent tree of an entry into i_block, and into leaf if it has more than 4 runs */
+static void ext_extents (build_image *b, const build_entry *e, unsigned char *iblock, unsigned char *leaf)
+{
+	unsigned char *node = iblock, *x;
+	build_run *r;
+	int i;
+
+	if (e->runs > 4)
+	{
+		extent_header (iblock, 1, 4, 1);
+		put32 (iblock + 12, 0);
+		put32 (iblock + 16, e->leaf);
+		put16 (iblock + 20, e->leaf >> 32);
+		memset (leaf, 0, BLOCK);
+		extent_header (leaf, e->runs, LEAF_EXTENTS, 0);
+		node = leaf;
+	}
+	else extent_header (iblock, e->runs, 4, 0);
+	for (i = 0; i < e->runs; i++)
+	{
+		r = &b->runs[e->run + i];
+		x = node + 12 + i * 12;
+		put32 (x, r->logical);
+		put16 (x + 4, r->len);
+		put16 (x + 6, r->start >> 32);
+		put32 (x + 8, r->start);
+	}
+}
+
+static void ext_inode (build_image *b, const build_entry *e, unsigned char *p)
+{
+	unsigned char leaf[BLOCK];
+	long long int size = S_ISDIR (e->mode) ? run_blocks (b, e) * BLOCK : e->size;
+	struct timespec now = { b->now, 0 };
+	unsigned int ma = major (e->rdev), mi = minor (e->rdev);
+
+	memset (p, 0, INODE_SIZE);
+	put16 (p, e->mode);
+	put16 (p + 0x02, e->uid);
+	put16 (p + 0x78, e->uid >> 16);
+	put16 (p + 0x18, e->gid);
+	put16 (p + 0x7A, e->gid >> 16);
+	put32 (p + 0x04, size);
+	put32 (p + 0x6C, size >> 32);
+	ext_time (p + 0x08, p + 0x8C, &e->atime);
+	ext_time (p + 0x0C, p + 0x84, &e->ctime);
+	ext_time (p + 0x10, p + 0x88, &e->mtime);
+	ext_time (p + 0x90, p + 0x94, &now);
+	// dir_nlink: a directory with too many sub directories counts 1
+	put16 (p + 0x1A, e->links < 65000 ? e->links : 1);
+	put32 (p + 0x1C, (run_blocks (b, e) + (e->leaf != 0)) * (BLOCK / SECTOR));
+	put16 (p + 0x80, INODE_EXTRA);
+	if (S_ISLNK (e->mode) && e->size < FAST_SYMLINK) memcpy (p + 0x28, e->target, e->size);
+	else if (S_ISCHR (e->mode) || S_ISBLK (e->mode))
+	{
+		if (ma < 256 && mi < 256) put32 (p + 0x28, ma << 8 | mi);
+		else put32 (p + 0x2C, (mi & 0xFF) | ma << 8 | (mi & ~0xFFu) << 12);
+	}
+	else if (S_ISREG (e->mode) || S_ISDIR (e->mode) || S_ISLNK (e->mode))
+	{
+		put32 (p + 0x20, EXT4_EXTENTS_FL);
+		ext_extents (b, e, p + 0x28, leaf);
+	}
+	if (e->xattr) memcpy (p + 0x80 + INODE_EXTRA, e->xattr, XATTR_AREA);
+}
+
+static void ext_superblock (build_image *b, unsigned char *s, long long int group)
+{
+	unsigned char leaf[BLOCK];
+
+	memset (s, 0, 1024);
+	put32 (s + 0x00, b->groups * b->ipg);
+	put32 (s + 0x04, b->blocks);
+	put32 (s + 0x08, b->blocks / 20);
+	put32 (s + 0x0C, b->free_blocks);
+	put32 (s + 0x10, b->groups * b->ipg - b->inodes_used);
+	put32 (s + 0x18, 2);                    // 4k blocks
+	put32 (s + 0x1C, 2);
+	put32 (s + 0x20, BLOCKS_PER_GROUP);
+	put32 (s + 0x24, BLOCKS_PER_GROUP);
+	put32 (s + 0x28, b->ipg);
+	put32 (s + 0x30, b->now);
+	put16 (s + 0x36, 0xFFFF);               // no check after a number of mounts
+	put16 (s + 0x38, EXT4_MAGIC);
+	put16 (s + 0x3A, 1);                    // clean
+	put16 (s + 0x3C, 1);                    // continue on errors
+	put32 (s + 0x40, b->now);
+	put32 (s + 0x4C, 1);                    // dynamic inode sizes
+	put32 (s + 0x54, FIRST_INO);
+	put16 (s + 0x58, INODE_SIZE);
+	put16 (s + 0x5A, group);
+	put32 (s + 0x5C, EXT4_COMPAT);
+	put32 (s + 0x60, EXT4_INCOMPAT);
+	put32 (s + 0x64, EXT4_RO_COMPAT);
+	memcpy (s + 0x68, b->uuid, 16);
+	strncpy ((char *) s + 0x78, b->opts.root_label ? b->opts.root_label : "rootfs", 16);
+	put32 (s + 0xE0, JOURNAL_INO);
+	memcpy (s + 0xEC, b->hash_seed, 16);
+	s[0xFC] = 1;                            // half_md4 directory hashes
+	s[0xFD] = 1;                            // s_jnl_blocks holds a copy of the journal extents
+	put32 (s + 0x100, 0x000C);              // user_xattr and acl
+	put32 (s + 0x108, b->now);
+	ext_extents (b, &b->journal, s + 0x10C, leaf);
+	put32 (s + 0x148, b->journal.size >> 32);
+	put32 (s + 0x14C, b->journal.size);
+	put16 (s + 0x15C, INODE_EXTRA);
+	put16 (s + 0x15E, INODE_EXTRA);
+	put32 (s + 0x160, 0x0002);              // unsigned directory hashes like on ARM
+	s[0x174] = 4;                           // flex groups of 16
+}
+
+static void ext_write (build_image *b, batch_writer *w)
+{
+	build_tree *t = &b->root;
+	long long int base = b->root_start * SECTOR, desc_blocks = (b->groups + DESC_PER_BLOCK - 1) / DESC_PER_BLOCK, i, g, n, used, free_inodes;
+	unsigned char *buf, *desc, block[BLOCK], leaf[BLOCK], sb[1024];
+	build_entry **by_ino, *e;
+
+	for (i = 0; i < t->count; i++)
+	{
+		if (!S_ISDIR (t->entries[i].mode)) continue;
+		n = ext_dir (b, i, NULL);
+		buf = calloc (n, BLOCK);
+		ext_dir (b, i, buf);
+		write_runs (w, b, &t->entries[i], base, BLOCK, buf);
+		free (buf);
+	}
+	buf = calloc (LOST_FOUND_BLOCKS, BLOCK);
+	put32 (buf, FIRST_INO);
+	put16 (buf + 4, 12);
+	buf[6] = 1;
+	buf[7] = 2;
+	buf[8] = '.';
+	put32 (buf + 12, ROOT_INO);
+	put16 (buf + 16, BLOCK - 12);
+	buf[18] = 2;
+	buf[19] = 2;
+	memcpy (buf + 20, "..", 2);
+	for (i = 1; i < LOST_FOUND_BLOCKS; i++) put16 (buf + i * BLOCK + 4, BLOCK);
+	write_runs (w, b, &b->lost_found, base, BLOCK, buf);
+	free (buf);
+
+	// the journal is empty, only its superblock is written
+	memset (block, 0, BLOCK);
+	put32be (block, JBD2_MAGIC);
+	put32be (block + 0x04, 4);
+	put32be (block + 0x0C, BLOCK);
+	put32be (block + 0x10, b->journal.size / BLOCK);
+	put32be (block + 0x14, 1);
+	put32be (block + 0x18, 1);
+	memcpy (block + 0x30, b->uuid, 16);
+	put32be (block + 0x40, 1);
+	batch_write (w, base + b->runs[b->journal.run].start * BLOCK, block, BLOCK);
+
+	// leaves and long symlinks, in the order they were laid out
+	for (i = -1; i < t->count; i++)
+	{
+		e = i < 0 ? &b->journal : &t->entries[i];
+		if (!e->leaf) continue;
+		ext_extents (b, e, block, leaf);
+		batch_write (w, base + e->leaf * BLOCK, leaf, BLOCK);
+	}
+	for (i = 0; i < t->count; i++)
+	{
+		e = &t->entries[i];
+		if (!S_ISLNK (e->mode) || e->size < FAST_SYMLINK) continue;
+		memset (block, 0, BLOCK);
+		memcpy (block, e->target, e->size);
+		write_runs (w, b, e, base, BLOCK, block);
+	}
+
+	by_ino = calloc (b->inodes_used + 1, sizeof (build_entry *));
+	by_ino[ROOT_INO] = &t->entries[0];
+	by_ino[JOURNAL_INO] = &b->journal;
+	by_ino[FIRST_INO] = &b->lost_found;
+	for (i = 1; i < t->count; i++)
+		if (t->entries[i].link < 0) by_ino[t->entries[i].ino] = &t->entries[i];
+	buf = malloc (b->itb * BLOCK);
+	desc = calloc (desc_blocks, BLOCK);
+	for (g = 0; g < b->groups; g++)
+	{
+		used = b->inodes_used - g * b->ipg;
+		used = used < 0 ? 0 : used > b->ipg ? b->ipg : used;
+		if (used)
+		{
+			memset (buf, 0, b->itb * BLOCK);
+			for (i = 0; i < used; i++)
+				if (by_ino[g * b->ipg + i + 1]) ext_inode (b, by_ino[g * b->ipg + i + 1], buf + i * INODE_SIZE);
+			batch_write (w, base + b->inode_table[g] * BLOCK, buf, (used + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * BLOCK);
+		}
+		for (free_inodes = b->ipg - used, n = 0, i = 0; i < used; i++)
+			if (by_ino[g * b->ipg + i + 1] && S_ISDIR (by_ino[g * b->ipg + i + 1]->mode)) n++;
+		put32 (desc + g * DESC_SIZE, b->block_bitmap[g]);
+		put32 (desc + g * DESC_SIZE + 0x04, b->inode_bitmap[g]);
+		put32 (desc + g * DESC_SIZE + 0x08, b->inode_table[g]);
+		for (used = 0, i = g * BLOCKS_PER_GROUP; i < (g + 1) * BLOCKS_PER_GROUP; i++) used += block_used (b, i);
+		put16 (desc + g * DESC_SIZE + 0x0C, BLOCKS_PER_GROUP - used);
+		put16 (desc + g * DESC_SIZE + 0x0E, free_inodes);
+		put16 (desc + g * DESC_SIZE + 0x10, n);
+	}
+	for (g = 0; g < b->groups; g++) batch_write (w, base + b->block_bitmap[g] * BLOCK, b->used + g * (BLOCKS_PER_GROUP / 8), BLOCK);
+	for (g = 0; g < b->groups; g++)
+	{
+		used = b->inodes_used - g * b->ipg;
+		used = used < 0 ? 0 : used > b->ipg ? b->ipg : used;
+		memset (block, 0, BLOCK);
+		for (i = 0; i < BLOCKS_PER_GROUP; i++)
+			if (i < used || i >= b->ipg) block[i >> 3] |= 1 << (i & 7);
+		batch_write (w, base + b->inode_bitmap[g] * BLOCK, block, BLOCK);
+	}
+	for (g = 0; g < b->groups; g++)
+	{
+		if (has_super (g))
+		{
+			ext_superblock (b, sb, g);
+			batch_write (w, base + (g ? g * BLOCKS_PER_GROUP * BLOCK : 1024), sb, 1024);
+		}
+		if (group_overhead (g) > has_super (g))
+			batch_write (w, base + (g * BLOCKS_PER_GROUP + has_super (g)) * BLOCK, desc + g / DESC_PER_BLOCK * BLOCK, BLOCK);
+	}
+	free (desc);
+	free (buf);
+	free (by_ino);
+}
+
+/*---------------------------------------------------------------------------*/
+/* FAT32 metadata */
+
+static void fat_time (time_t t, unsigned char *date, unsigned char *time)
+{
+	struct tm tm;
+
+	// like the kernel without a time zone, which Raspberry Pi OS does not set
+	gmtime_r (&t, &tm);
+	if (tm.tm_year < 80) memset (&tm, 0, sizeof (tm)), tm.tm_year = 80, tm.tm_mday = 1;
+	if (tm.tm_year > 207) tm.tm_year = 207;
+	put16 (date, (tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday);
+	if (time) put16 (time, tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2);
+}
+
+static void fat_entry (unsigned char *p, const char *short_name, int attr, unsigned char lower, uint32_t cluster, uint32_t size, const build_entry *e)
+{
+	memcpy (p, short_name, 11);
+	p[11] = attr;
+	p[12] = lower;
+	fat_time (e->ctime.tv_sec, p + 16, p + 14);
+	fat_time (e->atime.tv_sec, p + 18, NULL);
+	put16 (p + 20, cluster >> 16);
+	fat_time (e->mtime.tv_sec, p + 24, p + 22);
+	put16 (p + 26, cluster);
+	put32 (p + 28, size);
+}
+
+static unsigned char fat_checksum (const char *short_name)
+{
+	unsigned char sum = 0;
+	int i;
+
+	for (i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + (unsigned char) short_name[i];
+	return sum;
+}
+
+/* the long name entries of a name, the last part first */
+static void fat_lfn (unsigned char *p, const char *name, int n, unsigned char sum)
+{
+	static const int pos[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	uint16_t units[260];
+	int units_len = fat_utf16 (name, units), k, j, seq, idx;
+
+	for (k = 0; k < n; k++, p += FAT_ENTRY)
+	{
+		seq = n - k;
+		p[0] = seq | (k == 0 ? 0x40 : 0);
+		p[11] = 0x0F;
+		p[13] = sum;
+		for (j = 0; j < 13; j++)
+		{
+			idx = (seq - 1) * 13 + j;
+			put16 (p + pos[j], idx < units_len ? units[idx] : idx == units_len ? 0 : 0xFFFF);
+		}
+	}
+}
+
+static uint32_t fat_first_cluster (const build_image *b, const build_entry *e)
+{
+	return e->runs ? b->runs[e->run].start + 2 : 0;
+}
+
+static void fat_label (const build_image *b, char *label)
+{
+	const char *l = b->opts.boot_label ? b->opts.boot_label : "bootfs";
+	int i;
+
+	memset (label, ' ', 11);
+	for (i = 0; i < 11 && l[i]; i++) label[i] = l[i] >= 'a' && l[i] <= 'z' ? l[i] - 32 : l[i];
+}
+
+/* fills the clusters of directory d of the boot tree */
+static void fat_dir (build_image *b, long long int d, unsigned char *p)
+{
+	build_tree *t = &b->boot;
+	build_entry *e = &t->entries[d], *c;
+	char label[11];
+	long long int i;
+
+	if (d == 0)
+	{
+		fat_label (b, label);
+		fat_entry (p, label, 0x08, 0, 0, 0, e);
+		p += FAT_ENTRY;
+	}
+	else
+	{
+		fat_entry (p, ".          ", 0x10, 0, fat_first_cluster (b, e), 0, e);
+		fat_entry (p + FAT_ENTRY, "..         ", 0x10, 0, e->parent ? fat_first_cluster (b, &t->entries[e->parent]) : 0, 0, &t->entries[e->parent]);
+		p += 2 * FAT_ENTRY;
+	}
+	for (i = e->first; i < e->first + e->count; i++)
+	{
+		c = &t->entries[i];
+		if (c->lfn)
+		{
+			fat_lfn (p, c->name, c->lfn, fat_checksum (c->short_name));
+			p += c->lfn * FAT_ENTRY;
+		}
+		fat_entry (p, c->short_name, S_ISDIR (c->mode) ? 0x10 : 0x20 | !(c->mode & 0222), c->lower, fat_first_cluster (b, c), S_ISDIR (c->mode) ? 0 : c->size, c);
+		p += FAT_ENTRY;
+	}
+}
+
+static void fat_write (build_image *b, batch_writer *w)
+{
+	build_tree *t = &b->boot;
+	long long int base = b->boot_start * SECTOR, data = base + (b->fat_reserved + 2 * b->fat_sectors) * SECTOR, cs = b->spc * SECTOR, i, c;
+	unsigned char boot[SECTOR], info[SECTOR], *fat, *buf;
+	build_run *r;
+	char label[11];
+
+	memset (boot, 0, SECTOR);
+	boot[0] = 0xEB;
+	boot[1] = 0x58;
+	boot[2] = 0x90;
+	memcpy (boot + 3, "imgclone", 8);
+	put16 (boot + 11, SECTOR);
+	boot[13] = b->spc;
+	put16 (boot + 14, b->fat_reserved);
+	boot[16] = 2;
+	boot[21] = 0xF8;
+	put16 (boot + 24, 63);
+	put16 (boot + 26, 255);
+	put32 (boot + 28, b->boot_start);
+	put32 (boot + 32, b->boot_sectors);
+	put32 (boot + 36, b->fat_sectors);
+	put32 (boot + 44, 2);                   // root directory cluster
+	put16 (boot + 48, 1);                   // FSInfo sector
+	put16 (boot + 50, 6);                   // backup boot sector
+	boot[64] = 0x80;
+	boot[66] = 0x29;
+	put32 (boot + 67, b->volume_id);
+	fat_label (b, label);
+	memcpy (boot + 71, label, 11);
+	memcpy (boot + 82, "FAT32   ", 8);
+	boot[510] = 0x55;
+	boot[511] = 0xAA;
+	memset (info, 0, SECTOR);
+	put32 (info, 0x41615252);
+	put32 (info + 484, 0x61417272);
+	put32 (info + 488, b->clusters - (b->next_cluster - 2));
+	put32 (info + 492, b->next_cluster);
+	put32 (info + 508, 0xAA550000);
+	batch_write (w, base, boot, SECTOR);
+	batch_write (w, base + SECTOR, info, SECTOR);
+	batch_write (w, base + 6 * SECTOR, boot, SECTOR);
+	batch_write (w, base + 7 * SECTOR, info, SECTOR);
+
+	fat = calloc (b->fat_sectors, SECTOR);
+	put32 (fat, 0x0FFFFFF8);
+	put32 (fat + 4, 0x0FFFFFFF);
+	for (i = 0; i < t->count; i++)
+	{
+		if (!t->entries[i].runs) continue;
+		r = &b->runs[t->entries[i].run];
+		for (c = r->start + 2; c < r->start + 2 + r->len; c++) put32 (fat + c * 4, c == r->start + 1 + r->len ? 0x0FFFFFFF : c + 1);
+	}
+	batch_write (w, base + b->fat_reserved * SECTOR, fat, b->fat_sectors * SECTOR);
+	batch_write (w, base + (b->fat_reserved + b->fat_sectors) * SECTOR, fat, b->fat_sectors * SECTOR);
+	free (fat);
+
+	for (i = 0; i < t->count; i++)
+	{
+		if (!S_ISDIR (t->entries[i].mode)) continue;
+		r = &b->runs[t->entries[i].run];
+		buf = calloc (r->len, cs);
+		fat_dir (b, i, buf);
+		batch_write (w, data + r->start * cs, buf, r->len * cs);
+		free (buf);
+	}
+}
+
+/* cylinder, head and sector of an LBA for the partition table, the largest value beyond 8 GB */
+static void chs (unsigned char *p, long long int lba)
+{
+	long long int c = lba / (255 * 63), h = lba / 63 % 255, s = lba % 63 + 1;
+
+	if (c > 1023)
+	{
+		c = 1023;
+		h = 254;
+		s = 63;
+	}
+	p[0] = h;
+	p[1] = s | (c >> 2 & 0xC0);
+	p[2] = c;
+}
+
+static void mbr_entry (unsigned char *p, int type, long long int start, long long int sectors)
+{
+	chs (p + 1, start);
+	p[4] = type;
+	chs (p + 5, start + sectors - 1);
+	put32 (p + 8, start);
+	put32 (p + 12, sectors);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Copy threads */
+
+static int open_source (const char *src)
+{
+	int in = open (src, O_RDONLY | O_NOFOLLOW | O_NOATIME);
+
+	if (in < 0 && errno == EPERM) in = open (src, O_RDONLY | O_NOFOLLOW);
+	return in;
+}
+
+/* copies the data of a file to its runs in the image, a file that changed size since the scan is cut off or padded with zeros */
+static void copy_data (build_ctx *ctx, char *buffer, const build_tree *t, long long int i)
+{
+	build_image *b = ctx->b;
+	const build_entry *e = &t->entries[i];
+	long long int base, unit, pos = 0, off, len, n;
+	char path[PATH_MAX];
+	build_run *r;
+	int in, k;
+
+	base = t->fat ? (b->boot_start + b->fat_reserved + 2 * b->fat_sectors) * SECTOR : b->root_start * SECTOR;
+	unit = t->fat ? b->spc * SECTOR : BLOCK;
+	if (entry_path (t, i, path, sizeof (path)) || (in = open_source (path)) < 0)
+	{
+		fprintf (stderr, "Could not open %s: %s\n", path, strerror (errno));
+		count (&ctx->stats->errors, 1);
+		return;
+	}
+	for (k = 0; k < e->runs; k++)
+	{
+		r = &b->runs[e->run + k];
+		pos = r->logical * unit;
+		if (pos >= e->size) break;
+		off = base + r->start * unit;
+		len = r->len * unit < e->size - pos ? r->len * unit : e->size - pos;
+		while (len > 0)
+		{
+			n = pread (in, buffer, len < COPY_BUFFER ? len : COPY_BUFFER, pos);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0)
+			{
+				if (n == 0) fprintf (stderr, "Warning: %s got shorter while it was copied, the rest reads as zeros.\n", path);
+				else fprintf (stderr, "Could not read %s: %s\n", path, strerror (errno));
+				if (n < 0) count (&ctx->stats->errors, 1);
+				close (in);
+				return;
+			}
+			if (write_sparse (ctx->fd, buffer, n, off, ctx->stats))
+			{
+				fprintf (stderr, "Could not write the image: %s\n", strerror (errno));
+				count (&ctx->stats->errors, 1);
+				close (in);
+				return;
+			}
+			throttle_take (n);
+			throttle_drop_read (in, pos, n);
+			throttle_drop_written (ctx->fd, off, n);
+			count (&ctx->stats->bytes, n);
+			pos += n;
+			off += n;
+			len -= n;
+		}
+	}
+	if (pread (in, buffer, 1, e->size) == 1) fprintf (stderr, "Warning: %s grew while it was copied, only its first %lld bytes are in the image.\n", path, e->size);
+	close (in);
+	count (&ctx->stats->files, 1);
+}
+
+static void *build_worker (build_ctx *ctx)
+{
+	char *buffer = malloc (COPY_BUFFER);
+	long long int i;
+
+	while ((i = __atomic_fetch_add (&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->njobs)
+		copy_data (ctx, buffer, ctx->jobs[i].fat ? &ctx->b->boot : &ctx->b->root, ctx->jobs[i].entry);
+	free (buffer);
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+build_image *build_scan (const build_options *options)
+{
+	build_image *b = calloc (1, sizeof (build_image));
+	struct stat st;
+
+	b->opts = *options;
+	b->now = time (NULL);
+	if (options->disk_id) snprintf (b->disk_id, sizeof (b->disk_id), "%s", options->disk_id);
+	else probe_random_id (b->disk_id);
+	random_bytes (b->uuid, 16);
+	b->uuid[6] = (b->uuid[6] & 0x0F) | 0x40;
+	b->uuid[8] = (b->uuid[8] & 0x3F) | 0x80;
+	random_bytes (b->hash_seed, 16);
+	random_bytes ((unsigned char *) &b->volume_id, 4);
+	b->xattr_list = malloc (XATTR_BUFFER);
+	b->xattr_value = malloc (XATTR_BUFFER);
+	b->boot_dir = options->boot_dir ? strdup (options->boot_dir) : find_boot_dir (options->root_dir);
+	if (b->boot_dir && stat (b->boot_dir, &st) == 0)
+	{
+		b->boot_dev = st.st_dev;
+		b->boot_ino = st.st_ino;
+	}
+	if (b->boot_dir == NULL || scan_tree (b, &b->boot, b->boot_dir, 1))
+	{
+		build_free (b);
+		return NULL;
+	}
+	if (scan_tree (b, &b->root, options->root_dir, 0) || layout_fat (b) || layout_ext4 (b))
+	{
+		build_free (b);
+		return NULL;
+	}
+	b->boot_start = ALIGN_SECTORS;
+	b->root_start = b->boot_start + b->boot_sectors;
+	b->root_sectors = b->blocks * (BLOCK / SECTOR);
+	return b;
+}
+
+long long int build_size (const build_image *b)
+{
+	return (b->root_start + b->root_sectors) * SECTOR;
+}
+
+void build_totals (const build_image *b, long long int *bytes, long long int *files)
+{
+	const build_tree *trees[2] = { &b->boot, &b->root };
+	long long int i;
+	int k;
+
+	*bytes = *files = 0;
+	for (k = 0; k < 2; k++)
+		for (i = 0; i < trees[k]->count; i++)
+		{
+			if (!S_ISREG (trees[k]->entries[i].mode)) continue;
+			(*files)++;
+			if (trees[k]->entries[i].link < 0) *bytes += k ? file_bytes (b, &trees[k]->entries[i]) : trees[k]->entries[i].size;
+		}
+}
+
+long long int build_write (build_image *b, const char *path, copy_stats *stats)
+{
+	const build_tree *trees[2] = { &b->boot, &b->root };
+	const build_entry *e;
+	unsigned char mbr[SECTOR];
+	copy_stats local;
+	batch_writer w;
+	build_ctx ctx;
+	pthread_t *threads;
+	long long int i;
+	int k, n;
+
+	if (stats == NULL)
+	{
+		memset (&local, 0, sizeof (local));
+		stats = &local;
+	}
+	stats->errors += b->errors;
+	stats->excluded += b->excluded;
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.b = b;
+	ctx.stats = stats;
+	ctx.fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (ctx.fd < 0 || ftruncate (ctx.fd, build_size (b)))
+	{
+		fprintf (stderr, "Could not create %s: %s\n", path, strerror (errno));
+		if (ctx.fd >= 0) close (ctx.fd);
+		return -1;
+	}
+
+	// the files with data in the order of their place in the image, the others are done
+	ctx.jobs = malloc ((b->boot.count + b->root.count) * sizeof (build_job));
+	for (k = 0; k < 2; k++)
+		for (i = 0; i < trees[k]->count; i++)
+		{
+			e = &trees[k]->entries[i];
+			if (S_ISDIR (e->mode)) count (&stats->dirs, 1);
+			else if (!S_ISREG (e->mode)) count (&stats->others, 1);
+			else if (e->runs == 0 || e->link >= 0) count (&stats->files, 1);
+			else
+			{
+				ctx.jobs[ctx.njobs].fat = k == 0;
+				ctx.jobs[ctx.njobs++].entry = i;
+			}
+		}
+	n = b->opts.threads > 0 ? b->opts.threads : copy_default_threads ();
+	if (n > ctx.njobs) n = ctx.njobs > 0 ? ctx.njobs : 1;
+	threads = malloc (n * sizeof (pthread_t));
+	for (k = 0; k < n; k++) pthread_create (&threads[k], NULL, (void *(*) (void *)) build_worker, &ctx);
+	for (k = 0; k < n; k++) pthread_join (threads[k], NULL);
+	free (threads);
+	free (ctx.jobs);
+
+	memset (&w, 0, sizeof (w));
+	w.fd = ctx.fd;
+	w.stats = stats;
+	w.buffer = malloc (WRITE_BATCH);
+	fat_write (b, &w);
+	ext_write (b, &w);
+	batch_flush (&w);
+	free (w.buffer);
+
+	// the partition table last, an image without it is not mistaken for a finished one
+	memset (mbr, 0, SECTOR);
+	put32 (mbr + 0x1B8, strtoul (b->disk_id, NULL, 16));
+	mbr_entry (mbr + 0x1BE, 0x0C, b->boot_start, b->boot_sectors);
+	mbr_entry (mbr + 0x1CE, 0x83, b->root_start, b->root_sectors);
+	mbr[510] = 0x55;
+	mbr[511] = 0xAA;
+	if (w.failed || fdatasync (ctx.fd) || pwrite_all (ctx.fd, (char *) mbr, SECTOR, 0) || fdatasync (ctx.fd))
+	{
+		if (!w.failed) fprintf (stderr, "Could not write the image: %s\n", strerror (errno));
+		close (ctx.fd);
+		return -1;
+	}
+	if (close (ctx.fd))
+	{
+		fprintf (stderr, "Could not write the image: %s\n", strerror (errno));
+		return -1;
+	}
+	return stats->errors;
+}
+
+static void free_tree (build_tree *t)
+{
+	long long int i;
+
+	for (i = 0; i < t->count; i++)
+	{
+		free (t->entries[i].name);
+		free (t->entries[i].target);
+		free (t->entries[i].xattr);
+	}
+	free (t->entries);
+	free (t->dir);
+}
+
+void build_free (build_image *b)
+{
+	if (b == NULL) return;
+	free_tree (&b->boot);
+	free_tree (&b->root);
+	free (b->runs);
+	free (b->ranges);
+	free (b->boot_dir);
+	free (b->xattr_list);
+	free (b->xattr_value);
+	free (b->block_bitmap);
+	free (b->inode_bitmap);
+	free (b->inode_table);
+	free (b->used);
+	free (b);
+}
@@ -0,0 +1,69 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+imgbuild: writes an image with a FAT32 boot partition and an ext4 root
+partition straight from two directory trees, like mke2fs -d, without a loop
+device, parted, mkfs or mounts, so the image side needs no root.
+
+The trees are read first, the names, attributes, link targets and extended
+attributes of all entries are kept in memory and both file systems are laid
+out before a byte is written: the metadata at the start of each partition,
+the directories after it, then the data of each file in one contiguous run in
+the order the files were found. The copy threads read the files and write
+their data to its place in the image file, blocks of zeros stay holes. The
+metadata is built in memory and written in large runs at the end, the MBR
+last, so an interrupted build leaves no valid image.
+
+The ext4 file system has 4k blocks, 256 byte inodes with nanosecond times,
+extents, a journal and the flex_bg and meta_bg layouts: all bitmaps and inode
+tables follow the superblock, and resize2fs can grow it on a larger card
+without reserved descriptor blocks. Holes of sparse files get no blocks.
+Extended attributes and ACLs are stored in the inode when they fit. The FAT32 file system has long file names.
+Entries are read like cp -ax: directories on other file systems are created
+empty, symlinks, device nodes and hard links are kept on ext4 and skipped on
+FAT.
+*/
+
+#ifndef IMGBUILD_H
+#define IMGBUILD_H
+
+#include "copytree.h"
+#include "exclude.h"
+
+typedef struct
+{
+	const char *root_dir;           /* tree of the ext4 partition */
+	const char *boot_dir;           /* tree of the FAT32 partition, NULL for a file system mounted on boot/firmware or boot of root_dir */
+	long long int boot_size;        /* bytes of the FAT32 partition, 0 for the size of the file system mounted on boot_dir or what its files need */
+	long long int extra_space;      /* free bytes in the ext4 file system */
+	const char *disk_id;            /* 8 hex digits, NULL for a random one */
+	const char *boot_label;         /* NULL for bootfs */
+	const char *root_label;         /* NULL for rootfs */
+	int threads;                    /* copy threads, 0 for default */
+	const exclude_rules *exclude;   /* entries that are not copied, may be NULL */
+} build_options;
+
+typedef struct build_image build_image;
+
+/* build_scan
+   Reads both trees and lays out the image
+	@return the layout or NULL with a message
+*/
+build_image *build_scan (const build_options *options);
+
+/* size of the image file in bytes */
+long long int build_size (const build_image *b);
+
+/* bytes and number of the files whose data is copied */
+void build_totals (const build_image *b, long long int *bytes, long long int *files);
+
+/* build_write
+   Writes the image, an existing file is replaced
+	@param stats counters updated during the copy, may be NULL
+	@return 0 on success, the number of entries that could not be copied, -1 with a message if the image could not be written
+*/
+long long int build_write (build_image *b, const char *path, copy_stats *stats);
+
+void build_free (build_image *b);
+
+#endif
@@ -29,6 +29,8 @@ https://github.com/tom-2015/imgclone.git
 
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,33 +41,45 @@ https://github.com/tom-2015/imgclone.git
 #include <pthread.h>
 #include <unistd.h>
 
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
+
+#include "copytree.h"
+#include "sink.h"
+#include "chunkstore.h"
+#include "blockcopy.h"
+#include "probe.h"
+#include "progress.h"
+#include "stats.h"
+#include "ioengine.h"
+#include "throttle.h"
+#include "checkpoint.h"
+#include "verify.h"
+#include "restore.h"
+#include "extract.h"
+#include "fleet.h"
+#include "exclude.h"
+#include "imgbuild.h"
+
 /*---------------------------------------------------------------------------*/
 /* Variable and macro definitions */
 /*---------------------------------------------------------------------------*/
 
-/* struct to store partition data */
-
-#define MAXPART 9
-
-typedef struct
-{
-    int pnum;
-    long long int start;
-    long long int end;
-    char ptype[10];
-    char ftype[20];
-    char flags[10];
-} partition_t;
-
 typedef struct
 {
 	char * src;
 	char * dst;
+	copy_options options;
+	copy_stats * stats;
+	long long int errors;
 } copy_args;
 
-partition_t parts[MAXPART];
 
-volatile char copying=0;
 
 /*---------------------------------------------------------------------------*/
 /* System helpers */
@@ -107,13 +121,13 @@ static int get_string (char *cmd, char *name)
 
 static int sys_printf (const char * format, ...)
 {
-    char buffer[256];
+    char buffer[1024];
 	char output[256];
     va_list args;
     FILE *fp;
 
     va_start (args, format);
-    vsprintf (buffer, format, args);
+    vsnprintf (buffer, sizeof (buffer), format, args);
 	printf ("%s\n",buffer);
     fp = popen (buffer, "r");
 	while (fgets(output, sizeof(output), fp) != NULL) {
@@ -151,173 +165,468 @@ static void escape_shell_arg(char * dst_buffer, const char * src_buffer){
 }
 
 void * copy_thread_func(copy_args * src_dst){
-	copying=1;
-	sys_printf ("cp -ax %s/. %s/.", src_dst->src, src_dst->dst);
-	copying=0;
+	src_dst->errors = copy_tree (src_dst->src, src_dst->dst, &src_dst->options, src_dst->stats);
 	return NULL;
 }
 
-/* clone_to_img
-   This function starts clone to img file
-	@param src_dev the source device to clone
-	@param dst_file the destination disk file to clone to (.IMG)
-	@param new_uuid if 1, new uuid will be generated for destination
-	@param extra_space add extra free space to the image file for future expansion
-	@param show_progress if 1 will show copy progress
-	@param compress if 1 will run bzip2 command to compress image when finished, 2 will run gzip to compress
-*/
-int clone_to_img (char * src_dev, char * dst_file, char new_uuid, long long int extra_space, char show_progress, char compress)
+typedef struct
 {
-    char buffer[1024], res[256], dev[16], uuid[64], puuid[64], npuuid[64], dst_dev[64], src_mnt[64], dst_mnt[64], dst_file_escaped[512];
-    int n, p, lbl, uid, puid;
-    long long int srcsz, dstsz, stime, total_blocks=0, blocks_available=0, file_size_needed=0,available_free_space=0;
-    double prog;
-    FILE *fp;
-	
-	escape_shell_arg(dst_file_escaped, dst_file);
+	img_sink * sink;
+	int fd;
+	long long int from;
+	long long int to;
+	int result;
+} drain_args;
+
+void * drain_thread_func(drain_args * drain){
+	drain->result = sink_drain (drain->sink, drain->fd, drain->from, drain->to);
+	return NULL;
+}
 
-    // get a new partition UUID
-    get_string ("uuid | cut -f1 -d-", npuuid);
+/* Waits for the running drain and starts draining the image up to byte to in the background, to 0 only waits */
 
-    // check the source has an msdos partition table
-    sprintf (buffer, "parted %s unit s print | tail -n +4 | head -n 1", src_dev);
-    fp = popen (buffer, "r");
-    if (fp == NULL) return 1;
-    if (fgets (buffer, sizeof (buffer) - 1, fp) == NULL)
-    {
-        pclose (fp);
-        fprintf(stderr,"Unable to read source.\n");
-        return 2;
-    }
-    pclose (fp);
-    if (strncmp (buffer, "Partition Table: msdos", 22))
-    {
-        fprintf(stderr,"Non-MSDOS partition table on source.\n");
-        return 3;
-    }
-    
-    // prepare temp mount points
-    get_string ("mktemp -d", src_mnt);
-    get_string ("mktemp -d", dst_mnt);
+static int start_drain (drain_args *drain, pthread_t *thread, int *running, long long int to)
+{
+	if (*running)
+	{
+		pthread_join (*thread, NULL);
+		*running = 0;
+		if (drain->result) return drain->result;
+	}
+	if (to <= drain->to) return 0;
+	drain->from = drain->to;
+	drain->to = to;
+	if (pthread_create (thread, NULL, (void* (*)(void*)) &drain_thread_func, drain))
+	{
+		// no thread, drain in the foreground
+		drain_thread_func (drain);
+		return drain->result;
+	}
+	*running = 1;
+	return 0;
+}
 
-	printf ("-----------------------------------------------\n");
-	printf ("----    READING PARTITIONS               ------\n");
-	printf ("-----------------------------------------------\n");
-	
-    // read in the source partition table
-    n = 0;
-    sprintf (buffer, "parted %s unit s print | sed '/^ /!d'", src_dev);
-    fp = popen (buffer, "r");
-    if (fp != NULL)
-    {
-        while (1)
-        {
-            if (fgets (buffer, sizeof (buffer) - 1, fp) == NULL) break;
-            if (n >= MAXPART)
-            {
-                pclose (fp);
-                fprintf(stderr,"Too many partitions on source.\n");
-                return 4;
-            }
-            
-			sscanf (buffer, "%d %llds %llds %*ds %s %s %s", &(parts[n].pnum), &(parts[n].start),
-                &(parts[n].end), (char *) &(parts[n].ptype), (char *) &(parts[n].ftype), (char *) &(parts[n].flags));
+typedef struct
+{
+	partition_t * parts;
+	char * dst_dev;
+	int n;
+	long long int inodes;
+	unsigned long long int keep;    /* bit n is set if partition n already has its files, it is not formatted */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int formatted;                  /* partitions formatted, in order */
+	int result;
+	int running;
+	int stop;                       /* set on an error, the partitions that are not started yet are not formatted */
+} format_args;
+
+static int format_partition (partition_t * parts, char * dst_dev, int p, int n, long long int inodes);
+
+/* formats the partitions one by one while the copy loop works on the previous ones */
+
+void * format_thread_func(format_args * format){
+	int p, result = 0;
+
+	for (p = 0; p < format->n && !result; p++){
+		pthread_mutex_lock (&format->lock);
+		if (format->stop) result = -1;
+		pthread_mutex_unlock (&format->lock);
+		if (!result && strcmp (format->parts[p].ptype, "extended") && !(format->keep & (1ULL << format->parts[p].pnum))) result = format_partition (format->parts, format->dst_dev, p, format->n, format->inodes);
+		pthread_mutex_lock (&format->lock);
+		format->result = result;
+		format->formatted = p + 1;
+		pthread_cond_broadcast (&format->cond);
+		pthread_mutex_unlock (&format->lock);
+	}
+	return NULL;
+}
 
-			printf("Partition %d start: %lld end: %lld ptype:%s ftype:%s flags: %s\n.", n+1, parts[n].start, parts[n].end, parts[n].ptype, parts[n].ftype, parts[n].flags);			
-            n++;
-			
-        }
-        pclose (fp);
-    }
+static int start_format (format_args *format, pthread_t *thread, partition_t * parts, char * dst_dev, int n, long long int inodes, unsigned long long int keep)
+{
+	format->parts = parts;
+	format->dst_dev = dst_dev;
+	format->n = n;
+	format->inodes = inodes;
+	format->keep = keep;
+	format->formatted = 0;
+	format->result = 0;
+	format->running = 0;
+	format->stop = 0;
+	pthread_mutex_init (&format->lock, NULL);
+	pthread_cond_init (&format->cond, NULL);
+	if (pthread_create (thread, NULL, (void* (*)(void*)) &format_thread_func, format))
+	{
+		// no thread, format everything in the foreground
+		format_thread_func (format);
+		return format->result;
+	}
+	format->running = 1;
+	return 0;
+}
 
-	//get the needed size of the destination image_file
-	//this is the start of the last partition + used space on last partition
-	
-	// belt-and-braces call to partprobe to make sure devices are found...
-	get_string ("partprobe", res);
-	
-	file_size_needed=parts[n-1].start*(long long int)512; //need at least the start of last partition as image size (blocks * block_size) in bytes
-	printf("Last partition starts at %lld bytes.\n", file_size_needed);
-	
-	//mount last partition to get used disk space
-	if (sys_printf ("mount %s%d %s", partition_name (src_dev, dev), parts[n-1].pnum, src_mnt))
+/* Waits until partition p has its file system */
+
+static int wait_format (format_args *format, int p)
+{
+	int result;
+
+	pthread_mutex_lock (&format->lock);
+	while (format->formatted <= p && !format->result) pthread_cond_wait (&format->cond, &format->lock);
+	result = format->result;
+	pthread_mutex_unlock (&format->lock);
+	return result;
+}
+
+/* The image is final up to the start of the first partition that still has to be copied */
+
+static long long int copied_until (partition_t * parts, int n, int p, long long int image_size)
+{
+	long long int until = image_size;
+	int q;
+
+	for (q = p + 1; q < n; q++)
 	{
-		fprintf(stderr,"Could not mount partition %s\n", partition_name (src_dev, dev));
-		return 5;
+		if (strcmp (parts[q].ptype, "extended") && parts[q].start * 512 < until) until = parts[q].start * 512;
 	}
+	return until;
+}
 
-	sprintf (buffer, "df %s | tail -n 1 | tr -s \" \" \" \" | cut -d ' ' -f 2", src_mnt);
-	get_string (buffer, res);
-	sscanf (res, "%lld", &total_blocks);
-	sprintf (buffer, "df %s | tail -n 1 | tr -s \" \" \" \" | cut -d ' ' -f 4", src_mnt);
-	get_string (buffer, res);
-	sscanf (res, "%lld", &blocks_available);
-	
-	long long int partition_size_used = (total_blocks - blocks_available) * 1024; //blocks used reported by df is not including all reserved space for filesystem, seems better to take the blocks available
-	printf("Used size of last partition %s is %lld bytes.\n", src_mnt, partition_size_used);
-	
-	if (sys_printf ("umount %s", src_mnt))
+/* Flush the kernel buffers of a partition device so its data is in the image file */
+
+static void sync_device (char *dev, int pnum)
+{
+	char path[80];
+	int fd;
+
+	sprintf (path, "%s%d", dev, pnum);
+	fd = open (path, O_RDONLY);
+	if (fd >= 0)
 	{
-		fputs("Could not unmount partition.\n",stderr);
-		return 6;
+		fsync (fd);
+		close (fd);
 	}
-	
-	file_size_needed+=partition_size_used;
-	file_size_needed+=file_size_needed*(long long int)2/(long long int)100; //add 2% extra space
-	file_size_needed+=extra_space; //add extra free space if required
-	if ((file_size_needed%512)!=0)	file_size_needed+=(long long int)(512-(file_size_needed%512)); //align at 512 byte block size
-	printf("Required size for destination image: %lld bytes\n", file_size_needed);
+}
 
-	printf ("-----------------------------------------------\n");
-	printf ("----    ALLOCATING SPACE FOR .IMG FILE   ------\n");
-	printf ("-----------------------------------------------\n");
-	
-	//create file
-	if (sys_printf("touch \"%s\"", dst_file_escaped)){
-		fprintf(stderr,"Could not create destination file %s.\n", dst_file);
-		return 24;
+/* Discard the free blocks of a mounted file system, on a loop device this punches them out of the image file */
+
+static void trim_mount (char *mnt)
+{
+	struct fstrim_range range;
+	int fd;
+
+	memset (&range, 0, sizeof (range));
+	range.len = ULLONG_MAX;
+	fd = open (mnt, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) return;
+	if (ioctl (fd, FITRIM, &range) == 0) printf ("Released %llu bytes of free space from the image.\n", (unsigned long long) range.len);
+	close (fd);
+}
+
+/* Leave what the exclude rules skip out of the used space of the file system mounted on mnt */
+
+static void exclude_space (const exclude_rules *exclude, char *mnt, fs_space *space)
+{
+	long long int bytes, files;
+
+	if (exclude == NULL) return;
+	exclude_measure (exclude, mnt, &bytes, &files);
+	if (files == 0) return;
+	printf ("%lld bytes in %lld inodes of %s are excluded.\n", bytes, files, mnt);
+	space->used = space->used > bytes ? space->used - bytes : 0;
+	space->files = space->files > files ? space->files - files : 0;
+}
+
+/* shrink_last_partition
+   Shrinks the unmounted ext file system of the last partition to its minimum size plus extra_space,
+   ends the partition with it and returns the new size of the image in bytes, -1 on error
+	@param dst_dev loop device of the image
+	@param p index of the last partition in parts
+*/
+
+static long long int shrink_last_partition (partition_t * parts, char * dst_dev, int p, long long int extra_space)
+{
+	char dev[64], part[80];
+	long long int size;
+	int fd, res;
+
+	sprintf (part, "%s%d", partition_name (dst_dev, dev), parts[p].pnum);
+	// resize2fs only works on a file system that was checked, e2fsck returns 1 or 2 if it fixed something
+	res = sys_printf ("e2fsck -f -y %s", part);
+	if (!WIFEXITED (res) || WEXITSTATUS (res) >= 4 || sys_printf ("resize2fs -M %s", part)) return -1;
+
+	fd = open (part, O_RDONLY);
+	if (fd < 0) return -1;
+	size = probe_filesystem_size (fd, 0);
+	close (fd);
+	if (size <= 0) return -1;
+	if (extra_space > 0)
+	{
+		size += extra_space;
+		size -= size % 4096;
+		if (sys_printf ("resize2fs %s %lldK", part, size / 1024)) return -1;
 	}
+	printf ("Shrunk partition %d to %lld bytes.\n", parts[p].pnum, size);
 
-	//check if file is on a different disk device
-	sprintf (buffer, "df \"%s\" | tail -n 1 | tr -s \" \" \" \" | cut -d ' ' -f 1", dst_file_escaped);
-	get_string (buffer, res);	
-	printf("%s\n", res);
-	if (strncmp(src_dev, buffer, strlen(src_dev))==0){
-		fprintf(stderr, "Destination file is located on the disk to clone. Destination file must be on external drive.\n");
-		return 25;
+	parts[p].end = parts[p].start + size / 512 - 1;
+	if (probe_set_partition_end (dst_dev, parts[p].pnum, parts[p].end)) return -1;
+	return (parts[p].end + 1) * 512;
+}
+
+/* removes the lists of the rescans of a partition, also the unfinished ones */
+
+static void reconcile_cleanup (copy_args * src_dst, char * dst_file)
+{
+	const char * suffix[] = {".pass", ".pass.tmp", ".changed", ".changed.tmp"};
+	char path[1024];
+	int i;
+
+	manifest_free (src_dst->options.base);
+	if (src_dst->options.record) manifest_close (src_dst->options.record);
+	if (src_dst->options.changed) manifest_close (src_dst->options.changed);
+	src_dst->options.base = NULL;
+	src_dst->options.record = NULL;
+	src_dst->options.changed = NULL;
+	for (i = 0; i < 4; i++)
+		if (snprintf (path, sizeof (path), "%s%s", dst_file, suffix[i]) < (int) sizeof (path)) unlink (path);
+}
+
+/* reconcile
+   Rescans a copied partition and copies what changed during the copy again, until nothing changes,
+   the number of changes stops going down or passes rescans are done. Entries that still changed in
+   the last rescan are reported.
+	@param src_dst the partition copy, pass_file (<dst_file>.pass) holds the list of the first copy
+	@param manifest_out receives the list of the partition after the last rescan
+	@return number of entries that changed in the last rescan, -1 on error
+*/
+
+static long long int reconcile (copy_args * src_dst, int pnum, char * dst_file, int passes, manifest_writer * manifest_out)
+{
+	char pass_file[1024], changed_file[1024];
+	long long int n = 0, last = -1, i;
+	struct timespec start, end;
+	manifest * m;
+	int pass;
+
+	sprintf (pass_file, "%s.pass", dst_file);
+	sprintf (changed_file, "%s.changed", dst_file);
+	for (pass = 1; pass <= passes; pass++)
+	{
+		// the list of the previous pass is the base, so only what changed since then is copied
+		src_dst->options.base = manifest_load (pass_file, pnum);
+		src_dst->options.record = manifest_create (pass_file);
+		src_dst->options.changed = manifest_create (changed_file);
+		if (src_dst->options.base == NULL || src_dst->options.record == NULL || src_dst->options.changed == NULL)
+		{
+			reconcile_cleanup (src_dst, dst_file);
+			return -1;
+		}
+		manifest_partition (src_dst->options.record, pnum);
+		manifest_partition (src_dst->options.changed, pnum);
+		memset (src_dst->stats, 0, sizeof (copy_stats));
+
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		copy_thread_func (src_dst);
+		clock_gettime (CLOCK_MONOTONIC, &end);
+		manifest_free (src_dst->options.base);
+		src_dst->options.base = NULL;
+		n = manifest_close (src_dst->options.record) | manifest_close (src_dst->options.changed);
+		src_dst->options.record = NULL;
+		src_dst->options.changed = NULL;
+		if (n)
+		{
+			reconcile_cleanup (src_dst, dst_file);
+			return -1;
+		}
+
+		n = src_dst->stats->files + src_dst->stats->others + src_dst->stats->deleted;
+		printf ("Rescan %d: %lld entries changed and %lld deleted during the previous pass, %lld bytes copied again in %.1f s.\n",
+			pass, src_dst->stats->files + src_dst->stats->others, src_dst->stats->deleted, src_dst->stats->bytes,
+			end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9);
+		// files that are written all the time change in every pass
+		if (n == 0 || (last >= 0 && n >= last)) break;
+		last = n;
 	}
-	
-	//check if there is enough space on the destination disk
-	sprintf (buffer, "df --output=avail -B 1 \"%s\" | tail -n 1", dst_file_escaped);
-	get_string (buffer, res);
-	printf("%s\n", res);
-	sscanf (res, "%lld", &available_free_space);
-	if (available_free_space < file_size_needed){
-		//sys_printf("rm %s", dst_file);
-		fprintf(stderr, "Not enough free space to create destination image file %lld free, required %lld bytes.\n", available_free_space, file_size_needed);
-		return 26;
+
+	if (n > 0)
+	{
+		m = manifest_load (changed_file, pnum);
+		fprintf (stderr, "Warning: %lld entries of partition %d were still changing, they may be inconsistent in the image:\n", n, pnum);
+		for (i = 0; m && i < m->count && i < 20; i++) fprintf (stderr, "  %s\n", m->entries[i].path);
+		if (m && m->count > 20) fprintf (stderr, "  and %lld more\n", m->count - 20);
+		if (m) manifest_free (m);
 	}
-	
-	//make file size big enough
-	if (sys_printf("truncate --size %lld \"%s\"", file_size_needed, dst_file_escaped)){
-		fprintf(stderr,"Could not create file large enough on destination disk.\n");
-		return 23;
+	unlink (changed_file);
+
+	m = manifest_load (pass_file, pnum);
+	if (m == NULL)
+	{
+		reconcile_cleanup (src_dst, dst_file);
+		return -1;
 	}
+	for (i = 0; i < m->count; i++) manifest_add_entry (manifest_out, &m->entries[i]);
+	manifest_free (m);
+	unlink (pass_file);
+	return n;
+}
 
-	printf ("-----------------------------------------------\n");
-	printf ("----  CREATING DISK DEVICE FOR .IMG FILE ------\n");
-	printf ("-----------------------------------------------\n");
-	
-	//create device, returns the /dev/loopX interface, which is dst_dev
-	sprintf(buffer, "losetup --show -f \"%s\"", dst_file_escaped);
-	get_string(buffer, dst_dev);
-	
-	//printf("Unmounting partitions on target\n");
-    // unmount any partitions on the target device
-    //for (n = 9; n >= 1; n--)
-    //{
-    //    sys_printf ("umount %s%d", partition_name (dst_dev, dev), n);
-    //}
+/* verify_partitions
+   Mounts every partition of the source and the image, the image read-only, and compares their files,
+   the image side is listed in <dst_file>.verify, which is signed in <dst_file>.verify.sig
+	@param since start of the backup, entries that changed on the source later are not counted as differences
+	@param ignore files that were changed in the image on purpose, NULL terminated
+	@param key_file secret key for a HMAC-SHA256 signature, NULL for a SHA-256
+	@param exclude entries of the source that were not copied, may be NULL
+	@return number of differences and unreadable entries, -1 on error
+*/
+
+static long long int verify_partitions (partition_t * parts, char * src_dev, char * dst_dev, int n, char * src_mnt, char * dst_mnt, char * dst_file, int threads,
+	time_t since, const char ** ignore, char * key_file, const exclude_rules * exclude, char show_progress, int progress_fd)
+{
+	char dev[64], verify_file[1024];
+	long long int result = 0;
+	verify_options options;
+	verify_stats stats;
+	progress verify_progress;
+	struct timespec start, end;
+	int p;
+
+	sprintf (verify_file, "%s.verify", dst_file);
+	options.threads = threads;
+	options.since = since;
+	options.ignore = ignore;
+	options.exclude = exclude;
+	options.record = manifest_create (verify_file);
+	if (options.record == NULL) return -1;
+
+	for (p = 0; p < n; p++)
+	{
+		if (!strcmp (parts[p].ptype, "extended")) continue;
+		if (sys_printf ("mount -o ro %s%d %s", partition_name (dst_dev, dev), parts[p].pnum, dst_mnt)) return -1;
+		// a second read-only mount of a mounted file system is refused, the source is mounted like for the copy
+		if (sys_printf ("mount %s%d %s", partition_name (src_dev, dev), parts[p].pnum, src_mnt))
+		{
+			sys_printf ("umount %s", dst_mnt);
+			return -1;
+		}
+
+		// FAT has no owners, modes or exact times to compare
+		options.metadata = strncmp (parts[p].ftype, "fat", 3) != 0;
+		manifest_partition (options.record, parts[p].pnum);
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		progress_start (&verify_progress, "verify", parts[p].pnum, &stats.bytes, &stats.files, 0, 0, show_progress, progress_fd);
+		result += verify_tree (src_mnt, dst_mnt, &options, &stats);
+		progress_finish (&verify_progress);
+		clock_gettime (CLOCK_MONOTONIC, &end);
+		printf ("Partition %d: %lld entries and %lld files with %lld bytes compared in %.1f s, %lld differ, %lld changed on the source during the backup.\n",
+			parts[p].pnum, stats.entries, stats.files, stats.bytes, end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9,
+			stats.mismatches, stats.changed);
+
+		sys_printf ("umount %s", src_mnt);
+		sys_printf ("umount %s", dst_mnt);
+	}
+
+	if (manifest_close (options.record) || verify_sign (verify_file, key_file))
+	{
+		fprintf(stderr,"Could not write %s.\n", verify_file);
+		return -1;
+	}
+	printf ("File list of the image written to %s, %s signature in %s.sig.\n", verify_file, key_file ? "HMAC-SHA256" : "SHA-256", verify_file);
+	return result;
+}
+
+/* Read the partition table of a device, returns the number of partitions, -1 if there are too many or -2/-3 if it can't be read */
+
+static int read_partition_table (char * device, partition_t * table, char * disk_id)
+{
+    int p, n;
+
+    n = probe_partition_table (device, table, disk_id);
+    for (p = 0; p < n; p++)
+    {
+        printf("Partition %d start: %lld end: %lld ptype:%s ftype:%s flags:%s uuid:%s label:%s\n", table[p].pnum, table[p].start, table[p].end, table[p].ptype, table[p].ftype, table[p].flags, table[p].uuid, table[p].label);
+    }
+    return n;
+}
+
+/* An incremental or resumed backup can only update an image that has the same partitions as the source, disk_id receives its disk identifier if not NULL */
+
+static int check_base_partitions (partition_t * parts, char * dst_dev, int n, char * disk_id)
+{
+    partition_t base[MAXPART];
+    int p;
+
+    if (read_partition_table (dst_dev, base, disk_id) != n)
+    {
+        fprintf(stderr,"The image has a different number of partitions than the source, make a full backup.\n");
+        return 32;
+    }
+    for (p = 0; p < n; p++)
+    {
+        // the last partition fills the image, its end can differ
+        if (base[p].pnum != parts[p].pnum || base[p].start != parts[p].start || strcmp (base[p].ptype, parts[p].ptype) ||
+            (p < n - 1 && base[p].end != parts[p].end))
+        {
+            fprintf(stderr,"Partition %d of the image does not match the source, make a full backup.\n", parts[p].pnum);
+            return 33;
+        }
+    }
+    return 0;
+}
+
+/* Copy the base image to the new image file, keeping holes; copy_file_range lets the file system share or copy server side */
+
+static int clone_base_image (char * base_file, char * dst_file)
+{
+    int in, out, res = 0;
+    long long int size, pos, data, hole;
+    loff_t off_in, off_out;
+    ssize_t len;
+
+    in = open (base_file, O_RDONLY);
+    if (in < 0) return 1;
+    out = open (dst_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        close (in);
+        return 1;
+    }
+    size = lseek (in, 0, SEEK_END);
+    if (ftruncate (out, size)) res = 1;
+    for (pos = 0; pos < size && !res; pos = hole)
+    {
+        data = lseek (in, pos, SEEK_DATA);
+        if (data < 0) break;
+        hole = lseek (in, data, SEEK_HOLE);
+        if (hole < 0) hole = size;
+        off_in = off_out = data;
+        while (off_in < hole)
+        {
+            len = copy_file_range (in, &off_in, out, &off_out, hole - off_in, 0);
+            if (len <= 0)
+            {
+                res = 1;
+                break;
+            }
+        }
+    }
+    close (in);
+    if (close (out)) res = 1;
+    return res;
+}
+
+/* create_partitions
+   Writes a new partition table on the destination device with the same partitions as parts[], format_partition creates the file systems
+	@param dst_dev the destination device
+	@param n number of partitions in parts[]
+	@param new_uuid if 1, npuuid will be used as partition UUID
+	@param npuuid new partition UUID
+	@param puuid the partition UUID (disk identifier) of the source, "" if it has none
+*/
+static int create_partitions (partition_t * parts, char * dst_dev, int n, char new_uuid, char * npuuid, char * puuid)
+{
+    char buffer[1024];
+    int p;
 
     // wipe the FAT on the target
     if (sys_printf ("dd if=/dev/zero of=%s bs=512 count=1", dst_dev))
@@ -326,254 +635,994 @@ int clone_to_img (char * src_dev, char * dst_file, char new_uuid, long long int
         return 7;
     }
 	
-	printf("Creating FAT on %s.\n", dst_dev);	
-    
-	// prepare the new FAT
-    if (sys_printf ("parted -s %s mklabel msdos", dst_dev))
-    {
-        fprintf(stderr,"Could not create FAT.\n");
-        return 8;
-    }	
-	
+	stats_phase ("creating partitions");
 	printf ("-----------------------------------------------\n");
 	printf ("----    CREATING PARTITIONS PLEASE WAIT  ------\n");
 	printf ("-----------------------------------------------\n");
 	
-    // recreate the partitions on the target
+    // one parted run for the table, the partitions and their flags, so the kernel table is updated once
+    sprintf (buffer, "parted -s %s -- mklabel msdos", dst_dev);
     for (p = 0; p < n; p++)
     {
-        // create the partition
         if (!strcmp (parts[p].ptype, "extended"))
-        {
-            if (sys_printf ("parted -s %s -- mkpart extended %llds -1s", dst_dev, parts[p].start))
-            {
-                fprintf(stderr,"Could not create partition.\n");
-                return 9;
-            }
-        }
+            sprintf (buffer + strlen (buffer), " mkpart extended %llds -1s", parts[p].start);
+        else if (p == n - 1)
+            sprintf (buffer + strlen (buffer), " mkpart %s %s %llds -1s", parts[p].ptype, parts[p].ftype, parts[p].start);
         else
+            sprintf (buffer + strlen (buffer), " mkpart %s %s %llds %llds", parts[p].ptype, parts[p].ftype, parts[p].start, parts[p].end);
+    }
+    for (p = 0; p < n; p++)
+    {
+        sprintf (buffer + strlen (buffer), " set %d lba %s", parts[p].pnum, strcmp (parts[p].flags, "lba") ? "off" : "on");
+    }
+    if (sys_printf ("%s", buffer))
+    {
+        fprintf(stderr,"Could not create partitions.\n");
+        return 9;
+    }
+
+    // refresh the kernel partition table once for all partitions
+    if (probe_reread (dst_dev)) sys_printf ("partprobe %s", dst_dev);
+
+    // write the partition UUID last, parted rewrites the MBR, PARTUUID=<disk id>-<partition number> in fstab and cmdline.txt
+    if (strlen (puuid) && probe_set_disk_id (dst_dev, new_uuid ? npuuid : puuid))
+    {
+        fprintf(stderr,"Could not write the disk identifier to %s.\n", dst_dev);
+    }
+
+    return 0;
+}
+
+/* format_partition
+   Creates the file system of partition p with the UUID and label of the source
+	@param n number of partitions, the last ext4 one gets inodes inodes
+	@param inodes number of inodes of the last ext4 file system, 0 for the mkfs default
+	@return 0 on success or the exit code of imgclone
+*/
+static int format_partition (partition_t * parts, char * dst_dev, int p, int n, long long int inodes)
+{
+    char buffer[1024], dev[16], uuid[64], label[64];
+    int uid;
+
+    // the UUID and label were read from the source file systems by read_partition_table
+    strcpy (uuid, parts[p].uuid);
+    uid = strlen (uuid) > 0;
+    if (uid && strlen (uuid) == 9)
+    {
+        // remove the hyphen from the middle of a FAT volume ID
+        memmove (uuid + 4, uuid + 5, 5);
+    }
+    escape_shell_arg (label, parts[p].label);
+
+    // create file systems
+    if (!strncmp (parts[p].ftype, "fat", 3))
+    {
+        if (uid) sprintf (buffer, "mkfs.fat -F 32 -i %s %s%d", uuid, partition_name (dst_dev, dev), parts[p].pnum);
+        else sprintf (buffer, "mkfs.fat -F 32 %s%d", partition_name (dst_dev, dev), parts[p].pnum);
+        if (strlen (label)) sprintf (buffer + strlen (buffer), " -n \"%s\"", label);
+
+        if (sys_printf ("%s", buffer))
         {
-            if (p == (n - 1))
+            if (uid)
             {
-                if (sys_printf ("parted -s %s -- mkpart %s %s %llds -1s", dst_dev,
-                    parts[p].ptype, parts[p].ftype, parts[p].start))
+                // second try just in case the only problem was a corrupt UUID
+                sprintf (buffer, "mkfs.fat -F 32 %s%d", partition_name (dst_dev, dev), parts[p].pnum);
+                if (sys_printf ("%s", buffer))
                 {
-                    fprintf(stderr,"Could not create partition.\n");
-                    return 10;
+                    fprintf(stderr, "Could not create file system on uid %s: %s\n", uuid, buffer);
+                    return 12;
                 }
             }
             else
             {
-                if (sys_printf ("parted -s %s mkpart %s %s %llds %llds", dst_dev,
-                    parts[p].ptype, parts[p].ftype, parts[p].start, parts[p].end))
-                {
-                    fprintf(stderr,"Could not create partition.\n");
-                    return 11;
-                }
+					fprintf(stderr, "Could not create file system: %s\n", buffer);
+                return 13;
             }
         }
+    }
 
-        // refresh the kernel partion table
-        sys_printf ("partprobe");
+    if (!strcmp (parts[p].ftype, "ext4"))
+    {
+        if (uid) sprintf (buffer, "mkfs.ext4 -F -U %s %s%d", uuid, partition_name (dst_dev, dev), parts[p].pnum);
+        else sprintf (buffer, "mkfs.ext4 -F %s%d", partition_name (dst_dev, dev), parts[p].pnum);
+        if (strlen (label)) sprintf (buffer + strlen (buffer), " -L \"%s\"", label);
+        if (p == n - 1 && inodes) sprintf (buffer + strlen (buffer), " -N %lld", inodes);
 
-        // get the UUID
-        sprintf (buffer, "lsblk -o name,uuid %s | grep %s%d | tr -s \" \" | cut -d \" \" -f 2", src_dev, partition_name (src_dev, dev) + 5, parts[p].pnum);
-        uid = get_string (buffer, uuid);
-        if (uid)
+        if (sys_printf ("%s", buffer))
         {
-            // sanity check the ID
-            if (strlen (uuid) == 9)
+            if (uid)
             {
-                if (uuid[4] == '-')
+                // second try just in case the only problem was a corrupt UUID
+                sprintf (buffer, "mkfs.ext4 -F %s%d", partition_name (dst_dev, dev), parts[p].pnum);
+                if (sys_printf ("%s", buffer))
                 {
-                    // remove the hyphen from the middle of a FAT volume ID
-                    uuid[4] = uuid[5];
-                    uuid[5] = uuid[6];
-                    uuid[6] = uuid[7];
-                    uuid[7] = uuid[8];
-                    uuid[8] = 0;
+                    fprintf(stderr,"Could not create file system.\n");
+                    return 14;
                 }
-                else uid = 0;
             }
-            else if (strlen (uuid) == 36)
+            else
             {
-                // check there are hyphens in the right places in a UUID
-                if (uuid[8] != '-') uid = 0;
-                if (uuid[13] != '-') uid = 0;
-                if (uuid[18] != '-') uid = 0;
-                if (uuid[23] != '-') uid = 0;
+                fprintf(stderr,"Could not create file system.\n");
+                return 15;
             }
-            else uid = 0;
         }
+    }
 
-        // get the label
-        sprintf (buffer, "lsblk -o name,label %s | grep %s%d | tr -s \" \" | cut -d \" \" -f 2", src_dev, partition_name (src_dev, dev) + 5, parts[p].pnum);
-        lbl = get_string (buffer, res);
-        if (!strlen (res)) lbl = 0;
-
-        // get the partition UUID
-        sprintf (buffer, "blkid %s | rev | cut -f 2 -d ' ' | rev | cut -f 2 -d \\\"", src_dev);
-        puid = get_string (buffer, puuid);
-        if (!strlen (puuid)) puid = 0;
+    return 0;
+}
 
-        // create file systems
-        if (!strncmp (parts[p].ftype, "fat", 3))
-        {
-            if (uid) sprintf (buffer, "mkfs.fat -F 32 -i %s %s%d", uuid, partition_name (dst_dev, dev), parts[p].pnum);
-            else sprintf (buffer, "mkfs.fat -F 32 %s%d", partition_name (dst_dev, dev), parts[p].pnum);
+/* Journal blocks mkfs.ext4 creates for a file system of blocks blocks, the table of ext2fs_default_journal_size */
 
-            if (sys_printf (buffer))
-            {
-                if (uid)
-                {
-                    // second try just in case the only problem was a corrupt UUID
-                    sprintf (buffer, "mkfs.fat -F 32 %s%d", partition_name (dst_dev, dev), parts[p].pnum);
-                    if (sys_printf (buffer))
-                    {
-                        fprintf(stderr, "Could not create file system on uid %s: %s\n", uuid, buffer);
-                        return 12;
-                    }
-                }
-                else
-                {
-					fprintf(stderr, "Could not create file system: %s\n", buffer);
-                    return 13;
-                }
-            }
+static long long int ext4_journal_blocks (long long int blocks)
+{
+	if (blocks < 2048) return 0;
+	if (blocks < 32768) return 1024;
+	if (blocks < 256 * 1024) return 4096;
+	if (blocks < 512 * 1024) return 8192;
+	if (blocks < 4096 * 1024) return 16384;
+	if (blocks < 8192 * 1024) return 32768;
+	if (blocks < 16384 * 1024) return 65536;
+	if (blocks < 32768 * 1024) return 131072;
+	return 262144;
+}
 
-            if (lbl) sys_printf ("fatlabel %s%d %s", partition_name (dst_dev, dev), parts[p].pnum, res);
-        }
+/* ext4_size_needed
+   Size of the smallest ext4 file system made with the mkfs.ext4 defaults that can hold the files:
+   4k blocks, 256 byte inodes, one inode per 16k, 5% of the blocks reserved for root and the default journal
+	@param used bytes used by the files on the source
+	@param files inodes used on the source
+	@param inodes returns the number of inodes mkfs.ext4 must create
+	@return size in bytes
+*/
+static long long int ext4_size_needed (long long int used, long long int files, long long int *inodes)
+{
+	long long int size, blocks, overhead, capacity, want, need_inodes;
+	int i;
 
-        if (!strcmp (parts[p].ftype, "ext4"))
-        {
-            if (uid) sprintf (buffer, "mkfs.ext4 -F -U %s %s%d", uuid, partition_name (dst_dev, dev), parts[p].pnum);
-            else sprintf (buffer, "mkfs.ext4 -F %s%d", partition_name (dst_dev, dev), parts[p].pnum);
+	// a different block layout can need a few more blocks for directories and extent trees
+	want = used + used / 100 + 16 * 1024 * 1024;
+	need_inodes = files + files / 20 + 1024;
+	size = want;
+	for (i = 0; i < 100; i++)
+	{
+		blocks = size / 4096;
+		*inodes = size / 16384 > need_inodes ? size / 16384 : need_inodes;
+		// inode tables, journal, two bitmaps per group of 32768 blocks, superblock backups and reserved descriptors
+		overhead = *inodes * 256 + ext4_journal_blocks (blocks) * 4096 + (blocks / 32768 + 1) * 2 * 4096 + 16 * 1024 * 1024;
+		capacity = size - overhead - size / 20;
+		if (capacity >= want) break;
+		size += want - capacity;
+	}
+	// more inodes than the default ratio gives must be asked for
+	if (*inodes == size / 16384) *inodes = 0;
+	return size;
+}
 
-            if (sys_printf (buffer))
-            {
-                if (uid)
-                {
-                    // second try just in case the only problem was a corrupt UUID
-                    sprintf (buffer, "mkfs.ext4 -F %s%d", partition_name (dst_dev, dev), parts[p].pnum);
-                    if (sys_printf (buffer))
-                    {
-                        fprintf(stderr,"Could not create file system.\n");
-                        return 14;
-                    }
-                }
-                else
-                {
-                    fprintf(stderr,"Could not create file system.\n");
-                    return 15;
-                }
-            }
+/* Name of an image in a repository: the file name without directory and .img */
 
-            if (lbl) sys_printf ("e2label %s%d %s", partition_name (dst_dev, dev), parts[p].pnum, res);
-        }
+static void image_name (char * file, char * name)
+{
+	char * base = strrchr (file, '/');
+	size_t len;
+
+	strcpy (name, base ? base + 1 : file);
+	len = strlen (name);
+	if (len > 4 && !strcmp (name + len - 4, ".img")) name[len - 4] = 0;
+}
+
+/* expand_last_partition
+   Grows the last partition on the disk and its ext file system to the end of the device, after a restore
+	@param device the device the image was written to
+	@return 0 on success or the exit code of imgclone
+*/
+
+static int expand_last_partition (char * device)
+{
+	partition_t parts[MAXPART];
+	char dev[64], part[80];
+	unsigned long long int size;
+	long long int end;
+	int fd, n, p, last = -1, res;
+
+	n = read_partition_table (device, parts, NULL);
+	if (n <= 0)
+	{
+		fprintf(stderr,"Could not read the partition table of %s.\n", device);
+		return 46;
+	}
+	for (p = 0; p < n; p++)
+	{
+		// the extended partition is grown with its last logical partition
+		if (strcmp (parts[p].ptype, "extended") && (last < 0 || parts[p].start > parts[last].start)) last = p;
+	}
+	if (last < 0 || strncmp (parts[last].ftype, "ext", 3))
+	{
+		printf ("The last partition is not ext2/3/4, it is not expanded.\n");
+		return 0;
+	}
+
+	fd = open (device, O_RDONLY);
+	if (fd < 0 || ioctl (fd, BLKGETSIZE64, &size))
+	{
+		fprintf(stderr,"Could not get the size of %s.\n", device);
+		if (fd >= 0) close (fd);
+		return 46;
+	}
+	close (fd);
+	// whole 4K blocks, the file system can't use a partial one
+	end = parts[last].start + (long long int) ((size / 512 - parts[last].start) / 8 * 8) - 1;
+	if (end <= parts[last].end)
+	{
+		printf ("Partition %d already ends at the end of %s.\n", parts[last].pnum, device);
+		return 0;
+	}
+
+	stats_phase ("expanding");
+	printf ("Expanding partition %d to %lld bytes.\n", parts[last].pnum, (end - parts[last].start + 1) * 512);
+	if (probe_set_partition_end (device, parts[last].pnum, end))
+	{
+		fprintf(stderr,"Could not change the end of partition %d.\n", parts[last].pnum);
+		return 46;
+	}
+	if (probe_reread (device)) sys_printf ("partprobe %s", device);
+
+	// resize2fs only works on a file system that was checked, e2fsck returns 1 or 2 if it fixed something
+	sprintf (part, "%s%d", partition_name (device, dev), parts[last].pnum);
+	res = sys_printf ("e2fsck -f -y %s", part);
+	if (!WIFEXITED (res) || WEXITSTATUS (res) >= 4 || sys_printf ("resize2fs %s", part))
+	{
+		fprintf(stderr,"Could not grow the file system on %s.\n", part);
+		return 46;
+	}
+	return 0;
+}
+
+/* open_image_sink
+   Opens the sink of one destination of the image
+	@param dst_file image file, or a pipe or device that gets the image as one sequential stream
+	@param used bytes a sparse image file needs, 0 to skip the free space check
+	@param out_file receives the name of the file written, with the extension of compress
+	@param err receives the exit code if the sink could not be opened
+	@return the sink or NULL
+*/
+
+static img_sink * open_image_sink (char * src_dev, char * dst_file, long long int used, char compress, char * out_file, int * err)
+{
+	char buffer[1024], * slash;
+	long long int available_free_space = 0;
+	fs_space space;
+	struct stat st;
+	img_sink * sink;
+
+	if (!strncmp (dst_file, "/dev/fd/", 8) || (stat (dst_file, &st) == 0 && !S_ISREG (st.st_mode)))
+	{
+		// stdout, a pipe or a device, the caller chose where it goes
+		strcpy (out_file, dst_file);
+	}
+	else
+	{
+		// the image does not exist yet, check the directory it goes to
+		strcpy (buffer, dst_file);
+		slash = strrchr (buffer, '/');
+		if (slash == NULL) strcpy (buffer, ".");
+		else slash[slash == buffer] = 0;
+		if (probe_same_disk (buffer, src_dev))
+		{
+			fprintf(stderr, "Destination file %s is located on the disk to clone. Destination file must be on external drive.\n", dst_file);
+			*err = 25;
+			return NULL;
+		}
+		// a sparse image needs space for the used blocks, a compressed one less
+		if (probe_space (buffer, &space) == 0) available_free_space = space.available;
+		if (compress == SINK_NONE && available_free_space < used)
+		{
+			fprintf(stderr, "Not enough free space to create destination image file %s %lld free, required %lld bytes.\n", dst_file, available_free_space, used);
+			*err = 26;
+			return NULL;
+		}
+		sprintf (out_file, "%s%s", dst_file, sink_extension (compress));
+	}
+	sink = compress ? sink_compress_open (out_file, compress, 0) : sink_file_open (out_file);
+	if (sink == NULL)
+	{
+		fprintf(stderr,"Could not create %s.\n", out_file);
+		*err = 37;
+	}
+	return sink;
+}
+
+/* check_resume_blocks
+   Checks the journal and the image file of an interrupted block mode backup against the source,
+   the partition table and the last copied bytes before the checkpoint must be the same
+	@param fd the source disk
+	@param ranges the ranges that are copied from the source
+	@return the offset the image is complete up to, -1 with a message if it can't be resumed
+*/
+
+static long long int check_resume_blocks (int fd, char * dst_file, char * journal_file, char * disk_id, long long int image_size, range_list * ranges)
+{
+	checkpoint_state state;
+	long long int start = 0, len = 512;
+	char * a, * b;
+	int img, p, res;
+
+	if (checkpoint_load (journal_file, &state)) return -1;
+	if (strcmp (state.mode, "blocks") || strcmp (state.disk_id, disk_id) || state.size != image_size)
+	{
+		fprintf(stderr,"%s is not the checkpoint of a block mode backup of this source.\n", journal_file);
+		return -1;
+	}
+	if (state.offset == 0) return 0;
+	img = open (dst_file, O_RDONLY);
+	if (img < 0)
+	{
+		fprintf(stderr,"Could not open %s: %s\n", dst_file, strerror (errno));
+		return -1;
+	}
+	// at most 1 MB of the end of the last range before the checkpoint
+	for (p = 0; p < ranges->n && ranges->r[p].start < state.offset; p++)
+	{
+		len = ranges->r[p].start + ranges->r[p].len < state.offset ? ranges->r[p].len : state.offset - ranges->r[p].start;
+		start = ranges->r[p].start + (len > 1048576 ? len - 1048576 : 0);
+		if (len > 1048576) len = 1048576;
+	}
+	// the holes at the end of the image file are only added when it is complete, they read as zeros
+	a = malloc (1048576);
+	b = calloc (1, 1048576);
+	res = pread (fd, a, 512, 0) != 512 || pread (img, b, 512, 0) < 0 || memcmp (a, b, 512);
+	memset (b, 0, 512);
+	if (!res) res = pread (fd, a, len, start) != len || pread (img, b, len, start) < 0 || memcmp (a, b, len);
+	free (a);
+	free (b);
+	close (img);
+	if (res)
+	{
+		fprintf(stderr,"%s does not match the source before its checkpoint at %lld bytes.\n", dst_file, state.offset);
+		return -1;
+	}
+	return state.offset;
+}
+
+/* clone_blocks
+   Block mode: writes the image straight from the source device, only the blocks the file systems use are read
+	@param n number of partitions in parts[]
+	@param compress SINK_NONE for a sparse .img file or the compression format
+	@param repo chunk repository, dst_file is then the image name
+	@param dst_file image file, or a pipe or device that gets the image as one sequential stream
+	@param more_dst n_more other destinations that get the same image, the source is read once
+	@param disk_id disk identifier of the source, recorded in the checkpoint journal
+	@param resume if 1, continue the image file of an interrupted backup after its last checkpoint
+*/
+
+static int clone_blocks (partition_t * parts, char * src_dev, char * disk_id, char * dst_file, char ** more_dst, int n_more, int n, char show_progress, int progress_fd, char compress, char * repo, char resume)
+{
+	char out_file[1024], out_files[MAXDEST][1024], name[512], * names[MAXDEST], journal_file[1024];
+	partition_t sorted[MAXPART], tmp;
+	range_list ranges;
+	progress copy_progress;
+	volatile long long int copied = 0;
+	long long int image_size = 0, pos = 0, used, offset = 0;
+	const char * fs;
+	img_sink * sink, * sinks[MAXDEST];
+	checkpoint * cp = NULL;
+	struct stat st;
+	int fd, direct_fd, sector_size, p, q, result, failed = 0;
+
+	// the partition table order is not always the disk order
+	memcpy (sorted, parts, n * sizeof (partition_t));
+	for (p = 1; p < n; p++)
+	{
+		for (q = p; q > 0 && sorted[q - 1].start > sorted[q].start; q--)
+		{
+			tmp = sorted[q];
+			sorted[q] = sorted[q - 1];
+			sorted[q - 1] = tmp;
+		}
+	}
+
+	// file system buffers of the mounted partitions go to the device first
+	sync ();
+	fd = open (src_dev, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr,"Could not open %s.\n", src_dev);
+		return 36;
+	}
+
+	memset (&ranges, 0, sizeof (ranges));
+	for (p = 0; p < n; p++)
+	{
+		if ((sorted[p].end + 1) * 512 > image_size) image_size = (sorted[p].end + 1) * 512;
+		// the extended partition is only a container, its boot records are in the gaps between the logical partitions
+		if (!strcmp (sorted[p].ptype, "extended")) continue;
+		if (sorted[p].start * 512 > pos) range_add (&ranges, pos, sorted[p].start * 512 - pos);
+		used = range_total (&ranges);
+		fs = fs_used_ranges (fd, sorted[p].start * 512, (sorted[p].end - sorted[p].start + 1) * 512, &ranges);
+		printf ("Partition %d (%s): %lld bytes used.\n", sorted[p].pnum, fs, range_total (&ranges) - used);
+		pos = (sorted[p].end + 1) * 512;
+	}
+	used = range_total (&ranges);
+	printf ("Copying %lld of %lld bytes in %d ranges.\n", used, image_size, ranges.n);
+
+	sprintf (journal_file, "%s.checkpoint", dst_file);
+	if (resume)
+	{
+		offset = check_resume_blocks (fd, dst_file, journal_file, disk_id, image_size, &ranges);
+		if (offset < 0)
+		{
+			fprintf(stderr,"Could not resume the backup to %s, start again without --resume.\n", dst_file);
+			close (fd);
+			range_free (&ranges);
+			return 49;
+		}
+		// the ranges before the checkpoint count as copied
+		for (p = 0; p < ranges.n && ranges.r[p].start < offset; p++)
+			copied += (ranges.r[p].start + ranges.r[p].len < offset ? ranges.r[p].len : offset - ranges.r[p].start);
+		printf ("Resuming %s at %lld of %lld bytes, %lld bytes are left to copy.\n", dst_file, offset, image_size, used - copied);
+		strcpy (out_file, dst_file);
+		sink = sink_file_resume (dst_file, offset);
+		result = sink ? 0 : 37;
+		cp = sink ? checkpoint_append (journal_file) : NULL;
+	}
+	else if (repo)
+	{
+		image_name (dst_file, name);
+		sprintf (out_file, "%s/index/%s.idx", repo, name);
+		sink = sink_chunkstore_open (repo, name, 0);
+		if (sink == NULL) fprintf(stderr,"Could not create %s.\n", out_file);
+		result = sink ? 0 : 37;
+	}
+	else
+	{
+		// one read of the source for all destinations, one that can't be created is left out
+		for (p = 0, q = 0; p <= n_more; p++)
+		{
+			sinks[q] = open_image_sink (src_dev, p ? more_dst[p - 1] : dst_file, used, compress, out_files[q], &result);
+			if (sinks[q]) names[q] = out_files[q], q++;
+			else failed++;
+		}
+		strcpy (out_file, out_files[0]);
+		sink = q == 0 ? NULL : q == 1 ? sinks[0] : sink_fanout_open (sinks, names, q);
+		if (q == 1 && n_more) strcpy (out_file, names[0]);
+		if (q > 1 && sink == NULL) result = 37;
+		// a single uncompressed image file can be resumed from its checkpoints
+		if (q == 1 && !n_more && compress == SINK_NONE && stat (out_file, &st) == 0 && S_ISREG (st.st_mode))
+			cp = checkpoint_create (journal_file, "blocks", disk_id, image_size);
+	}
+	if (sink == NULL)
+	{
+		close (fd);
+		range_free (&ranges);
+		return result;
+	}
+	if (cp) sink = checkpoint_sink_open (sink, cp);
+
+	stats_phase ("copying blocks");
+	printf ("-----------------------------------------------\n");
+	printf ("----    COPYING BLOCKS PLEASE WAIT       ------\n");
+	printf ("-----------------------------------------------\n");
+
+	// gentle mode reads around the page cache, the ranges are whole sectors and the I/O buffers are aligned
+	direct_fd = -1;
+	if (throttle_gentle () && ioctl (fd, BLKSSZGET, &sector_size) == 0 && sector_size == 512)
+		direct_fd = open (src_dev, O_RDONLY | O_DIRECT);
+	if (direct_fd >= 0) printf ("Reading %s with O_DIRECT.\n", src_dev);
+
+	progress_start (&copy_progress, "blocks", 0, &copied, NULL, used, 0, show_progress, progress_fd);
+	result = block_copy (direct_fd >= 0 ? direct_fd : fd, &ranges, image_size, sink, &copied);
+	progress_finish (&copy_progress);
+	if (sink_close (sink)) result = -1;
+	if (direct_fd >= 0) close (direct_fd);
+	close (fd);
+	range_free (&ranges);
+	checkpoint_close (cp, result == 0);
+	if (result)
+	{
+		if (n_more) fprintf(stderr,"Could not write the image to every destination.\n");
+		else fprintf(stderr,"Could not write image %s.\n", out_file);
+		return 38;
+	}
+	if (failed)
+	{
+		fprintf(stderr,"%d of %d destinations could not be created.\n", failed, n_more + 1);
+		return 38;
+	}
+	if (n_more) printf("Images completed!\n");
+	else printf("Image %s completed!\n", out_file);
+	return 0;
+}
+
+/* clone_to_img
+   This function starts clone to img file
+	@param src_dev the source device to clone
+	@param dst_file the destination disk file to clone to (.IMG)
+	@param more_dst n_more other destinations, they get a copy of the image while the next partition is copied
+	@param new_uuid if 1, new uuid will be generated for destination
+	@param extra_space add extra free space to the image file for future expansion
+	@param show_progress if 1 will show copy progress
+	@param progress_fd file descriptor for the JSON progress stream, -1 for none
+	@param compress SINK_BZIP2, SINK_GZIP or SINK_ZSTD compresses the image while it is copied, the .img file is removed when finished
+	@param threads number of file copy threads, 0 for default
+	@param base_file previous image to update incrementally using its manifest, NULL for a full backup
+	@param repo chunk repository to store the image in, dst_file is the temporary raw image, NULL to keep the image file
+	@param block_mode if 1, copy the used blocks of the file systems instead of the files, the partitions keep their size
+	@param shrink if 1, shrink the last ext file system and partition to the minimum size after the copy
+	@param reconcile_passes number of rescans after the copy of each partition that copy what changed in the meantime, 0 for none
+	@param verify if 1, compare the files of the image with the source when the copy is done
+	@param key_file secret key to sign the file list of the verification with, NULL for none
+	@param resume if 1, continue the uncompressed image of an interrupted backup after its last checkpoint
+	@param exclude files that are left out of the image, NULL to copy everything, the last partition is made smaller by what they use
+*/
+int clone_to_img (char * src_dev, char * dst_file, char ** more_dst, int n_more, char new_uuid, long long int extra_space, char show_progress, int progress_fd, char compress, int threads, char * base_file, char * repo, char block_mode, char shrink, int reconcile_passes, char verify, char * key_file, char resume, const exclude_rules * exclude)
+{
+    char buffer[1024], dev[16], puuid[64], npuuid[64], dst_dev[64], src_mnt[64], dst_mnt[64], dst_file_escaped[1024], compressed_file[1024], manifest_file[1024], pass_file[1024], name[512];
+    int n, p, n_err, puid, draining=0, n_sinks=0, drain_failed=0, sink_err, result, attached=0, src_mounted=0, dst_mounted=0;
+    char more_files[MAXDEST][1024], * names[MAXDEST];
+    partition_t parts[MAXPART];
+    img_sink * sinks[MAXDEST];
+    fs_space space;
+    drain_args drain;
+    format_args format;
+    pthread_t format_thread;
+    pthread_t drain_thread;
+    manifest_writer * manifest_out = NULL;
+    manifest * resume_base = NULL;
+    checkpoint * cp = NULL;
+    checkpoint_watch * watch;
+    checkpoint_state resume_state;
+    char journal_file[1024];
+    int image_fd = -1;
+    struct stat image_st;
+    long long int srcsz, dstsz, src_files, file_size_needed=0,available_free_space=0,space_needed,part_size,last_inodes=0,dropped;
+    char shrunk=0;
+    long long int differences=0;
+    time_t started=time(NULL);
+    // -u rewrites these on purpose
+    const char * uuid_files[] = {"etc/fstab", "cmdline.txt", NULL};
+	
+	escape_shell_arg(dst_file_escaped, dst_file);
+	drain.sink = NULL;
+	drain.fd = -1;
+	format.running = 0;
+
+    // get a new partition UUID
+    probe_random_id (npuuid);
+
+	stats_phase ("reading partitions");
+	printf ("-----------------------------------------------\n");
+	printf ("----    READING PARTITIONS               ------\n");
+	printf ("-----------------------------------------------\n");
+	
+    // read in the source partition table, it must be an msdos partition table
+    n = read_partition_table (src_dev, parts, puuid);
+    if (n == -2)
+    {
+        fprintf(stderr,"Unable to read source.\n");
+        return 2;
+    }
+    if (n == -3)
+    {
+        fprintf(stderr,"Non-MSDOS partition table on source.\n");
+        return 3;
+    }
+    if (n < 0)
+    {
+        fprintf(stderr,"Too many partitions on source.\n");
+        return 4;
+    }
+    if (n == 0)
+    {
+        fprintf(stderr,"No partitions on source.\n");
+        return 2;
+    }
+
+	if (block_mode) return clone_blocks (parts, src_dev, puuid, dst_file, more_dst, n_more, n, show_progress, progress_fd, compress, repo, resume);
+
+    // prepare temp mount points
+    strcpy (src_mnt, "/tmp/tmp.XXXXXX");
+    strcpy (dst_mnt, "/tmp/tmp.XXXXXX");
+    if (mkdtemp (src_mnt) == NULL || mkdtemp (dst_mnt) == NULL)
+    {
+        fprintf(stderr,"Could not create mount points.\n");
+        return 1;
+    }
 
-        // write the partition UUID
-        if (puid) sys_printf ("echo \"x\ni\n0x%s\nr\nw\n\" | fdisk %s", new_uuid ? npuuid : puuid, dst_dev);
+	//get the needed size of the destination image_file
+	//the partitions before the last one keep their size, the last one is made just big enough for its files
+	
+	file_size_needed=parts[n-1].start*(long long int)512; //need at least the start of last partition as image size (blocks * block_size) in bytes
+	printf("Last partition starts at %lld bytes.\n", file_size_needed);
+	
+	//mount last partition to get used disk space
+	if (sys_printf ("mount %s%d %s", partition_name (src_dev, dev), parts[n-1].pnum, src_mnt))
+	{
+		fprintf(stderr,"Could not mount partition %s\n", partition_name (src_dev, dev));
+		return 5;
+	}
+
+	probe_space (src_mnt, &space);
+	printf("Used size of last partition %s is %lld bytes in %lld inodes.\n", src_mnt, space.used, space.files);
+	exclude_space (exclude, src_mnt, &space);
+	
+	if (sys_printf ("umount %s", src_mnt))
+	{
+		fputs("Could not unmount partition.\n",stderr);
+		return 6;
+	}
+	
+	if (!strcmp (parts[n-1].ftype, "ext4")){
+		//room for the data, the inodes, the journal and the reserved blocks of the new file system
+		file_size_needed+=ext4_size_needed(space.used + extra_space, space.files, &last_inodes);
+		printf("Last partition needs %lld inodes.\n", last_inodes);
+	}else{
+		file_size_needed+=space.used+space.used*(long long int)2/(long long int)100+extra_space; //add 2% extra space
+	}
+	if ((file_size_needed%4096)!=0)	file_size_needed+=(long long int)(4096-(file_size_needed%4096)); //align at file system block size
+	printf("Required size for destination image: %lld bytes\n", file_size_needed);
+	
+	sprintf(journal_file, "%s.checkpoint", dst_file);
+	sprintf(manifest_file, "%s.manifest", dst_file);
+	memset(&resume_state, 0, sizeof(resume_state));
+	if (resume){
+		//the layout of the image was fixed when it was created, the source may have changed since
+		if (checkpoint_load(journal_file, &resume_state)) return 49;
+		if (strcmp(resume_state.mode, "files") || strcmp(resume_state.disk_id, puuid)){
+			fprintf(stderr,"%s is not the checkpoint of a backup of this source, start again without --resume.\n", journal_file);
+			return 49;
+		}
+		if (stat(dst_file, &image_st) || image_st.st_size != resume_state.size){
+			fprintf(stderr,"%s is missing or its size changed since the checkpoint, start again without --resume.\n", dst_file);
+			return 49;
+		}
+		file_size_needed = resume_state.size;
+		printf("Resuming the backup to %s, %d partitions are complete.\n", dst_file, __builtin_popcountll(resume_state.done));
+	}
+
+	stats_phase ("allocating space");
+	printf ("-----------------------------------------------\n");
+	printf ("----    ALLOCATING SPACE FOR .IMG FILE   ------\n");
+	printf ("-----------------------------------------------\n");
+	
+	//create file
+	n_err = open(dst_file, O_WRONLY | O_CREAT, 0644);
+	if (n_err < 0){
+		fprintf(stderr,"Could not create destination file %s.\n", dst_file);
+		return 24;
+	}
+	close(n_err);
+
+	//check if file is on a different disk device
+	if (probe_same_disk(dst_file, src_dev)){
+		fprintf(stderr, "Destination file is located on the disk to clone. Destination file must be on external drive.\n");
+		return 25;
+	}
+	
+	//check if there is enough space on the destination disk
+	probe_space(dst_file, &space);
+	available_free_space = space.available;
+	printf("%lld bytes available for %s\n", available_free_space, dst_file);
+	//a compressed image or one stored in the repository is drained after each partition and punched out of the temporary file,
+	//it only holds the largest partition at a time
+	space_needed = file_size_needed;
+	if ((compress || repo) && base_file == NULL){
+		space_needed = 0;
+		for (p = 0; p < n; p++){
+			if (!strcmp(parts[p].ptype, "extended")) continue;
+			part_size = p == n - 1 ? file_size_needed - parts[p].start * 512 : (parts[p].end - parts[p].start + 1) * 512;
+			if (part_size > space_needed) space_needed = part_size;
+		}
+		printf("The largest partition needs %lld bytes of temporary space.\n", space_needed);
+	}
+	if (!resume && available_free_space < space_needed){
+		//sys_printf("rm %s", dst_file);
+		fprintf(stderr, "Not enough free space to create destination image file %lld free, required %lld bytes.\n", available_free_space, space_needed);
+		return 26;
+	}
+	
+	if (base_file){
+		//start from a copy of the previous image
+		struct stat base_st;
+		
+		if (stat(base_file, &base_st) || base_st.st_size < file_size_needed){
+			fprintf(stderr,"Base image %s is missing or too small for the used space, make a full backup.\n", base_file);
+			return 31;
+		}
+		printf("Copying base image %s to %s\n", base_file, dst_file);
+		if (clone_base_image(base_file, dst_file)){
+			fprintf(stderr,"Could not copy base image %s to %s.\n", base_file, dst_file);
+			return 23;
+		}
+	}else if (!resume){
+		//make file size big enough
+		if (truncate(dst_file, file_size_needed)){
+			fprintf(stderr,"Could not create file large enough on destination disk.\n");
+			return 23;
+		}
+	}
+
+	stats_phase ("creating disk device");
+	printf ("-----------------------------------------------\n");
+	printf ("----  CREATING DISK DEVICE FOR .IMG FILE ------\n");
+	printf ("-----------------------------------------------\n");
+	
+	//create device, returns the /dev/loopX interface, which is dst_dev
+	//in gentle mode the loop device writes the image file without the page cache
+	if (snprintf(buffer, sizeof(buffer), "losetup -P --show -f %s\"%s\"", throttle_gentle() ? "--direct-io=on " : "", dst_file_escaped) >= (int) sizeof(buffer)){
+		fprintf(stderr,"The path of %s is too long.\n", dst_file);
+		return 23;
+	}
+	get_string(buffer, dst_dev);
+	attached = strlen(dst_dev) > 0;
+	
+	//printf("Unmounting partitions on target\n");
+    // unmount any partitions on the target device
+    //for (n = 9; n >= 1; n--)
+    //{
+    //    sys_printf ("umount %s%d", partition_name (dst_dev, dev), n);
+    //}
 
-        prog = p + 1;
-        prog /= n;
-        //gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (progress), prog);
+    if (resume)
+    {
+        // the partitions of the interrupted backup are kept, the image has the disk identifier it was given then
+        if (probe_reread (dst_dev)) sys_printf ("partprobe %s", dst_dev);
+        if (check_base_partitions (parts, dst_dev, n, npuuid))
+        {
+            fprintf(stderr,"The partially written image %s does not match the source, start again without --resume.\n", dst_file);
+            result = 49;
+            goto fail;
+        }
+        // the files of the interrupted partition that reached the image before the last checkpoint stay
+        if (resume_state.current)
+        {
+            if (snprintf (buffer, sizeof (buffer), "%s.tmp", manifest_file) >= (int) sizeof (buffer))
+            {
+                fprintf(stderr,"The path of the manifest of %s is too long.\n", dst_file);
+                result = 49;
+                goto fail;
+            }
+            if (stat (buffer, &image_st) == 0 && (image_st.st_size <= resume_state.current_manifest || truncate (buffer, resume_state.current_manifest) == 0))
+                resume_base = manifest_load (buffer, resume_state.current);
+            if (resume_base == NULL) resume_state.current = 0;
+        }
+        // the other partitions get a new file system
+        n_err = start_format (&format, &format_thread, parts, dst_dev, n, last_inodes, resume_state.done | (resume_state.current ? 1ULL << resume_state.current : 0));
+        if (n_err)
+        {
+            result = n_err;
+            goto fail;
+        }
+        puid = strlen (puuid) > 0;
+    }
+    else if (base_file == NULL)
+    {
+        // new partitions and file systems
+        n_err = create_partitions (parts, dst_dev, n, new_uuid, npuuid, puuid);
+        if (n_err)
+        {
+            result = n_err;
+            goto fail;
+        }
+        // the file systems are created in the background, partition p is waited for before it is copied
+        n_err = start_format (&format, &format_thread, parts, dst_dev, n, last_inodes, 0);
+        if (n_err)
+        {
+            result = n_err;
+            goto fail;
+        }
+        puid = strlen (puuid) > 0;
+    }
+    else
+    {
+        // the partitions and file systems of the base image are updated
+        puid = 0;
+        if (probe_reread (dst_dev)) sys_printf ("partprobe %s", dst_dev);
+        n_err = check_base_partitions (parts, dst_dev, n, NULL);
+        if (n_err)
+        {
+            result = n_err;
+            goto fail;
+        }
     }
 
 	printf("%d partitions created, now copy files.\n", n);
 	
+	//list of all files, the next backup can use it as base
+	manifest_out = resume ? manifest_append(manifest_file, resume_state.done_manifest) : manifest_create(manifest_file);
+	if (manifest_out == NULL){
+		result = 34;
+		goto fail;
+	}
+	
+	if (repo){
+		//store each finished part of the image in the repository while the next partition is copied
+		image_name(dst_file, name);
+		sprintf(compressed_file, "%s/index/%s.idx", repo, name);
+		printf("Storing image in repository %s as %s while copying.\n", repo, name);
+		sinks[n_sinks] = sink_chunkstore_open(repo, name, 0);
+		if (sinks[n_sinks]) names[n_sinks++] = compressed_file;
+		else drain_failed++;
+	}else if (compress){
+		//compress each finished part of the image while the next partition is copied
+		sprintf(compressed_file, "%s%s", dst_file, sink_extension(compress));
+		printf("Compressing image to %s while copying.\n", compressed_file);
+		sinks[n_sinks] = sink_compress_open(compressed_file, compress, 0);
+		if (sinks[n_sinks]) names[n_sinks++] = compressed_file;
+		else drain_failed++;
+	}
+	//the other destinations get a copy of each finished part, the card is only read once
+	for (p = 0; p < n_more; p++){
+		sinks[n_sinks] = open_image_sink(src_dev, more_dst[p], file_size_needed, compress, more_files[n_sinks], &sink_err);
+		if (sinks[n_sinks]){
+			printf("Writing the image to %s too while copying.\n", more_files[n_sinks]);
+			names[n_sinks] = more_files[n_sinks];
+			n_sinks++;
+		}else{
+			drain_failed++;
+		}
+	}
+	if (n_sinks==1) drain.sink = sinks[0];
+	else if (n_sinks>1) drain.sink = sink_fanout_open(sinks, names, n_sinks);
+	if ((repo || compress) && drain_failed){
+		fprintf(stderr,"Could not start compression of %s.\n", compressed_file);
+		result = 29;
+		goto fail;
+	}
+	if (n_sinks == 0 && base_file == NULL){
+		//the journal records what is in the image, an interrupted backup continues after its last record
+		cp = resume ? checkpoint_append(journal_file) : checkpoint_create(journal_file, "files", puuid, file_size_needed);
+		if (resume_base) checkpoint_files(cp, resume_state.current, resume_state.done_manifest);
+		image_fd = open(dst_file, O_RDONLY);
+	}
+	if (n_sinks){
+		//the image file is only a temporary file if it is compressed or stored in the repository, the drained parts are punched out of it
+		drain.fd = open(dst_file, repo || compress ? O_RDWR : O_RDONLY);
+		drain.from = drain.to = 0;
+		drain.result = 0;
+		if (drain.sink==NULL || drain.fd<0){
+			fprintf(stderr,"Could not start writing %s.\n", names[0]);
+			result = 29;
+			goto fail;
+		}
+	}
+	
     // do the copy for each partition
     for (p = 0; p < n; p++)
     {
         // don't try to copy extended partitions
         if (strcmp (parts[p].ptype, "extended"))
         {
+            if (resume_state.done & (1ULL << parts[p].pnum))
+            {
+                printf ("Partition %d of %d is already in the image.\n", p + 1, n);
+                continue;
+            }
+            int resuming = resume_base && parts[p].pnum == resume_state.current;
+            if (base_file == NULL)
+            {
+                stats_phase ("formatting");
+                n_err = wait_format (&format, p);
+                if (n_err)
+                {
+                    result = n_err;
+                    goto fail;
+                }
+            }
+            stats_phase ("mounting");
             printf ("Copying partition %d of %d...\n", p + 1, n);
 			printf ("Copy from %s to %s\n", src_mnt, dst_mnt);
 			
-            // belt-and-braces call to partprobe to make sure devices are found...
-            get_string ("partprobe", res);
-
             // mount partitions
             if (sys_printf ("mount %s%d %s", partition_name (dst_dev, dev), parts[p].pnum, dst_mnt))
             {
                 fprintf(stderr,"Could not mount partition.\n");
-                return 16;
+                result = 16;
+                goto fail;
             }
+            dst_mounted = 1;
 
             if (sys_printf ("mount %s%d %s", partition_name (src_dev, dev), parts[p].pnum, src_mnt))
             {
                 fprintf(stderr,"Could not mount partition.\n");
-                return 17;
+                result = 17;
+                goto fail;
             }
+            src_mounted = 1;
 
             // check there is enough space...
-            sprintf (buffer, "df %s | tail -n 1 | tr -s \" \" \" \" | cut -d ' ' -f 3", src_mnt);
-            get_string (buffer, res);
-            sscanf (res, "%lld", &srcsz);
+            probe_space (src_mnt, &space);
+            exclude_space (exclude, src_mnt, &space);
+            srcsz = space.used / 1024;
+            src_files = space.files;
 
-            sprintf (buffer, "df %s | tail -n 1 | tr -s \" \" \" \" | cut -d ' ' -f 4", dst_mnt);
-            get_string (buffer, res);
-            sscanf (res, "%lld", &dstsz);
+            // an incremental backup overwrites the old files, so it may use the whole file system
+            probe_space (dst_mnt, &space);
+            dstsz = (base_file || resuming ? space.total : space.available) / 1024;
 
             if (srcsz >= dstsz)
             {
-                sys_printf ("umount %s", dst_mnt);
-                sys_printf ("umount %s", src_mnt);
                 fprintf(stderr,"Insufficient space. Backup aborted.\n");
-                return 18;
+                result = 18;
+                goto fail;
             }
 
+			stats_phase ("copying files");
 			printf ("-----------------------------------------------\n");
 			printf ("----    COPYING FILES PLEASE WAIT        ------\n");
 			printf ("-----------------------------------------------\n");
 			
-			if (show_progress){
-				long long int progress_max;
-				long long int progress_done;
-				copy_args src_dst;
-				pthread_t copy_thread;
-				
-				src_dst.src=src_mnt;
-				src_dst.dst=dst_mnt;
-				copying=1;
-				if(pthread_create(&copy_thread, NULL, (void* (*)(void*)) & copy_thread_func, &src_dst)) {
-					fprintf(stderr, "Error creating copy thread\n");
-					return 27;
+			copy_stats stats;
+			copy_args src_dst;
+			progress copy_progress;
+			
+			src_dst.src=src_mnt;
+			src_dst.dst=dst_mnt;
+			src_dst.options.threads=threads;
+			src_dst.options.record=manifest_out;
+			src_dst.options.base=NULL;
+			src_dst.options.changed=NULL;
+			src_dst.options.exclude=exclude;
+			src_dst.stats=&stats;
+			src_dst.errors=0;
+			
+			manifest_partition(manifest_out, parts[p].pnum);
+			if (reconcile_passes){
+				//the rescans compare with the list of this copy, it goes to the manifest at the end
+				sprintf(pass_file, "%s.pass", dst_file);
+				src_dst.options.record=manifest_create(pass_file);
+				if (src_dst.options.record==NULL){
+					result = 34;
+					goto fail;
 				}
-				
-				// get the size to be copied
-				/*sprintf (buffer, "du -s %s", src_mnt);
-				get_string (buffer, res);
-				sscanf (res, "%ld", &progress_max);*/
-				progress_max = srcsz;
-				if (progress_max < 50000) stime = 1;
-				else if (progress_max < 500000) stime = 5;
-				else stime = 10;
-
-				// wait for the copy to complete, while updating the progress bar...
-				//sprintf (buffer, "du -s %s", dst_mnt);
-				sprintf (buffer, "df %s | tail -n 1 | tr -s \" \" \" \" | cut -d ' ' -f 3", dst_mnt);
-				sleep (5);
-				printf("0%%");
-				while (copying)
-				{
-					get_string2 (buffer, res, 0);
-					sscanf (res, "%lld", &progress_done);
-					prog = 100.0 * progress_done / progress_max;
-					if (prog > 100) prog=100;
-					printf("\r%d%%", (int)prog);
-					fflush(stdout);
-					sleep (stime);
+				manifest_partition(src_dst.options.record, parts[p].pnum);
+			}
+			if (base_file){
+				sprintf(buffer, "%s.manifest", base_file);
+				src_dst.options.base=manifest_load(buffer, parts[p].pnum);
+				if (src_dst.options.base==NULL){
+					fprintf(stderr,"Could not read manifest %s of the base image.\n", buffer);
+					if (reconcile_passes) reconcile_cleanup(&src_dst, dst_file);
+					result = 35;
+					goto fail;
 				}
-				printf ("\r100%%\n");
-				/* wait for the second thread to finish */
-				if(pthread_join(copy_thread, NULL)) {
-					fprintf(stderr, "Error joining thread\n");
-					return 28;
+				printf("Updating %lld files of the base image.\n", src_dst.options.base->count);
+			}else if (resuming){
+				//the copy is finished like an incremental backup of what reached the image
+				dropped = manifest_prune(resume_base, dst_mnt);
+				src_dst.options.base = resume_base;
+				printf("Resuming partition %d, %lld entries of the interrupted copy are in the image, %lld are copied again.\n", parts[p].pnum, resume_base->count, dropped);
+			}
+			
+			// the used space and inodes of the source are the expected totals, an incremental backup copies an unknown part of them
+			memset(&stats, 0, sizeof(stats));
+			progress_start(&copy_progress, "copy", parts[p].pnum, &stats.bytes, &stats.files, src_dst.options.base ? 0 : srcsz * 1024,
+				src_dst.options.base ? 0 : src_files, show_progress, progress_fd);
+			//the files that reached the image are recorded every minute, the rescans of --reconcile only at the end
+			watch = reconcile_passes ? NULL : checkpoint_watch_start(cp, parts[p].pnum, manifest_out, dst_mnt, image_fd);
+			copy_thread_func(&src_dst);
+			checkpoint_watch_stop(watch);
+			progress_finish(&copy_progress);
+			
+			printf("Copied %lld files, %lld directories, %lld other entries, %lld bytes, %lld bytes of holes and zeros not written.\n", stats.files, stats.dirs, stats.others, stats.bytes, stats.holes);
+			if (stats.excluded) printf("%lld entries excluded.\n", stats.excluded);
+			if (src_dst.options.base){
+				printf("%lld entries unchanged, %lld deleted.\n", stats.unchanged, stats.deleted);
+				manifest_free(src_dst.options.base);
+				src_dst.options.base = NULL;
+				resume_base = NULL;
+			}
+			if (src_dst.errors){
+				fprintf(stderr, "Warning: %lld files could not be copied.\n", src_dst.errors);
+			}
+			if (reconcile_passes){
+				stats_phase ("reconciling");
+				n_err=manifest_close(src_dst.options.record);
+				src_dst.options.record=NULL;
+				if (n_err || reconcile(&src_dst, parts[p].pnum, dst_file, reconcile_passes, manifest_out) < 0){
+					reconcile_cleanup(&src_dst, dst_file);
+					fprintf(stderr,"Could not rescan partition %d.\n", parts[p].pnum);
+					result = 42;
+					goto fail;
 				}
-				
-			}else{ 
-				sys_printf ("cp -ax %s/. %s/.", src_mnt, dst_mnt);
 			}
             
             // fix up relevant files if changing partition UUID
@@ -585,6 +1634,8 @@ int clone_to_img (char * src_dev, char * dst_file, char new_uuid, long long int
             }
 
             // unmount partitions
+            stats_phase ("unmounting");
+            trim_mount (dst_mnt);
             int timeout=30;
             while (sys_printf ("umount %s", dst_mnt) && timeout>0)
             {
@@ -592,103 +1643,365 @@ int clone_to_img (char * src_dev, char * dst_file, char new_uuid, long long int
                 timeout--;
                 if (timeout==0){
                     fprintf(stderr,"Could not unmount partition %s.\n", dst_mnt);
-                    return 19;
+                    result = 19;
+                    goto fail;
                 }
             }
+            dst_mounted = 0;
 
             if (sys_printf ("umount %s", src_mnt))
             {
                 fprintf(stderr,"Warning: could not unmount partition source partition %s.\n", src_mnt);
                 //return 20;
             }
+            src_mounted = 0;
+
+            if (shrink && p == n - 1){
+                stats_phase ("shrinking");
+                if (strncmp (parts[p].ftype, "ext", 3)){
+                    printf ("Partition %d is not ext2/3/4, it is not shrunk.\n", parts[p].pnum);
+                }else{
+                    file_size_needed = shrink_last_partition (parts, dst_dev, p, extra_space);
+                    if (file_size_needed < 0){
+                        fprintf(stderr,"Could not shrink partition %d.\n", parts[p].pnum);
+                        result = 40;
+                        goto fail;
+                    }
+                    shrunk = 1;
+                }
+            }
 
-			//if (sys_printf ("umount %s%d", partition_name (dst_dev, dev), parts[p].pnum)){
-				
-			//}
-        }
-
-        // set the flags
-        if (!strcmp (parts[p].flags, "lba"))
-        {
-            if (sys_printf ("parted -s %s set %d lba on", dst_dev, parts[p].pnum))
+            // the partition is complete in the image file, a resumed backup skips it
+            if (cp)
             {
-                fprintf(stderr,"Could not set flags.\n");
-                return 21;
+                sync_device (partition_name (dst_dev, dev), parts[p].pnum);
+                if (fdatasync (image_fd) == 0) checkpoint_partition (cp, parts[p].pnum, manifest_sync (manifest_out));
             }
-        }
-        else
-        {
-            if (sys_printf ("parted -s %s set %d lba off", dst_dev, parts[p].pnum))
-            {
-                fprintf(stderr,"Could not set flags.\n");
-                return 22;
+
+            if (drain.sink){
+                sync_device (partition_name (dst_dev, dev), parts[p].pnum);
+                if (start_drain (&drain, &drain_thread, &draining, copied_until (parts, n, p, file_size_needed))){
+                    fprintf(stderr,"Could not compress image.\n");
+                    result = 30;
+                    goto fail;
+                }
             }
+
+			//if (sys_printf ("umount %s%d", partition_name (dst_dev, dev), parts[p].pnum)){
+				
+			//}
         }
+
     }
 	
+	if (format.running){
+		pthread_join (format_thread, NULL);
+		format.running = 0;
+	}
+	
+	if (verify){
+		stats_phase ("verifying");
+		printf ("-----------------------------------------------\n");
+		printf ("----    VERIFYING IMAGE PLEASE WAIT      ------\n");
+		printf ("-----------------------------------------------\n");
+		differences = verify_partitions (parts, src_dev, dst_dev, n, src_mnt, dst_mnt, dst_file, threads, started,
+			puid && new_uuid ? uuid_files : NULL, key_file, exclude, show_progress, progress_fd);
+		if (differences < 0){
+			fprintf(stderr,"Could not verify the image.\n");
+			result = 44;
+			goto fail;
+		}
+	}
+	
+	stats_phase ("finishing");
+	n_err = manifest_close(manifest_out);
+	manifest_out = NULL;
+	if (n_err){
+		fprintf(stderr,"Could not write manifest %s.\n", manifest_file);
+	}
+	
 	//release the image file
+	attached = 0;
 	if (sys_printf("losetup -d %s", dst_dev)){
 		fprintf(stderr,"Error releasing device %s.\n", dst_dev);
-		return 24;
+		result = 24;
+		goto fail;
 	}else{
 		printf("Backup completed!\n");
 	}
 	
+	//the image ends with the shrunk last partition
+	if (shrunk && truncate(dst_file, file_size_needed)){
+		fprintf(stderr,"Could not truncate %s to %lld bytes.\n", dst_file, file_size_needed);
+		result = 41;
+		goto fail;
+	}
+	
+	//the image is complete, there is nothing left to resume
+	checkpoint_close(cp, 1);
+	cp = NULL;
+	if (image_fd>=0) close(image_fd);
+	image_fd = -1;
+	
 	//delete partitions from devices
 	for (p = 0; p < n; p++){
 		sys_printf ("rm %s%d", partition_name (dst_dev, dev), parts[p].pnum);
 	}
 	
-	if (compress==1){
-		printf("Compressing image.\n");
-		sys_printf("bzip2 -f \"%s\"", dst_file_escaped);
+	if (drain.sink){
+		stats_phase ("compression");
+		for (p = 0; p < n_sinks; p++) printf("Writing %s.\n", names[p]);
+		n_err = start_drain (&drain, &drain_thread, &draining, file_size_needed) || start_drain (&drain, &drain_thread, &draining, 0);
+		if (sink_close(drain.sink)) n_err = 1;
+		drain.sink = NULL;
+		close(drain.fd);
+		drain.fd = -1;
+		if (n_err){
+			if (n_sinks>1) fprintf(stderr,"Could not write the image to every destination.\n");
+			else fprintf(stderr,"Could not compress image to %s.\n", names[0]);
+			result = 30;
+			goto fail;
+		}
+		if (repo || compress) unlink(dst_file);
+		if (repo){
+			//keep the manifest with the index
+			sprintf(buffer, "%s/index/%s.manifest", repo, name);
+			rename(manifest_file, buffer);
+		}
+		for (p = 0; p < n_sinks; p++) printf("Image %s completed!\n", names[p]);
 	}
-
-	if (compress==2){
-		printf("Compressing image.\n");
-		sys_printf("gzip -f \"%s\"", dst_file_escaped);
+	if (drain_failed){
+		fprintf(stderr,"%d of %d destinations could not be created.\n", drain_failed, n_more + 1);
+		result = 30;
+		goto fail;
 	}
 	
+	if (differences){
+		fprintf(stderr,"Verification failed, %lld entries of the image differ from the source.\n", differences);
+		result = 43;
+		goto fail;
+	}
+	if (verify) printf("Verification passed.\n");
     return 0;
+
+fail:
+	//the background threads use this stack frame, they are stopped before it is gone
+	if (format.running){
+		pthread_mutex_lock (&format.lock);
+		format.stop = 1;
+		pthread_mutex_unlock (&format.lock);
+		pthread_join (format_thread, NULL);
+	}
+	if (draining) pthread_join (drain_thread, NULL);
+	if (src_mounted) sys_printf ("umount %s", src_mnt);
+	if (dst_mounted) sys_printf ("umount %s", dst_mnt);
+	if (attached) sys_printf ("losetup -d %s", dst_dev);
+	if (manifest_out) manifest_close(manifest_out);
+	if (resume_base) manifest_free(resume_base);
+	checkpoint_close(cp, 0);
+	if (image_fd>=0) close(image_fd);
+	if (drain.sink) sink_close(drain.sink);
+	if (drain.fd>=0) close(drain.fd);
+	return result;
+}
+
+/* build_to_img
+   Writes the image straight from the directory trees of the running system, without loop devices, parted, mkfs or mounts
+	@param src_dev disk whose identifier and labels the image gets, so PARTUUID= in fstab and cmdline.txt stays valid
+	@param dst_file the image file, it is replaced
+	@param options the trees, sizes, threads and exclude rules, disk_id and the labels are set here
+	@param show_progress if 1 will show copy progress
+	@param progress_fd file descriptor for the JSON progress stream, -1 for none
+	@return 0 on success or the exit code
+*/
+static int build_to_img (char * src_dev, char * dst_file, build_options * options, char show_progress, int progress_fd)
+{
+	char disk_id[16], boot_label[20], root_label[20], name[PATH_MAX], dir[PATH_MAX], root[PATH_MAX], * slash;
+	partition_t parts[MAXPART];
+	long long int bytes, files, errors;
+	progress build_progress;
+	copy_stats stats;
+	build_image * b;
+	fs_space space;
+	struct stat st, dst_st;
+	int n;
+
+	// the image must not be written into the tree it is built from
+	snprintf(name, sizeof(name), "%s", dst_file);
+	slash = strrchr(name, '/');
+	if (slash) *slash = 0;
+	if (realpath(slash ? (strlen(name) ? name : "/") : ".", dir) && realpath(options->root_dir, root) && stat(dir, &dst_st)==0 && stat(root, &st)==0 &&
+		dst_st.st_dev==st.st_dev && (!strcmp(root, "/") || (!strncmp(dir, root, strlen(root)) && (dir[strlen(root)]=='/' || dir[strlen(root)]==0)))){
+		fprintf(stderr,"Destination file is located in the file system to copy, use a file on an external drive.\n");
+		return 25;
+	}
+
+	stats_phase ("reading partitions");
+	n = probe_partition_table(src_dev, parts, disk_id);
+	if (n>=2 && strlen(disk_id)){
+		options->disk_id = disk_id;
+		snprintf(boot_label, sizeof(boot_label), "%s", parts[0].label);
+		snprintf(root_label, sizeof(root_label), "%s", parts[n-1].label);
+		if (strlen(boot_label)) options->boot_label = boot_label;
+		if (strlen(root_label)) options->root_label = root_label;
+	}else{
+		printf("Could not read the partition table of %s, the image gets a new disk identifier: PARTUUID= in its fstab and cmdline.txt must be changed.\n", src_dev);
+	}
+
+	stats_phase ("scanning");
+	b = build_scan(options);
+	if (b==NULL) return 50;
+	build_totals(b, &bytes, &files);
+	printf("Building a %lld byte image with %lld files, %lld bytes of data.\n", build_size(b), files, bytes);
+
+	// the image is sparse, only the data and the metadata take space
+	n = open(dst_file, O_WRONLY | O_CREAT, 0644);
+	if (n>=0) close(n);
+	if (probe_space(dst_file, &space)==0 && space.available < bytes){
+		fprintf(stderr, "Not enough free space to create destination image file %lld free, required %lld bytes.\n", space.available, bytes);
+		build_free(b);
+		return 26;
+	}
+
+	stats_phase ("building");
+	memset(&stats, 0, sizeof(stats));
+	progress_start(&build_progress, "build", 0, &stats.bytes, &stats.files, bytes, files, show_progress, progress_fd);
+	errors = build_write(b, dst_file, &stats);
+	progress_finish(&build_progress);
+	build_free(b);
+	if (errors<0){
+		fprintf(stderr,"Could not build %s.\n", dst_file);
+		return 50;
+	}
+	printf("Copied %lld files, %lld directories, %lld other entries, %lld bytes, %lld bytes of holes and zeros not written.\n", stats.files, stats.dirs, stats.others, stats.bytes, stats.holes);
+	if (stats.excluded) printf("%lld entries excluded.\n", stats.excluded);
+	if (errors) fprintf(stderr,"Warning: %lld entries could not be copied.\n", errors);
+	printf("Image %s is ready.\n", dst_file);
+	return 0;
 }
 
 
 /*---------------------------------------------------------------------------*/
 /* Main function */
+/* options of a fleet that are the same for all jobs */
+
+typedef struct
+{
+	char new_uuid;
+	long long int extra_space;
+	char compress;
+	char block_mode;
+	char shrink;
+	int reconcile_passes;
+	char verify;
+	char * key_file;
+	char resume;
+	const exclude_rules * exclude;
+} clone_options;
+
+/* Runs one job of a fleet, the jobs share stdout so they don't show progress */
+
+static int clone_job (fleet_job * job, int threads, void * arg)
+{
+	clone_options * o = arg;
+	char * more_dst[MAXDEST];
+	int i;
+
+	for (i = 0; i < job->n_more; i++) more_dst[i] = job->more_dst[i];
+	return clone_to_img (job->src_dev, job->dst_file, more_dst, job->n_more, o->new_uuid, o->extra_space, 0, -1, o->compress, threads,
+		NULL, NULL, o->block_mode, o->shrink, o->reconcile_passes, o->verify, o->key_file, o->resume, o->exclude);
+}
+
+/* Ends the job of the -s and -d arguments so far, the next -s starts a new one */
+
+static int add_job (fleet_job * jobs, int * n_jobs, char * src_dev, char * dst_file, char ** more_dst, int * n_more)
+{
+	int i;
+
+	if (strlen(dst_file)==0){
+		fprintf(stderr,"Missing destination for -s %s (-d <destination_file>).\n", src_dev);
+		return 1;
+	}
+	if (*n_jobs==MAXJOBS){
+		fprintf(stderr,"At most %d jobs can be run at once.\n", MAXJOBS);
+		return 1;
+	}
+	memset(&jobs[*n_jobs], 0, sizeof(fleet_job));
+	snprintf(jobs[*n_jobs].src_dev, sizeof(jobs[*n_jobs].src_dev), "%s", src_dev);
+	snprintf(jobs[*n_jobs].dst_file, sizeof(jobs[*n_jobs].dst_file), "%s", dst_file);
+	for (i = 0; i < *n_more; i++) snprintf(jobs[*n_jobs].more_dst[i], sizeof(jobs[*n_jobs].more_dst[i]), "%s", more_dst[i]);
+	jobs[*n_jobs].n_more = *n_more;
+	(*n_jobs)++;
+	dst_file[0]=0;
+	*n_more=0;
+	return 0;
+}
+
 int main (int argc, char *argv[])
 {
-	char dst_file[64];
+	char dst_file[512];
+	char * more_dst[MAXDEST];
+	char stream_file[32];
+	int n_more=0;
 	char src_dev[64];
 	char new_uuid=0;
 	char show_progress=0;
+	int progress_fd=-1;
+	char * stats_file=NULL;
 	char compress=0;
 	long long int extra_space=(long long int)512*(long long int)20480; //10MB extra space
+	int threads=0;
+	char * base_file=NULL;
+	char * repo=NULL;
+	char * export_name=NULL;
+	char block_mode=0;
+	char shrink=0;
+	int image_fd=-1;
+	int io_type=IO_ENGINE_AUTO, io_depth=0, io_block=0;
+	char gentle=0, adaptive=0;
+	int reconcile_passes=0;
+	char verify=0;
+	char * key_file=NULL;
+	char * restore_file=NULL;
+	char * extract_path=NULL;
+	char expand=0, discard=0, src_set=0, resume=0;
+	double max_rate=0;
+	fleet_job * jobs=NULL;
+	char * jobs_file=NULL;
+	exclude_rules * exclude=NULL;
+	build_options build;
+	int n_jobs=0, max_jobs=MAXJOBS, jobs_per_dest=2, jobs_per_bus=2;
 	int i;
 	
-	printf ("----    Raspberry Pi clone to image V1.8    ---\n");
-	printf ("-----------------------------------------------\n");
-	printf ("---- DO NOT CHANGE FILES ON YOUR SD CARD    ---\n");
-	printf ("---- WHILE THE BACKUP PROGRAM IS RUNNING    ---\n");
-	printf ("---- THE DESTINATION .IMG FILE MUST BE      ---\n");
-	printf ("---- ON AN EXTERNAL STORAGE / NETWORK SHARE ---\n");
-	printf ("-----------------------------------------------\n");
-	
 	sprintf(src_dev, "/dev/mmcblk0");
 	dst_file[0]=0;
+	memset(&build, 0, sizeof(build));
 	
 	for (i=1;i<argc;i++){
 		if (strcmp(argv[i], "-d")==0){
 			i++;
-			if (i<argc){
-				stpcpy(dst_file,argv[i]);
+			if (i<argc && strlen(dst_file) && n_more<MAXDEST-1){
+				//the card is read once for all destinations
+				more_dst[n_more++]=argv[i];
+			}else if (i<argc && strlen(dst_file)){
+				fprintf(stderr,"At most %d destinations can be given with -d.\n", MAXDEST);
+				return 1;
+			}else if (i<argc){
+				snprintf(dst_file, sizeof(dst_file), "%s", argv[i]);
 			}else{
 				fprintf(stderr,"Missing file name for -d.\n");
 				return 1;
 			}
 		}else if (strcmp(argv[i], "-s")==0){
 			i++;
+			if (i<argc && src_set){
+				//another source, the -d arguments after it belong to it
+				if (jobs==NULL) jobs=calloc(MAXJOBS, sizeof(fleet_job));
+				if (add_job(jobs, &n_jobs, src_dev, dst_file, more_dst, &n_more)) return 1;
+			}
 			if (i<argc){
-				stpcpy(src_dev,argv[i]);
+				snprintf(src_dev, sizeof(src_dev), "%s", argv[i]);
+				src_set=1;
 			}else{
 				fprintf(stderr,"Missing device for -s.\n");
 				return 1;
@@ -705,8 +2018,150 @@ int main (int argc, char *argv[])
 			compress=1;
 		}else if (strcmp(argv[i], "-gzip")==0){
 			compress=2;
+		}else if (strcmp(argv[i], "-zstd")==0){
+			compress=3;
 		}else if (strcmp(argv[i], "-p")==0){
 			show_progress=1;
+		}else if (strcmp(argv[i], "--progress-json")==0){
+			i++;
+			if (i>=argc || sscanf(argv[i], "%d", &progress_fd)!=1 || fcntl(progress_fd, F_GETFD)==-1){
+				fprintf(stderr,"Missing or invalid file descriptor for --progress-json.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--stats-json")==0){
+			i++;
+			if (i<argc){
+				stats_file=argv[i];
+			}else{
+				fprintf(stderr,"Missing file name for --stats-json.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "-b")==0){
+			block_mode=1;
+		}else if (strcmp(argv[i], "--io-engine")==0){
+			i++;
+			if (i<argc && strcmp(argv[i], "io_uring")==0){
+				io_type=IO_ENGINE_URING;
+			}else if (i<argc && strcmp(argv[i], "threads")==0){
+				io_type=IO_ENGINE_THREADS;
+			}else{
+				fprintf(stderr,"--io-engine must be io_uring or threads.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--io-depth")==0){
+			i++;
+			if (i<argc){
+				sscanf(argv[i], "%d", &io_depth);
+			}else{
+				fprintf(stderr,"Missing request count for --io-depth.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--io-block")==0){
+			i++;
+			if (i<argc){
+				sscanf(argv[i], "%d", &io_block);
+			}else{
+				fprintf(stderr,"Missing byte count for --io-block.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--reconcile")==0){
+			i++;
+			if (i>=argc || sscanf(argv[i], "%d", &reconcile_passes)!=1 || reconcile_passes<0){
+				fprintf(stderr,"Missing or invalid number of passes for --reconcile.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--restore")==0){
+			i++;
+			if (i<argc){
+				restore_file=argv[i];
+			}else{
+				fprintf(stderr,"Missing image file for --restore.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--extract")==0){
+			i++;
+			if (i<argc){
+				extract_path=argv[i];
+			}else{
+				fprintf(stderr,"Missing path for --extract.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--jobs")==0){
+			i++;
+			if (i<argc){
+				jobs_file=argv[i];
+			}else{
+				fprintf(stderr,"Missing job file for --jobs.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--max-jobs")==0){
+			i++;
+			if (i>=argc || sscanf(argv[i], "%d", &max_jobs)!=1 || max_jobs<1){
+				fprintf(stderr,"Missing or invalid number for --max-jobs.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--jobs-per-dest")==0){
+			i++;
+			if (i>=argc || sscanf(argv[i], "%d", &jobs_per_dest)!=1 || jobs_per_dest<1){
+				fprintf(stderr,"Missing or invalid number for --jobs-per-dest.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--jobs-per-bus")==0){
+			i++;
+			if (i>=argc || sscanf(argv[i], "%d", &jobs_per_bus)!=1 || jobs_per_bus<1){
+				fprintf(stderr,"Missing or invalid number for --jobs-per-bus.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--expand")==0){
+			expand=1;
+		}else if (strcmp(argv[i], "--discard")==0){
+			discard=1;
+		}else if (strcmp(argv[i], "--verify")==0){
+			verify=1;
+		}else if (strcmp(argv[i], "--resume")==0){
+			resume=1;
+		}else if (strcmp(argv[i], "--exclude")==0){
+			i++;
+			if (exclude==NULL) exclude=exclude_new();
+			if (i>=argc){
+				fprintf(stderr,"Missing rule for --exclude.\n");
+				return 1;
+			}
+			if (exclude_add(exclude, argv[i])) return 1;
+		}else if (strcmp(argv[i], "--exclude-from")==0){
+			i++;
+			if (exclude==NULL) exclude=exclude_new();
+			if (i>=argc){
+				fprintf(stderr,"Missing file name for --exclude-from.\n");
+				return 1;
+			}
+			if (exclude_add_file(exclude, argv[i])) return 1;
+		}else if (strcmp(argv[i], "--exclude-defaults")==0){
+			if (exclude==NULL) exclude=exclude_new();
+			exclude_add_defaults(exclude);
+		}else if (strcmp(argv[i], "--sign-key")==0){
+			i++;
+			if (i<argc){
+				key_file=argv[i];
+			}else{
+				fprintf(stderr,"Missing key file for --sign-key.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--gentle")==0){
+			gentle=1;
+		}else if (strcmp(argv[i], "--adaptive")==0){
+			adaptive=1;
+		}else if (strcmp(argv[i], "--max-rate")==0){
+			i++;
+			if (i>=argc || sscanf(argv[i], "%lf", &max_rate)!=1 || max_rate<=0){
+				fprintf(stderr,"Missing or invalid MB/s for --max-rate.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--stream")==0){
+			if (strlen(dst_file)==0) strcpy(dst_file, "-");
+			else if (n_more<MAXDEST-1) more_dst[n_more++]="-";
+		}else if (strcmp(argv[i], "--shrink")==0){
+			shrink=1;
 		}else if (strcmp(argv[i], "-x")==0){
 			i++;
 			if (i<argc){
@@ -715,6 +2170,60 @@ int main (int argc, char *argv[])
 				fprintf(stderr,"Missing byte count for -x.\n");
 				return 1;
 			}
+		}else if (strcmp(argv[i], "-j")==0){
+			i++;
+			if (i<argc){
+				sscanf(argv[i], "%d", &threads);
+			}else{
+				fprintf(stderr,"Missing thread count for -j.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--base")==0){
+			i++;
+			if (i<argc){
+				base_file=argv[i];
+			}else{
+				fprintf(stderr,"Missing image file for --base.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--build")==0){
+			i++;
+			if (i<argc){
+				build.root_dir=argv[i];
+			}else{
+				fprintf(stderr,"Missing directory for --build.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--boot-dir")==0){
+			i++;
+			if (i<argc){
+				build.boot_dir=argv[i];
+			}else{
+				fprintf(stderr,"Missing directory for --boot-dir.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--boot-size")==0){
+			i++;
+			if (i>=argc || sscanf(argv[i], "%lld", &build.boot_size)!=1 || build.boot_size<=0){
+				fprintf(stderr,"Missing or invalid byte count for --boot-size.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--repo")==0){
+			i++;
+			if (i<argc){
+				repo=argv[i];
+			}else{
+				fprintf(stderr,"Missing directory for --repo.\n");
+				return 1;
+			}
+		}else if (strcmp(argv[i], "--export")==0){
+			i++;
+			if (i<argc){
+				export_name=argv[i];
+			}else{
+				fprintf(stderr,"Missing image name for --export.\n");
+				return 1;
+			}
 		}else if (strcmp(argv[i], "-?")==0){
 			printf("Create a backup of your SD card to an image file.\n");
 			printf("Warning! the <destination_file> image file must be located on an external drive, you cannot backup to a file on the SD card!\n");
@@ -722,11 +2231,49 @@ int main (int argc, char *argv[])
 			printf("imgclone [-u 1] [-s <source_device>] -d <destination_file>\n");
 			printf("	-u 1				   optional creates new UUID for the partitions.\n");
 			printf("	-s <source_device>     creates a backup of source_device, optional default is /dev/mmcblk0.\n");
-			printf("	-d <destination_file>  backup to destination_file.\n");
+			printf("	-d <destination_file>  backup to destination_file, - writes the image to stdout in block mode.\n");
+			printf("	                       -d can be repeated (up to 8) to write the same image to several destinations while the card is read once.\n");
+			printf("    --jobs <file>          clone many sources at once, one job per line: <source_device> <destination_file> [<destination_file> ...],\n");
+			printf("                           -s can also be given more than once, the -d arguments after each -s belong to it.\n");
+			printf("    --max-jobs <n>         with several sources, run at most <n> jobs at the same time.\n");
+			printf("    --jobs-per-dest <n>    run at most <n> jobs at the same time that write to one file system, default 2.\n");
+			printf("    --jobs-per-bus <n>     run at most <n> jobs at the same time whose sources are on one USB bus or controller, default 2.\n");
+			printf("    --stream               same as -d -, the raw or compressed image is written to stdout, messages go to stderr.\n");
 			printf("    -x <number>            add <number> extra bytes of free space to the last partition.\n");
 			printf("    -p			           write copy progress to output.\n");
-			printf("    -bzip2  	           use bzip2 command to compress the image after cloning.\n");
-			printf("    -gzip   	           use gzip  command to compress the image after cloning.\n");
+			printf("    --progress-json <fd>   write progress as one JSON object per line to file descriptor <fd>.\n");
+			printf("    --stats-json <file>    write wall time, I/O, CPU time and peak memory of each phase as JSON to <file>, - for stdout.\n");
+			printf("    -j <threads>           number of parallel file copy threads, default 2 per CPU core.\n");
+			printf("    --shrink               shrink the last ext2/3/4 partition to the smallest size that holds its files plus -x, and the image with it.\n");
+			printf("    -b                     block mode, copy only the used blocks of ext2/3/4 and FAT file systems, partitions keep their size.\n");
+			printf("    --io-engine <type>     io_uring (default when the kernel has it) or threads, for the block reads and image writes.\n");
+			printf("    --io-depth <number>    number of block reads or writes in flight, default 16.\n");
+			printf("    --io-block <bytes>     size of each block read or write, default 1048576.\n");
+			printf("    --reconcile <passes>   after each partition, copy the files that changed during the copy again, up to <passes> times.\n");
+			printf("    --verify               compare the files of the image with the source after the copy and write a signed list of them.\n");
+			printf("    --sign-key <file>      with --verify, sign the list with HMAC-SHA256 and the secret key in <file> instead of a SHA-256.\n");
+			printf("    --gentle               keep the copied data out of the page cache, for backups of a system that is in use.\n");
+			printf("    --max-rate <MB/s>      copy at most <MB/s> megabytes per second.\n");
+			printf("    --adaptive             slow the copy down while requests to the source device take longer than normal.\n");
+			printf("    --base <image_file>    incremental backup, copy only the files that changed since the uncompressed <image_file> was made.\n");
+			printf("    --exclude <rule>       leave the files that match <rule> out of the image, e.g. /var/swap or *.tmp, can be repeated.\n");
+			printf("    --exclude-from <file>  read exclude rules from <file>, one per line.\n");
+			printf("    --exclude-defaults     leave out the swap file, package and user caches, journal logs and temporary files of Raspberry Pi OS.\n");
+			printf("    --resume               continue an interrupted backup to an uncompressed image file after the last checkpoint in <destination_file>.checkpoint.\n");
+			printf("    -bzip2  	           compress the image with bzip2 while cloning.\n");
+			printf("    -gzip   	           compress the image with gzip on all CPU cores while cloning.\n");
+			printf("    -zstd   	           compress the image with zstd on all CPU cores while cloning.\n");
+			printf("    --repo <directory>     store the image in a deduplicating chunk repository, -d is the image name.\n");
+			printf("    --restore <image>      write a .img, .img.gz, .img.zst or .img.bz2 backup to the device given with -s, zero blocks are not written.\n");
+			printf("    --expand               with --restore, grow the last ext2/3/4 partition and file system to the end of the device.\n");
+			printf("    --discard              with --restore, unmap zero blocks when the device reads them back as zeros.\n");
+			printf("    --extract [<n>:]<path> copy one file out of the .img or indexed .img.gz given with -s to -d <file>, - for stdout,\n");
+			printf("                           from partition <n> or the last partition, without restoring the image.\n");
+			printf("    --export <name>        with --repo, write image <name> from the repository to -d <destination_file>, - for stdout.\n");
+			printf("    --build <directory>    write the image straight from the files below <directory> (/ for the running system), without loop\n");
+			printf("                           devices, parted, mkfs or mounts: a FAT32 boot and an ext4 root partition, -s only gives the disk identifier.\n");
+			printf("    --boot-dir <directory> with --build, the files of the boot partition, default the file system mounted on boot/firmware or boot.\n");
+			printf("    --boot-size <bytes>    with --build, the size of the boot partition, default the size of the mounted boot file system.\n");
 			return 0;
 		}else{
 			fprintf(stderr,"Invalid argument %s\n", argv[i]);
@@ -734,13 +2281,260 @@ int main (int argc, char *argv[])
 		}
 	}
 	
+	if ((build.boot_dir || build.boot_size) && build.root_dir==NULL){
+		fprintf(stderr,"--boot-dir and --boot-size need --build <directory>.\n");
+		return 1;
+	}
+	
+	if (n_jobs || jobs_file){
+		clone_options options;
+		int failed, j;
+		
+		if (jobs==NULL) jobs=calloc(MAXJOBS, sizeof(fleet_job));
+		if ((src_set || strlen(dst_file)) && add_job(jobs, &n_jobs, src_dev, dst_file, more_dst, &n_more)) return 1;
+		if (jobs_file && (n_jobs=fleet_load(jobs_file, jobs, n_jobs))<0) return 1;
+		if (n_jobs==0){
+			fprintf(stderr,"No jobs in %s.\n", jobs_file);
+			return 1;
+		}
+		if (repo || restore_file || extract_path || export_name || build.root_dir || base_file || adaptive || show_progress || progress_fd>=0){
+			fprintf(stderr,"Several sources cannot be combined with --repo, --restore, --extract, --export, --build, --base, --adaptive or progress reports.\n");
+			return 1;
+		}
+		for (i=0;i<n_jobs;i++){
+			for (j=0;j<i;j++){
+				if (!strcmp(jobs[i].src_dev, jobs[j].src_dev)){
+					fprintf(stderr,"%s is the source of more than one job.\n", jobs[i].src_dev);
+					return 1;
+				}
+			}
+			for (j=-1;j<jobs[i].n_more;j++){
+				if (!strcmp(j<0 ? jobs[i].dst_file : jobs[i].more_dst[j], "-")){
+					fprintf(stderr,"The jobs of a fleet cannot write to stdout.\n");
+					return 1;
+				}
+			}
+		}
+		if (block_mode && (new_uuid || shrink || reconcile_passes || verify || exclude)){
+			fprintf(stderr,"-b cannot be combined with -u, --shrink, --reconcile, --verify or --exclude, the file systems are copied as they are.\n");
+			return 1;
+		}
+		for (i=0;i<n_jobs && resume;i++){
+			if (compress || jobs[i].n_more){
+				fprintf(stderr,"--resume continues one uncompressed image file per source, it cannot be combined with compression or more than one -d.\n");
+				return 1;
+			}
+		}
+		if (key_file && !verify){
+			fprintf(stderr,"--sign-key needs --verify.\n");
+			return 1;
+		}
+		io_engine_configure(io_type, io_depth, io_block);
+		throttle_configure((long long int)(max_rate*1000000), gentle, NULL);
+		if (threads<=0) threads=copy_default_threads();
+		options.new_uuid=new_uuid;
+		options.extra_space=extra_space;
+		options.compress=compress;
+		options.block_mode=block_mode;
+		options.shrink=shrink;
+		options.reconcile_passes=reconcile_passes;
+		options.verify=verify;
+		options.key_file=key_file;
+		options.resume=resume;
+		options.exclude=exclude;
+		//the phases of the jobs overlap, the whole run is one phase
+		stats_hold("fleet");
+		failed = fleet_run(jobs, n_jobs, max_jobs, jobs_per_dest, jobs_per_bus, threads, clone_job, &options);
+		free(jobs);
+		stats_end();
+		stats_print(stdout);
+		i = failed ? 48 : 0;
+		if (stats_file && stats_write_json(stats_file, i) && i==0) i=39;
+		return i;
+	}
+	
+	if (n_more && (repo || restore_file || extract_path || export_name || build.root_dir)){
+		fprintf(stderr,"-d can only be given more than once for a backup without --repo.\n");
+		return 1;
+	}
+	
+	if (restore_file){
+		volatile long long int written=0;
+		progress restore_progress;
+		struct stat st;
+		
+		//the default source is the running SD card, restoring needs a device that was named
+		if (!src_set){
+			fprintf(stderr,"--restore needs the device to write to with -s <device>.\n");
+			return 1;
+		}
+		if (probe_mounted(src_dev)){
+			fprintf(stderr,"%s or one of its partitions is mounted, unmount it first.\n", src_dev);
+			return 1;
+		}
+		stats_phase("restoring");
+		progress_start(&restore_progress, "restore", 0, &written, NULL, stat(restore_file, &st)==0 && (st.st_size & 511)==0 ? st.st_size : 0, 0, show_progress, progress_fd);
+		i = restore_image(restore_file, src_dev, discard, threads, &written);
+		progress_finish(&restore_progress);
+		if (i){
+			fprintf(stderr,"Could not restore %s to %s.\n", restore_file, src_dev);
+			i = 45;
+		}else{
+			printf("Restored %lld bytes to %s.\n", written, src_dev);
+			if (probe_reread(src_dev)) sys_printf("partprobe %s", src_dev);
+			if (expand) i = expand_last_partition(src_dev);
+		}
+		stats_end();
+		stats_print(stdout);
+		if (stats_file && stats_write_json(stats_file, i) && i==0) i=39;
+		return i;
+	}
+	
+	if (extract_path){
+		const char * name;
+		int out;
+		
+		if (!src_set){
+			fprintf(stderr,"--extract needs the image to read with -s <image>.\n");
+			return 1;
+		}
+		//without -d the file goes to the current directory under its own name
+		if (strlen(dst_file)==0){
+			name = strrchr(extract_path, '/');
+			name = name ? name+1 : strchr(extract_path, ':') ? strchr(extract_path, ':')+1 : extract_path;
+			if (strlen(name)==0){
+				fprintf(stderr,"Missing destination file argument (-d <destination_file>).\n");
+				return 1;
+			}
+			snprintf(dst_file, sizeof(dst_file), "%s", name);
+		}
+		if (strcmp(dst_file, "-")==0){
+			out=dup(1);
+			if (out<0 || dup2(2, 1)<0){
+				fprintf(stderr,"Could not redirect stdout.\n");
+				return 1;
+			}
+		}else{
+			out=open(dst_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (out<0){
+				fprintf(stderr,"Could not create %s: %s\n", dst_file, strerror(errno));
+				return 1;
+			}
+		}
+		i = extract_file(src_dev, extract_path, out);
+		if (close(out)) i = -1;
+		if (i){
+			fprintf(stderr,"Could not extract %s from %s.\n", extract_path, src_dev);
+			return 47;
+		}
+		return 0;
+	}
+	
 	if (strlen(dst_file)==0){
 		fprintf(stderr,"Missing destination file argument (-d <destination_file>).\n");
 		return 1;
 	}
 	
+	if (strcmp(dst_file, "-")==0){
+		//the image goes to stdout, all messages to stderr
+		if (isatty(1)){
+			fprintf(stderr,"Not writing an image to a terminal, redirect stdout to a file or pipe.\n");
+			return 1;
+		}
+		image_fd=dup(1);
+		if (image_fd<0 || dup2(2, 1)<0){
+			fprintf(stderr,"Could not redirect stdout.\n");
+			return 1;
+		}
+		snprintf(dst_file, sizeof(dst_file), "/dev/fd/%d", image_fd);
+	}
+	for (i=0;i<n_more;i++){
+		if (strcmp(more_dst[i], "-")) continue;
+		if (image_fd>=0 || isatty(1)){
+			fprintf(stderr,"Only one destination can be stdout, and not a terminal.\n");
+			return 1;
+		}
+		image_fd=dup(1);
+		if (image_fd<0 || dup2(2, 1)<0){
+			fprintf(stderr,"Could not redirect stdout.\n");
+			return 1;
+		}
+		snprintf(stream_file, sizeof(stream_file), "/dev/fd/%d", image_fd);
+		more_dst[i]=stream_file;
+	}
+	
+	printf ("----    Raspberry Pi clone to image V1.8    ---\n");
+	printf ("-----------------------------------------------\n");
+	printf ("---- DO NOT CHANGE FILES ON YOUR SD CARD    ---\n");
+	printf ("---- WHILE THE BACKUP PROGRAM IS RUNNING    ---\n");
+	printf ("---- THE DESTINATION .IMG FILE MUST BE      ---\n");
+	printf ("---- ON AN EXTERNAL STORAGE / NETWORK SHARE ---\n");
+	printf ("-----------------------------------------------\n");
+	
+	if (export_name){
+		if (repo==NULL){
+			fprintf(stderr,"--export needs --repo <directory>.\n");
+			return 1;
+		}
+		return chunkstore_export(repo, export_name, dst_file);
+	}
+	
+	if (build.root_dir){
+		//the image is written by imgclone itself, none of the options for the partitions it copies apply
+		if (image_fd>=0 || repo || compress || block_mode || new_uuid || base_file || shrink || reconcile_passes || verify || resume){
+			fprintf(stderr,"--build cannot be combined with stdout, --repo, compression, -b, -u, --base, --shrink, --reconcile, --verify or --resume.\n");
+			return 1;
+		}
+		throttle_configure((long long int)(max_rate*1000000), gentle, NULL);
+		if (gentle) printf("Gentle mode is on.\n");
+		if (max_rate>0) printf("Copying at most %.1f MB/s.\n", max_rate);
+		if (threads<=0) threads=copy_default_threads();
+		printf("Building %s from %s with %d copy threads.\n", dst_file, build.root_dir, threads);
+		if (exclude) printf("Leaving out the files that match %d exclude rules.\n", exclude_count(exclude));
+		build.extra_space=extra_space;
+		build.threads=threads;
+		build.exclude=exclude;
+		i = build_to_img(src_dev, dst_file, &build, show_progress, progress_fd);
+		stats_end();
+		stats_print(stdout);
+		if (stats_file && stats_write_json(stats_file, i) && i==0) i=39;
+		return i;
+	}
+	
+	if (image_fd>=0){
+		//without an image file and loop device only the blocks can be copied
+		if (repo || new_uuid || base_file || shrink || reconcile_passes || verify || exclude){
+			fprintf(stderr,"Streaming to stdout cannot be combined with --repo, -u, --base, --shrink, --reconcile, --verify or --exclude.\n");
+			return 1;
+		}
+		block_mode=1;
+	}
+	
+	if (resume && (repo || compress || n_more || base_file || image_fd>=0)){
+		fprintf(stderr,"--resume continues an uncompressed image file, it cannot be combined with --repo, compression, --base, stdout or more than one -d.\n");
+		return 1;
+	}
+	
+	if (repo){
+		char name[512], tmp_dir[512];
+		
+		if (compress || base_file){
+			fprintf(stderr,"--repo cannot be combined with compression or --base.\n");
+			return 1;
+		}
+		//the raw image is built in the repository and removed when it is stored
+		snprintf(name, sizeof(name), "%s", dst_file);
+		if (snprintf(dst_file, sizeof(dst_file), "%s/tmp/%s.img", repo, name) >= (int) sizeof(dst_file)){
+			fprintf(stderr,"The path of the repository %s and the name %s are too long.\n", repo, name);
+			return 1;
+		}
+		mkdir(repo, 0755);
+		snprintf(tmp_dir, sizeof(tmp_dir), "%s/tmp", repo);
+		mkdir(tmp_dir, 0755);
+	}
 
 	printf("Cloning %s to %s\n", src_dev, dst_file);
+	for (i=0;i<n_more;i++) printf("and to %s\n", more_dst[i]);
 	switch (compress){
 		case 1:
 			printf("bzip2 compress is on.\n");
@@ -748,9 +2542,50 @@ int main (int argc, char *argv[])
 		case 2:
 			printf("gzip compress in on.\n");
 			break;
+		case 3:
+			printf("zstd compress is on.\n");
+			break;
 	}
 	if (show_progress){
 		printf("Show progress is on.\n");
 	}
-	return clone_to_img(src_dev, dst_file, new_uuid, extra_space, show_progress, compress);
+	if (base_file){
+		if (new_uuid){
+			fprintf(stderr,"-u cannot be used with --base, the partitions of the base image are kept.\n");
+			return 1;
+		}
+		printf("Incremental backup based on %s.\n", base_file);
+	}
+	if (block_mode){
+		if (new_uuid || base_file || shrink || reconcile_passes || verify || exclude){
+			fprintf(stderr,"-b cannot be combined with -u, --base, --shrink, --reconcile, --verify or --exclude, the file systems are copied as they are.\n");
+			return 1;
+		}
+		printf("Block mode is on, do not write to the source while it is copied.\n");
+	}
+	io_engine_configure(io_type, io_depth, io_block);
+	throttle_configure((long long int)(max_rate*1000000), gentle, adaptive ? src_dev : NULL);
+	if (gentle) printf("Gentle mode is on.\n");
+	if (max_rate>0) printf("Copying at most %.1f MB/s.\n", max_rate);
+	if (key_file && !verify){
+		fprintf(stderr,"--sign-key needs --verify.\n");
+		return 1;
+	}
+	if (threads<=0) threads=copy_default_threads();
+	printf("Using %d copy threads.\n", threads);
+	if (resume) printf("Resuming an interrupted backup.\n");
+	if (exclude) printf("Leaving out the files that match %d exclude rules.\n", exclude_count(exclude));
+	i = clone_to_img(src_dev, dst_file, more_dst, n_more, new_uuid, extra_space, show_progress, progress_fd, compress, threads, base_file, repo, block_mode, shrink, reconcile_passes, verify, key_file, resume, exclude);
+	if (i && i!=49 && !repo && !compress && !n_more && !base_file && image_fd<0){
+		char journal_file[1024];
+		
+		snprintf(journal_file, sizeof(journal_file), "%s.checkpoint", dst_file);
+		if (access(journal_file, F_OK)==0) fprintf(stderr,"Run imgclone again with --resume to continue after the last checkpoint.\n");
+	}
+	
+	//time and I/O of each phase
+	stats_end();
+	stats_print(stdout);
+	if (stats_file && stats_write_json(stats_file, i) && i==0) i=39;
+	return i;
 }
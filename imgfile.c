@@ -0,0 +1,263 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+imgfile: reads raw images and indexed gzip images at random offsets.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "imgfile.h"
+#include "util.h"
+
+#define CACHE_FRAMES 16
+
+typedef struct
+{
+	long long int frame;            /* -1 if empty */
+	unsigned long long int used;    /* last use, the oldest slot is reused */
+	char *data;
+} frame_cache;
+
+struct img_file
+{
+	int fd;
+	long long int size;
+	int gz;
+	unsigned int frame_size;
+	long long int nframes;
+	long long int *offsets;         /* file offset of every frame and the end of the last one */
+	unsigned char *in;              /* compressed frame */
+	unsigned int in_size;
+	frame_cache cache[CACHE_FRAMES];
+	unsigned long long int tick;
+	long long int frames_read;
+};
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+static unsigned long long int get_le (const unsigned char *p, int bytes)
+{
+	unsigned long long int v = 0;
+	int i;
+
+	for (i = bytes - 1; i >= 0; i--) v = (v << 8) | p[i];
+	return v;
+}
+
+/* checks an empty member written by gz_empty_member and returns the length of its subfield data, -1 if it is not one */
+static int empty_member (const unsigned char *p, long long int avail, char si1, char si2)
+{
+	int len;
+
+	if (avail < 26 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || p[3] != 4) return -1;
+	len = (int) get_le (p + 14, 2);
+	if (get_le (p + 10, 2) != (unsigned int) len + 4 || p[12] != si1 || p[13] != si2 || 26 + len > avail) return -1;
+	return len;
+}
+
+/* reads the trailer and the index of a gzip image */
+static int load_index (img_file *f, long long int file_size)
+{
+	unsigned char trailer[IMG_TRAILER_SIZE], *index;
+	long long int index_offset, index_len, pos, i, n = 0;
+	int len;
+
+	if (file_size < IMG_TRAILER_SIZE || read_at (f->fd, trailer, IMG_TRAILER_SIZE, file_size - IMG_TRAILER_SIZE)) return -1;
+	if (empty_member (trailer, IMG_TRAILER_SIZE, 'I', 'T') != IMG_TRAILER_DATA) return -1;
+	index_offset = get_le (trailer + 16, 8);
+	f->size = get_le (trailer + 24, 8);
+	f->frame_size = get_le (trailer + 32, 4);
+	f->nframes = get_le (trailer + 36, 4);
+	index_len = file_size - IMG_TRAILER_SIZE - index_offset;
+	if (index_offset < 0 || index_len < 0 || f->frame_size == 0 || f->nframes != (f->size + f->frame_size - 1) / f->frame_size) return -1;
+
+	index = malloc (index_len + 1);
+	f->offsets = malloc ((f->nframes + 1) * sizeof (long long int));
+	if (index == NULL || f->offsets == NULL || read_at (f->fd, index, index_len, index_offset))
+	{
+		free (index);
+		return -1;
+	}
+	f->offsets[0] = 0;
+	for (pos = 0; pos < index_len; pos += 26 + len)
+	{
+		len = empty_member (index + pos, index_len - pos, 'I', 'X');
+		if (len < 0) break;
+		for (i = 0; i < len / 4 && n < f->nframes; i++, n++)
+		{
+			f->offsets[n + 1] = f->offsets[n] + get_le (index + pos + 16 + i * 4, 4);
+			if (f->offsets[n + 1] - f->offsets[n] > f->in_size) f->in_size = f->offsets[n + 1] - f->offsets[n];
+		}
+	}
+	free (index);
+	// every frame must be listed and the frames must end where the index starts
+	return n == f->nframes && f->offsets[n] == index_offset ? 0 : -1;
+}
+
+/* returns the inflated frame from the cache or the file */
+static char *get_frame (img_file *f, long long int frame)
+{
+	frame_cache *c = &f->cache[0];
+	int i;
+
+	for (i = 0; i < CACHE_FRAMES; i++)
+	{
+		if (f->cache[i].frame == frame)
+		{
+			f->cache[i].used = ++f->tick;
+			return f->cache[i].data;
+		}
+		if (f->cache[i].used < c->used) c = &f->cache[i];
+	}
+
+	if (c->data == NULL) c->data = malloc (f->frame_size);
+	if (c->data == NULL || img_file_inflate (f, frame, f->in, c->data) < 0)
+	{
+		c->frame = -1;
+		return NULL;
+	}
+	c->frame = frame;
+	c->used = ++f->tick;
+	f->frames_read++;
+	return c->data;
+}
+
+/* opens the image, a gzip image without an index is only reported if quiet is 0 */
+static img_file *open_image (const char *path, int quiet)
+{
+	unsigned char magic[2];
+	img_file *f;
+	int i;
+
+	f = calloc (1, sizeof (img_file));
+	f->fd = open (path, O_RDONLY);
+	// the end of the file, also the size of a block device
+	if (f->fd >= 0) f->size = lseek (f->fd, 0, SEEK_END);
+	if (f->fd < 0 || f->size < 0 || read_at (f->fd, magic, 2, 0))
+	{
+		fprintf (stderr, "Could not read %s: %s\n", path, strerror (errno));
+		img_file_close (f);
+		return NULL;
+	}
+	for (i = 0; i < CACHE_FRAMES; i++) f->cache[i].frame = -1;
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+	{
+		f->gz = 1;
+		if (load_index (f, f->size) || (f->in = malloc (f->in_size)) == NULL)
+		{
+			if (!quiet) fprintf (stderr, "%s has no frame index, it was not written by the gzip compression of imgclone.\n", path);
+			img_file_close (f);
+			return NULL;
+		}
+	}
+	else if ((magic[0] == 0x28 && magic[1] == 0xb5) || (magic[0] == 'B' && magic[1] == 'Z'))
+	{
+		fprintf (stderr, "%s is compressed with zstd or bzip2, which can't be read at random, decompress it first.\n", path);
+		img_file_close (f);
+		return NULL;
+	}
+	return f;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+img_file *img_file_open (const char *path)
+{
+	return open_image (path, 0);
+}
+
+img_file *img_file_open_index (const char *path)
+{
+	img_file *f = open_image (path, 1);
+
+	if (f && !f->gz)
+	{
+		img_file_close (f);
+		return NULL;
+	}
+	return f;
+}
+
+long long int img_file_size (img_file *f)
+{
+	return f->size;
+}
+
+int img_file_read (img_file *f, void *buf, long long int len, long long int offset)
+{
+	long long int frame, pos, n;
+	char *data;
+
+	if (offset < 0 || offset + len > f->size) return -1;
+	if (!f->gz) return read_at (f->fd, buf, len, offset);
+	while (len > 0)
+	{
+		frame = offset / f->frame_size;
+		pos = offset % f->frame_size;
+		n = f->frame_size - pos < len ? f->frame_size - pos : len;
+		data = get_frame (f, frame);
+		if (data == NULL) return -1;
+		memcpy (buf, data + pos, n);
+		buf = (char *) buf + n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+long long int img_file_frames (img_file *f, unsigned int *frame_size, unsigned int *max_in)
+{
+	*frame_size = f->frame_size;
+	*max_in = f->in_size;
+	return f->gz ? f->nframes : 0;
+}
+
+long long int img_file_inflate (img_file *f, long long int frame, unsigned char *in, char *out)
+{
+	long long int len = f->offsets[frame + 1] - f->offsets[frame];
+	z_stream zs;
+	int ret;
+
+	if (read_at (f->fd, in, len, f->offsets[frame])) return -1;
+	memset (&zs, 0, sizeof (zs));
+	if (inflateInit2 (&zs, 15 + 16) != Z_OK) return -1;
+	zs.next_in = in;
+	zs.avail_in = len;
+	zs.next_out = (unsigned char *) out;
+	zs.avail_out = f->frame_size;
+	ret = inflate (&zs, Z_FINISH);
+	inflateEnd (&zs);
+	if (ret != Z_STREAM_END)
+	{
+		fprintf (stderr, "Corrupt frame %lld in the image.\n", frame);
+		return -1;
+	}
+	return f->frame_size - zs.avail_out;
+}
+
+long long int img_file_frames_read (img_file *f)
+{
+	return f->frames_read;
+}
+
+void img_file_close (img_file *f)
+{
+	int i;
+
+	if (f->fd >= 0) close (f->fd);
+	for (i = 0; i < CACHE_FRAMES; i++) free (f->cache[i].data);
+	free (f->offsets);
+	free (f->in);
+	free (f);
+}
@@ -0,0 +1,64 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+imgfile: random access to the bytes of a raw or compressed image.
+
+A .img file is read directly. A .gz image of the gzip sink is a row of
+independent gzip members (frames) of the same number of image bytes each
+(1 MB), followed by an index:
+	index members, empty gzip members with extra subfield "IX": the
+	    compressed length of up to IMG_INDEX_FRAMES frames, 32 bit little endian
+	a trailer member, an empty gzip member of IMG_TRAILER_SIZE bytes with extra
+	    subfield "IT": offset of the first index member (64 bit), image size
+	    (64 bit), bytes of image per frame (32 bit) and number of frames (32 bit)
+gunzip decompresses the empty members to nothing, so the file stays a normal
+gzip file. Reading a byte of the image only inflates the frame that holds it,
+the last frames read are kept.
+*/
+
+#ifndef IMGFILE_H
+#define IMGFILE_H
+
+#define IMG_INDEX_FRAMES 16000   /* frame lengths per index member, the extra field holds at most 64K */
+#define IMG_TRAILER_DATA 24
+#define IMG_TRAILER_SIZE (26 + IMG_TRAILER_DATA)
+
+typedef struct img_file img_file;
+
+/* img_file_open
+   Opens a raw image or a gzip image with an index
+	@return the image or NULL with a message if the file can't be read at random
+*/
+img_file *img_file_open (const char *path);
+
+/* opens a gzip image with an index, returns NULL without a message if the file has none or is not a gzip file */
+img_file *img_file_open_index (const char *path);
+
+/* size of the image in bytes */
+long long int img_file_size (img_file *f);
+
+/* reads len bytes of the image at offset, returns 0 on success */
+int img_file_read (img_file *f, void *buf, long long int len, long long int offset);
+
+/* img_file_frames
+   Describes the frames of a gzip image, for a reader that inflates them on several threads
+	@param frame_size receives the image bytes of a frame, the last one can be shorter
+	@param max_in receives the compressed length of the largest frame
+	@return number of frames, 0 for a raw image
+*/
+long long int img_file_frames (img_file *f, unsigned int *frame_size, unsigned int *max_in);
+
+/* img_file_inflate
+   Inflates a frame of a gzip image, can be called from several threads at once
+	@param in buffer of max_in bytes for the compressed frame
+	@param out receives the frame, frame_size bytes
+	@return bytes of the frame or -1 with a message
+*/
+long long int img_file_inflate (img_file *f, long long int frame, unsigned char *in, char *out);
+
+/* number of frames inflated so far, 0 for a raw image */
+long long int img_file_frames_read (img_file *f);
+
+void img_file_close (img_file *f);
+
+#endif
@@ -0,0 +1,453 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+ioengine: io_uring and thread pool block I/O.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "ioengine.h"
+#include "throttle.h"
+
+// io_uring is used through the system calls, liburing is not needed
+#if defined(IORING_OFF_SQES) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING
+#endif
+
+#define DEFAULT_DEPTH   16
+#define DEFAULT_BLOCK   (1024*1024)
+#define MAX_DEPTH       256
+#define MAX_THREADS     32
+
+#define SLOT_IDLE       0
+#define SLOT_BUSY       1
+#define SLOT_DONE       2
+
+typedef struct
+{
+	char *buf;
+	struct iovec iov;
+	int fd;
+	long long int offset;
+	int len;
+	int done;               /* bytes transferred so far */
+	int write;
+	int state;
+	int error;              /* errno of a failed request */
+} io_slot;
+
+struct io_engine
+{
+	int type;
+	int depth;
+	int block_size;
+	io_slot *slots;
+
+	// io_uring
+	int ring_fd;
+	int fixed;              /* buffers are registered */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+#ifdef HAVE_IO_URING
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+#endif
+
+	// thread pool
+	pthread_t *threads;
+	int n_threads;
+	int *queue;             /* slots waiting for a thread */
+	int queue_head;
+	int queue_count;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t finished;
+};
+
+static int config_type = IO_ENGINE_AUTO;
+static int config_depth = DEFAULT_DEPTH;
+static int config_block = DEFAULT_BLOCK;
+
+void io_engine_configure (int type, int depth, int block_size)
+{
+	config_type = type;
+	if (depth > 0) config_depth = depth > MAX_DEPTH ? MAX_DEPTH : depth;
+	if (block_size >= 4096) config_block = block_size - block_size % 4096;
+}
+
+/*---------------------------------------------------------------------------*/
+/* io_uring */
+
+#ifdef HAVE_IO_URING
+
+static int uring_enter (io_engine *e, unsigned submit, unsigned wait)
+{
+	long res;
+
+	do res = syscall (__NR_io_uring_enter, e->ring_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	while (res < 0 && errno == EINTR);
+	return res;
+}
+
+/* queues the part of a slot that is not transferred yet */
+static int uring_push (io_engine *e, int slot)
+{
+	io_slot *s = &e->slots[slot];
+	unsigned tail = *e->sq_tail, index = tail & *e->sq_mask;
+	struct io_uring_sqe *sqe = &e->sqes[index];
+
+	memset (sqe, 0, sizeof (*sqe));
+	sqe->fd = s->fd;
+	sqe->off = s->offset + s->done;
+	sqe->user_data = slot;
+	if (e->fixed)
+	{
+		sqe->opcode = s->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long) (s->buf + s->done);
+		sqe->len = s->len - s->done;
+		sqe->buf_index = slot;
+	}
+	else
+	{
+		// readv and writev are in every kernel that has io_uring, plain read and write came later
+		s->iov.iov_base = s->buf + s->done;
+		s->iov.iov_len = s->len - s->done;
+		sqe->opcode = s->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (unsigned long) &s->iov;
+		sqe->len = 1;
+	}
+	e->sq_array[index] = index;
+	__atomic_store_n (e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return uring_enter (e, 1, 0) == 1 ? 0 : -1;
+}
+
+/* handles one completion, waits for it if none is ready */
+static int uring_reap (io_engine *e)
+{
+	unsigned head = *e->cq_head;
+	struct io_uring_cqe *cqe;
+	io_slot *s;
+
+	while (head == __atomic_load_n (e->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		if (uring_enter (e, 0, 1) < 0) return -1;
+	}
+	cqe = &e->cqes[head & *e->cq_mask];
+	s = &e->slots[cqe->user_data];
+	if (cqe->res < 0) s->error = -cqe->res;
+	else if (cqe->res == 0) s->error = EIO;       // end of the device or file
+	else s->done += cqe->res;
+	__atomic_store_n (e->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	// a short transfer continues where it stopped
+	if (!s->error && s->done < s->len && uring_push (e, cqe->user_data)) s->error = errno;
+	if (s->error || s->done == s->len) s->state = SLOT_DONE;
+	return 0;
+}
+
+static int uring_open (io_engine *e)
+{
+	struct io_uring_params p;
+	struct iovec *iov;
+	int i;
+
+	memset (&p, 0, sizeof (p));
+	e->ring_fd = syscall (__NR_io_uring_setup, e->depth, &p);
+	if (e->ring_fd < 0) return -1;
+
+	e->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	e->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (e->cq_ring_size > e->sq_ring_size) e->sq_ring_size = e->cq_ring_size;
+		e->cq_ring_size = e->sq_ring_size;
+	}
+	e->sq_ring = mmap (NULL, e->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQ_RING);
+	if (e->sq_ring == MAP_FAILED) goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) e->cq_ring = e->sq_ring;
+	else e->cq_ring = mmap (NULL, e->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_CQ_RING);
+	if (e->cq_ring == MAP_FAILED) goto fail;
+	e->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	e->sqes = mmap (NULL, e->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQES);
+	if (e->sqes == MAP_FAILED) goto fail;
+
+	e->sq_tail = (unsigned *) ((char *) e->sq_ring + p.sq_off.tail);
+	e->sq_mask = (unsigned *) ((char *) e->sq_ring + p.sq_off.ring_mask);
+	e->sq_array = (unsigned *) ((char *) e->sq_ring + p.sq_off.array);
+	e->cq_head = (unsigned *) ((char *) e->cq_ring + p.cq_off.head);
+	e->cq_tail = (unsigned *) ((char *) e->cq_ring + p.cq_off.tail);
+	e->cq_mask = (unsigned *) ((char *) e->cq_ring + p.cq_off.ring_mask);
+	e->cqes = (struct io_uring_cqe *) ((char *) e->cq_ring + p.cq_off.cqes);
+
+	// fixed buffers save mapping the pages for every request, they count against RLIMIT_MEMLOCK so this may fail
+	iov = calloc (e->depth, sizeof (struct iovec));
+	if (iov)
+	{
+		for (i = 0; i < e->depth; i++)
+		{
+			iov[i].iov_base = e->slots[i].buf;
+			iov[i].iov_len = e->block_size;
+		}
+		e->fixed = syscall (__NR_io_uring_register, e->ring_fd, IORING_REGISTER_BUFFERS, iov, e->depth) == 0;
+		free (iov);
+	}
+	return 0;
+
+fail:
+	if (e->sq_ring != MAP_FAILED && e->sq_ring) munmap (e->sq_ring, e->sq_ring_size);
+	if (e->cq_ring != MAP_FAILED && e->cq_ring && e->cq_ring != e->sq_ring) munmap (e->cq_ring, e->cq_ring_size);
+	close (e->ring_fd);
+	return -1;
+}
+
+static void uring_close (io_engine *e)
+{
+	munmap (e->sqes, e->sqes_size);
+	if (e->cq_ring != e->sq_ring) munmap (e->cq_ring, e->cq_ring_size);
+	munmap (e->sq_ring, e->sq_ring_size);
+	close (e->ring_fd);
+}
+
+#endif
+
+/*---------------------------------------------------------------------------*/
+/* Thread pool */
+
+static void transfer (io_slot *s)
+{
+	ssize_t n;
+
+	while (s->done < s->len)
+	{
+		if (s->write) n = pwrite (s->fd, s->buf + s->done, s->len - s->done, s->offset + s->done);
+		else n = pread (s->fd, s->buf + s->done, s->len - s->done, s->offset + s->done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0)
+		{
+			s->error = n ? errno : EIO;
+			return;
+		}
+		s->done += n;
+	}
+}
+
+static void *io_thread (io_engine *e)
+{
+	io_slot *s;
+
+	pthread_mutex_lock (&e->lock);
+	for (;;)
+	{
+		while (!e->stop && e->queue_count == 0) pthread_cond_wait (&e->work, &e->lock);
+		if (e->queue_count == 0) break;
+		s = &e->slots[e->queue[e->queue_head]];
+		e->queue_head = (e->queue_head + 1) % e->depth;
+		e->queue_count--;
+		pthread_mutex_unlock (&e->lock);
+
+		transfer (s);
+
+		pthread_mutex_lock (&e->lock);
+		s->state = SLOT_DONE;
+		pthread_cond_broadcast (&e->finished);
+	}
+	pthread_mutex_unlock (&e->lock);
+	return NULL;
+}
+
+static int threads_open (io_engine *e)
+{
+	int i;
+
+	e->queue = calloc (e->depth, sizeof (int));
+	e->n_threads = e->depth > MAX_THREADS ? MAX_THREADS : e->depth;
+	e->threads = calloc (e->n_threads, sizeof (pthread_t));
+	if (e->queue == NULL || e->threads == NULL) return -1;
+	pthread_mutex_init (&e->lock, NULL);
+	pthread_cond_init (&e->work, NULL);
+	pthread_cond_init (&e->finished, NULL);
+	for (i = 0; i < e->n_threads; i++)
+	{
+		if (pthread_create (&e->threads[i], NULL, (void* (*)(void*)) &io_thread, e)) break;
+	}
+	e->n_threads = i;
+	return 0;
+}
+
+static void threads_close (io_engine *e)
+{
+	int i;
+
+	pthread_mutex_lock (&e->lock);
+	e->stop = 1;
+	pthread_cond_broadcast (&e->work);
+	pthread_mutex_unlock (&e->lock);
+	for (i = 0; i < e->n_threads; i++) pthread_join (e->threads[i], NULL);
+	pthread_mutex_destroy (&e->lock);
+	pthread_cond_destroy (&e->work);
+	pthread_cond_destroy (&e->finished);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+io_engine *io_engine_open (void)
+{
+	io_engine *e;
+	int i;
+
+	e = calloc (1, sizeof (io_engine));
+	if (e == NULL) return NULL;
+	e->depth = config_depth;
+	e->block_size = config_block;
+	e->slots = calloc (e->depth, sizeof (io_slot));
+	if (e->slots == NULL) goto fail;
+	for (i = 0; i < e->depth; i++)
+	{
+		// aligned for O_DIRECT
+		if (posix_memalign ((void **) &e->slots[i].buf, 4096, e->block_size)) goto fail;
+	}
+
+	e->type = IO_ENGINE_THREADS;
+#ifdef HAVE_IO_URING
+	if (config_type != IO_ENGINE_THREADS && uring_open (e) == 0) e->type = IO_ENGINE_URING;
+#endif
+	if (e->type == IO_ENGINE_THREADS && threads_open (e)) goto fail;
+	return e;
+
+fail:
+	if (e->slots)
+	{
+		for (i = 0; i < e->depth; i++) free (e->slots[i].buf);
+	}
+	free (e->slots);
+	free (e->queue);
+	free (e->threads);
+	free (e);
+	return NULL;
+}
+
+void io_engine_close (io_engine *e)
+{
+	int i;
+
+	if (e == NULL) return;
+	for (i = 0; i < e->depth; i++) io_engine_wait (e, i);
+#ifdef HAVE_IO_URING
+	if (e->type == IO_ENGINE_URING) uring_close (e);
+#endif
+	if (e->type == IO_ENGINE_THREADS) threads_close (e);
+	for (i = 0; i < e->depth; i++) free (e->slots[i].buf);
+	free (e->slots);
+	free (e->queue);
+	free (e->threads);
+	free (e);
+}
+
+const char *io_engine_name (io_engine *e)
+{
+	return e->type == IO_ENGINE_URING ? "io_uring" : "threads";
+}
+
+int io_engine_depth (io_engine *e)
+{
+	return e->depth;
+}
+
+int io_engine_block_size (io_engine *e)
+{
+	return e->block_size;
+}
+
+char *io_engine_buffer (io_engine *e, int slot)
+{
+	return e->slots[slot].buf;
+}
+
+int io_engine_submit (io_engine *e, int slot, int fd, long long int offset, int len, int write)
+{
+	io_slot *s = &e->slots[slot];
+
+	if (s->state != SLOT_IDLE || len > e->block_size) return -1;
+	// the rate limit counts the data once, when it is read
+	if (!write) throttle_take (len);
+	s->fd = fd;
+	s->offset = offset;
+	s->len = len;
+	s->done = 0;
+	s->write = write;
+	s->error = 0;
+	s->state = SLOT_BUSY;
+	if (len == 0)
+	{
+		s->state = SLOT_DONE;
+		return 0;
+	}
+#ifdef HAVE_IO_URING
+	if (e->type == IO_ENGINE_URING)
+	{
+		if (uring_push (e, slot) == 0) return 0;
+		s->state = SLOT_IDLE;
+		return -1;
+	}
+#endif
+	pthread_mutex_lock (&e->lock);
+	e->queue[(e->queue_head + e->queue_count) % e->depth] = slot;
+	e->queue_count++;
+	pthread_cond_signal (&e->work);
+	pthread_mutex_unlock (&e->lock);
+	return 0;
+}
+
+int io_engine_wait (io_engine *e, int slot)
+{
+	io_slot *s = &e->slots[slot];
+
+	if (s->state == SLOT_IDLE) return 0;
+#ifdef HAVE_IO_URING
+	if (e->type == IO_ENGINE_URING)
+	{
+		while (s->state == SLOT_BUSY)
+		{
+			if (uring_reap (e))
+			{
+				s->error = errno;
+				break;
+			}
+		}
+	}
+#endif
+	if (e->type == IO_ENGINE_THREADS)
+	{
+		pthread_mutex_lock (&e->lock);
+		while (s->state == SLOT_BUSY) pthread_cond_wait (&e->finished, &e->lock);
+		pthread_mutex_unlock (&e->lock);
+	}
+	s->state = SLOT_IDLE;
+	if (s->error)
+	{
+		errno = s->error;
+		return -1;
+	}
+	if (s->write) throttle_drop_written (s->fd, s->offset, s->len);
+	else throttle_drop_read (s->fd, s->offset, s->len);
+	return 0;
+}
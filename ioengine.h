@@ -0,0 +1,62 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+ioengine: queued block reads and writes on raw devices and image files.
+
+An engine owns a pool of depth buffers of block_size bytes, one per slot. A
+read or write is submitted on a slot and runs in the background until the
+slot is waited for, so up to depth requests are in flight at the same time.
+The engine uses io_uring with the buffers registered as fixed buffers when
+the kernel has it, and otherwise a pool of threads doing pread and pwrite.
+*/
+
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#define IO_ENGINE_AUTO    0
+#define IO_ENGINE_URING   1
+#define IO_ENGINE_THREADS 2
+
+typedef struct io_engine io_engine;
+
+/* io_engine_configure
+   Sets what io_engine_open creates, called once from main
+	@param type IO_ENGINE_AUTO, IO_ENGINE_URING or IO_ENGINE_THREADS
+	@param depth number of requests in flight, 0 for the default
+	@param block_size bytes per request, a multiple of 4096, 0 for the default
+*/
+void io_engine_configure (int type, int depth, int block_size);
+
+/* io_engine_open
+   Creates an engine with the configured type, queue depth and block size
+	@return the engine or NULL if no memory
+*/
+io_engine *io_engine_open (void);
+
+/* waits for the requests in flight and frees the engine */
+void io_engine_close (io_engine *e);
+
+/* "io_uring" or "threads" */
+const char *io_engine_name (io_engine *e);
+
+int io_engine_depth (io_engine *e);
+
+int io_engine_block_size (io_engine *e);
+
+/* buffer of a slot, aligned to 4096 bytes */
+char *io_engine_buffer (io_engine *e, int slot);
+
+/* io_engine_submit
+   Starts reading or writing len bytes of the slot buffer at offset of fd, the slot must be idle
+	@param write 0 to read into the buffer, 1 to write it
+	@return 0 on success
+*/
+int io_engine_submit (io_engine *e, int slot, int fd, long long int offset, int len, int write);
+
+/* io_engine_wait
+   Waits until the request of a slot is finished, the slot is idle again afterwards
+	@return 0 if all bytes were transferred, -1 on error or end of file with errno set, 0 for an idle slot
+*/
+int io_engine_wait (io_engine *e, int slot);
+
+#endif
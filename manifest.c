@@ -0,0 +1,310 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+manifest: read and write the file list stored next to an image.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "manifest.h"
+
+struct manifest_writer
+{
+	FILE *fp;
+	char *path;
+	char *tmp_path;
+	pthread_mutex_t lock;
+	char *line;
+	size_t line_size;
+};
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+static void escape_path (const char *src, char *dst)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+
+	while ((c = *src++) != 0)
+	{
+		if (c <= ' ' || c == '%' || c == 0x7f)
+		{
+			*dst++ = '%';
+			*dst++ = hex[c >> 4];
+			*dst++ = hex[c & 15];
+		}
+		else *dst++ = c;
+	}
+	*dst = 0;
+}
+
+static void unescape_path (char *s)
+{
+	char *d = s;
+	unsigned int c;
+
+	while (*s)
+	{
+		if (s[0] == '%' && s[1] && s[2] && sscanf (s + 1, "%2x", &c) == 1)
+		{
+			*d++ = c;
+			s += 3;
+		}
+		else *d++ = *s++;
+	}
+	*d = 0;
+}
+
+static long long int bucket (const manifest *m, const char *path)
+{
+	return hash_buffer (path, strlen (path), 0) % m->buckets;
+}
+
+/* index on path */
+static void index_entries (manifest *m)
+{
+	long long int i, b;
+
+	free (m->table);
+	m->buckets = m->count * 2 + 1;
+	m->table = calloc (m->buckets, sizeof (manifest_entry *));
+	for (i = 0; i < m->count; i++)
+	{
+		b = bucket (m, m->entries[i].path);
+		m->entries[i].next = m->table[b];
+		m->table[b] = &m->entries[i];
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/* Reading */
+
+manifest *manifest_load (const char *path, int pnum)
+{
+	manifest *m;
+	manifest_entry *e;
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0, alloc = 0;
+	int section = -1, n;
+	long long int msec, csec;
+
+	fp = fopen (path, "r");
+	if (fp == NULL) return NULL;
+	m = calloc (1, sizeof (manifest));
+
+	while (getline (&line, &size, fp) > 0)
+	{
+		line[strcspn (line, "\n")] = 0;
+		if (line[0] == 'P')
+		{
+			sscanf (line, "P %d", &section);
+			continue;
+		}
+		if (section != pnum || line[0] == '#' || line[0] == 0) continue;
+
+		if (m->count == (long long int) alloc)
+		{
+			alloc = alloc ? alloc * 2 : 4096;
+			m->entries = realloc (m->entries, alloc * sizeof (manifest_entry));
+		}
+		e = &m->entries[m->count];
+		memset (e, 0, sizeof (manifest_entry));
+		n = 0;
+		if (sscanf (line, "%o %llu %lld %lld.%ld %lld.%ld %" SCNx64 " %n", &e->mode, &e->ino, &e->size,
+			&msec, &e->mtime.tv_nsec, &csec, &e->ctime.tv_nsec, &e->hash, &n) < 8 || n == 0)
+		{
+			fprintf (stderr, "Warning: invalid line in manifest %s: %s\n", path, line);
+			continue;
+		}
+		e->mtime.tv_sec = msec;
+		e->ctime.tv_sec = csec;
+		e->path = strdup (line + n);
+		unescape_path (e->path);
+		m->count++;
+	}
+	free (line);
+	fclose (fp);
+	index_entries (m);
+	return m;
+}
+
+manifest_entry *manifest_find (manifest *m, const char *path)
+{
+	manifest_entry *e;
+
+	for (e = m->table[bucket (m, path)]; e != NULL; e = e->next)
+	{
+		if (!strcmp (e->path, path)) return e;
+	}
+	return NULL;
+}
+
+int manifest_unchanged (const manifest_entry *e, const struct stat *st)
+{
+	return e->mode == st->st_mode && e->ino == (unsigned long long int) st->st_ino && e->size == st->st_size &&
+		e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+		e->ctime.tv_sec == st->st_ctim.tv_sec && e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+long long int manifest_prune (manifest *m, const char *root)
+{
+	char *path = NULL;
+	struct stat st;
+	long long int i, n = 0;
+	size_t size = 0, need;
+
+	for (i = 0; i < m->count; i++)
+	{
+		need = strlen (root) + strlen (m->entries[i].path) + 2;
+		if (need > size)
+		{
+			size = need * 2;
+			path = realloc (path, size);
+		}
+		sprintf (path, "%s/%s", root, m->entries[i].path);
+		// hard links are only created at the end of a copy, their entries are written before that
+		if (lstat (path, &st) || (st.st_mode & S_IFMT) != (m->entries[i].mode & S_IFMT) || (S_ISREG (st.st_mode) && st.st_size != m->entries[i].size))
+		{
+			free (m->entries[i].path);
+			continue;
+		}
+		m->entries[n++] = m->entries[i];
+	}
+	free (path);
+	i = m->count - n;
+	m->count = n;
+	index_entries (m);
+	return i;
+}
+
+void manifest_free (manifest *m)
+{
+	long long int i;
+
+	if (m == NULL) return;
+	for (i = 0; i < m->count; i++) free (m->entries[i].path);
+	free (m->entries);
+	free (m->table);
+	free (m);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Writing */
+
+manifest_writer *manifest_create (const char *path)
+{
+	manifest_writer *w = calloc (1, sizeof (manifest_writer));
+
+	w->path = strdup (path);
+	w->tmp_path = malloc (strlen (path) + 5);
+	sprintf (w->tmp_path, "%s.tmp", path);
+	w->fp = fopen (w->tmp_path, "w");
+	if (w->fp == NULL)
+	{
+		fprintf (stderr, "Could not create manifest %s: %s\n", w->tmp_path, strerror (errno));
+		free (w->path);
+		free (w->tmp_path);
+		free (w);
+		return NULL;
+	}
+	pthread_mutex_init (&w->lock, NULL);
+	fprintf (w->fp, "# imgclone manifest 1\n");
+	return w;
+}
+
+manifest_writer *manifest_append (const char *path, long long int offset)
+{
+	manifest_writer *w = calloc (1, sizeof (manifest_writer));
+
+	w->path = strdup (path);
+	w->tmp_path = malloc (strlen (path) + 5);
+	sprintf (w->tmp_path, "%s.tmp", path);
+	if (offset == 0) w->fp = fopen (w->tmp_path, "w");
+	else if (truncate (w->tmp_path, offset) == 0 && (w->fp = fopen (w->tmp_path, "a")) != NULL) fseek (w->fp, 0, SEEK_END);
+	if (w->fp == NULL)
+	{
+		fprintf (stderr, "Could not continue manifest %s: %s\n", w->tmp_path, strerror (errno));
+		free (w->path);
+		free (w->tmp_path);
+		free (w);
+		return NULL;
+	}
+	pthread_mutex_init (&w->lock, NULL);
+	if (offset == 0) fprintf (w->fp, "# imgclone manifest 1\n");
+	return w;
+}
+
+long long int manifest_sync (manifest_writer *w)
+{
+	long long int len = -1;
+
+	pthread_mutex_lock (&w->lock);
+	if (fflush (w->fp) == 0 && fdatasync (fileno (w->fp)) == 0) len = ftell (w->fp);
+	pthread_mutex_unlock (&w->lock);
+	return len;
+}
+
+void manifest_partition (manifest_writer *w, int pnum)
+{
+	pthread_mutex_lock (&w->lock);
+	fprintf (w->fp, "P %d\n", pnum);
+	pthread_mutex_unlock (&w->lock);
+}
+
+void manifest_add (manifest_writer *w, const char *path, const struct stat *st, uint64_t hash)
+{
+	size_t need = strlen (path) * 3 + 1;
+
+	pthread_mutex_lock (&w->lock);
+	if (w->line_size < need)
+	{
+		w->line_size = need * 2;
+		w->line = realloc (w->line, w->line_size);
+	}
+	escape_path (path, w->line);
+	fprintf (w->fp, "%o %llu %lld %lld.%09ld %lld.%09ld %016" PRIx64 " %s\n", st->st_mode, (unsigned long long int) st->st_ino,
+		(long long int) st->st_size, (long long int) st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+		(long long int) st->st_ctim.tv_sec, st->st_ctim.tv_nsec, hash, w->line);
+	pthread_mutex_unlock (&w->lock);
+}
+
+void manifest_add_entry (manifest_writer *w, const manifest_entry *e)
+{
+	struct stat st;
+
+	memset (&st, 0, sizeof (st));
+	st.st_mode = e->mode;
+	st.st_ino = e->ino;
+	st.st_size = e->size;
+	st.st_mtim = e->mtime;
+	st.st_ctim = e->ctime;
+	manifest_add (w, e->path, &st, e->hash);
+}
+
+int manifest_close (manifest_writer *w)
+{
+	int res = 0;
+
+	if (fclose (w->fp) || rename (w->tmp_path, w->path))
+	{
+		fprintf (stderr, "Could not write manifest %s: %s\n", w->path, strerror (errno));
+		res = 1;
+	}
+	pthread_mutex_destroy (&w->lock);
+	free (w->line);
+	free (w->path);
+	free (w->tmp_path);
+	free (w);
+	return res;
+}
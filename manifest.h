@@ -0,0 +1,76 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+manifest: list of all files in an image, written next to it as <image>.manifest
+
+The file is plain text, one section per partition:
+	P <partition number>
+	<mode> <inode> <size> <mtime> <ctime> <hash> <path>
+mode is octal including the file type, times are seconds.nanoseconds, hash is
+the XXH64 of the file data (of the target for symlinks, 0 for other types and
+for the second and further names of a hard link), hashed from the copy buffer
+while the file is copied. Paths are relative to the
+partition root with control characters, spaces and % escaped as %XX.
+*/
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+typedef struct manifest_entry
+{
+	char *path;
+	unsigned int mode;
+	unsigned long long int ino;
+	long long int size;
+	struct timespec mtime;
+	struct timespec ctime;
+	uint64_t hash;
+	volatile char seen;        /* set when the path is found on the source */
+	struct manifest_entry *next;
+} manifest_entry;
+
+typedef struct
+{
+	manifest_entry *entries;
+	long long int count;
+	manifest_entry **table;
+	long long int buckets;
+} manifest;
+
+typedef struct manifest_writer manifest_writer;
+
+/* loads the section of partition pnum, returns NULL if the file can't be read */
+manifest *manifest_load (const char *path, int pnum);
+manifest_entry *manifest_find (manifest *m, const char *path);
+
+/* 1 if the entry describes the same file version as st */
+int manifest_unchanged (const manifest_entry *e, const struct stat *st);
+void manifest_free (manifest *m);
+
+/* manifest_prune
+   Drops the entries whose file below root is missing or has another type or size, the copy of an
+   interrupted backup that did not reach the image
+	@return the number of entries dropped
+*/
+long long int manifest_prune (manifest *m, const char *root);
+
+/* writer, entries can be added from multiple threads, the file appears on manifest_close */
+manifest_writer *manifest_create (const char *path);
+void manifest_partition (manifest_writer *w, int pnum);
+void manifest_add (manifest_writer *w, const char *path, const struct stat *st, uint64_t hash);
+/* manifest_append
+   Continues the unfinished manifest of an interrupted backup
+	@param offset bytes of the unfinished manifest to keep, the entries after it are dropped
+	@return the writer or NULL if the unfinished manifest is missing
+*/
+manifest_writer *manifest_append (const char *path, long long int offset);
+/* writes the entries added so far to disk, returns the length of the unfinished manifest or -1 */
+long long int manifest_sync (manifest_writer *w);
+/* copies an entry of a loaded manifest */
+void manifest_add_entry (manifest_writer *w, const manifest_entry *e);
+int manifest_close (manifest_writer *w);
+
+#endif
@@ -0,0 +1,471 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+probe: native replacements for parted print, lsblk, blkid, df, uuid and
+partprobe. All on-disk values are little endian.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <mntent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <limits.h>
+#include <linux/fs.h>
+
+#include "probe.h"
+#include "util.h"
+
+#define MBR_SIGNATURE  0x1FE
+#define MBR_DISK_ID    0x1B8
+#define MBR_TABLE      0x1BE
+#define MAX_LOGICAL    64     /* protection against a loop in the EBR chain */
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+/* copies a space padded on-disk string, trailing spaces and zeros are removed */
+static void copy_label (char *dst, const unsigned char *src, int len)
+{
+	memcpy (dst, src, len);
+	dst[len] = 0;
+	while (len > 0 && (dst[len - 1] == ' ' || dst[len - 1] == 0)) dst[--len] = 0;
+}
+
+static int is_extended (int type)
+{
+	return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+/*---------------------------------------------------------------------------*/
+/* File systems */
+
+static const char *probe_ext (const unsigned char *sb, char *uuid, char *label)
+{
+	const unsigned char *u = sb + 0x68;
+	uint32_t compat = le32 (sb + 0x5C), incompat = le32 (sb + 0x60), ro_compat = le32 (sb + 0x64);
+
+	sprintf (uuid, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+		u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+	copy_label (label, sb + 0x78, 16);
+
+	// same rule as blkid: extents, 64bit, flex_bg or the newer read-only features are ext4
+	if ((incompat & (0x0040 | 0x0080 | 0x0200)) || (ro_compat & (0x0008 | 0x0010 | 0x0020 | 0x0040))) return "ext4";
+	if (compat & 0x0004) return "ext3";
+	return "ext2";
+}
+
+static const char *probe_fat (const unsigned char *bs, char *uuid, char *label)
+{
+	long long int bps = le16 (bs + 11), spc = bs[13], rsvd = le16 (bs + 14), nfats = bs[16], root_entries = le16 (bs + 17);
+	long long int total = le16 (bs + 19), fat_size = le16 (bs + 22), clusters;
+	const unsigned char *ext;
+	uint32_t id;
+
+	if (total == 0) total = le32 (bs + 32);
+	// FAT32 has no 16 bit FAT size, its extended BPB is 28 bytes further
+	ext = fat_size ? bs + 0x24 : bs + 0x40;
+	if (fat_size == 0) fat_size = le32 (bs + 36);
+	if ((bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) || spc == 0 || (spc & (spc - 1)) || nfats < 1 || nfats > 2 || fat_size == 0 || rsvd == 0)
+		return "";
+	if (total <= rsvd + nfats * fat_size) return "";
+	clusters = (total - rsvd - nfats * fat_size - (root_entries * 32 + bps - 1) / bps) / spc;
+
+	if (ext[2] == 0x29)
+	{
+		id = le32 (ext + 3);
+		sprintf (uuid, "%04X-%04X", id >> 16, id & 0xffff);
+		copy_label (label, ext + 7, 11);
+		if (!strcmp (label, "NO NAME")) label[0] = 0;
+	}
+	return clusters < 65525 ? "fat16" : "fat32";
+}
+
+/* identifies the file system of the first 4096 bytes of a partition */
+static const char *probe_start (const unsigned char *buf, char *uuid, char *label)
+{
+	uuid[0] = 0;
+	label[0] = 0;
+	if (le16 (buf + 1024 + 0x38) == 0xEF53) return probe_ext (buf + 1024, uuid, label);
+	if (!memcmp (buf + 4096 - 10, "SWAPSPACE2", 10)) return "linux-swap";
+	if (buf[510] == 0x55 && buf[511] == 0xAA) return probe_fat (buf, uuid, label);
+	return "";
+}
+
+const char *probe_filesystem (int fd, long long int offset, char *uuid, char *label)
+{
+	unsigned char buf[4096];
+
+	uuid[0] = 0;
+	label[0] = 0;
+	if (read_at (fd, buf, sizeof (buf), offset)) return "";
+	return probe_start (buf, uuid, label);
+}
+
+long long int probe_filesystem_size (int fd, long long int offset)
+{
+	unsigned char sb[1024];
+	long long int blocks;
+
+	if (read_at (fd, sb, sizeof (sb), offset + 1024) || le16 (sb + 0x38) != 0xEF53) return -1;
+	blocks = le32 (sb + 0x04);
+	// 64bit file systems keep the high half of the block count further on
+	if (le32 (sb + 0x60) & 0x0080) blocks |= (long long int) le32 (sb + 0x150) << 32;
+	return blocks * (1024LL << le32 (sb + 0x18));
+}
+
+static int is_power (long long int n, int base)
+{
+	while (n > 1 && n % base == 0) n /= base;
+	return n == 1;
+}
+
+static long long int ext_desc_per_block (const unsigned char *sb)
+{
+	long long int desc_size = 32;
+
+	if ((le32 (sb + 0x60) & 0x0080) && le16 (sb + 0xFE) > 32) desc_size = le16 (sb + 0xFE);
+	return (1024LL << le32 (sb + 0x18)) / desc_size;
+}
+
+/* meta_bg and the group where it starts */
+static int ext_meta_group (const unsigned char *sb, long long int g)
+{
+	return (le32 (sb + 0x60) & 0x0010) && g / ext_desc_per_block (sb) >= le32 (sb + 0x104);
+}
+
+int probe_ext_has_super (const unsigned char *sb, long long int g)
+{
+	if (g == 0) return 1;
+	if (le32 (sb + 0x5C) & 0x0200) return g == le32 (sb + 0x24C) || g == le32 (sb + 0x250);     // sparse_super2
+	if (!(le32 (sb + 0x64) & 0x0001)) return 1;
+	return g == 1 || is_power (g, 3) || is_power (g, 5) || is_power (g, 7);
+}
+
+long long int probe_ext_desc_block (const unsigned char *sb, long long int n)
+{
+	long long int first = le32 (sb + 0x14), g = n * ext_desc_per_block (sb);
+
+	// with meta_bg each block of descriptors is in the first group it describes, after the superblock backup
+	if (!ext_meta_group (sb, g)) return first + 1 + n;
+	return first + g * le32 (sb + 0x20) + probe_ext_has_super (sb, g);
+}
+
+long long int probe_ext_base_blocks (const unsigned char *sb, long long int g)
+{
+	long long int blocks = probe_ext_has_super (sb, g), total, groups, dpb = ext_desc_per_block (sb), r;
+
+	if (ext_meta_group (sb, g))
+	{
+		// a copy in the first, second and last group of the meta group
+		r = g % dpb;
+		return blocks + (r == 0 || r == 1 || r == dpb - 1);
+	}
+	if (blocks == 0) return 0;
+	total = le32 (sb + 0x04);
+	if (le32 (sb + 0x60) & 0x0080) total |= (long long int) le32 (sb + 0x150) << 32;
+	groups = (total - le32 (sb + 0x14) + le32 (sb + 0x20) - 1) / le32 (sb + 0x20);
+	if (le32 (sb + 0x60) & 0x0010) blocks += le32 (sb + 0x104);
+	else blocks += (groups + dpb - 1) / dpb;
+	return blocks + le16 (sb + 0xCE);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Partition table */
+
+static void set_le32 (unsigned char *p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static int add_partition (probe_reader reader, void *source, partition_t *table, int n, int pnum, const char *ptype, const unsigned char *entry, long long int start)
+{
+	unsigned char buf[4096];
+	partition_t *p;
+	int type = entry[4];
+
+	if (n >= MAXPART) return -1;
+	p = &table[n];
+	memset (p, 0, sizeof (partition_t));
+	p->pnum = pnum;
+	p->start = start;
+	p->end = start + le32 (entry + 12) - 1;
+	strcpy (p->ptype, ptype);
+	if (type == 0x0c || type == 0x0e || type == 0x0f) strcpy (p->flags, "lba");
+	else if (entry[0] == 0x80) strcpy (p->flags, "boot");
+	if (!is_extended (type) && reader (source, buf, sizeof (buf), start * 512) == 0) strcpy (p->ftype, probe_start (buf, p->uuid, p->label));
+	return n + 1;
+}
+
+static int read_fd (void *source, void *buf, long long int len, long long int offset)
+{
+	return read_at (*(int *) source, buf, len, offset);
+}
+
+int probe_partition_table (const char *device, partition_t *table, char *disk_id)
+{
+	int fd, n;
+
+	if (disk_id) disk_id[0] = 0;
+	fd = open (device, O_RDONLY);
+	if (fd < 0) return -2;
+	n = probe_read_partitions (read_fd, &fd, table, disk_id);
+	close (fd);
+	return n;
+}
+
+int probe_read_partitions (probe_reader reader, void *source, partition_t *table, char *disk_id)
+{
+	unsigned char mbr[512], ebr[512], *entry;
+	long long int ext_start = 0, ebr_start;
+	int i, n = 0, logical;
+
+	if (disk_id) disk_id[0] = 0;
+	if (reader (source, mbr, sizeof (mbr), 0)) return -2;
+	if (le16 (mbr + MBR_SIGNATURE) != 0xAA55 || mbr[MBR_TABLE + 4] == 0xEE) return -3;
+	if (disk_id && le32 (mbr + MBR_DISK_ID)) sprintf (disk_id, "%08x", le32 (mbr + MBR_DISK_ID));
+
+	for (i = 0; i < 4 && n >= 0; i++)
+	{
+		entry = mbr + MBR_TABLE + i * 16;
+		if (entry[4] == 0 || le32 (entry + 12) == 0) continue;
+		if (is_extended (entry[4]))
+		{
+			ext_start = le32 (entry + 8);
+			n = add_partition (reader, source, table, n, i + 1, "extended", entry, ext_start);
+		}
+		else n = add_partition (reader, source, table, n, i + 1, "primary", entry, le32 (entry + 8));
+	}
+
+	// logical partitions: each EBR describes one partition and links to the next EBR
+	ebr_start = ext_start;
+	for (logical = 0; ext_start && ebr_start && logical < MAX_LOGICAL && n >= 0; logical++)
+	{
+		if (reader (source, ebr, sizeof (ebr), ebr_start * 512) || le16 (ebr + MBR_SIGNATURE) != 0xAA55) break;
+		entry = ebr + MBR_TABLE;
+		if (entry[4] && le32 (entry + 12)) n = add_partition (reader, source, table, n, 5 + logical, "logical", entry, ebr_start + le32 (entry + 8));
+		entry += 16;
+		ebr_start = is_extended (entry[4]) && le32 (entry + 8) ? ext_start + le32 (entry + 8) : 0;
+	}
+	return n;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Devices and mounted file systems */
+
+int probe_space (const char *path, fs_space *space)
+{
+	struct statvfs st;
+
+	if (statvfs (path, &st)) return -1;
+	space->total = (long long int) st.f_blocks * st.f_frsize;
+	space->used = (long long int) (st.f_blocks - st.f_bfree) * st.f_frsize;
+	space->available = (long long int) st.f_bavail * st.f_frsize;
+	space->files = (long long int) (st.f_files - st.f_ffree);
+	return 0;
+}
+
+int probe_same_disk (const char *path, const char *device)
+{
+	struct stat path_st, dev_st;
+	char link[128], sys[PATH_MAX], dev[32];
+	unsigned int maj, min;
+	FILE *fp;
+	int same = 0;
+
+	if (stat (path, &path_st) || stat (device, &dev_st) || !S_ISBLK (dev_st.st_mode)) return 0;
+	if (path_st.st_dev == dev_st.st_rdev) return 1;
+
+	// a partition is a subdirectory of its disk in sysfs
+	sprintf (link, "/sys/dev/block/%u:%u/..", major (path_st.st_dev), minor (path_st.st_dev));
+	if (realpath (link, sys) == NULL) return 0;
+	strcat (sys, "/dev");
+	fp = fopen (sys, "r");
+	if (fp == NULL) return 0;
+	if (fgets (dev, sizeof (dev), fp) && sscanf (dev, "%u:%u", &maj, &min) == 2)
+		same = maj == major (dev_st.st_rdev) && min == minor (dev_st.st_rdev);
+	fclose (fp);
+	return same;
+}
+
+int probe_mounted (const char *device)
+{
+	struct mntent *m;
+	FILE *fp;
+	int mounted = 0;
+
+	fp = setmntent ("/proc/mounts", "r");
+	if (fp == NULL) return 0;
+	while (!mounted && (m = getmntent (fp)) != NULL)
+	{
+		// only file systems on block devices, a hanging network share is not touched
+		if (!strncmp (m->mnt_fsname, "/dev/", 5)) mounted = probe_same_disk (m->mnt_dir, device);
+	}
+	endmntent (fp);
+	return mounted;
+}
+
+/* the controller a sysfs device path hangs below: its USB bus, MMC host or PCI function */
+static void bus_of (const char *sys, char *bus, int len)
+{
+	const char *p, *start = NULL;
+	int n;
+
+	for (p = strstr (sys, "/usb"); p && !(p[4] >= '0' && p[4] <= '9'); p = strstr (p + 1, "/usb"));
+	if (p) start = p + 1;
+	if (start == NULL && (p = strstr (sys, "/mmc_host/")) != NULL) start = p + 10;
+	if (start == NULL && !strncmp (sys, "/sys/devices/pci", 16) && (p = strchr (sys + 13, '/')) != NULL) start = p + 1;
+	if (start == NULL) start = strrchr (sys, '/') ? strrchr (sys, '/') + 1 : sys;
+	n = strcspn (start, "/");
+	if (n >= len) n = len - 1;
+	memcpy (bus, start, n);
+	bus[n] = 0;
+}
+
+int probe_bus (const char *device, char *bus, int len)
+{
+	struct stat st;
+	char link[PATH_MAX], sys[PATH_MAX];
+	FILE *fp;
+	dev_t dev;
+
+	if (stat (device, &st) || !S_ISBLK (st.st_mode)) return -1;
+	dev = st.st_rdev;
+	// a loop device shares the bus of the disk its backing file is on
+	sprintf (link, "/sys/dev/block/%u:%u/loop/backing_file", major (dev), minor (dev));
+	fp = fopen (link, "r");
+	if (fp)
+	{
+		if (fgets (link, sizeof (link), fp))
+		{
+			link[strcspn (link, "\n")] = 0;
+			if (stat (link, &st) == 0 && major (st.st_dev)) dev = st.st_dev;
+		}
+		fclose (fp);
+	}
+	sprintf (link, "/sys/dev/block/%u:%u", major (dev), minor (dev));
+	if (realpath (link, sys) == NULL) return -1;
+	bus_of (sys, bus, len);
+	return 0;
+}
+
+long long int probe_read_bytes (const char *device)
+{
+	struct stat st;
+	char path[64];
+	long long int ios, merges, sectors;
+	FILE *fp;
+	int n;
+
+	if (stat (device, &st) || !S_ISBLK (st.st_mode)) return -1;
+	sprintf (path, "/sys/dev/block/%u:%u/stat", major (st.st_rdev), minor (st.st_rdev));
+	fp = fopen (path, "r");
+	if (fp == NULL) return -1;
+	n = fscanf (fp, "%lld %lld %lld", &ios, &merges, &sectors);
+	fclose (fp);
+	return n == 3 ? sectors * 512 : -1;
+}
+
+int probe_reread (const char *device)
+{
+	int fd, res;
+
+	fd = open (device, O_RDONLY);
+	if (fd < 0) return -1;
+	sync ();
+	res = ioctl (fd, BLKRRPART);
+	close (fd);
+	return res;
+}
+
+int probe_set_disk_id (const char *device, const char *disk_id)
+{
+	unsigned char id[4];
+	uint32_t value = strtoul (disk_id, NULL, 16);
+	int fd, res;
+
+	id[0] = value;
+	id[1] = value >> 8;
+	id[2] = value >> 16;
+	id[3] = value >> 24;
+	fd = open (device, O_WRONLY);
+	if (fd < 0) return -1;
+	res = pwrite (fd, id, 4, MBR_DISK_ID) != 4;
+	if (fsync (fd)) res = -1;
+	close (fd);
+	return res;
+}
+
+int probe_set_partition_end (const char *device, int pnum, long long int end)
+{
+	unsigned char mbr[512], ebr[512], *entry, *ext_entry = NULL;
+	long long int ext_start = 0, ebr_start;
+	int fd, i, logical, res = -1;
+
+	fd = open (device, O_RDWR);
+	if (fd < 0) return -1;
+	if (read_at (fd, mbr, sizeof (mbr), 0) || le16 (mbr + MBR_SIGNATURE) != 0xAA55) goto out;
+	for (i = 0; i < 4; i++)
+	{
+		entry = mbr + MBR_TABLE + i * 16;
+		if (is_extended (entry[4]))
+		{
+			ext_entry = entry;
+			ext_start = le32 (entry + 8);
+		}
+		if (i + 1 == pnum && entry[4] && end >= le32 (entry + 8))
+		{
+			set_le32 (entry + 12, end - le32 (entry + 8) + 1);
+			res = pwrite (fd, mbr, sizeof (mbr), 0) != sizeof (mbr);
+			goto out;
+		}
+	}
+	if (pnum < 5 || ext_entry == NULL) goto out;
+
+	// a logical partition is described by its own EBR, the extended partition that holds it must end with it
+	ebr_start = ext_start;
+	for (logical = 0; ebr_start && logical < MAX_LOGICAL; logical++)
+	{
+		if (read_at (fd, ebr, sizeof (ebr), ebr_start * 512) || le16 (ebr + MBR_SIGNATURE) != 0xAA55) break;
+		entry = ebr + MBR_TABLE;
+		if (5 + logical == pnum)
+		{
+			if (end < ebr_start + le32 (entry + 8)) break;
+			set_le32 (entry + 12, end - ebr_start - le32 (entry + 8) + 1);
+			set_le32 (ext_entry + 12, end - ext_start + 1);
+			res = pwrite (fd, ebr, sizeof (ebr), ebr_start * 512) != sizeof (ebr) || pwrite (fd, mbr, sizeof (mbr), 0) != sizeof (mbr);
+			break;
+		}
+		entry += 16;
+		ebr_start = is_extended (entry[4]) && le32 (entry + 8) ? ext_start + le32 (entry + 8) : 0;
+	}
+out:
+	if (res == 0 && fsync (fd)) res = -1;
+	close (fd);
+	return res;
+}
+
+void probe_random_id (char *id)
+{
+	uint32_t value = 0;
+	int fd;
+
+	fd = open ("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read (fd, &value, sizeof (value)) != sizeof (value)) value = time (NULL) ^ (getpid () << 16);
+	if (fd >= 0) close (fd);
+	if (value == 0) value = 1;
+	sprintf (id, "%08x", value);
+}
@@ -0,0 +1,114 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+probe: information about disks, partitions and file systems without running
+external programs. The MBR and the chain of extended boot records are parsed
+directly, UUIDs and labels are read from the ext superblock and the FAT boot
+sector, space figures come from statvfs.
+*/
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#define MAXPART 9
+
+/* struct to store partition data, start and end are in 512 byte sectors, the names are the ones parted uses */
+typedef struct
+{
+    int pnum;
+    long long int start;
+    long long int end;
+    char ptype[10];     /* primary, extended or logical */
+    char ftype[20];     /* fat16, fat32, ext2, ext3, ext4, linux-swap or "" */
+    char flags[10];     /* lba, boot or "" */
+    char uuid[40];      /* file system UUID as lsblk shows it, "" if none */
+    char label[20];     /* file system label, "" if none */
+} partition_t;
+
+/* sizes of a mounted file system in bytes, like the columns of df */
+typedef struct
+{
+    long long int total;
+    long long int used;
+    long long int available;
+    long long int files;        /* inodes in use, 0 if the file system has no inodes */
+} fs_space;
+
+/* probe_partition_table
+   Reads an MSDOS partition table including the logical partitions
+	@param device disk device or image file
+	@param table receives up to MAXPART partitions, ordered by number
+	@param disk_id receives the disk identifier as 8 hex digits, "" if it is 0, may be NULL
+	@return number of partitions, -1 if there are too many, -2 if the device can't be read, -3 if it has no MSDOS partition table
+*/
+int probe_partition_table (const char *device, partition_t *table, char *disk_id);
+
+/* reads len bytes at a byte offset of a disk or image, returns 0 on success */
+typedef int (*probe_reader) (void *source, void *buf, long long int len, long long int offset);
+
+/* probe_read_partitions
+   Reads an MSDOS partition table like probe_partition_table, from any source, e.g. a compressed image
+	@param reader reads from source
+	@return like probe_partition_table
+*/
+int probe_read_partitions (probe_reader reader, void *source, partition_t *table, char *disk_id);
+
+/* probe_filesystem
+   Identifies the file system at a byte offset of an open device
+	@param uuid receives the UUID, "" if not found
+	@param label receives the label, "" if not found
+	@return file system name as parted shows it or "" if unknown
+*/
+const char *probe_filesystem (int fd, long long int offset, char *uuid, char *label);
+
+/* size in bytes of the ext file system at a byte offset of an open device, -1 if it is not ext2/3/4 */
+long long int probe_filesystem_size (int fd, long long int offset);
+
+/* returns 1 if group g of the ext file system with superblock sb has a copy of the superblock */
+int probe_ext_has_super (const unsigned char *sb, long long int g);
+
+/* probe_ext_desc_block
+   Finds the group descriptors of an ext file system, also when meta_bg spreads them over the groups
+	@param sb superblock
+	@param n block of the descriptor table, the one of group g is g / (block size / descriptor size)
+	@return block number
+*/
+long long int probe_ext_desc_block (const unsigned char *sb, long long int n);
+
+/* blocks at the start of group g for the superblock backup, group descriptors and reserved descriptor blocks */
+long long int probe_ext_base_blocks (const unsigned char *sb, long long int g);
+
+/* space on the file system that holds path, returns 0 on success */
+int probe_space (const char *path, fs_space *space);
+
+/* returns 1 if path is stored on device or one of its partitions */
+int probe_same_disk (const char *path, const char *device);
+
+/* returns 1 if device or one of its partitions is mounted */
+int probe_mounted (const char *device);
+
+/* name of the bus or controller device is attached to (usb1, mmc0, a PCI function), for a loop device
+   the one of its backing file, returns 0 on success */
+int probe_bus (const char *device, char *bus, int len);
+
+/* bytes read from device since boot, including its partitions, -1 if unknown */
+long long int probe_read_bytes (const char *device);
+
+/* makes the kernel read the partition table of device again, returns 0 on success */
+int probe_reread (const char *device);
+
+/* writes the disk identifier (8 hex digits) to the MBR of device, returns 0 on success */
+int probe_set_disk_id (const char *device, const char *disk_id);
+
+/* probe_set_partition_end
+   Moves the end of a partition in the MSDOS partition table, the start stays
+	@param pnum partition number, for a logical partition the extended partition is made to end with it
+	@param end new last sector
+	@return 0 on success
+*/
+int probe_set_partition_end (const char *device, int pnum, long long int end);
+
+/* random disk identifier, id must hold 9 chars */
+void probe_random_id (char *id);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+progress: status line and JSON progress stream.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "progress.h"
+#include "util.h"
+
+#define REPORT_INTERVAL 1     /* seconds */
+#define LOG_INTERVAL    10    /* seconds between lines when stdout is not a terminal */
+
+static void report (progress *p, int final)
+{
+	double t = now (), elapsed = t - p->start, interval = t - p->last_time;
+	long long int bytes = *p->bytes, files = p->files ? *p->files : 0;
+	double rate, avg_rate, file_rate, eta = -1, pct = -1;
+	char eta_text[32];
+
+	if (interval <= 0) interval = 1e-9;
+	if (elapsed <= 0) elapsed = 1e-9;
+	rate = (bytes - p->last_bytes) / interval / 1e6;
+	avg_rate = bytes / elapsed / 1e6;
+	file_rate = (files - p->last_files) / interval;
+	if (final)
+	{
+		rate = avg_rate;
+		file_rate = files / elapsed;
+	}
+	if (p->total_bytes > 0)
+	{
+		// the totals are estimates from the file system, never show 100% before the end
+		pct = final ? 100 : 100.0 * bytes / p->total_bytes;
+		if (pct > 99 && !final) pct = 99;
+		if (avg_rate > 0) eta = final ? 0 : (p->total_bytes > bytes ? (p->total_bytes - bytes) / (avg_rate * 1e6) : 0);
+	}
+	p->last_time = t;
+	p->last_bytes = bytes;
+	p->last_files = files;
+
+	if (p->show && (final || isatty (1) || t - p->last_log >= LOG_INTERVAL))
+	{
+		p->last_log = t;
+		if (eta >= 0) snprintf (eta_text, sizeof (eta_text), "ETA %d:%02d", (int) eta / 60, (int) eta % 60);
+		else eta_text[0] = 0;
+		if (pct >= 0) printf ("\r%3d%% ", (int) pct);
+		else printf ("\r");
+		printf ("%lld MB, %.1f MB/s (avg %.1f MB/s)", bytes / 1000000, rate, avg_rate);
+		if (p->files) printf (", %lld files, %.0f files/s", files, file_rate);
+		printf (" %s   %s", eta_text, isatty (1) && !final ? "" : "\n");
+		fflush (stdout);
+	}
+	if (p->json_fd >= 0)
+	{
+		dprintf (p->json_fd, "{\"phase\":\"%s\",\"partition\":%d,\"bytes\":%lld,\"total_bytes\":%lld,\"files\":%lld,\"total_files\":%lld,"
+			"\"elapsed\":%.3f,\"mb_s\":%.3f,\"avg_mb_s\":%.3f,\"files_s\":%.1f,\"eta\":%.0f,\"done\":%s}\n",
+			p->phase, p->partition, bytes, p->total_bytes, files, p->total_files, elapsed, rate, avg_rate, file_rate, eta, final ? "true" : "false");
+	}
+}
+
+static void *progress_thread (progress *p)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock (&p->lock);
+	while (!p->done)
+	{
+		clock_gettime (CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += REPORT_INTERVAL;
+		// woken early by progress_finish
+		while (!p->done && pthread_cond_timedwait (&p->cond, &p->lock, &deadline) == 0);
+		if (!p->done) report (p, 0);
+	}
+	pthread_mutex_unlock (&p->lock);
+	return NULL;
+}
+
+void progress_start (progress *p, const char *phase, int partition, const volatile long long int *bytes, const volatile long long int *files,
+	long long int total_bytes, long long int total_files, char show, int json_fd)
+{
+	pthread_condattr_t attr;
+
+	memset (p, 0, sizeof (progress));
+	p->phase = phase;
+	p->partition = partition;
+	p->bytes = bytes;
+	p->files = files;
+	p->total_bytes = total_bytes;
+	p->total_files = total_files;
+	p->show = show;
+	p->json_fd = json_fd;
+	p->start = p->last_time = now ();
+	p->last_bytes = *bytes;
+	p->last_files = files ? *files : 0;
+	if (!show && json_fd < 0) return;
+
+	pthread_mutex_init (&p->lock, NULL);
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&p->cond, &attr);
+	pthread_condattr_destroy (&attr);
+	p->running = !pthread_create (&p->thread, NULL, (void* (*)(void*)) &progress_thread, p);
+}
+
+void progress_finish (progress *p)
+{
+	if (!p->show && p->json_fd < 0) return;
+	if (p->running)
+	{
+		pthread_mutex_lock (&p->lock);
+		p->done = 1;
+		pthread_cond_signal (&p->cond);
+		pthread_mutex_unlock (&p->lock);
+		pthread_join (p->thread, NULL);
+	}
+	// the rates of the whole phase
+	p->last_time = p->start;
+	p->last_bytes = 0;
+	p->last_files = 0;
+	report (p, 1);
+	pthread_mutex_destroy (&p->lock);
+	pthread_cond_destroy (&p->cond);
+}
@@ -0,0 +1,52 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+progress: reports the byte and file counters of a running copy once per
+second, as a status line for people and as JSON lines for programs.
+The work runs in the calling thread, a reporter thread reads the counters and
+is woken up when the work is finished.
+
+JSON lines have the form:
+	{"phase":"copy","partition":2,"bytes":...,"total_bytes":...,"files":...,"total_files":...,
+	 "elapsed":...,"mb_s":...,"avg_mb_s":...,"files_s":...,"eta":...,"done":false}
+*/
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <pthread.h>
+
+typedef struct
+{
+	const char *phase;
+	int partition;
+	const volatile long long int *bytes;   /* counters updated by the work, files may be NULL */
+	const volatile long long int *files;
+	long long int total_bytes;             /* expected totals, 0 if unknown */
+	long long int total_files;
+	char show;                             /* print the status line on stdout */
+	int json_fd;                           /* JSON lines are written here, -1 for none */
+	double start;
+	double last_time;
+	long long int last_bytes;
+	long long int last_files;
+	double last_log;                       /* time of the last status line when stdout is not a terminal */
+	int done;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+} progress;
+
+/* progress_start
+   Starts reporting, nothing is started if show is 0 and json_fd is -1
+	@param phase name of the phase for the JSON stream
+	@param partition partition number, 0 if the phase is not about one partition
+*/
+void progress_start (progress *p, const char *phase, int partition, const volatile long long int *bytes, const volatile long long int *files,
+	long long int total_bytes, long long int total_files, char show, int json_fd);
+
+/* stops the reporter and writes the final figures */
+void progress_finish (progress *p);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+restore: reads an image in any of the formats imgclone writes and feeds it to
+the device sink.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "sink.h"
+#include "imgfile.h"
+#include "restore.h"
+
+#define IN_BUFFER   (1024*1024)
+#define OUT_BUFFER  (4*1024*1024)     /* image bytes passed to the sink at once, a multiple of the sector size */
+#define RAW_WINDOW  (64*1024*1024)    /* progress granularity of a raw image */
+
+/* frames of an indexed gzip image, inflated by the workers and written in order by the calling thread */
+typedef struct
+{
+	long long int frame;            /* frame in the slot, -1 if the slot is free */
+	long long int len;              /* bytes of the inflated frame, 0 while it is inflated, -1 on error */
+	char *data;
+} frame_slot;
+
+typedef struct
+{
+	img_file *image;
+	unsigned int frame_size;
+	unsigned int max_in;
+	long long int nframes;
+	long long int next;             /* next frame a worker takes */
+	long long int done;             /* frames the writer is finished with */
+	int nslots;
+	frame_slot *slots;
+	int stop;                       /* the writer failed, the workers end */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} frame_reader;
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+/* reads len bytes or up to the end of the stream */
+static ssize_t read_full (int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len)
+	{
+		n = read (fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return -1;
+		if (n == 0) break;
+		done += n;
+	}
+	return done;
+}
+
+/* runs argv with its stdout connected to the returned pipe */
+static int start_command (char *const argv[], pid_t *pid)
+{
+	int pfd[2];
+
+	if (pipe (pfd)) return -1;
+	*pid = fork ();
+	if (*pid == 0)
+	{
+		dup2 (pfd[1], 1);
+		close (pfd[0]);
+		close (pfd[1]);
+		execvp (argv[0], argv);
+		fprintf (stderr, "Could not start %s: %s\n", argv[0], strerror (errno));
+		_exit (127);
+	}
+	close (pfd[1]);
+	if (*pid < 0)
+	{
+		close (pfd[0]);
+		return -1;
+	}
+	return pfd[0];
+}
+
+/*---------------------------------------------------------------------------*/
+/* Readers */
+
+/* a raw image, its holes are not even read */
+static int restore_raw (img_sink *s, int fd, volatile long long int *written)
+{
+	struct stat st;
+	long long int pos, to;
+
+	if (fstat (fd, &st)) return -1;
+	for (pos = 0; pos < st.st_size; pos = to)
+	{
+		to = st.st_size - pos > RAW_WINDOW ? pos + RAW_WINDOW : st.st_size;
+		if (sink_drain (s, fd, pos, to)) return -1;
+		*written = s->offset;
+	}
+	return 0;
+}
+
+/* a stream of decompressed data from a pipe */
+static int restore_stream (img_sink *s, int fd, volatile long long int *written)
+{
+	char *buffer = malloc (OUT_BUFFER);
+	ssize_t n;
+	int res = 0;
+
+	if (buffer == NULL) return -1;
+	do
+	{
+		n = read_full (fd, buffer, OUT_BUFFER);
+		if (n < 0) res = -1;
+		else if (n > 0) res = sink_write_sparse (s, buffer, n);
+		*written = s->offset;
+	} while (n == OUT_BUFFER && !res);
+	free (buffer);
+	return res;
+}
+
+/* gzip, one or many members after each other like the gzip sink writes them */
+static int restore_gzip (img_sink *s, int fd, volatile long long int *written)
+{
+	z_stream zs;
+	char *in = malloc (IN_BUFFER), *out = malloc (OUT_BUFFER);
+	ssize_t n;
+	int res = 0, ret = Z_OK;
+
+	memset (&zs, 0, sizeof (zs));
+	// window bits 15 + 16 only accepts gzip
+	if (in == NULL || out == NULL || inflateInit2 (&zs, 15 + 16) != Z_OK)
+	{
+		free (in);
+		free (out);
+		return -1;
+	}
+	zs.next_out = (unsigned char *) out;
+	zs.avail_out = OUT_BUFFER;
+	while (!res)
+	{
+		if (zs.avail_in == 0)
+		{
+			n = read_full (fd, in, IN_BUFFER);
+			if (n < 0) res = -1;
+			if (n <= 0) break;
+			zs.next_in = (unsigned char *) in;
+			zs.avail_in = n;
+		}
+		ret = inflate (&zs, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+		{
+			// the next member starts right after this one
+			inflateReset (&zs);
+		}
+		else if (ret != Z_OK && ret != Z_BUF_ERROR)
+		{
+			fprintf (stderr, "Corrupt gzip data: %s\n", zs.msg ? zs.msg : "unknown error");
+			res = -1;
+		}
+		// the sink only gets full buffers, so its writes stay aligned
+		if (!res && zs.avail_out == 0)
+		{
+			res = sink_write_sparse (s, out, OUT_BUFFER);
+			zs.next_out = (unsigned char *) out;
+			zs.avail_out = OUT_BUFFER;
+			*written = s->offset;
+		}
+	}
+	// a member that was cut off leaves the stream in the middle of a member
+	if (!res && zs.total_in > 0 && ret != Z_STREAM_END)
+	{
+		fprintf (stderr, "The gzip file ends in the middle of the image.\n");
+		res = -1;
+	}
+	if (!res && zs.avail_out < OUT_BUFFER) res = sink_write_sparse (s, out, OUT_BUFFER - zs.avail_out);
+	*written = s->offset;
+	inflateEnd (&zs);
+	free (in);
+	free (out);
+	return res;
+}
+
+/* inflates the frames in the order they are taken, a frame waits until the writer is finished with the frame before it in its slot */
+static void *frame_worker (frame_reader *r)
+{
+	unsigned char *in = malloc (r->max_in);
+	long long int frame, len;
+	frame_slot *slot;
+
+	pthread_mutex_lock (&r->lock);
+	while (!r->stop && r->next < r->nframes)
+	{
+		frame = r->next++;
+		slot = &r->slots[frame % r->nslots];
+		while (!r->stop && frame >= r->done + r->nslots) pthread_cond_wait (&r->cond, &r->lock);
+		if (r->stop) break;
+		slot->frame = frame;
+		slot->len = 0;
+		pthread_mutex_unlock (&r->lock);
+		len = in ? img_file_inflate (r->image, frame, in, slot->data) : -1;
+		pthread_mutex_lock (&r->lock);
+		slot->len = len;
+		pthread_cond_broadcast (&r->cond);
+	}
+	pthread_mutex_unlock (&r->lock);
+	free (in);
+	return NULL;
+}
+
+/* gzip with the index of the gzip sink, its independent frames are inflated by threads workers */
+static int restore_frames (img_sink *s, img_file *image, int threads, volatile long long int *written)
+{
+	frame_reader r;
+	frame_slot *slot;
+	pthread_t *workers;
+	long long int frame;
+	int i, started = 0, res = 0;
+
+	memset (&r, 0, sizeof (r));
+	r.image = image;
+	r.nframes = img_file_frames (image, &r.frame_size, &r.max_in);
+	if (threads <= 0) threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+	if (threads <= 0) threads = 1;
+	r.nslots = threads * 2 + 2;
+	r.slots = calloc (r.nslots, sizeof (frame_slot));
+	workers = calloc (threads, sizeof (pthread_t));
+	if (r.slots == NULL || workers == NULL) res = -1;
+	for (i = 0; !res && i < r.nslots; i++)
+	{
+		r.slots[i].frame = -1;
+		r.slots[i].data = malloc (r.frame_size);
+		if (r.slots[i].data == NULL) res = -1;
+	}
+	pthread_mutex_init (&r.lock, NULL);
+	pthread_cond_init (&r.cond, NULL);
+	for (i = 0; !res && i < threads; i++)
+	{
+		if (pthread_create (&workers[i], NULL, (void * (*)(void *)) &frame_worker, &r)) break;
+		started++;
+	}
+	if (!res && started == 0) res = -1;
+
+	// the sink gets the frames in order, so its writes stay sequential and aligned
+	for (frame = 0; !res && frame < r.nframes; frame++)
+	{
+		slot = &r.slots[frame % r.nslots];
+		pthread_mutex_lock (&r.lock);
+		while (slot->frame != frame || slot->len == 0) pthread_cond_wait (&r.cond, &r.lock);
+		pthread_mutex_unlock (&r.lock);
+		if (slot->len < 0) res = -1;
+		else res = sink_write_sparse (s, slot->data, slot->len);
+		*written = s->offset;
+		pthread_mutex_lock (&r.lock);
+		slot->frame = -1;
+		r.done++;
+		pthread_cond_broadcast (&r.cond);
+		pthread_mutex_unlock (&r.lock);
+	}
+
+	pthread_mutex_lock (&r.lock);
+	r.stop = 1;
+	pthread_cond_broadcast (&r.cond);
+	pthread_mutex_unlock (&r.lock);
+	for (i = 0; i < started; i++) pthread_join (workers[i], NULL);
+	for (i = 0; r.slots && i < r.nslots; i++) free (r.slots[i].data);
+	free (r.slots);
+	free (workers);
+	pthread_mutex_destroy (&r.lock);
+	pthread_cond_destroy (&r.cond);
+	return res;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+int restore_image (const char *image, const char *device, int discard, int threads, volatile long long int *written)
+{
+	unsigned char magic[4];
+	char *zstd_argv[] = { "zstd", "-d", "-c", "-q", (char *) image, NULL };
+	char *bzip2_argv[] = { "bzip2", "-d", "-c", (char *) image, NULL };
+	char *const *argv = NULL;
+	img_file *indexed = NULL;
+	img_sink *s;
+	pid_t pid = -1;
+	int fd, in, res, status;
+
+	fd = open (image, O_RDONLY);
+	if (fd < 0 || read_full (fd, (char *) magic, 4) != 4)
+	{
+		fprintf (stderr, "Could not read %s: %s\n", image, fd < 0 ? strerror (errno) : "too short");
+		if (fd >= 0) close (fd);
+		return -1;
+	}
+	lseek (fd, 0, SEEK_SET);
+
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) argv = zstd_argv;
+	else if (magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h') argv = bzip2_argv;
+	printf ("Restoring %s image %s to %s.\n", argv ? argv[0] : magic[0] == 0x1f && magic[1] == 0x8b ? "gzip" : "raw", image, device);
+
+	s = sink_device_open (device, discard);
+	if (s == NULL)
+	{
+		close (fd);
+		return -1;
+	}
+	if (argv)
+	{
+		in = start_command (argv, &pid);
+		res = in < 0 ? -1 : restore_stream (s, in, written);
+		if (in >= 0) close (in);
+		if (pid > 0 && (waitpid (pid, &status, 0) < 0 || !WIFEXITED (status) || WEXITSTATUS (status))) res = -1;
+	}
+	else if (magic[0] == 0x1f && magic[1] == 0x8b && (indexed = img_file_open_index (image)) != NULL)
+	{
+		res = restore_frames (s, indexed, threads, written);
+		img_file_close (indexed);
+	}
+	else if (magic[0] == 0x1f && magic[1] == 0x8b) res = restore_gzip (s, fd, written);
+	else res = restore_raw (s, fd, written);
+	close (fd);
+	if (sink_close (s)) res = -1;
+	return res;
+}
@@ -0,0 +1,29 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+restore: writes a backup image back to an SD card.
+
+The format of the image is recognized by its first bytes: a raw .img file,
+gzip (also the multi-member files of the gzip sink), zstd or bzip2. gzip is
+decompressed here with zlib: the 1 MB frames of an image with the index of the
+gzip sink on several threads, other gzip files on one. zstd and bzip2 are
+decompressed by the external programs through a pipe. Decompression runs while the queued writes of the device sink are in
+flight. Blocks of zeros and the holes of a sparse .img file are not written
+but zeroed by the kernel, or unmapped with discard.
+*/
+
+#ifndef RESTORE_H
+#define RESTORE_H
+
+/* restore_image
+   Writes image to a block device from offset 0
+	@param image .img, .img.gz, .img.zst or .img.bz2 file
+	@param device the block device, nothing on it may be mounted
+	@param discard 1 to unmap the zero regions instead of zeroing them when the device allows it
+	@param threads threads that inflate an indexed gzip image, 0 for one per core
+	@param written updated with the image bytes written so far, for progress reports
+	@return 0 on success
+*/
+int restore_image (const char *image, const char *device, int discard, int threads, volatile long long int *written);
+
+#endif
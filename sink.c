@@ -0,0 +1,1045 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+sink: image output destinations.
+
+The gzip sink works like pigz: the image is cut in blocks that are compressed
+on all cores at the same time, every block becomes an independent gzip member
+and the members are written in order. A concatenation of gzip members is a
+valid gzip file, so the result can be restored with plain gunzip or zcat.
+The compressed length of every member is stored in an index at the end, in
+empty members that gunzip skips, see imgfile.h for the layout.
+zstd and bzip2 are fed through a pipe to the external programs, zstd is
+started with one thread per core.
+
+The fan-out sink copies the image into a ring of buffers once, a thread per
+destination writes the ring to its own sink. The producer waits while the
+slowest destination is a full ring behind, a failed destination drops out.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <zlib.h>
+
+#include "sink.h"
+#include "ioengine.h"
+#include "imgfile.h"
+#include "util.h"
+
+#define GZ_BLOCK     (1024*1024)
+#define DRAIN_BUFFER (4*1024*1024)
+#define FAN_CHUNK    (4*1024*1024)
+#define FAN_SLOTS    16              /* image bytes in flight between the source and the slowest destination */
+
+#define SLOT_FREE 0
+#define SLOT_FULL 1
+#define SLOT_BUSY 2
+#define SLOT_DONE 3
+
+// aligned so it can be written to a device opened with O_DIRECT
+static char zero_buffer[65536] __attribute__ ((aligned (4096)));
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+static int default_threads (int threads)
+{
+	if (threads <= 0) threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+	if (threads <= 0) threads = 1;
+	return threads;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Parallel gzip */
+
+typedef struct
+{
+	char *in;
+	long long int in_len;
+	char *out;
+	long long int out_len;
+	int zero;      /* block of zeros, use the precompressed member */
+	int state;
+} gz_slot;
+
+typedef struct
+{
+	int fd;
+	int level;
+	int nslots;
+	gz_slot *slots;
+	long long int next_in;    /* block being filled by the producer */
+	long long int next_work;  /* next block to compress */
+	long long int next_out;   /* next block to write */
+	int closing;
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int nworkers;
+	pthread_t *workers;             /* nworkers of them were started */
+	pthread_t writer;
+	int writer_started;
+	char *zero_member;
+	long long int zero_len;
+	unsigned int *frames;     /* compressed length of every member written, for the index */
+	long long int nframes;
+	long long int sframes;
+	long long int written;    /* bytes written to the file */
+} gz_sink;
+
+static long long int gz_compress (int level, const char *in, long long int in_len, char *out, long long int out_size)
+{
+	z_stream zs;
+	long long int len;
+
+	memset (&zs, 0, sizeof (zs));
+	// window bits 15 + 16 writes a gzip header and trailer
+	if (deflateInit2 (&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+	zs.next_in = (Bytef *) in;
+	zs.avail_in = in_len;
+	zs.next_out = (Bytef *) out;
+	zs.avail_out = out_size;
+	if (deflate (&zs, Z_FINISH) != Z_STREAM_END)
+	{
+		deflateEnd (&zs);
+		return -1;
+	}
+	len = zs.total_out;
+	deflateEnd (&zs);
+	return len;
+}
+
+static void *gz_worker (gz_sink *g)
+{
+	gz_slot *slot;
+
+	pthread_mutex_lock (&g->lock);
+	for (;;)
+	{
+		while (g->next_work == g->next_in && !g->closing) pthread_cond_wait (&g->cond, &g->lock);
+		if (g->next_work == g->next_in) break;
+		slot = &g->slots[g->next_work % g->nslots];
+		g->next_work++;
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock (&g->lock);
+
+		if (!slot->zero)
+		{
+			slot->out_len = gz_compress (g->level, slot->in, slot->in_len, slot->out, deflateBound (NULL, GZ_BLOCK) + 64);
+		}
+
+		pthread_mutex_lock (&g->lock);
+		if (!slot->zero && slot->out_len < 0) g->error = 1;
+		slot->state = SLOT_DONE;
+		pthread_cond_broadcast (&g->cond);
+	}
+	pthread_mutex_unlock (&g->lock);
+	return NULL;
+}
+
+static void *gz_writer (gz_sink *g)
+{
+	gz_slot *slot;
+	int res;
+
+	pthread_mutex_lock (&g->lock);
+	for (;;)
+	{
+		slot = &g->slots[g->next_out % g->nslots];
+		while (!(g->next_out < g->next_in && slot->state == SLOT_DONE) && !(g->closing && g->next_out == g->next_in))
+			pthread_cond_wait (&g->cond, &g->lock);
+		if (g->next_out == g->next_in) break;
+		pthread_mutex_unlock (&g->lock);
+
+		if (slot->zero) res = write_all (g->fd, g->zero_member, g->zero_len);
+		else res = slot->out_len < 0 ? -1 : write_all (g->fd, slot->out, slot->out_len);
+		if (g->nframes == g->sframes)
+		{
+			g->sframes = g->sframes ? g->sframes * 2 : 4096;
+			g->frames = realloc (g->frames, g->sframes * sizeof (unsigned int));
+		}
+		g->frames[g->nframes] = slot->zero ? g->zero_len : slot->out_len;
+		g->written += g->frames[g->nframes++];
+
+		pthread_mutex_lock (&g->lock);
+		if (res) g->error = 1;
+		slot->state = SLOT_FREE;
+		slot->in_len = 0;
+		slot->zero = 0;
+		g->next_out++;
+		pthread_cond_broadcast (&g->cond);
+	}
+	pthread_mutex_unlock (&g->lock);
+	return NULL;
+}
+
+/* hand the slot being filled to the workers and wait for the next one to become free */
+static int gz_submit (gz_sink *g)
+{
+	gz_slot *slot;
+
+	pthread_mutex_lock (&g->lock);
+	g->slots[g->next_in % g->nslots].state = SLOT_FULL;
+	g->next_in++;
+	pthread_cond_broadcast (&g->cond);
+	slot = &g->slots[g->next_in % g->nslots];
+	while (slot->state != SLOT_FREE && !g->error) pthread_cond_wait (&g->cond, &g->lock);
+	pthread_mutex_unlock (&g->lock);
+	return g->error ? -1 : 0;
+}
+
+static int gz_write (img_sink *s, const char *buf, long long int len)
+{
+	gz_sink *g = s->priv;
+	gz_slot *slot;
+	long long int n;
+
+	while (len > 0)
+	{
+		slot = &g->slots[g->next_in % g->nslots];
+		n = GZ_BLOCK - slot->in_len;
+		if (n > len) n = len;
+		memcpy (slot->in + slot->in_len, buf, n);
+		slot->in_len += n;
+		buf += n;
+		len -= n;
+		if (slot->in_len == GZ_BLOCK && gz_submit (g)) return -1;
+	}
+	return 0;
+}
+
+static int gz_zero (img_sink *s, long long int len)
+{
+	gz_sink *g = s->priv;
+	gz_slot *slot;
+	long long int n;
+
+	while (len > 0)
+	{
+		slot = &g->slots[g->next_in % g->nslots];
+		if (slot->in_len == 0 && len >= GZ_BLOCK)
+		{
+			// whole blocks of zeros all compress to the same member
+			slot->zero = 1;
+			slot->in_len = GZ_BLOCK;
+			len -= GZ_BLOCK;
+			if (gz_submit (g)) return -1;
+			continue;
+		}
+		n = GZ_BLOCK - slot->in_len;
+		if (n > len) n = len;
+		memset (slot->in + slot->in_len, 0, n);
+		slot->in_len += n;
+		len -= n;
+		if (slot->in_len == GZ_BLOCK && gz_submit (g)) return -1;
+	}
+	return 0;
+}
+
+/* gzip member without data, the extra field carries a subfield si1 si2 with len bytes of data */
+static long long int gz_empty_member (char *out, char si1, char si2, const unsigned char *data, int len)
+{
+	static const unsigned char header[10] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3 };
+	static const unsigned char trailer[10] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	unsigned char *p = (unsigned char *) out;
+
+	// FLG.FEXTRA, XLEN, the subfield, an empty final deflate block, CRC32 and ISIZE of nothing
+	memcpy (p, header, 10);
+	p[10] = (len + 4) & 0xff;
+	p[11] = (len + 4) >> 8;
+	p[12] = si1;
+	p[13] = si2;
+	p[14] = len & 0xff;
+	p[15] = len >> 8;
+	memcpy (p + 16, data, len);
+	memcpy (p + 16 + len, trailer, 10);
+	return 26 + len;
+}
+
+static void put_le (unsigned char *p, unsigned long long int v, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++) p[i] = v >> (i * 8);
+}
+
+/* the lengths of all members in index members, then the trailer that points to them */
+static int gz_write_index (gz_sink *g, long long int image_size)
+{
+	unsigned char data[IMG_INDEX_FRAMES * 4], trailer[IMG_TRAILER_DATA];
+	char member[IMG_INDEX_FRAMES * 4 + 32];
+	long long int i, n, len, index_offset = g->written;
+
+	for (i = 0; i < g->nframes; i += n)
+	{
+		n = g->nframes - i < IMG_INDEX_FRAMES ? g->nframes - i : IMG_INDEX_FRAMES;
+		for (len = 0; len < n; len++) put_le (data + len * 4, g->frames[i + len], 4);
+		len = gz_empty_member (member, 'I', 'X', data, n * 4);
+		if (write_all (g->fd, member, len)) return -1;
+	}
+	put_le (trailer, index_offset, 8);
+	put_le (trailer + 8, image_size, 8);
+	put_le (trailer + 16, GZ_BLOCK, 4);
+	put_le (trailer + 20, g->nframes, 4);
+	len = gz_empty_member (member, 'I', 'T', trailer, IMG_TRAILER_DATA);
+	return write_all (g->fd, member, len);
+}
+
+/* ends the threads that were started and frees the buffers */
+static void gz_free (gz_sink *g)
+{
+	int i;
+
+	pthread_mutex_lock (&g->lock);
+	g->closing = 1;
+	pthread_cond_broadcast (&g->cond);
+	pthread_mutex_unlock (&g->lock);
+	for (i = 0; i < g->nworkers; i++) pthread_join (g->workers[i], NULL);
+	if (g->writer_started) pthread_join (g->writer, NULL);
+	for (i = 0; g->slots && i < g->nslots; i++)
+	{
+		free (g->slots[i].in);
+		free (g->slots[i].out);
+	}
+	free (g->slots);
+	free (g->workers);
+	free (g->zero_member);
+	free (g->frames);
+	pthread_mutex_destroy (&g->lock);
+	pthread_cond_destroy (&g->cond);
+	free (g);
+}
+
+static int gz_close (img_sink *s)
+{
+	gz_sink *g = s->priv;
+	int res;
+
+	if (g->slots[g->next_in % g->nslots].in_len > 0) gz_submit (g);
+	pthread_mutex_lock (&g->lock);
+	g->closing = 1;
+	pthread_cond_broadcast (&g->cond);
+	pthread_mutex_unlock (&g->lock);
+	// the writer is done once it was joined, the index follows the last member
+	if (g->writer_started) pthread_join (g->writer, NULL);
+	g->writer_started = 0;
+
+	res = g->error;
+	if (!res && gz_write_index (g, s->offset)) res = 1;
+	if (close (g->fd)) res = 1;
+	gz_free (g);
+	return res;
+}
+
+static img_sink *sink_gzip_open (const char *path, int threads)
+{
+	img_sink *s;
+	gz_sink *g;
+	char *zeros;
+	int i, n, ok;
+
+	g = calloc (1, sizeof (gz_sink));
+	s = calloc (1, sizeof (img_sink));
+	if (g == NULL || s == NULL)
+	{
+		free (g);
+		free (s);
+		return NULL;
+	}
+	g->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (g->fd < 0)
+	{
+		fprintf (stderr, "Could not create %s: %s\n", path, strerror (errno));
+		free (g);
+		free (s);
+		return NULL;
+	}
+	pthread_mutex_init (&g->lock, NULL);
+	pthread_cond_init (&g->cond, NULL);
+	g->level = Z_DEFAULT_COMPRESSION;
+	n = default_threads (threads);
+	g->nslots = n * 2 + 2;
+	g->slots = calloc (g->nslots, sizeof (gz_slot));
+	g->workers = calloc (n, sizeof (pthread_t));
+	zeros = calloc (1, GZ_BLOCK);
+	g->zero_member = malloc (deflateBound (NULL, GZ_BLOCK) + 64);
+	ok = g->slots && g->workers && zeros && g->zero_member;
+	for (i = 0; ok && i < g->nslots; i++)
+	{
+		g->slots[i].in = malloc (GZ_BLOCK);
+		g->slots[i].out = malloc (deflateBound (NULL, GZ_BLOCK) + 64);
+		ok = g->slots[i].in && g->slots[i].out;
+	}
+	if (ok) g->zero_len = gz_compress (g->level, zeros, GZ_BLOCK, g->zero_member, deflateBound (NULL, GZ_BLOCK) + 64);
+	free (zeros);
+	// only the threads that were started are joined
+	for (i = 0; ok && i < n; i++)
+	{
+		if (pthread_create (&g->workers[i], NULL, (void * (*)(void *)) &gz_worker, g)) break;
+		g->nworkers++;
+	}
+	if (ok && g->nworkers > 0) g->writer_started = pthread_create (&g->writer, NULL, (void * (*)(void *)) &gz_writer, g) == 0;
+	if (!ok || g->zero_len < 0 || !g->writer_started)
+	{
+		fprintf (stderr, "Could not start the compression of %s.\n", path);
+		close (g->fd);
+		gz_free (g);
+		free (s);
+		return NULL;
+	}
+
+	s->write = gz_write;
+	s->zero = gz_zero;
+	s->close = gz_close;
+	s->priv = g;
+	return s;
+}
+
+/*---------------------------------------------------------------------------*/
+/* External compressor fed through a pipe */
+
+typedef struct
+{
+	int fd;
+	pid_t pid;
+} cmd_sink;
+
+static int cmd_write (img_sink *s, const char *buf, long long int len)
+{
+	return write_all (((cmd_sink *) s->priv)->fd, buf, len);
+}
+
+static int cmd_zero (img_sink *s, long long int len)
+{
+	long long int n;
+
+	while (len > 0)
+	{
+		n = len > (long long int) sizeof (zero_buffer) ? (long long int) sizeof (zero_buffer) : len;
+		if (cmd_write (s, zero_buffer, n)) return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static int cmd_close (img_sink *s)
+{
+	cmd_sink *c = s->priv;
+	int status = 0;
+
+	close (c->fd);
+	if (waitpid (c->pid, &status, 0) < 0) status = 1;
+	free (c);
+	return !(WIFEXITED (status) && WEXITSTATUS (status) == 0);
+}
+
+/* runs argv with stdin connected to the sink and stdout redirected to path */
+static img_sink *sink_command_open (const char *path, char *const argv[])
+{
+	img_sink *s;
+	cmd_sink *c;
+	int pfd[2], out;
+
+	out = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0)
+	{
+		fprintf (stderr, "Could not create %s: %s\n", path, strerror (errno));
+		return NULL;
+	}
+	if (pipe (pfd))
+	{
+		close (out);
+		return NULL;
+	}
+	c = calloc (1, sizeof (cmd_sink));
+	c->pid = fork ();
+	if (c->pid == 0)
+	{
+		dup2 (pfd[0], 0);
+		dup2 (out, 1);
+		close (pfd[0]);
+		close (pfd[1]);
+		close (out);
+		execvp (argv[0], argv);
+		fprintf (stderr, "Could not start %s: %s\n", argv[0], strerror (errno));
+		_exit (127);
+	}
+	close (pfd[0]);
+	close (out);
+	if (c->pid < 0)
+	{
+		close (pfd[1]);
+		free (c);
+		return NULL;
+	}
+	// a compressor that dies must give a write error, not kill us
+	signal (SIGPIPE, SIG_IGN);
+	c->fd = pfd[1];
+	s = calloc (1, sizeof (img_sink));
+	s->write = cmd_write;
+	s->zero = cmd_zero;
+	s->close = cmd_close;
+	s->priv = c;
+	return s;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Sparse file */
+
+typedef struct
+{
+	int fd;
+	int stream;         /* a pipe or device, holes must be written as zeros */
+	int device;         /* block device, the kernel zeroes the zero regions */
+	int discard;        /* zero regions of the device are unmapped when it guarantees they read back as zeros */
+	io_engine *io;      /* queued writes of a regular file or device */
+	int next;           /* slot for the next write */
+} file_sink;
+
+static int file_write (img_sink *s, const char *buf, long long int len)
+{
+	file_sink *f = s->priv;
+	long long int pos = s->offset - len, n;
+	int block;
+
+	if (f->io == NULL) return write_all (f->fd, buf, len);
+	// the data is copied to a free buffer of the engine, the write itself goes on in the background
+	block = io_engine_block_size (f->io);
+	for (; len > 0; len -= n, buf += n, pos += n)
+	{
+		n = len > block ? block : len;
+		if (io_engine_wait (f->io, f->next))
+		{
+			fprintf (stderr, "Could not write image: %s\n", strerror (errno));
+			return -1;
+		}
+		memcpy (io_engine_buffer (f->io, f->next), buf, n);
+		if (io_engine_submit (f->io, f->next, f->fd, pos, n, 1)) return -1;
+		f->next = (f->next + 1) % io_engine_depth (f->io);
+	}
+	return 0;
+}
+
+/* zeroes a region of a block device without sending the zeros from here */
+static int device_zero (file_sink *f, long long int pos, long long int len)
+{
+	unsigned long long int range[2] = { pos, len };
+	long long int n;
+
+	// unmapping is only done by the kernel if the device reads unmapped blocks as zeros
+	if (f->discard && fallocate (f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len) == 0) return 0;
+	// WRITE ZEROES when the device has it, otherwise the kernel writes zero pages
+	if (ioctl (f->fd, BLKZEROOUT, range) == 0) return 0;
+	for (; len > 0; len -= n, pos += n)
+	{
+		n = len > (long long int) sizeof (zero_buffer) ? (long long int) sizeof (zero_buffer) : len;
+		if (pwrite (f->fd, zero_buffer, n, pos) != n) return -1;
+	}
+	return 0;
+}
+
+static int file_zero (img_sink *s, long long int len)
+{
+	file_sink *f = s->priv;
+	long long int n;
+
+	if (f->device) return device_zero (f, s->offset - len, len);
+	// the writes are positioned, skipping the region leaves a hole
+	if (f->io) return 0;
+	if (!f->stream) return lseek (f->fd, len, SEEK_CUR) < 0;
+	for (; len > 0; len -= n)
+	{
+		n = len > (long long int) sizeof (zero_buffer) ? (long long int) sizeof (zero_buffer) : len;
+		if (write_all (f->fd, zero_buffer, n)) return -1;
+	}
+	return 0;
+}
+
+static int file_sync (img_sink *s)
+{
+	file_sink *f = s->priv;
+	int i;
+
+	if (f->stream) return -1;
+	for (i = 0; f->io && i < io_engine_depth (f->io); i++)
+	{
+		if (io_engine_wait (f->io, i)) return -1;
+	}
+	return fdatasync (f->fd);
+}
+
+static int file_close (img_sink *s)
+{
+	file_sink *f = s->priv;
+	int i, res = 0;
+
+	if (f->io)
+	{
+		for (i = 0; i < io_engine_depth (f->io); i++)
+		{
+			if (io_engine_wait (f->io, i)) res = 1;
+		}
+		io_engine_close (f->io);
+	}
+	// a hole at the end is not allocated by the writes
+	if (!f->stream && ftruncate (f->fd, s->offset)) res = 1;
+	if (f->device && fsync (f->fd)) res = 1;
+	if (close (f->fd)) res = 1;
+	free (f);
+	return res;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Fan-out */
+
+typedef struct
+{
+	char *buf;
+	long long int len;
+	int zero;      /* a zero region of len bytes, buf is not used */
+} fan_slot;
+
+typedef struct fan_sink fan_sink;
+
+typedef struct
+{
+	fan_sink *fan;
+	img_sink *sink;
+	char *name;
+	long long int next;       /* next slot to write */
+	long long int stalls;     /* times the producer waited for this destination */
+	int failed;
+	double seconds;
+	pthread_t thread;
+} fan_dest;
+
+struct fan_sink
+{
+	fan_slot slots[FAN_SLOTS];
+	long long int head;       /* slot being filled by the producer */
+	int closing;
+	int ndests;
+	fan_dest *dests;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct timespec start;
+};
+
+static double fan_elapsed (fan_sink *f)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - f->start.tv_sec) + (now.tv_nsec - f->start.tv_nsec) / 1e9;
+}
+
+/* every destination writes the slots in order at its own pace, a failed one only skips them */
+static void *fan_writer (fan_dest *d)
+{
+	fan_sink *f = d->fan;
+	fan_slot *slot;
+	int res;
+
+	for (;;)
+	{
+		pthread_mutex_lock (&f->lock);
+		while (d->next == f->head && !f->closing) pthread_cond_wait (&f->cond, &f->lock);
+		if (d->next == f->head)
+		{
+			pthread_mutex_unlock (&f->lock);
+			break;
+		}
+		slot = &f->slots[d->next % FAN_SLOTS];
+		pthread_mutex_unlock (&f->lock);
+
+		if (!d->failed)
+		{
+			res = slot->zero ? sink_zero (d->sink, slot->len) : sink_write (d->sink, slot->buf, slot->len);
+			if (res)
+			{
+				d->failed = 1;
+				fprintf (stderr, "Writing %s failed at %lld bytes, the other destinations continue.\n", d->name, d->sink->offset);
+			}
+		}
+
+		pthread_mutex_lock (&f->lock);
+		d->next++;
+		pthread_cond_broadcast (&f->cond);
+		pthread_mutex_unlock (&f->lock);
+	}
+	d->seconds = fan_elapsed (f);
+	return NULL;
+}
+
+/* hands the filled slot to the destinations, waits until the slowest one frees the next slot */
+static void fan_publish (fan_sink *f)
+{
+	fan_dest *slowest;
+	int i;
+
+	pthread_mutex_lock (&f->lock);
+	f->head++;
+	pthread_cond_broadcast (&f->cond);
+	for (;;)
+	{
+		slowest = &f->dests[0];
+		for (i = 1; i < f->ndests; i++)
+		{
+			if (f->dests[i].next < slowest->next) slowest = &f->dests[i];
+		}
+		if (f->head - slowest->next < FAN_SLOTS) break;
+		slowest->stalls++;
+		pthread_cond_wait (&f->cond, &f->lock);
+	}
+	pthread_mutex_unlock (&f->lock);
+	f->slots[f->head % FAN_SLOTS].len = 0;
+	f->slots[f->head % FAN_SLOTS].zero = 0;
+}
+
+static int fan_write (img_sink *s, const char *buf, long long int len)
+{
+	fan_sink *f = s->priv;
+	fan_slot *slot;
+	long long int n;
+
+	while (len > 0)
+	{
+		slot = &f->slots[f->head % FAN_SLOTS];
+		if (slot->zero)
+		{
+			fan_publish (f);
+			continue;
+		}
+		n = FAN_CHUNK - slot->len < len ? FAN_CHUNK - slot->len : len;
+		memcpy (slot->buf + slot->len, buf, n);
+		slot->len += n;
+		buf += n;
+		len -= n;
+		if (slot->len == FAN_CHUNK) fan_publish (f);
+	}
+	return 0;
+}
+
+static int fan_zero (img_sink *s, long long int len)
+{
+	fan_sink *f = s->priv;
+	fan_slot *slot = &f->slots[f->head % FAN_SLOTS];
+
+	// zero regions take a slot without data, regions after each other are merged
+	if (slot->len && !slot->zero) fan_publish (f);
+	slot = &f->slots[f->head % FAN_SLOTS];
+	slot->zero = 1;
+	slot->len += len;
+	return 0;
+}
+
+static int fan_close (img_sink *s)
+{
+	fan_sink *f = s->priv;
+	fan_dest *d;
+	int i, ok = 0, res = 0;
+
+	if (f->slots[f->head % FAN_SLOTS].len) fan_publish (f);
+	pthread_mutex_lock (&f->lock);
+	f->closing = 1;
+	pthread_cond_broadcast (&f->cond);
+	pthread_mutex_unlock (&f->lock);
+
+	for (i = 0; i < f->ndests; i++)
+	{
+		d = &f->dests[i];
+		pthread_join (d->thread, NULL);
+		if (sink_close (d->sink)) d->failed = 1;
+		if (d->failed)
+		{
+			fprintf (stderr, "%s is incomplete.\n", d->name);
+			res = 1;
+		}
+		else
+		{
+			printf ("%s written in %.1f s, the source waited for it %lld times.\n", d->name, d->seconds, d->stalls);
+			ok++;
+		}
+		free (d->name);
+	}
+	if (ok && res) fprintf (stderr, "%d of %d destinations were written.\n", ok, f->ndests);
+	for (i = 0; i < FAN_SLOTS; i++) free (f->slots[i].buf);
+	free (f->dests);
+	pthread_mutex_destroy (&f->lock);
+	pthread_cond_destroy (&f->cond);
+	free (f);
+	return res;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+const char *sink_extension (int format)
+{
+	switch (format)
+	{
+		case SINK_BZIP2: return ".bz2";
+		case SINK_GZIP: return ".gz";
+		case SINK_ZSTD: return ".zst";
+	}
+	return "";
+}
+
+img_sink *sink_compress_open (const char *path, int format, int threads)
+{
+	char thread_arg[16];
+	char *zstd_argv[] = { "zstd", "-q", "-c", thread_arg, NULL };
+	char *bzip2_argv[] = { "bzip2", "-c", NULL };
+
+	switch (format)
+	{
+		case SINK_GZIP:
+			return sink_gzip_open (path, threads);
+		case SINK_ZSTD:
+			sprintf (thread_arg, "-T%d", default_threads (threads));
+			return sink_command_open (path, zstd_argv);
+		case SINK_BZIP2:
+			return sink_command_open (path, bzip2_argv);
+	}
+	return NULL;
+}
+
+img_sink *sink_file_open (const char *path)
+{
+	img_sink *s;
+	file_sink *f;
+	struct stat st;
+	int fd;
+
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || fstat (fd, &st))
+	{
+		fprintf (stderr, "Could not create %s: %s\n", path, strerror (errno));
+		if (fd >= 0) close (fd);
+		return NULL;
+	}
+	f = calloc (1, sizeof (file_sink));
+	f->fd = fd;
+	f->stream = !S_ISREG (st.st_mode);
+	if (!f->stream) f->io = io_engine_open ();
+	s = calloc (1, sizeof (img_sink));
+	s->write = file_write;
+	s->zero = file_zero;
+	s->close = file_close;
+	s->sync = file_sync;
+	s->priv = f;
+	return s;
+}
+
+img_sink *sink_file_resume (const char *path, long long int offset)
+{
+	img_sink *s;
+	file_sink *f;
+	struct stat st;
+	int fd;
+
+	fd = open (path, O_WRONLY);
+	if (fd < 0 || fstat (fd, &st) || !S_ISREG (st.st_mode) || lseek (fd, offset, SEEK_SET) != offset)
+	{
+		fprintf (stderr, "Could not continue %s: %s\n", path, fd < 0 ? strerror (errno) : "not an image file");
+		if (fd >= 0) close (fd);
+		return NULL;
+	}
+	f = calloc (1, sizeof (file_sink));
+	f->fd = fd;
+	f->io = io_engine_open ();
+	s = calloc (1, sizeof (img_sink));
+	s->write = file_write;
+	s->zero = file_zero;
+	s->close = file_close;
+	s->sync = file_sync;
+	s->offset = offset;
+	s->priv = f;
+	return s;
+}
+
+img_sink *sink_device_open (const char *path, int discard)
+{
+	img_sink *s;
+	file_sink *f;
+	struct stat st;
+	int fd, sector_size;
+
+	fd = open (path, O_WRONLY);
+	if (fd < 0 || fstat (fd, &st) || !S_ISBLK (st.st_mode))
+	{
+		fprintf (stderr, "Could not open block device %s: %s\n", path, fd < 0 ? strerror (errno) : "not a block device");
+		if (fd >= 0) close (fd);
+		return NULL;
+	}
+	// the engine buffers are aligned, the page cache is bypassed when the sectors are small enough for every write
+	if (ioctl (fd, BLKSSZGET, &sector_size) == 0 && sector_size == 512) fcntl (fd, F_SETFL, O_DIRECT);
+	f = calloc (1, sizeof (file_sink));
+	f->fd = fd;
+	f->stream = 1;
+	f->device = 1;
+	f->discard = discard;
+	f->io = io_engine_open ();
+	s = calloc (1, sizeof (img_sink));
+	s->write = file_write;
+	s->zero = file_zero;
+	s->close = file_close;
+	s->priv = f;
+	return s;
+}
+
+img_sink *sink_fanout_open (img_sink **sinks, char **names, int n)
+{
+	img_sink *s;
+	fan_sink *f;
+	int i, j;
+
+	f = calloc (1, sizeof (fan_sink));
+	f->ndests = n;
+	f->dests = calloc (n, sizeof (fan_dest));
+	pthread_mutex_init (&f->lock, NULL);
+	pthread_cond_init (&f->cond, NULL);
+	clock_gettime (CLOCK_MONOTONIC, &f->start);
+	for (i = 0; i < FAN_SLOTS; i++) f->slots[i].buf = malloc (FAN_CHUNK);
+	for (i = 0; i < n; i++)
+	{
+		f->dests[i].fan = f;
+		f->dests[i].sink = sinks[i];
+		f->dests[i].name = strdup (names[i]);
+	}
+	s = calloc (1, sizeof (img_sink));
+	s->write = fan_write;
+	s->zero = fan_zero;
+	s->close = fan_close;
+	s->priv = f;
+	for (i = 0; i < n; i++)
+	{
+		if (pthread_create (&f->dests[i].thread, NULL, (void *(*)(void *)) fan_writer, &f->dests[i]))
+		{
+			// the destinations that have a thread are closed by their writer, the others here
+			f->ndests = i;
+			fprintf (stderr, "Could not start a writer for %s.\n", names[i]);
+			for (j = i; j < n; j++)
+			{
+				free (f->dests[j].name);
+				sink_close (sinks[j]);
+			}
+			fan_close (s);
+			free (s);
+			return NULL;
+		}
+	}
+	return s;
+}
+
+int sink_write (img_sink *s, const char *buf, long long int len)
+{
+	s->offset += len;
+	return s->write (s, buf, len);
+}
+
+int sink_zero (img_sink *s, long long int len)
+{
+	s->offset += len;
+	return s->zero (s, len);
+}
+
+int sink_is_zero (const char *buf, long long int len)
+{
+	// every byte equal to the one before it and the first one is zero
+	return len <= 0 || (buf[0] == 0 && !memcmp (buf, buf + 1, len - 1));
+}
+
+int sink_write_sparse (img_sink *s, const char *buf, long long int len)
+{
+	long long int i, n, run = -1, zero = 0;
+	int res = 0;
+
+	for (i = 0; i < len && !res; i += n)
+	{
+		n = len - i < SINK_ZERO_BLOCK ? len - i : SINK_ZERO_BLOCK;
+		if (sink_is_zero (buf + i, n))
+		{
+			if (run >= 0) res = sink_write (s, buf + run, i - run);
+			run = -1;
+			zero += n;
+		}
+		else
+		{
+			if (zero) res = sink_zero (s, zero);
+			zero = 0;
+			if (run < 0) run = i;
+		}
+	}
+	if (!res && run >= 0) res = sink_write (s, buf + run, len - run);
+	if (!res && zero) res = sink_zero (s, zero);
+	return res;
+}
+
+int sink_sync (img_sink *s)
+{
+	return s->sync ? s->sync (s) : -1;
+}
+
+int sink_close (img_sink *s)
+{
+	int res = s->close (s);
+
+	free (s);
+	return res;
+}
+
+int sink_drain (img_sink *s, int fd, long long int from, long long int to)
+{
+	char *buffer;
+	long long int pos, data, hole, n;
+	ssize_t len;
+	int punch, res = 0;
+
+	if (s->offset != from) return -1;
+	buffer = malloc (DRAIN_BUFFER);
+	if (buffer == NULL) return -1;
+	punch = (fcntl (fd, F_GETFL) & O_ACCMODE) == O_RDWR;
+
+	for (pos = from; pos < to && !res; pos = hole)
+	{
+		// skip the holes of the sparse image file
+		data = lseek (fd, pos, SEEK_DATA);
+		if (data < 0 || data > to) data = to;
+		if (data > pos) res = sink_zero (s, data - pos);
+		hole = lseek (fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > to) hole = to;
+
+		for (pos = data; pos < hole && !res; pos += len)
+		{
+			n = hole - pos > DRAIN_BUFFER ? DRAIN_BUFFER : hole - pos;
+			len = pread (fd, buffer, n, pos);
+			if (len <= 0)
+			{
+				fprintf (stderr, "Could not read image at %lld: %s\n", pos, len ? strerror (errno) : "end of file");
+				res = -1;
+				break;
+			}
+			res = sink_write_sparse (s, buffer, len);
+		}
+		// give back the space of the part that is done, so the raw image never has to fit completely
+		if (punch && !res && hole > data)
+			fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, data, hole - data);
+	}
+	free (buffer);
+	return res;
+}
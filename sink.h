@@ -0,0 +1,99 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+sink: destinations for a disk image that is produced sequentially from offset 0.
+Producers call sink_write for data and sink_zero for regions that are known to
+be empty, so sinks can store them efficiently.
+*/
+
+#ifndef SINK_H
+#define SINK_H
+
+#define SINK_NONE  0
+#define SINK_BZIP2 1
+#define SINK_GZIP  2
+#define SINK_ZSTD  3
+
+typedef struct img_sink
+{
+	int (*write) (struct img_sink *s, const char *buf, long long int len);
+	int (*zero) (struct img_sink *s, long long int len);
+	int (*close) (struct img_sink *s);
+	int (*sync) (struct img_sink *s);     /* NULL if the sink can't make its data durable */
+	long long int offset;   /* image bytes consumed so far */
+	void *priv;
+} img_sink;
+
+/* file extension for the compressed image of each format, "" for SINK_NONE */
+const char *sink_extension (int format);
+
+/* sink_compress_open
+   Opens a sink that compresses the image into a file
+	@param path output file name
+	@param format SINK_GZIP, SINK_ZSTD or SINK_BZIP2
+	@param threads number of compression threads, 0 for one per CPU core
+	@return the sink or NULL on error
+*/
+img_sink *sink_compress_open (const char *path, int format, int threads);
+
+/* sink_file_open
+   Opens a sink that writes the uncompressed image to a file, zero regions become holes.
+   A pipe or device (/dev/fd/1, a FIFO) is written sequentially with the zeros
+	@param path output file name
+	@return the sink or NULL on error
+*/
+img_sink *sink_file_open (const char *path);
+
+/* sink_device_open
+   Opens a sink that writes an image to a block device with queued O_DIRECT writes,
+   zero regions are zeroed by the kernel (BLKZEROOUT) instead of written
+	@param path device file name
+	@param discard 1 to unmap the zero regions when the device reads unmapped blocks as zeros
+	@return the sink or NULL on error
+*/
+img_sink *sink_device_open (const char *path, int discard);
+
+/* sink_file_resume
+   Opens a sink that continues an uncompressed image file at offset, the bytes before it are kept
+	@param path existing image file
+	@param offset image bytes already written
+	@return the sink or NULL on error
+*/
+img_sink *sink_file_resume (const char *path, long long int offset);
+
+/* sink_fanout_open
+   Opens a sink that passes the image to several sinks, each written by its own thread.
+   At most 64 MB is buffered for the slowest one, a sink that fails is reported and skipped
+	@param sinks the destinations, closed with the fan-out sink, or by sink_fanout_open if it fails
+	@param names file names of the destinations for the messages
+	@param n number of destinations
+	@return the sink or NULL on error, sink_close returns an error if one destination failed
+*/
+img_sink *sink_fanout_open (img_sink **sinks, char **names, int n);
+
+int sink_write (img_sink *s, const char *buf, long long int len);
+int sink_zero (img_sink *s, long long int len);
+
+/* like sink_write, blocks of SINK_ZERO_BLOCK bytes that are all zero are passed as zero regions */
+int sink_write_sparse (img_sink *s, const char *buf, long long int len);
+
+#define SINK_ZERO_BLOCK 4096
+
+/* returns 1 if len bytes of buf are all zero, uses the vectorized memcmp of the C library */
+int sink_is_zero (const char *buf, long long int len);
+
+/* waits for the writes in flight and syncs the image written so far to disk, -1 if the sink can't */
+int sink_sync (img_sink *s);
+
+/* flushes and frees the sink, returns 0 if everything was written */
+int sink_close (img_sink *s);
+
+/* sink_drain
+   Feeds the bytes [from, to) of an image file to the sink, holes are passed as zero regions
+	@param s the sink, its offset must be equal to from
+	@param fd image file opened for reading, if opened read-write the drained range is punched out
+	@return 0 on success
+*/
+int sink_drain (img_sink *s, int fd, long long int from, long long int to);
+
+#endif
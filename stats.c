@@ -0,0 +1,190 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+stats: per phase instrumentation.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+#define MAX_PHASES 16
+
+/* counters of the process at one moment */
+typedef struct
+{
+	double wall;
+	double user;
+	double sys;
+	long long int rchar;          /* bytes passed to read calls, cache hits included */
+	long long int wchar;
+	long long int syscr;          /* read and write system calls */
+	long long int syscw;
+	long long int read_bytes;     /* bytes the storage layer read and wrote */
+	long long int write_bytes;
+	long long int child_blocks_in;  /* 512 byte blocks of the programs that were run */
+	long long int child_blocks_out;
+} sample;
+
+typedef struct
+{
+	const char *name;
+	sample total;
+	long long int max_rss;        /* kB, highest of imgclone and the programs it ran */
+	int runs;
+} phase;
+
+static phase phases[MAX_PHASES];
+static int phase_count;
+static phase *current;
+static sample current_start;
+static int held;                    /* stats_hold phase, stats_phase is ignored */
+
+static double seconds (struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void take_sample (sample *s, long long int *max_rss)
+{
+	struct timespec ts;
+	struct rusage self, children;
+	char line[128], key[32];
+	long long int value;
+	FILE *fp;
+
+	memset (s, 0, sizeof (sample));
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	s->wall = ts.tv_sec + ts.tv_nsec / 1e9;
+
+	getrusage (RUSAGE_SELF, &self);
+	getrusage (RUSAGE_CHILDREN, &children);
+	s->user = seconds (self.ru_utime) + seconds (children.ru_utime);
+	s->sys = seconds (self.ru_stime) + seconds (children.ru_stime);
+	s->child_blocks_in = children.ru_inblock;
+	s->child_blocks_out = children.ru_oublock;
+	if (max_rss) *max_rss = self.ru_maxrss > children.ru_maxrss ? self.ru_maxrss : children.ru_maxrss;
+
+	fp = fopen ("/proc/self/io", "r");
+	if (fp == NULL) return;
+	while (fgets (line, sizeof (line), fp))
+	{
+		if (sscanf (line, "%31[^:]: %lld", key, &value) != 2) continue;
+		if (!strcmp (key, "rchar")) s->rchar = value;
+		else if (!strcmp (key, "wchar")) s->wchar = value;
+		else if (!strcmp (key, "syscr")) s->syscr = value;
+		else if (!strcmp (key, "syscw")) s->syscw = value;
+		else if (!strcmp (key, "read_bytes")) s->read_bytes = value;
+		else if (!strcmp (key, "write_bytes")) s->write_bytes = value;
+	}
+	fclose (fp);
+}
+
+/* adds b - a to total */
+static void add_difference (sample *total, const sample *a, const sample *b)
+{
+	total->wall += b->wall - a->wall;
+	total->user += b->user - a->user;
+	total->sys += b->sys - a->sys;
+	total->rchar += b->rchar - a->rchar;
+	total->wchar += b->wchar - a->wchar;
+	total->syscr += b->syscr - a->syscr;
+	total->syscw += b->syscw - a->syscw;
+	total->read_bytes += b->read_bytes - a->read_bytes;
+	total->write_bytes += b->write_bytes - a->write_bytes;
+	total->child_blocks_in += b->child_blocks_in - a->child_blocks_in;
+	total->child_blocks_out += b->child_blocks_out - a->child_blocks_out;
+}
+
+void stats_end (void)
+{
+	sample now;
+	long long int max_rss;
+
+	if (current == NULL) return;
+	take_sample (&now, &max_rss);
+	add_difference (&current->total, &current_start, &now);
+	// getrusage only knows the peak of the whole run, so far
+	if (max_rss > current->max_rss) current->max_rss = max_rss;
+	current = NULL;
+}
+
+void stats_phase (const char *name)
+{
+	int i;
+
+	if (held) return;
+	stats_end ();
+	for (i = 0; i < phase_count; i++)
+	{
+		if (!strcmp (phases[i].name, name)) break;
+	}
+	if (i == phase_count)
+	{
+		if (phase_count == MAX_PHASES) return;
+		phases[phase_count++].name = name;
+	}
+	current = &phases[i];
+	current->runs++;
+	take_sample (&current_start, NULL);
+}
+
+void stats_hold (const char *name)
+{
+	stats_phase (name);
+	held = 1;
+}
+
+void stats_print (FILE *out)
+{
+	sample *t;
+	double wall = 0;
+	int i;
+
+	if (phase_count == 0) return;
+	fprintf (out, "%-22s %9s %9s %9s %10s %10s %10s %9s\n", "phase", "wall s", "user s", "sys s", "read MB", "write MB", "syscalls", "peak MB");
+	for (i = 0; i < phase_count; i++)
+	{
+		t = &phases[i].total;
+		wall += t->wall;
+		fprintf (out, "%-22s %9.2f %9.2f %9.2f %10.1f %10.1f %10lld %9.1f\n", phases[i].name, t->wall, t->user, t->sys,
+			(t->rchar + t->child_blocks_in * 512) / 1e6, (t->wchar + t->child_blocks_out * 512) / 1e6,
+			t->syscr + t->syscw, phases[i].max_rss / 1024.0);
+	}
+	fprintf (out, "%-22s %9.2f\n", "total", wall);
+}
+
+int stats_write_json (const char *path, int result)
+{
+	sample *t;
+	FILE *fp;
+	int i, res;
+
+	fp = strcmp (path, "-") ? fopen (path, "w") : stdout;
+	if (fp == NULL)
+	{
+		fprintf (stderr, "Could not create %s.\n", path);
+		return -1;
+	}
+	fprintf (fp, "{\"result\":%d,\"phases\":[", result);
+	for (i = 0; i < phase_count; i++)
+	{
+		t = &phases[i].total;
+		fprintf (fp, "%s\n{\"name\":\"%s\",\"runs\":%d,\"wall\":%.3f,\"user\":%.3f,\"sys\":%.3f,"
+			"\"rchar\":%lld,\"wchar\":%lld,\"syscr\":%lld,\"syscw\":%lld,\"read_bytes\":%lld,\"write_bytes\":%lld,"
+			"\"child_read_bytes\":%lld,\"child_write_bytes\":%lld,\"max_rss_kb\":%lld}",
+			i ? "," : "", phases[i].name, phases[i].runs, t->wall, t->user, t->sys,
+			t->rchar, t->wchar, t->syscr, t->syscw, t->read_bytes, t->write_bytes,
+			t->child_blocks_in * 512, t->child_blocks_out * 512, phases[i].max_rss);
+	}
+	fprintf (fp, "\n]}\n");
+	res = ferror (fp);
+	if (fp != stdout && fclose (fp)) res = 1;
+	return res ? -1 : 0;
+}
@@ -0,0 +1,39 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+stats: wall time, I/O and CPU figures per phase of a backup.
+
+Phases follow each other, stats_phase ends the running phase and starts the
+next one. A phase that is started again adds to its earlier figures, so all
+partition copies end up in one "copying files" line. I/O comes from
+/proc/self/io (all threads of imgclone), CPU time and peak memory from
+getrusage, including the programs imgclone ran like mkfs and parted.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/* ends the running phase and starts or resumes phase name */
+void stats_phase (const char *name);
+
+/* starts phase name and keeps it until the end, for clones that run at the same time and
+   would each switch phases */
+void stats_hold (const char *name);
+
+/* ends the running phase */
+void stats_end (void);
+
+/* prints a table of all phases */
+void stats_print (FILE *out);
+
+/* stats_write_json
+   Writes all phases as a JSON object to a file
+	@param path file name, - for stdout
+	@param result exit code of the backup
+	@return 0 on success
+*/
+int stats_write_json (const char *path, int result);
+
+#endif
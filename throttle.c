@@ -0,0 +1,156 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+throttle: rate limit, adaptive throttle and page cache hygiene.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "throttle.h"
+#include "util.h"
+
+#define SAMPLE_INTERVAL 0.5                 /* seconds between samples of the disk statistics */
+#define MIN_RATE        (256*1024)          /* the adaptive throttle never goes below this */
+#define BURST           0.25                /* seconds of the rate that may be used at once */
+#define LATENCY_FLOOR   10.0                /* ms, below this a disk is never considered busy */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static long long int max_rate;              /* configured limit, 0 for none */
+static long long int rate;                  /* limit in force, 0 for none */
+static double tokens;
+static double last_refill;
+static int gentle;
+
+// adaptive throttle
+static char stat_path[128];
+static double last_sample;
+static long long int last_ios, last_ticks;
+static long long int sample_bytes;          /* bytes taken since the last sample */
+static double base_latency;                 /* lowest ms per request seen, 0 until known */
+
+/* completed requests and the ms spent on them from the stat file of the disk */
+static int read_disk_stat (long long int *ios, long long int *ticks)
+{
+	long long int v[11];
+	FILE *fp;
+	int n;
+
+	fp = fopen (stat_path, "r");
+	if (fp == NULL) return -1;
+	n = fscanf (fp, "%lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
+		&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10]);
+	fclose (fp);
+	if (n != 11) return -1;
+	*ios = v[0] + v[4];
+	*ticks = v[3] + v[7];
+	return 0;
+}
+
+/* called with the lock held */
+static void adapt (double t)
+{
+	long long int ios, ticks, throughput;
+	double latency;
+
+	if (t - last_sample < SAMPLE_INTERVAL || read_disk_stat (&ios, &ticks)) return;
+	throughput = sample_bytes / (t - last_sample);
+	sample_bytes = 0;
+	last_sample = t;
+	if (ios == last_ios)
+	{
+		last_ticks = ticks;
+		return;
+	}
+	latency = (double) (ticks - last_ticks) / (ios - last_ios);
+	last_ios = ios;
+	last_ticks = ticks;
+	if (base_latency == 0 || latency < base_latency) base_latency = latency;
+
+	if (latency > LATENCY_FLOOR && latency > 4 * base_latency)
+	{
+		// the disk is busy, back off
+		rate = (rate ? rate : throughput) / 2;
+		if (rate < MIN_RATE) rate = MIN_RATE;
+	}
+	else if (rate)
+	{
+		rate += rate / 4;
+		// back to the configured limit, or no limit once the copy no longer reaches the rate
+		if (max_rate && rate >= max_rate) rate = max_rate;
+		else if (!max_rate && rate > 4 * throughput) rate = 0;
+	}
+}
+
+void throttle_configure (long long int rate_limit, int gentle_mode, const char *device)
+{
+	const char *name;
+
+	max_rate = rate = rate_limit;
+	gentle = gentle_mode;
+	last_refill = last_sample = now ();
+	tokens = rate * BURST;
+	stat_path[0] = 0;
+	if (device == NULL) return;
+
+	// /sys/block has whole disks, /dev/mmcblk0 becomes /sys/block/mmcblk0/stat
+	name = strrchr (device, '/');
+	snprintf (stat_path, sizeof (stat_path), "/sys/block/%s/stat", name ? name + 1 : device);
+	if (read_disk_stat (&last_ios, &last_ticks))
+	{
+		printf ("No statistics for %s, the adaptive throttle is off.\n", device);
+		stat_path[0] = 0;
+	}
+}
+
+int throttle_gentle (void)
+{
+	return gentle;
+}
+
+void throttle_take (long long int bytes)
+{
+	struct timespec ts;
+	double t, wait = 0;
+
+	if (!max_rate && !stat_path[0]) return;
+	pthread_mutex_lock (&lock);
+	t = now ();
+	sample_bytes += bytes;
+	if (stat_path[0]) adapt (t);
+	if (rate)
+	{
+		tokens += (t - last_refill) * rate;
+		if (tokens > rate * BURST) tokens = rate * BURST;
+		// the bucket may go negative, the next caller then waits for this one as well
+		tokens -= bytes;
+		if (tokens < 0) wait = -tokens / rate;
+	}
+	last_refill = t;
+	pthread_mutex_unlock (&lock);
+
+	if (wait > 0)
+	{
+		ts.tv_sec = (time_t) wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		nanosleep (&ts, NULL);
+	}
+}
+
+void throttle_drop_read (int fd, long long int offset, long long int len)
+{
+	if (gentle) posix_fadvise (fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+void throttle_drop_written (int fd, long long int offset, long long int len)
+{
+	if (!gentle) return;
+	// dirty pages can't be dropped, write them first
+	sync_file_range (fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise (fd, offset, len, POSIX_FADV_DONTNEED);
+}
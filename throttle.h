@@ -0,0 +1,38 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+throttle: keeps a backup of a live system out of the way of its programs.
+
+A token bucket limits the bytes copied per second over all copy threads.
+The adaptive throttle samples /sys/block/<disk>/stat of the source twice a
+second and halves the rate when the average time a request of the disk
+spends queued rises well above the lowest time seen, then lets the rate grow
+again while the disk is calm. Gentle mode drops the data the backup has read
+or written from the page cache, so it does not push out the working set of
+the programs on the system.
+*/
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+/* throttle_configure
+   Called once from main before any copy starts
+	@param max_rate bytes per second, 0 for no limit
+	@param gentle 1 to keep the copied data out of the page cache
+	@param device source disk, whose queue latency is followed, NULL for no adaptive throttle
+*/
+void throttle_configure (long long int max_rate, int gentle, const char *device);
+
+/* returns 1 in gentle mode */
+int throttle_gentle (void);
+
+/* waits until bytes may be copied, safe to call from every thread */
+void throttle_take (long long int bytes);
+
+/* gentle mode: drops read data from the page cache */
+void throttle_drop_read (int fd, long long int offset, long long int len);
+
+/* gentle mode: writes out written data and drops it from the page cache */
+void throttle_drop_written (int fd, long long int offset, long long int len);
+
+#endif
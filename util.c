@@ -0,0 +1,85 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+util: shared helpers, see util.h.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+uint16_t le16 (const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+uint32_t le32 (const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+int read_at (int fd, void *buf, long long int len, long long int offset)
+{
+	ssize_t n;
+	char *p = buf;
+
+	while (len > 0)
+	{
+		n = pread (fd, p, len, offset);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+int write_all (int fd, const char *buf, long long int len)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = write (fd, buf, len);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int pwrite_all (int fd, const char *buf, long long int len, long long int offset)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = pwrite (fd, buf, len, offset);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+double now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
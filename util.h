@@ -0,0 +1,29 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+util: the small helpers of all modules: little endian fields of on-disk
+structures, reads and writes that go on until every byte is done and the
+monotonic clock.
+*/
+
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdint.h>
+
+uint16_t le16 (const unsigned char *p);
+uint32_t le32 (const unsigned char *p);
+
+/* reads len bytes at offset, returns 0 on success, -1 on an error or at the end of the file */
+int read_at (int fd, void *buf, long long int len, long long int offset);
+
+/* writes len bytes, returns 0 on success */
+int write_all (int fd, const char *buf, long long int len);
+
+/* writes len bytes at offset, returns 0 on success */
+int pwrite_all (int fd, const char *buf, long long int len, long long int offset);
+
+/* seconds of the monotonic clock */
+double now (void);
+
+#endif
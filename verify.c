@@ -0,0 +1,530 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+verify: multi-threaded comparison of a copied tree with its source.
+
+Directories to read and files to compare go on one shared stack, newest task
+first so the walk stays depth first. Reading a directory compares the
+metadata of its entries and queues the regular files, so the data of many
+files is read from both sides at the same time.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "copytree.h"
+#include "verify.h"
+#include "throttle.h"
+
+#define TASK_DIR  0
+#define TASK_FILE 1
+
+#define VERIFY_BUFFER (1024*1024)  /* bytes read from each side at once */
+#define REPORT_MAX    100          /* differences listed, the rest is only counted */
+
+typedef struct verify_task
+{
+	int type;
+	char *path;                     /* relative to the roots, "" for the roots themselves */
+	struct stat st;                 /* of the copy */
+	struct verify_task *next;
+} verify_task;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	verify_task *tasks;
+	long long int pending;          /* tasks queued or running */
+	const char *src;
+	const char *dst;
+	dev_t root_dev;
+	verify_options opts;
+	verify_stats *stats;
+} verify_ctx;
+
+typedef struct
+{
+	verify_ctx *ctx;
+	char *src_buffer;
+	char *dst_buffer;
+} verify_worker;
+
+/*---------------------------------------------------------------------------*/
+/* Helpers */
+
+static void count (volatile long long int *counter, long long int n)
+{
+	__atomic_add_fetch (counter, n, __ATOMIC_RELAXED);
+}
+
+/* root + "/" + path, or root for the root itself */
+static char *full_path (const char *root, const char *path)
+{
+	size_t lr = strlen (root), lp = strlen (path);
+	char *p = malloc (lr + lp + 2);
+
+	if (p == NULL) return NULL;
+	memcpy (p, root, lr);
+	p[lr] = '/';
+	memcpy (p + lr + 1, path, lp + 1);
+	if (lp == 0) p[lr] = 0;
+	return p;
+}
+
+static char *join_relative (const char *dir, const char *name)
+{
+	return *dir ? full_path (dir, name) : strdup (name);
+}
+
+static int ignored (verify_ctx *ctx, const char *path)
+{
+	const char **p;
+
+	for (p = ctx->opts.ignore; p && *p; p++)
+	{
+		if (!strcmp (*p, path)) return 1;
+	}
+	return 0;
+}
+
+static void verify_error (verify_ctx *ctx, const char *path, const char *what)
+{
+	fprintf (stderr, "Could not %s %s: %s\n", what, path, strerror (errno));
+	count (&ctx->stats->errors, 1);
+}
+
+/* a difference is expected when the source entry changed or went away after the backup started,
+   at is the entry on the source that has to be checked, the directory for entries that are only in the copy */
+static void differs (verify_ctx *ctx, const char *path, const char *at, const char *what)
+{
+	struct stat st;
+	char *src;
+
+	if (ignored (ctx, path)) return;
+	src = full_path (ctx->src, at);
+	if (src == NULL || lstat (src, &st) || st.st_ctim.tv_sec >= ctx->opts.since)
+	{
+		count (&ctx->stats->changed, 1);
+	}
+	else if (__atomic_add_fetch (&ctx->stats->mismatches, 1, __ATOMIC_RELAXED) <= REPORT_MAX)
+	{
+		fprintf (stderr, "Verify: /%s %s.\n", path, what);
+	}
+	free (src);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Task stack */
+
+static void push_task (verify_ctx *ctx, int type, const char *path, const struct stat *st)
+{
+	size_t lp = strlen (path) + 1;
+	verify_task *t = malloc (sizeof (verify_task) + lp);
+
+	if (t == NULL)
+	{
+		verify_error (ctx, path, "queue");
+		return;
+	}
+	t->type = type;
+	t->path = (char *) (t + 1);
+	memcpy (t->path, path, lp);
+	t->st = *st;
+
+	pthread_mutex_lock (&ctx->lock);
+	t->next = ctx->tasks;
+	ctx->tasks = t;
+	ctx->pending++;
+	pthread_cond_signal (&ctx->cond);
+	pthread_mutex_unlock (&ctx->lock);
+}
+
+/* waits for a task, NULL when all work is done */
+static verify_task *pop_task (verify_ctx *ctx)
+{
+	verify_task *t;
+
+	pthread_mutex_lock (&ctx->lock);
+	while (ctx->tasks == NULL && ctx->pending > 0) pthread_cond_wait (&ctx->cond, &ctx->lock);
+	t = ctx->tasks;
+	if (t != NULL) ctx->tasks = t->next;
+	pthread_mutex_unlock (&ctx->lock);
+	return t;
+}
+
+static void task_done (verify_ctx *ctx)
+{
+	pthread_mutex_lock (&ctx->lock);
+	if (--ctx->pending == 0) pthread_cond_broadcast (&ctx->cond);
+	pthread_mutex_unlock (&ctx->lock);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Compare functions */
+
+/* reads len bytes or up to the end of the file */
+static ssize_t read_full (int fd, char *buf, size_t len, off_t pos)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len)
+	{
+		n = pread (fd, buf + done, len - done, pos + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return -1;
+		if (n == 0) break;
+		done += n;
+	}
+	return done;
+}
+
+static void verify_file (verify_worker *w, verify_task *t)
+{
+	verify_ctx *ctx = w->ctx;
+	hash_state src_hash, dst_hash;
+	char *src, *dst;
+	ssize_t ns, nd;
+	off_t pos = 0;
+	int in, out;
+
+	src = full_path (ctx->src, t->path);
+	dst = full_path (ctx->dst, t->path);
+	if (src == NULL || dst == NULL)
+	{
+		verify_error (ctx, t->path, "compare");
+		free (src);
+		free (dst);
+		return;
+	}
+	in = open (src, O_RDONLY | O_NOFOLLOW | O_NOATIME);
+	if (in < 0 && errno == EPERM) in = open (src, O_RDONLY | O_NOFOLLOW);
+	out = open (dst, O_RDONLY | O_NOFOLLOW);
+	if (in < 0 || out < 0)
+	{
+		if (in < 0) differs (ctx, t->path, t->path, "can't be opened on the source");
+		else verify_error (ctx, dst, "open");
+		if (in >= 0) close (in);
+		if (out >= 0) close (out);
+		free (src);
+		free (dst);
+		return;
+	}
+	posix_fadvise (in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise (out, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	hash_init (&src_hash, 0);
+	hash_init (&dst_hash, 0);
+	for (;;)
+	{
+		ns = read_full (in, w->src_buffer, VERIFY_BUFFER, pos);
+		nd = read_full (out, w->dst_buffer, VERIFY_BUFFER, pos);
+		if (ns < 0 || nd < 0)
+		{
+			verify_error (ctx, ns < 0 ? src : dst, "read");
+			break;
+		}
+		hash_update (&src_hash, w->src_buffer, ns);
+		hash_update (&dst_hash, w->dst_buffer, nd);
+		throttle_take (ns);
+		throttle_drop_read (in, pos, ns);
+		throttle_drop_read (out, pos, nd);
+		count (&ctx->stats->bytes, nd);
+		pos += nd;
+		if (ns != nd)
+		{
+			differs (ctx, t->path, t->path, "has a different length");
+			break;
+		}
+		if (nd < VERIFY_BUFFER)
+		{
+			if (hash_final (&src_hash) != hash_final (&dst_hash)) differs (ctx, t->path, t->path, "has different data");
+			break;
+		}
+	}
+	close (in);
+	close (out);
+	if (ctx->opts.record) manifest_add (ctx->opts.record, t->path, &t->st, hash_final (&dst_hash));
+	count (&ctx->stats->files, 1);
+	free (src);
+	free (dst);
+}
+
+/* compares everything but the file data, which is queued */
+static void verify_entry (verify_ctx *ctx, const char *path, const char *src, const char *dst, const struct stat *ss, const struct stat *ds)
+{
+	char src_target[4096], dst_target[4096];
+	ssize_t ls = 0, ld = 0;
+
+	count (&ctx->stats->entries, 1);
+	if ((ss->st_mode & S_IFMT) != (ds->st_mode & S_IFMT))
+	{
+		differs (ctx, path, path, "is of a different type");
+		return;
+	}
+	if (S_ISREG (ss->st_mode) && ss->st_size != ds->st_size) differs (ctx, path, path, "has a different size");
+	if (ctx->opts.metadata)
+	{
+		if (ss->st_mode != ds->st_mode) differs (ctx, path, path, "has a different mode");
+		if (ss->st_uid != ds->st_uid || ss->st_gid != ds->st_gid) differs (ctx, path, path, "has a different owner");
+		if (!S_ISDIR (ss->st_mode) && (ss->st_mtim.tv_sec != ds->st_mtim.tv_sec || ss->st_mtim.tv_nsec != ds->st_mtim.tv_nsec))
+			differs (ctx, path, path, "has a different modification time");
+		if (!S_ISDIR (ss->st_mode) && ss->st_nlink != ds->st_nlink) differs (ctx, path, path, "has a different number of hard links");
+		if ((S_ISCHR (ss->st_mode) || S_ISBLK (ss->st_mode)) && ss->st_rdev != ds->st_rdev) differs (ctx, path, path, "is a different device");
+	}
+
+	if (S_ISLNK (ss->st_mode))
+	{
+		ls = readlink (src, src_target, sizeof (src_target));
+		ld = readlink (dst, dst_target, sizeof (dst_target));
+		if (ld < 0) verify_error (ctx, dst, "read link");
+		else if (ls != ld || memcmp (src_target, dst_target, ld)) differs (ctx, path, path, "points somewhere else");
+	}
+
+	if (S_ISREG (ss->st_mode))
+	{
+		push_task (ctx, TASK_FILE, path, ds);
+		return;
+	}
+	if (S_ISDIR (ss->st_mode) && ss->st_dev == ctx->root_dev) push_task (ctx, TASK_DIR, path, ds);
+	if (ctx->opts.record && *path) manifest_add (ctx->opts.record, path, ds, ld > 0 ? hash_buffer (dst_target, ld, 0) : 0);
+}
+
+/* every entry of the source must be in the copy and the other way around */
+static void verify_dir (verify_worker *w, verify_task *t)
+{
+	verify_ctx *ctx = w->ctx;
+	struct dirent *de;
+	struct stat ss, ds;
+	char *src_dir, *dst_dir, *path, *src, *dst;
+	exclude_dir *excluded;
+	DIR *d, *c;
+
+	src_dir = full_path (ctx->src, t->path);
+	dst_dir = full_path (ctx->dst, t->path);
+	if (src_dir == NULL || dst_dir == NULL)
+	{
+		verify_error (ctx, t->path, "compare");
+		goto out;
+	}
+
+	d = opendir (src_dir);
+	if (d == NULL)
+	{
+		differs (ctx, t->path, t->path, "can't be read on the source");
+		goto out;
+	}
+	excluded = exclude_enter (ctx->opts.exclude, t->path);
+	while ((de = readdir (d)) != NULL)
+	{
+		if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, "..")) continue;
+		path = join_relative (t->path, de->d_name);
+		src = full_path (ctx->src, path ? path : "");
+		dst = full_path (ctx->dst, path ? path : "");
+		if (path == NULL || src == NULL || dst == NULL)
+		{
+			verify_error (ctx, src_dir, "read entries of");
+		}
+		else if (fstatat (dirfd (d), de->d_name, &ss, AT_SYMLINK_NOFOLLOW))
+		{
+			// removed since readdir
+			count (&ctx->stats->changed, 1);
+		}
+		else if (exclude_match (excluded, de->d_name, S_ISDIR (ss.st_mode)))
+		{
+			// left out of the image on purpose
+		}
+		else if (lstat (dst, &ds))
+		{
+			count (&ctx->stats->entries, 1);
+			differs (ctx, path, path, "is missing in the image");
+		}
+		else
+		{
+			verify_entry (ctx, path, src, dst, &ss, &ds);
+		}
+		free (path);
+		free (src);
+		free (dst);
+	}
+	exclude_leave (excluded);
+
+	// entries of the copy that are not on the source, fstatat relative to the open source directory
+	c = opendir (dst_dir);
+	if (c == NULL)
+	{
+		verify_error (ctx, dst_dir, "read directory");
+	}
+	else
+	{
+		while ((de = readdir (c)) != NULL)
+		{
+			if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, "..")) continue;
+			// mkfs creates lost+found on every ext file system
+			if (!*t->path && !strcmp (de->d_name, "lost+found")) continue;
+			if (fstatat (dirfd (d), de->d_name, &ss, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) continue;
+			path = join_relative (t->path, de->d_name);
+			if (path == NULL) continue;
+			count (&ctx->stats->entries, 1);
+			differs (ctx, path, t->path, "is in the image but not on the source");
+			free (path);
+		}
+		closedir (c);
+	}
+	closedir (d);
+
+out:
+	free (src_dir);
+	free (dst_dir);
+}
+
+static void *verify_worker_func (verify_worker *w)
+{
+	verify_task *t;
+
+	while ((t = pop_task (w->ctx)) != NULL)
+	{
+		if (t->type == TASK_DIR) verify_dir (w, t);
+		else verify_file (w, t);
+		free (t);
+		task_done (w->ctx);
+	}
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Public functions */
+
+long long int verify_tree (const char *src, const char *dst, const verify_options *options, verify_stats *stats)
+{
+	int threads = options->threads;
+	verify_ctx ctx;
+	verify_worker *workers;
+	pthread_t *tids;
+	verify_stats local_stats;
+	struct stat ss, ds;
+	int i;
+
+	if (threads <= 0) threads = copy_default_threads ();
+	if (stats == NULL) stats = &local_stats;
+	memset (stats, 0, sizeof (verify_stats));
+
+	if (lstat (src, &ss) || lstat (dst, &ds))
+	{
+		fprintf (stderr, "Could not stat %s or %s: %s\n", src, dst, strerror (errno));
+		return 1;
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.src = src;
+	ctx.dst = dst;
+	ctx.root_dev = ss.st_dev;
+	ctx.opts = *options;
+	ctx.stats = stats;
+	pthread_mutex_init (&ctx.lock, NULL);
+	pthread_cond_init (&ctx.cond, NULL);
+	workers = calloc (threads, sizeof (verify_worker));
+	tids = calloc (threads, sizeof (pthread_t));
+	for (i = 0; i < threads; i++)
+	{
+		workers[i].ctx = &ctx;
+		workers[i].src_buffer = malloc (VERIFY_BUFFER);
+		workers[i].dst_buffer = malloc (VERIFY_BUFFER);
+	}
+
+	push_task (&ctx, TASK_DIR, "", &ds);
+
+	for (i = 0; i < threads; i++)
+	{
+		if (pthread_create (&tids[i], NULL, (void * (*)(void *)) &verify_worker_func, &workers[i]))
+		{
+			fprintf (stderr, "Error creating verify thread\n");
+			break;
+		}
+	}
+	if (i == 0) verify_worker_func (&workers[0]);
+	while (i > 0) pthread_join (tids[--i], NULL);
+
+	if (stats->mismatches > REPORT_MAX) fprintf (stderr, "Verify: and %lld more differences.\n", stats->mismatches - REPORT_MAX);
+
+	for (i = 0; i < threads; i++)
+	{
+		free (workers[i].src_buffer);
+		free (workers[i].dst_buffer);
+	}
+	pthread_mutex_destroy (&ctx.lock);
+	pthread_cond_destroy (&ctx.cond);
+	free (workers);
+	free (tids);
+	return stats->mismatches + stats->errors;
+}
+
+int verify_sign (const char *path, const char *key_file)
+{
+	hmac_sha256_state hmac;
+	sha256_state sha;
+	unsigned char digest[32], key[4096];
+	char buffer[65536], hex[65], sig_path[1024];
+	const char *name;
+	size_t key_len = 0, n;
+	FILE *in, *out;
+
+	if (key_file)
+	{
+		in = fopen (key_file, "rb");
+		if (in == NULL)
+		{
+			fprintf (stderr, "Could not read key %s: %s\n", key_file, strerror (errno));
+			return -1;
+		}
+		key_len = fread (key, 1, sizeof (key), in);
+		fclose (in);
+		if (key_len == 0)
+		{
+			fprintf (stderr, "Key %s is empty.\n", key_file);
+			return -1;
+		}
+		hmac_sha256_init (&hmac, key, key_len);
+		memset (key, 0, sizeof (key));
+	}
+	else sha256_init (&sha);
+
+	in = fopen (path, "rb");
+	if (in == NULL) return -1;
+	while ((n = fread (buffer, 1, sizeof (buffer), in)) > 0)
+	{
+		if (key_file) hmac_sha256_update (&hmac, buffer, n);
+		else sha256_update (&sha, buffer, n);
+	}
+	if (ferror (in))
+	{
+		fclose (in);
+		return -1;
+	}
+	fclose (in);
+	if (key_file) hmac_sha256_final (&hmac, digest);
+	else sha256_final (&sha, digest);
+	hash_hex (digest, 32, hex);
+
+	// the file name without its directory, the SHA-256 in the layout of sha256sum so sha256sum -c checks it,
+	// an HMAC has the name of the algorithm in front
+	name = strrchr (path, '/');
+	name = name ? name + 1 : path;
+	snprintf (sig_path, sizeof (sig_path), "%s.sig", path);
+	out = fopen (sig_path, "w");
+	if (out == NULL) return -1;
+	fprintf (out, "%s%s  %s\n", key_file ? "hmac-sha256 " : "", hex, name);
+	return fclose (out) ? -1 : 0;
+}
@@ -0,0 +1,63 @@
+/*
+This file is part of imgclone, see imgclone.c for the license.
+
+verify: compares a copied partition with its source.
+
+A pool of worker threads walks the source and the copy side by side. Every
+entry must exist on both sides with the same type, mode, owner, size, link
+target, device number and modification time (only type and size on file
+systems without owners like FAT), and entries of the copy must exist on the
+source. Regular files are read from both sides in parallel, one file per
+worker, and their XXH64 hashes compared. The modification time of
+directories is not compared, adding or removing entries changes it. Entries
+of the source that the exclude rules left out are skipped.
+
+The source can be in use: a difference on an entry whose change time on the
+source is after the backup started is counted as changed, not as an error.
+*/
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <time.h>
+
+#include "manifest.h"
+#include "exclude.h"
+
+/* counters updated while the verification runs, safe to read from another thread */
+typedef struct
+{
+	volatile long long int entries;     /* entries compared */
+	volatile long long int files;       /* regular files whose data was compared */
+	volatile long long int bytes;       /* bytes of file data read from the copy */
+	volatile long long int mismatches;  /* entries that differ or are missing on one side */
+	volatile long long int changed;     /* entries that differ because the source changed during the backup */
+	volatile long long int errors;      /* entries that could not be read */
+} verify_stats;
+
+typedef struct
+{
+	int threads;                    /* number of worker threads, 0 for default */
+	int metadata;                   /* 1 to compare mode, owner and times, 0 for FAT */
+	time_t since;                   /* start of the backup, later changes on the source are expected */
+	const char **ignore;            /* paths relative to the root that were changed on purpose, NULL terminated, may be NULL */
+	manifest_writer *record;        /* every entry of the copy is added with the hash of its data, may be NULL */
+	const exclude_rules *exclude;   /* entries of the source that were not copied, may be NULL */
+} verify_options;
+
+/* verify_tree
+   Compares directory dst with directory src
+	@param options threads, what to compare and the manifest to record
+	@param stats counters updated during the verification, may be NULL
+	@return number of mismatches and unreadable entries, 0 if the copy is the same as the source
+*/
+long long int verify_tree (const char *src, const char *dst, const verify_options *options, verify_stats *stats);
+
+/* verify_sign
+   Writes the SHA-256 of a file to <path>.sig, or its HMAC-SHA256 when a key file is given
+	@param key_file file with the secret key, NULL for a plain SHA-256
+	@return 0 on success
+*/
+int verify_sign (const char *path, const char *key_file);
+
+#endif